@@ -0,0 +1,518 @@
+/*
+ * Benchmark suite: codec microbenchmarks and end-to-end pub -> sub
+ * throughput and latency through the embedded mock broker.
+ *
+ * Microbenchmarks time mqtt_encode_publish_qos0(), the same PUBLISH built
+ * from a pre-encoded topic as a registered topic sends it,
+ * mqtt_encode_connect() and the client's PUBLISH decode path (frame +
+ * view) over a grid of topic and payload sizes. Sizes an encoder rejects are reported with
+ * "supported": false rather than left out, so the grid is stable. The
+ * string and topic validators are timed with each implementation
+ * (scalar, sse2, avx2) on ASCII and on mixed UTF-8 text.
+ *
+ * The end-to-end part connects N publisher/subscriber pairs, each pair
+ * on its own topic, over loopback TCP or the in-memory transport, all
+ * driven by one mqtt_loop_t while the broker runs on its own thread.
+ * Every payload carries its send time. The throughput phase keeps up to
+ * BENCH_WINDOW messages per pair in flight; the latency phase has one.
+ *
+ * Results are written to stdout as one JSON object; only library
+ * warnings and errors are logged (to stderr).
+ *
+ * Usage: mqtt_bench [connections] [messages/connection] [payload] [tcp|mem] [all|micro|e2e]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_client.h"
+#include "mqtt_decode.h"
+#include "mqtt_encode.h"
+#include "mqtt_log.h"
+#include "mqtt_loop.h"
+#include "mqtt_mock_broker.h"
+#include "mqtt_time.h"
+#include "mqtt_validate.h"
+
+#define BENCH_WINDOW          256      // messages in flight per pair (throughput)
+#define BENCH_LATENCY_SAMPLES 10000    // per pair, at most (latency phase)
+#define BENCH_MIN_TIME_NS     100000000ull
+#define BENCH_STALL_MS        10000
+
+static volatile size_t bench_sink; // keeps results observable
+
+/* ---- Microbenchmarks ---- */
+
+typedef struct {
+    const char *topic;
+    size_t      topic_len;
+    uint8_t    *payload;
+    size_t      payload_len;
+    uint8_t    *buf;
+    size_t      buf_len;
+    uint8_t    *frame;              // pre-encoded PUBLISH for the decoder
+    size_t      frame_len;
+    uint8_t    *topic_wire;         // pre-encoded topic (length prefix + name)
+    size_t      topic_wire_len;
+    const char *impl;               // validator implementation, or NULL
+} micro_case_t;
+
+typedef int (*micro_fn)(const micro_case_t *c);
+
+static int micro_encode_publish_qos0(const micro_case_t *c) {
+    return mqtt_encode_publish_qos0(c->buf, c->buf_len, c->topic,
+                                    c->payload, c->payload_len);
+}
+
+static int micro_encode_publish_cached_topic(const micro_case_t *c) {
+    int hlen = mqtt_encode_publish_fixed_header(c->buf, c->buf_len, 0, false,
+                                                c->topic_wire_len + c->payload_len);
+    if (hlen < 0) return -1;
+    memcpy(c->buf + hlen, c->topic_wire, c->topic_wire_len);
+    memcpy(c->buf + hlen + c->topic_wire_len, c->payload, c->payload_len);
+    return hlen + (int)(c->topic_wire_len + c->payload_len);
+}
+
+static int micro_encode_connect(const micro_case_t *c) {
+    return mqtt_encode_connect(c->buf, c->buf_len, "mqtt-bench-client", 60);
+}
+
+static int micro_decode_publish(const micro_case_t *c) {
+    size_t frame_len = 0;
+    if (mqtt_decode_frame(c->frame, c->frame_len, &frame_len) != 1) return -1;
+    mqtt_publish_view_t v;
+    if (mqtt_decode_publish_view(c->frame, frame_len, &v) != 0) return -1;
+    return (int)v.payload_len;
+}
+
+static int micro_validate_utf8(const micro_case_t *c) {
+    return mqtt_validate_utf8(c->payload, c->payload_len) ? (int)c->payload_len : -1;
+}
+
+static int micro_validate_topic_name(const micro_case_t *c) {
+    return mqtt_validate_topic_name(c->topic, c->topic_len) ? (int)c->topic_len : -1;
+}
+
+/* ns per call of fn, run for at least BENCH_MIN_TIME_NS; -1 if fn fails. */
+static double micro_time(micro_fn fn, const micro_case_t *c, size_t *ops) {
+    if (fn(c) < 0) return -1.0;
+
+    size_t n = 64;
+    for (;;) {
+        size_t acc = 0;
+        uint64_t start = mqtt_time_now_ns();
+        for (size_t i = 0; i < n; ++i) {
+            acc += (size_t)fn(c);
+        }
+        uint64_t elapsed = mqtt_time_now_ns() - start;
+        bench_sink += acc;
+        if (elapsed >= BENCH_MIN_TIME_NS) {
+            *ops = n;
+            return (double)elapsed / (double)n;
+        }
+        n *= 2;
+    }
+}
+
+static void micro_report(FILE *out, bool *first, const char *name,
+                         const micro_case_t *c, double ns, size_t ops, size_t bytes) {
+    fprintf(out, "%s\n    {\"name\": \"%s\", \"topic_len\": %zu, \"payload_len\": %zu, ",
+            *first ? "" : ",", name, c->topic_len, c->payload_len);
+    *first = false;
+    if (c->impl) fprintf(out, "\"impl\": \"%s\", ", c->impl);
+    if (ns < 0) {
+        fprintf(out, "\"supported\": false}");
+        return;
+    }
+    fprintf(out, "\"supported\": true, \"iterations\": %zu, \"ns_per_op\": %.2f, "
+                 "\"ops_per_sec\": %.0f, \"mb_per_sec\": %.1f}",
+            ops, ns, 1e9 / ns, (double)bytes * 1e3 / ns);
+}
+
+/*
+ * Fill text[0..len) with code points of mixed width: mostly ASCII plus
+ * two-, three- and four-byte sequences, padded with ASCII at the end.
+ */
+static void micro_fill_utf8(uint8_t *text, size_t len) {
+    static const char *const words[] = { "sensor ", "Gr\xc3\xbc\xc3\x9f""e ",
+                                         "\xe6\xb8\xa9\xe5\xba\xa6 ", "temp ",
+                                         "\xf0\x9f\x8c\xa1 " };
+    size_t n = 0;
+    for (size_t w = 0;; w = (w + 1) % (sizeof(words) / sizeof(words[0]))) {
+        size_t wlen = strlen(words[w]);
+        if (n + wlen > len) break;
+        memcpy(text + n, words[w], wlen);
+        n += wlen;
+    }
+    memset(text + n, 'a', len - n);
+}
+
+/* The validators with each implementation this CPU has. */
+static int run_micro_validate(FILE *out, bool *first, uint8_t *text, char *topic) {
+    static const size_t text_lens[] = { 16, 64, 256, 4096, 65536 };
+    static const size_t topic_lens[] = { 8, 64, 256 };
+    static const struct {
+        mqtt_validate_impl_t impl;
+        const char          *name;
+    } impls[] = {
+        { MQTT_VALIDATE_SCALAR, "scalar" },
+        { MQTT_VALIDATE_SSE2,   "sse2" },
+        { MQTT_VALIDATE_AVX2,   "avx2" },
+    };
+
+    for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); ++k) {
+        bool supported = mqtt_validate_set_impl(impls[k].impl) == 0;
+        micro_case_t c = { .impl = impls[k].name };
+        size_t ops = 0;
+        double ns;
+
+        for (int utf8 = 0; utf8 <= 1; ++utf8) {
+            for (size_t i = 0; i < sizeof(text_lens) / sizeof(text_lens[0]); ++i) {
+                c.payload     = text;
+                c.payload_len = text_lens[i];
+                if (utf8) micro_fill_utf8(text, c.payload_len);
+                else      memset(text, 'a', c.payload_len);
+                ns = supported ? micro_time(micro_validate_utf8, &c, &ops) : -1.0;
+                micro_report(out, first, utf8 ? "validate_utf8_mixed" : "validate_utf8_ascii",
+                             &c, ns, ops, c.payload_len);
+            }
+        }
+        c.payload_len = 0;
+        for (size_t i = 0; i < sizeof(topic_lens) / sizeof(topic_lens[0]); ++i) {
+            memset(topic, 'a', topic_lens[i]);
+            for (size_t j = 7; j < topic_lens[i]; j += 8) topic[j] = '/';
+            topic[topic_lens[i]] = '\0';
+            c.topic     = topic;
+            c.topic_len = topic_lens[i];
+            ns = supported ? micro_time(micro_validate_topic_name, &c, &ops) : -1.0;
+            micro_report(out, first, "validate_topic_name", &c, ns, ops, c.topic_len);
+        }
+    }
+    return mqtt_validate_set_impl(MQTT_VALIDATE_AUTO);
+}
+
+static int run_micro(FILE *out) {
+    static const size_t topic_lens[]   = { 8, 64, 256 };
+    static const size_t payload_lens[] = { 0, 16, 256, 4096, 65536 };
+    bool first = true;
+
+    size_t buf_len = mqtt_encode_publish_size(256, 65536, 0);
+    uint8_t *buf = (uint8_t *)malloc(buf_len);
+    uint8_t *frame = (uint8_t *)malloc(buf_len);
+    uint8_t *payload = (uint8_t *)calloc(1, 65536);
+    char *topic = (char *)malloc(257);
+    uint8_t *topic_wire = (uint8_t *)malloc(2 + 256);
+    if (!buf || !frame || !payload || !topic || !topic_wire) return -1;
+
+    fprintf(out, "  \"micro\": [");
+
+    micro_case_t c = { .buf = buf, .buf_len = buf_len };
+    size_t ops = 0;
+    double ns = micro_time(micro_encode_connect, &c, &ops);
+    micro_report(out, &first, "encode_connect", &c, ns, ops,
+                 ns < 0 ? 0 : (size_t)micro_encode_connect(&c));
+
+    for (size_t t = 0; t < sizeof(topic_lens) / sizeof(topic_lens[0]); ++t) {
+        for (size_t p = 0; p < sizeof(payload_lens) / sizeof(payload_lens[0]); ++p) {
+            memset(topic, 'a', topic_lens[t]);
+            for (size_t i = 7; i < topic_lens[t]; i += 8) topic[i] = '/';
+            topic[topic_lens[t]] = '\0';
+
+            c.topic       = topic;
+            c.topic_len   = topic_lens[t];
+            c.payload     = payload;
+            c.payload_len = payload_lens[p];
+            int flen = mqtt_encode_publish(frame, buf_len, topic, payload,
+                                           c.payload_len, 0, false, 0);
+            if (flen < 0) return -1;
+            c.frame     = frame;
+            c.frame_len = (size_t)flen;
+            int wlen = mqtt_encode_topic(topic_wire, 2 + 256, topic, c.topic_len);
+            if (wlen < 0) return -1;
+            c.topic_wire     = topic_wire;
+            c.topic_wire_len = (size_t)wlen;
+
+            ns = micro_time(micro_encode_publish_qos0, &c, &ops);
+            micro_report(out, &first, "encode_publish_qos0", &c, ns, ops, c.frame_len);
+            ns = micro_time(micro_encode_publish_cached_topic, &c, &ops);
+            micro_report(out, &first, "encode_publish_cached_topic", &c, ns, ops,
+                         c.frame_len);
+            ns = micro_time(micro_decode_publish, &c, &ops);
+            micro_report(out, &first, "decode_publish", &c, ns, ops, c.frame_len);
+        }
+    }
+
+    if (run_micro_validate(out, &first, buf, topic) != 0) return -1;
+    fprintf(out, "\n  ]");
+
+    free(buf);
+    free(frame);
+    free(payload);
+    free(topic);
+    free(topic_wire);
+    return 0;
+}
+
+/* ---- End to end ---- */
+
+typedef struct {
+    mqtt_client_t *pub;
+    mqtt_client_t *sub;
+    char           topic[32];
+    size_t         sent;
+    size_t         received;
+    uint64_t      *samples;     // latency in ns, one per received message
+    size_t         nsamples;
+} bench_pair_t;
+
+static void bench_on_message(const char *topic, size_t topic_len,
+                             const uint8_t *payload, size_t payload_len,
+                             void *user_data) {
+    (void)topic;
+    (void)topic_len;
+    bench_pair_t *p = (bench_pair_t *)user_data;
+    uint64_t now = mqtt_time_now_ns();
+    uint64_t sent_at = 0;
+    if (payload_len >= sizeof(sent_at)) memcpy(&sent_at, payload, sizeof(sent_at));
+    p->samples[p->nsamples++] = now - sent_at;
+    p->received++;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void report_latency(FILE *out, bench_pair_t *pairs, size_t npairs) {
+    size_t total = 0;
+    for (size_t i = 0; i < npairs; ++i) total += pairs[i].nsamples;
+    uint64_t *all = (uint64_t *)malloc((total ? total : 1) * sizeof(*all));
+    if (!all) {
+        fprintf(out, "null");
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < npairs; ++i) {
+        memcpy(all + n, pairs[i].samples, pairs[i].nsamples * sizeof(*all));
+        n += pairs[i].nsamples;
+    }
+    qsort(all, n, sizeof(*all), cmp_u64);
+
+    double pct[3] = { 0.50, 0.99, 0.999 };
+    double us[3] = { 0 };
+    for (int i = 0; i < 3 && n > 0; ++i) {
+        size_t idx = (size_t)(pct[i] * (double)(n - 1) + 0.5);
+        us[i] = (double)all[idx] / 1e3;
+    }
+    fprintf(out, "{\"samples\": %zu, \"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, "
+                 "\"max\": %.1f}",
+            n, us[0], us[1], us[2], n > 0 ? (double)all[n - 1] / 1e3 : 0.0);
+    free(all);
+}
+
+/*
+ * Publish count messages per pair with at most window in flight and
+ * drive the loop until all have arrived.
+ *
+ * @return elapsed ns, or 0 on stall or error
+ */
+static uint64_t e2e_phase(mqtt_loop_t *loop, bench_pair_t *pairs, size_t npairs,
+                          size_t count, size_t window, uint8_t *payload, size_t payload_len) {
+    for (size_t i = 0; i < npairs; ++i) {
+        pairs[i].sent = pairs[i].received = pairs[i].nsamples = 0;
+    }
+
+    size_t done = 0;
+    size_t last_done = 0;
+    uint64_t last_progress = mqtt_time_now_ms();
+    uint64_t start = mqtt_time_now_ns();
+    while (done < npairs) {
+        done = 0;
+        for (size_t i = 0; i < npairs; ++i) {
+            bench_pair_t *p = &pairs[i];
+            if (p->received == count) {
+                done++;
+                continue;
+            }
+            size_t room = window - (p->sent - p->received);
+            if (room == 0 || p->sent == count) continue;
+
+            mqtt_client_publish_begin_batch(p->pub);
+            for (; room > 0 && p->sent < count; --room, ++p->sent) {
+                uint64_t now = mqtt_time_now_ns();
+                memcpy(payload, &now, sizeof(now));
+                if (mqtt_client_publish_qos0(p->pub, p->topic, payload, payload_len) != 0)
+                    return 0;
+            }
+            if (mqtt_client_flush(p->pub) != 0) return 0;
+        }
+        if (mqtt_loop_run_once(loop, 1) < 0) return 0;
+
+        size_t received = 0;
+        for (size_t i = 0; i < npairs; ++i) received += pairs[i].received;
+        uint64_t now_ms = mqtt_time_now_ms();
+        if (received != last_done) {
+            last_done = received;
+            last_progress = now_ms;
+        } else if (now_ms - last_progress > BENCH_STALL_MS) {
+            fprintf(stderr, "mqtt_bench: no progress for %d ms\n", BENCH_STALL_MS);
+            return 0;
+        }
+    }
+    uint64_t elapsed = mqtt_time_now_ns() - start;
+    return elapsed ? elapsed : 1;
+}
+
+static mqtt_client_t *e2e_client(mqtt_mock_broker_t *broker, mqtt_transport_t *transport,
+                                 const char *client_id, bench_pair_t *pair) {
+    mqtt_client_config_t cfg = {
+        .host            = "127.0.0.1",
+        .port            = mqtt_mock_broker_port(broker),
+        .client_id       = client_id,
+        .transport       = transport,
+        .on_message_view = pair ? bench_on_message : NULL,
+        .user_data       = pair,
+    };
+    mqtt_client_t *client = mqtt_client_create(&cfg);
+    if (!client) return NULL;
+    if (mqtt_client_connect(client) != 0) {
+        mqtt_client_destroy(client);
+        return NULL;
+    }
+    return client;
+}
+
+static int run_e2e(FILE *out, size_t npairs, size_t count, size_t payload_len, bool mem) {
+    mqtt_mock_broker_config_t bcfg = { .no_tcp = mem };
+    mqtt_mock_broker_t *broker = mqtt_mock_broker_create(&bcfg);
+    if (!broker || mqtt_mock_broker_start(broker) != 0) return -1;
+
+    size_t nsamples = count > BENCH_LATENCY_SAMPLES ? count : BENCH_LATENCY_SAMPLES;
+    bench_pair_t *pairs = (bench_pair_t *)calloc(npairs, sizeof(*pairs));
+    mqtt_transport_t **transports =
+        (mqtt_transport_t **)calloc(2 * npairs, sizeof(*transports));
+    uint8_t *payload = (uint8_t *)calloc(1, payload_len);
+    mqtt_loop_t *loop = mqtt_loop_create();
+    if (!pairs || !transports || !payload || !loop) return -1;
+
+    for (size_t i = 0; i < npairs; ++i) {
+        bench_pair_t *p = &pairs[i];
+        snprintf(p->topic, sizeof(p->topic), "bench/e2e/%zu", i);
+        p->samples = (uint64_t *)malloc(nsamples * sizeof(uint64_t));
+        if (!p->samples) return -1;
+
+        if (mem) {
+            transports[2 * i]     = mqtt_mock_broker_transport(broker);
+            transports[2 * i + 1] = mqtt_mock_broker_transport(broker);
+            if (!transports[2 * i] || !transports[2 * i + 1]) return -1;
+        }
+        p->pub = e2e_client(broker, transports[2 * i], "bench-pub", NULL);
+        p->sub = e2e_client(broker, transports[2 * i + 1], "bench-sub", p);
+        if (!p->pub || !p->sub) return -1;
+        if (mqtt_client_subscribe_qos0(p->sub, p->topic) != 0) return -1;
+        if (mqtt_loop_add(loop, p->pub) != 0 || mqtt_loop_add(loop, p->sub) != 0) return -1;
+    }
+
+    uint64_t tput_ns = e2e_phase(loop, pairs, npairs, count, BENCH_WINDOW,
+                                 payload, payload_len);
+    if (tput_ns == 0) return -1;
+
+    size_t total = npairs * count;
+    size_t remaining = 2 + strlen(pairs[0].topic) + payload_len;
+    size_t frame_len = 1 + (remaining < 128 ? 1 : remaining < 16384 ? 2
+                          : remaining < 2097152 ? 3 : 4) + remaining;
+    fprintf(out, "  \"e2e\": {\n    \"throughput\": {\"messages\": %zu, \"window\": %d, "
+                 "\"elapsed_ms\": %.1f, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.1f, "
+                 "\"latency_us\": ",
+            total, BENCH_WINDOW, (double)tput_ns / 1e6,
+            (double)total * 1e9 / (double)tput_ns,
+            (double)total * (double)frame_len * 1e3 / (double)tput_ns);
+    report_latency(out, pairs, npairs);
+
+    size_t lat_count = count < BENCH_LATENCY_SAMPLES ? count : BENCH_LATENCY_SAMPLES;
+    uint64_t lat_ns = e2e_phase(loop, pairs, npairs, lat_count, 1, payload, payload_len);
+    if (lat_ns == 0) return -1;
+    fprintf(out, "},\n    \"latency\": {\"messages\": %zu, \"window\": 1, "
+                 "\"elapsed_ms\": %.1f, \"latency_us\": ",
+            npairs * lat_count, (double)lat_ns / 1e6);
+    report_latency(out, pairs, npairs);
+
+    // Transport calls per packet over both phases: the syscall cost over TCP.
+    uint64_t sends = 0, sent = 0, recvs = 0, received = 0;
+    for (size_t i = 0; i < npairs; ++i) {
+        mqtt_client_stats_t st;
+        mqtt_client_get_stats(pairs[i].pub, &st);
+        sends += st.send_calls;
+        for (size_t t = 0; t < MQTT_PACKET_TYPES; ++t) sent += st.packets_out[t];
+        mqtt_client_get_stats(pairs[i].sub, &st);
+        recvs += st.recv_calls;
+        for (size_t t = 0; t < MQTT_PACKET_TYPES; ++t) received += st.packets_in[t];
+    }
+    fprintf(out, "},\n    \"transport_calls\": {\"send_per_packet\": %.3f, "
+                 "\"recv_per_packet\": %.3f}\n  }",
+            sent ? (double)sends / (double)sent : 0.0,
+            received ? (double)recvs / (double)received : 0.0);
+
+    mqtt_loop_destroy(loop);
+    for (size_t i = 0; i < npairs; ++i) {
+        mqtt_client_disconnect(pairs[i].pub);
+        mqtt_client_disconnect(pairs[i].sub);
+        mqtt_client_destroy(pairs[i].pub);
+        mqtt_client_destroy(pairs[i].sub);
+        free(pairs[i].samples);
+    }
+    for (size_t i = 0; i < 2 * npairs; ++i) {
+        mqtt_transport_destroy(transports[i]);
+    }
+    mqtt_mock_broker_destroy(broker);
+    free(transports);
+    free(pairs);
+    free(payload);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    size_t npairs      = argc > 1 ? (size_t)atoi(argv[1]) : 4;
+    size_t count       = argc > 2 ? (size_t)atoi(argv[2]) : 100000;
+    size_t payload_len = argc > 3 ? (size_t)atoi(argv[3]) : 64;
+    const char *transport = argc > 4 ? argv[4] : "tcp";
+    const char *mode      = argc > 5 ? argv[5] : "all";
+
+    bool mem = strcmp(transport, "mem") == 0;
+    bool micro = strcmp(mode, "all") == 0 || strcmp(mode, "micro") == 0;
+    bool e2e   = strcmp(mode, "all") == 0 || strcmp(mode, "e2e") == 0;
+    if (npairs == 0 || count == 0 || (!mem && strcmp(transport, "tcp") != 0) ||
+        (!micro && !e2e)) {
+        fprintf(stderr, "Usage: %s [connections] [messages/connection] [payload] "
+                        "[tcp|mem] [all|micro|e2e]\n", argv[0]);
+        return 1;
+    }
+    // Room for the send timestamp.
+    if (payload_len < sizeof(uint64_t)) payload_len = sizeof(uint64_t);
+
+    // Connection chatter from hundreds of clients would drown the results.
+    mqtt_log_set_level(MQTT_LOG_WARN);
+    FILE *out = stdout;
+
+    fprintf(out, "{\n  \"config\": {\"connections\": %zu, \"messages\": %zu, "
+                 "\"payload\": %zu, \"transport\": \"%s\"}",
+            npairs, count, payload_len, mem ? "mem" : "tcp");
+
+    if (micro) {
+        fprintf(out, ",\n");
+        if (run_micro(out) != 0) {
+            fprintf(stderr, "mqtt_bench: microbenchmarks failed\n");
+            return 1;
+        }
+    }
+    if (e2e) {
+        fprintf(out, ",\n");
+        if (run_e2e(out, npairs, count, payload_len, mem) != 0) {
+            fprintf(stderr, "mqtt_bench: end-to-end run failed\n");
+            return 1;
+        }
+    }
+    fprintf(out, "\n}\n");
+    return 0;
+}
@@ -0,0 +1,244 @@
+/*
+ * Throughput benchmark for mqtt_runtime_t.
+ *
+ * Starts an in-process TCP sink that answers CONNECT with CONNACK and
+ * then discards everything, connects a number of clients to it with
+ * mqtt_client_connect_async() (the loop threads finish the handshakes),
+ * and lets producer threads publish through mqtt_runtime_publish() as
+ * fast as they can. Reports how long the connects took, and messages
+ * per second until the sink has received every byte.
+ *
+ * Usage: mqtt_runtime_bench [threads] [clients] [producers] [msgs/producer] [payload]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "mqtt_client.h"
+#include "mqtt_decode.h"
+#include "mqtt_runtime.h"
+#include "mqtt_time.h"
+
+#define BENCH_TOPIC "bench/runtime"
+
+static atomic_size_t sink_bytes;
+static atomic_size_t connected;
+static atomic_size_t connect_failed;
+
+typedef struct {
+    mqtt_runtime_session_t **sessions;
+    size_t nsessions;
+    size_t count;
+    size_t payload_len;
+    size_t first;
+} producer_arg_t;
+
+/* One thread per sink connection: CONNACK, then count and discard. */
+static void *sink_conn_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    static const uint8_t connack[4] = { 0x20, 0x02, 0x00, 0x00 };
+    uint8_t buf[65536];
+    size_t have = 0;
+    size_t frame_len = 0;
+
+    // Wait for the complete CONNECT packet.
+    while (mqtt_decode_frame(buf, have, &frame_len) != 1) {
+        ssize_t r = recv(fd, buf + have, sizeof(buf) - have, 0);
+        if (r <= 0) {
+            close(fd);
+            return NULL;
+        }
+        have += (size_t)r;
+    }
+    if (send(fd, connack, sizeof(connack), 0) != (ssize_t)sizeof(connack)) {
+        close(fd);
+        return NULL;
+    }
+    atomic_fetch_add(&sink_bytes, have - frame_len);
+
+    for (;;) {
+        ssize_t r = recv(fd, buf, sizeof(buf), 0);
+        if (r <= 0) break;
+        atomic_fetch_add(&sink_bytes, (size_t)r);
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *sink_accept_thread(void *arg) {
+    int lfd = (int)(intptr_t)arg;
+    for (;;) {
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) break;
+
+        pthread_t t;
+        if (pthread_create(&t, NULL, sink_conn_thread, (void *)(intptr_t)fd) == 0) {
+            pthread_detach(t);
+        } else {
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+static int sink_start(uint16_t *port) {
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lfd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port        = 0;
+
+    socklen_t alen = sizeof(addr);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(lfd, 1024) != 0 ||
+        getsockname(lfd, (struct sockaddr *)&addr, &alen) != 0) {
+        perror("sink");
+        close(lfd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+
+    pthread_t t;
+    if (pthread_create(&t, NULL, sink_accept_thread, (void *)(intptr_t)lfd) != 0) {
+        close(lfd);
+        return -1;
+    }
+    pthread_detach(t);
+    return 0;
+}
+
+/* Runs on the loop threads as CONNACKs arrive. */
+static void on_connection(mqtt_client_t *client, bool up, bool session_present,
+                          void *user_data) {
+    (void)client;
+    (void)session_present;
+    (void)user_data;
+    atomic_fetch_add(up ? &connected : &connect_failed, 1);
+}
+
+static void *producer_thread(void *arg) {
+    producer_arg_t *p = (producer_arg_t *)arg;
+    uint8_t *payload = (uint8_t *)calloc(1, p->payload_len ? p->payload_len : 1);
+
+    for (size_t i = 0; i < p->count; ++i) {
+        mqtt_runtime_session_t *s = p->sessions[(p->first + i) % p->nsessions];
+        while (mqtt_runtime_publish(s, BENCH_TOPIC, payload, p->payload_len) != 0) {
+            sched_yield();
+        }
+    }
+
+    free(payload);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    size_t threads     = argc > 1 ? (size_t)atoi(argv[1]) : 0;
+    size_t nclients    = argc > 2 ? (size_t)atoi(argv[2]) : 64;
+    size_t nproducers  = argc > 3 ? (size_t)atoi(argv[3]) : 4;
+    size_t per_prod    = argc > 4 ? (size_t)atoi(argv[4]) : 250000;
+    size_t payload_len = argc > 5 ? (size_t)atoi(argv[5]) : 64;
+
+    if (nclients == 0 || nproducers == 0) {
+        fprintf(stderr, "Usage: %s [threads] [clients] [producers] "
+                        "[msgs/producer] [payload]\n", argv[0]);
+        return 1;
+    }
+
+    uint16_t port = 0;
+    if (sink_start(&port) != 0) return 1;
+
+    mqtt_runtime_config_t rcfg = { .num_threads = threads, .pin_threads = true };
+    mqtt_runtime_t *rt = mqtt_runtime_create(&rcfg);
+    if (!rt) return 1;
+
+    mqtt_client_t **clients = (mqtt_client_t **)calloc(nclients, sizeof(*clients));
+    mqtt_runtime_session_t **sessions =
+        (mqtt_runtime_session_t **)calloc(nclients, sizeof(*sessions));
+    if (!clients || !sessions) return 1;
+
+    uint64_t connect_start = mqtt_time_now_ms();
+    for (size_t i = 0; i < nclients; ++i) {
+        mqtt_client_config_t cfg = {
+            .host           = "127.0.0.1",
+            .port           = port,
+            .client_id      = "bench",
+            .keep_alive_sec = 60,
+            .on_connection  = on_connection,
+        };
+        clients[i] = mqtt_client_create(&cfg);
+        if (!clients[i] || mqtt_client_connect_async(clients[i]) != 0) return 1;
+        sessions[i] = mqtt_runtime_add_client(rt, clients[i]);
+        if (!sessions[i]) return 1;
+    }
+    while (atomic_load(&connected) + atomic_load(&connect_failed) < nclients) {
+        usleep(1000);
+    }
+    if (atomic_load(&connect_failed) > 0) {
+        fprintf(stderr, "%zu connects failed\n", atomic_load(&connect_failed));
+        return 1;
+    }
+    uint64_t connect_ms = mqtt_time_now_ms() - connect_start;
+
+    // Each PUBLISH: 1 type byte + remaining length + topic prefix + topic + payload
+    size_t remaining = 2 + strlen(BENCH_TOPIC) + payload_len;
+    size_t rl_bytes  = remaining < 128 ? 1 : remaining < 16384 ? 2
+                     : remaining < 2097152 ? 3 : 4;
+    size_t frame_len = 1 + rl_bytes + remaining;
+    size_t total_msgs = nproducers * per_prod;
+    size_t expected   = total_msgs * frame_len;
+
+    pthread_t *prod = (pthread_t *)calloc(nproducers, sizeof(pthread_t));
+    producer_arg_t *args = (producer_arg_t *)calloc(nproducers, sizeof(producer_arg_t));
+    if (!prod || !args) return 1;
+
+    atomic_store(&sink_bytes, 0);
+    uint64_t start = mqtt_time_now_ms();
+
+    for (size_t i = 0; i < nproducers; ++i) {
+        args[i].sessions    = sessions;
+        args[i].nsessions   = nclients;
+        args[i].count       = per_prod;
+        args[i].payload_len = payload_len;
+        args[i].first       = i;
+        pthread_create(&prod[i], NULL, producer_thread, &args[i]);
+    }
+    for (size_t i = 0; i < nproducers; ++i) {
+        pthread_join(prod[i], NULL);
+    }
+
+    while (atomic_load(&sink_bytes) < expected) {
+        usleep(1000);
+    }
+    uint64_t elapsed = mqtt_time_now_ms() - start;
+    if (elapsed == 0) elapsed = 1;
+
+    printf("threads=%zu clients=%zu producers=%zu msgs=%zu payload=%zu "
+           "connect_ms=%llu elapsed_ms=%llu msgs_per_sec=%.0f MB_per_sec=%.1f\n",
+           mqtt_runtime_num_threads(rt), nclients, nproducers, total_msgs,
+           payload_len, (unsigned long long)connect_ms, (unsigned long long)elapsed,
+           (double)total_msgs * 1000.0 / (double)elapsed,
+           (double)expected / 1000.0 / (double)elapsed);
+
+    mqtt_runtime_destroy(rt);
+    for (size_t i = 0; i < nclients; ++i) {
+        mqtt_client_disconnect(clients[i]);
+        mqtt_client_destroy(clients[i]);
+    }
+    free(clients);
+    free(sessions);
+    free(prod);
+    free(args);
+    return 0;
+}
@@ -14,7 +14,17 @@ static void print_message_callback(const char *topic,
     fflush(stdout);
 }
 
-static int run_connect_test(const char *host, uint16_t port) {
+static void print_tls_stats(const mqtt_client_t *client) {
+    mqtt_tls_stats_t st;
+    if (mqtt_transport_tls_get_stats(mqtt_client_transport(client), &st) == 0) {
+        printf("TLS handshakes=%llu resumed=%llu\n",
+               (unsigned long long)st.handshakes,
+               (unsigned long long)st.resumed);
+    }
+}
+
+static int run_connect_test(const char *host, uint16_t port,
+                            const mqtt_tls_config_t *tls) {
     mqtt_client_config_t cfg = {
         .host           = host,
         .port           = port,
@@ -22,7 +32,8 @@ static int run_connect_test(const char *host, uint16_t port) {
         .keep_alive_sec = 30,
         .username       = NULL,
         .password       = NULL,
-        .on_message     = NULL
+        .on_message     = NULL,
+        .tls            = tls
     };
 
     printf("MQTT CLI (connect test). Host=%s, Port=%u\n",
@@ -40,6 +51,17 @@ static int run_connect_test(const char *host, uint16_t port) {
         return 1;
     }
 
+    // Connect once more: the second handshake should resume the session
+    if (tls) {
+        mqtt_client_disconnect(client);
+        if (mqtt_client_connect(client) != 0) {
+            fprintf(stderr, "Failed to reconnect to broker.\n");
+            mqtt_client_destroy(client);
+            return 1;
+        }
+        print_tls_stats(client);
+    }
+
     mqtt_client_loop(client);
 
     mqtt_client_disconnect(client);
@@ -50,6 +72,7 @@ static int run_connect_test(const char *host, uint16_t port) {
 }
 
 static int run_publish(const char *host, uint16_t port,
+                       const mqtt_tls_config_t *tls,
                        const char *topic, const char *message) {
     mqtt_client_config_t cfg = {
         .host           = host,
@@ -58,7 +81,8 @@ static int run_publish(const char *host, uint16_t port,
         .keep_alive_sec = 30,
         .username       = NULL,
         .password       = NULL,
-        .on_message     = NULL
+        .on_message     = NULL,
+        .tls            = tls
     };
 
     printf("MQTT CLI (publish). Host=%s, Port=%u, Topic=%s, Message=%s\n",
@@ -93,6 +117,7 @@ static int run_publish(const char *host, uint16_t port,
 }
 
 static int run_subscribe(const char *host, uint16_t port,
+                         const mqtt_tls_config_t *tls,
                          const char *topic) {
     mqtt_client_config_t cfg = {
         .host           = host,
@@ -101,7 +126,8 @@ static int run_subscribe(const char *host, uint16_t port,
         .keep_alive_sec = 30,
         .username       = NULL,
         .password       = NULL,
-        .on_message     = print_message_callback
+        .on_message     = print_message_callback,
+        .tls            = tls
     };
 
     printf("MQTT CLI (subscribe). Host=%s, Port=%u, Topic=%s\n",
@@ -142,10 +168,50 @@ static int run_subscribe(const char *host, uint16_t port,
     return 0;
 }
 
+static void print_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] pub <host> <port> <topic> <message>\n"
+            "       %s [options] sub <host> <port> <topic>\n"
+            "       %s [options] [host] [port]\n"
+            "Options:\n"
+            "  --tls                connect over TLS\n"
+            "  --cafile <file>      PEM bundle to verify the broker (implies --tls)\n"
+            "  --insecure           skip certificate verification (implies --tls)\n"
+            "  --server-name <name> SNI and name to verify (implies --tls)\n",
+            prog, prog, prog);
+}
+
 int main(int argc, char *argv[]) {
+    const char *prog = argv[0];
+    mqtt_tls_config_t tls_cfg = {0};
+    int use_tls = 0;
+
+    // Options come before the command; shift them off argv
+    while (argc >= 2 && strncmp(argv[1], "--", 2) == 0) {
+        if (strcmp(argv[1], "--tls") == 0) {
+            use_tls = 1;
+        } else if (strcmp(argv[1], "--insecure") == 0) {
+            tls_cfg.insecure = true;
+            use_tls = 1;
+        } else if (strcmp(argv[1], "--cafile") == 0 && argc >= 3) {
+            tls_cfg.ca_file = argv[2];
+            use_tls = 1;
+            argv++; argc--;
+        } else if (strcmp(argv[1], "--server-name") == 0 && argc >= 3) {
+            tls_cfg.server_name = argv[2];
+            use_tls = 1;
+            argv++; argc--;
+        } else {
+            print_usage(prog);
+            return 1;
+        }
+        argv++; argc--;
+    }
+    const mqtt_tls_config_t *tls = use_tls ? &tls_cfg : NULL;
+
     if (argc >= 2 && strcmp(argv[1], "pub") == 0) {
         if (argc < 6) {
-            fprintf(stderr, "Usage: %s pub <host> <port> <topic> <message>\n", argv[0]);
+            print_usage(prog);
             return 1;
         }
         const char *host    = argv[2];
@@ -153,26 +219,26 @@ int main(int argc, char *argv[]) {
         const char *topic   = argv[4];
         const char *message = argv[5];
 
-        return run_publish(host, port, topic, message);
+        return run_publish(host, port, tls, topic, message);
 
     } else if (argc >= 2 && strcmp(argv[1], "sub") == 0) {
         if (argc < 5) {
-            fprintf(stderr, "Usage: %s sub <host> <port> <topic>\n", argv[0]);
+            print_usage(prog);
             return 1;
         }
         const char *host  = argv[2];
         uint16_t    port  = (uint16_t)atoi(argv[3]);
         const char *topic = argv[4];
 
-        return run_subscribe(host, port, topic);
+        return run_subscribe(host, port, tls, topic);
 
     } else {
         const char *host = "broker.hivemq.com";
-        uint16_t    port = 1883;
+        uint16_t    port = tls ? 8883 : 1883;
 
         if (argc >= 2) host = argv[1];
         if (argc >= 3) port = (uint16_t)atoi(argv[2]);
 
-        return run_connect_test(host, port);
+        return run_connect_test(host, port, tls);
     }
 }
@@ -0,0 +1,32 @@
+/*
+ * Stand-alone mock broker, e.g. for mqtt_cli in an offline environment.
+ *
+ * Usage: mqtt_mock_broker [port] [address]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "mqtt_mock_broker.h"
+
+int main(int argc, char *argv[]) {
+    mqtt_mock_broker_config_t cfg = {
+        .host = argc >= 3 ? argv[2] : NULL,
+        .port = argc >= 2 ? (uint16_t)atoi(argv[1]) : 1883,
+    };
+
+    mqtt_mock_broker_t *broker = mqtt_mock_broker_create(&cfg);
+    if (!broker) {
+        fprintf(stderr, "Failed to start mock broker.\n");
+        return 1;
+    }
+
+    printf("Mock broker listening on %s:%u\n",
+           cfg.host ? cfg.host : "127.0.0.1",
+           (unsigned int)mqtt_mock_broker_port(broker));
+    fflush(stdout);
+
+    while (mqtt_mock_broker_poll(broker, -1) == 0) {
+    }
+
+    mqtt_mock_broker_destroy(broker);
+    return 1;
+}
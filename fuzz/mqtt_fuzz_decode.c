@@ -0,0 +1,224 @@
+/*
+ * Fuzz target for the inbound packet path.
+ *
+ * Each input is a byte stream as a broker might send it. It is split
+ * with mqtt_decode_frame() and every frame goes through
+ * mqtt_decode_packet(), whose views must stay inside the frame. The
+ * same bytes are then fed to a connected client over the in-memory
+ * transport, so the dispatcher, the QoS 1/2 replies and the receive
+ * buffer handling see them too.
+ *
+ * Built with -fsanitize=fuzzer (clang, MQTT_FUZZ_LIBFUZZER=ON) this is a
+ * libFuzzer target. Otherwise it has its own driver:
+ *
+ *   mqtt_fuzz_decode FILE...      run each file once
+ *   mqtt_fuzz_decode [runs] [seed] mutate a built-in corpus of valid
+ *                                  packets (default 100000 runs)
+ *
+ * Run it under -fsanitize=address,undefined to catch memory errors.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mqtt_client.h"
+#include "mqtt_decode.h"
+#include "mqtt_log.h"
+#include "mqtt_transport_mem.h"
+
+#define FUZZ_MAX_INPUT 65536
+
+static void fuzz_check(int ok, const char *what) {
+    if (!ok) {
+        fprintf(stderr, "mqtt_fuzz_decode: %s\n", what);
+        abort();
+    }
+}
+
+static int fuzz_within(const uint8_t *buf, size_t len,
+                       const void *p, size_t n) {
+    const uint8_t *q = (const uint8_t *)p;
+    return q >= buf && n <= len && (size_t)(q - buf) <= len - n;
+}
+
+static void fuzz_decoder(const uint8_t *data, size_t size) {
+    size_t off = 0;
+    size_t frame_len = 0;
+
+    while (off < size && mqtt_decode_frame(data + off, size - off, &frame_len) == 1) {
+        const uint8_t *buf = data + off;
+        mqtt_packet_t pkt;
+
+        if (mqtt_decode_packet(buf, frame_len, &pkt) == 0) {
+            fuzz_check(pkt.type == (mqtt_packet_type_t)(buf[0] >> 4), "type mismatch");
+            if (pkt.type == MQTT_PACKET_PUBLISH) {
+                const mqtt_publish_view_t *m = &pkt.publish;
+                fuzz_check(m->qos <= 2, "PUBLISH qos");
+                fuzz_check((m->qos == 0) == (pkt.packet_id == 0), "PUBLISH packet id");
+                fuzz_check(fuzz_within(buf, frame_len, m->topic, m->topic_len), "topic bounds");
+                fuzz_check(fuzz_within(buf, frame_len, m->payload, m->payload_len),
+                           "payload bounds");
+                fuzz_check(m->payload + m->payload_len == buf + frame_len, "payload end");
+            } else if (pkt.type == MQTT_PACKET_SUBACK) {
+                fuzz_check(pkt.suback.count > 0, "SUBACK count");
+                fuzz_check(fuzz_within(buf, frame_len, pkt.suback.return_codes,
+                                       pkt.suback.count), "SUBACK bounds");
+            } else if (pkt.type != MQTT_PACKET_CONNACK && pkt.type != MQTT_PACKET_PINGRESP) {
+                fuzz_check(pkt.packet_id != 0, "packet id");
+            }
+        }
+        off += frame_len;
+    }
+}
+
+static void fuzz_client(const uint8_t *data, size_t size) {
+    static const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+    mqtt_transport_t *client_end = NULL;
+    mqtt_transport_t *broker_end = NULL;
+
+    if (mqtt_transport_mem_pair(&client_end, &broker_end) != 0) abort();
+
+    // Queued ahead of the blocking CONNECT handshake.
+    broker_end->ops->send(broker_end, connack, sizeof(connack));
+
+    mqtt_client_config_t cfg = {
+        .host      = "fuzz",
+        .port      = 1883,
+        .client_id = "fuzz",
+        .transport = client_end,
+    };
+    mqtt_client_t *client = mqtt_client_create(&cfg);
+    if (!client || mqtt_client_connect(client) != 0) abort();
+
+    mqtt_client_set_nonblocking(client, true);
+    if (size > 0) broker_end->ops->send(broker_end, data, size);
+    mqtt_client_loop(client);
+
+    mqtt_client_destroy(client);
+    mqtt_transport_destroy(client_end);
+    mqtt_transport_destroy(broker_end);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if (size > FUZZ_MAX_INPUT) return 0;
+    mqtt_log_set_level(MQTT_LOG_OFF);   // malformed input is the point
+    fuzz_decoder(data, size);
+    fuzz_client(data, size);
+    return 0;
+}
+
+#ifndef MQTT_FUZZ_LIBFUZZER
+
+/* ---- Standalone driver ---- */
+
+/* Valid server-to-client packets to start mutating from. */
+static const uint8_t fuzz_seed_connack[]  = { 0x20, 0x02, 0x01, 0x00 };
+static const uint8_t fuzz_seed_publish0[] = { 0x30, 0x07, 0x00, 0x03, 'a', '/', 'b', 'h', 'i' };
+static const uint8_t fuzz_seed_publish1[] = { 0x32, 0x09, 0x00, 0x03, 'a', '/', 'b', 0x00, 0x01,
+                                              'h', 'i' };
+static const uint8_t fuzz_seed_publish2[] = { 0x3D, 0x08, 0x00, 0x01, 'x', 0x12, 0x34,
+                                              0x00, 0x01, 0x02 };
+static const uint8_t fuzz_seed_acks[]     = { 0x40, 0x02, 0x00, 0x01, 0x50, 0x02, 0x00, 0x02,
+                                              0x62, 0x02, 0x12, 0x34, 0x70, 0x02, 0x00, 0x02 };
+static const uint8_t fuzz_seed_suback[]   = { 0x90, 0x05, 0x00, 0x07, 0x00, 0x01, 0x80 };
+static const uint8_t fuzz_seed_misc[]     = { 0xB0, 0x02, 0x00, 0x09, 0xD0, 0x00 };
+
+static const struct {
+    const uint8_t *data;
+    size_t         len;
+} fuzz_seeds[] = {
+    { fuzz_seed_connack,  sizeof(fuzz_seed_connack) },
+    { fuzz_seed_publish0, sizeof(fuzz_seed_publish0) },
+    { fuzz_seed_publish1, sizeof(fuzz_seed_publish1) },
+    { fuzz_seed_publish2, sizeof(fuzz_seed_publish2) },
+    { fuzz_seed_acks,     sizeof(fuzz_seed_acks) },
+    { fuzz_seed_suback,   sizeof(fuzz_seed_suback) },
+    { fuzz_seed_misc,     sizeof(fuzz_seed_misc) },
+};
+#define FUZZ_NSEEDS (sizeof(fuzz_seeds) / sizeof(fuzz_seeds[0]))
+
+static uint64_t fuzz_rng;
+
+static uint32_t fuzz_rand(uint32_t n) {
+    fuzz_rng ^= fuzz_rng >> 12;
+    fuzz_rng ^= fuzz_rng << 25;
+    fuzz_rng ^= fuzz_rng >> 27;
+    return (uint32_t)((fuzz_rng * 0x2545F4914F6CDD1Dull) >> 32) % n;
+}
+
+static void fuzz_append_seed(uint8_t *buf, size_t *len) {
+    size_t k = fuzz_rand(FUZZ_NSEEDS);
+    if (*len + fuzz_seeds[k].len > 512) return;
+    memcpy(buf + *len, fuzz_seeds[k].data, fuzz_seeds[k].len);
+    *len += fuzz_seeds[k].len;
+}
+
+/* A few seeds back to back, then a handful of byte-level mutations. */
+static size_t fuzz_mutate(uint8_t *buf) {
+    size_t len = 0;
+    size_t n = 1 + fuzz_rand(4);
+    for (size_t i = 0; i < n; ++i) fuzz_append_seed(buf, &len);
+
+    size_t edits = fuzz_rand(5);
+    for (size_t i = 0; i < edits && len > 0; ++i) {
+        size_t at = fuzz_rand((uint32_t)len);
+        switch (fuzz_rand(5)) {
+        case 0:                                     // flip a bit
+            buf[at] ^= (uint8_t)(1u << fuzz_rand(8));
+            break;
+        case 1:                                     // random byte
+            buf[at] = (uint8_t)fuzz_rand(256);
+            break;
+        case 2:                                     // interesting byte
+            buf[at] = (uint8_t[]){ 0x00, 0x01, 0x7F, 0x80, 0xFF }[fuzz_rand(5)];
+            break;
+        case 3:                                     // truncate
+            len = at;
+            break;
+        default:                                    // delete one byte
+            memmove(buf + at, buf + at + 1, len - at - 1);
+            len--;
+            break;
+        }
+    }
+    return len;
+}
+
+static int fuzz_run_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    static uint8_t buf[FUZZ_MAX_INPUT];
+    size_t len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && argv[1][strspn(argv[1], "0123456789")] != '\0') {
+        int rc = 0;
+        for (int i = 1; i < argc; ++i) {
+            if (fuzz_run_file(argv[i]) != 0) rc = 1;
+        }
+        return rc;
+    }
+
+    unsigned long runs = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    fuzz_rng = argc > 2 ? strtoull(argv[2], NULL, 10) : 0x9E3779B97F4A7C15ull;
+    if (fuzz_rng == 0) fuzz_rng = 1;
+
+    uint8_t buf[512];
+    for (unsigned long i = 0; i < runs; ++i) {
+        size_t len = fuzz_mutate(buf);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("mqtt_fuzz_decode: %lu runs, no failures\n", runs);
+    return 0;
+}
+
+#endif // MQTT_FUZZ_LIBFUZZER
@@ -5,9 +5,20 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "mqtt_metrics.h"
+#include "mqtt_pool.h"
+#include "mqtt_topic_trie.h"
+#include "mqtt_transport.h"
+#include "mqtt_transport_tls.h"
+
 // Forward declaration of internal struct
 typedef struct mqtt_client mqtt_client_t;
 
+/**
+ * A topic registered with mqtt_client_topic_register().
+ */
+typedef struct mqtt_topic_entry mqtt_client_topic_t;
+
 /**
  * Callback for incoming PUBLISH messages (QoS 0).
  */
@@ -15,6 +26,113 @@ typedef void (*mqtt_message_callback_t)(const char *topic,
                                         const uint8_t *payload,
                                         size_t payload_len);
 
+/**
+ * Callback for incoming PUBLISH messages without copying the topic.
+ *
+ * topic and payload point into the receive buffer and are only valid
+ * during the call; topic is not NUL-terminated.
+ */
+typedef void (*mqtt_message_view_callback_t)(const char *topic,
+                                             size_t topic_len,
+                                             const uint8_t *payload,
+                                             size_t payload_len,
+                                             void *user_data);
+
+/**
+ * Called when a QoS 1 message got its PUBACK or a QoS 2 message its
+ * PUBCOMP.
+ */
+typedef void (*mqtt_delivery_callback_t)(uint16_t packet_id, void *user_data);
+
+/**
+ * Called when the SUBACK for one SUBSCRIBE packet arrives.
+ *
+ * first_index is the position, in the array passed to
+ * mqtt_client_subscribe_many(), of the first filter this packet carried;
+ * return_codes[i] belongs to filter first_index + i (0x00-0x02 granted
+ * QoS, 0x80 failure).
+ *
+ * If the connection is lost or closed before the SUBACK arrives, it is
+ * called with return_codes NULL and count the number of filters the
+ * packet carried. Whether the broker applied them is unknown; with
+ * auto_reconnect, subscribe again once the connection is back.
+ */
+typedef void (*mqtt_suback_callback_t)(uint16_t packet_id,
+                                       size_t first_index,
+                                       const uint8_t *return_codes,
+                                       size_t count,
+                                       void *ctx);
+
+/**
+ * Called when a connection is established (session_present as reported
+ * by the broker's CONNACK) and, with auto_reconnect, when it is lost.
+ * Also called with connected = false when mqtt_client_connect_async()
+ * gives up.
+ */
+typedef void (*mqtt_connection_callback_t)(mqtt_client_t *client,
+                                           bool connected,
+                                           bool session_present,
+                                           void *user_data);
+
+/**
+ * Called when mqtt_client_next_deadline_ms() may have moved earlier
+ * than the caller last saw, e.g. a batch with a flush interval started.
+ */
+typedef void (*mqtt_client_deadline_hook_t)(mqtt_client_t *client, void *ctx);
+
+/**
+ * Called on a producer thread when mqtt_client_publish_concurrent()
+ * queued a frame and the writer has not been told since its last drain.
+ * It should get the thread driving the client to call
+ * mqtt_client_process_write() soon, and must not touch the client itself.
+ */
+typedef void (*mqtt_client_wakeup_hook_t)(mqtt_client_t *client, void *ctx);
+
+/**
+ * Called on the thread driving the client when the outbound backlog
+ * reaches tx_high_watermark (congested = true) and again once it is
+ * back down to tx_low_watermark. It runs inside the call that moved the
+ * backlog, so it should only note the state (e.g. pause a producer),
+ * not call into the client.
+ */
+typedef void (*mqtt_tx_pressure_callback_t)(mqtt_client_t *client,
+                                            bool congested,
+                                            void *user_data);
+
+/**
+ * What a publish does when its message would take the outbound backlog
+ * past tx_queue_max.
+ */
+typedef enum {
+    MQTT_TX_OVERFLOW_REJECT = 0,   // fail with MQTT_CLIENT_ERR_QUEUE_FULL
+    MQTT_TX_OVERFLOW_DROP_OLDEST,  // discard the oldest queued QoS 0 messages
+    MQTT_TX_OVERFLOW_BLOCK,        // wait for room, up to tx_block_timeout_ms
+} mqtt_tx_overflow_t;
+
+/**
+ * Returned by mqtt_client_publish() when receive_maximum messages are
+ * already awaiting acknowledgement.
+ */
+#define MQTT_CLIENT_ERR_INFLIGHT_FULL (-2)
+
+/**
+ * Returned by mqtt_client_publish() when pool_mem_cap leaves no room
+ * for another stored message.
+ */
+#define MQTT_CLIENT_ERR_NO_MEMORY (-3)
+
+/**
+ * Returned by the publish functions while reconnecting when
+ * offline_queue_max QoS 0 messages are already waiting.
+ */
+#define MQTT_CLIENT_ERR_OFFLINE_FULL (-4)
+
+/**
+ * Returned by the publish functions when tx_queue_max leaves no room for
+ * the message (see mqtt_tx_overflow_t).
+ */
+#define MQTT_CLIENT_ERR_QUEUE_FULL (-5)
+
 /**
  * Configuration for the MQTT client.
  */
@@ -22,22 +140,232 @@ typedef struct {
     const char *host;          // e.g. "broker.hivemq.com"
     uint16_t    port;          // e.g. 1883
     const char *client_id;     // e.g. "srijan-mqtt-client"
-    uint16_t    keep_alive_sec;
+    uint16_t    keep_alive_sec;   // PINGREQ after this long without sending, 0 = off
+    uint32_t    ping_timeout_ms;  // PINGRESP wait, 0 = keep_alive_sec
+    uint32_t    connect_timeout_ms; // non-blocking connect up to CONNACK, 0 = 10 s
 
     const char *username;      // optional
-    const char *password;      // optional
+    const char *password;      // optional, needs username
+
+    // Last will (optional): published by the broker if the connection
+    // drops without a DISCONNECT
+    const char    *will_topic;        // NULL = no will
+    const uint8_t *will_payload;
+    size_t         will_payload_len;  // up to 65535
+    uint8_t        will_qos;
+    bool           will_retain;
+
+    // Transport: plain TCP unless one of these is set
+    const mqtt_tls_config_t *tls;     // TLS (e.g. port 8883), see mqtt_transport_tls.h
+    mqtt_transport_t        *transport; // custom transport, owned by the caller; overrides tls
 
     mqtt_message_callback_t on_message; // can be NULL
+    mqtt_message_view_callback_t on_message_view; // used instead of on_message if set
+
+    // Batch mode (see mqtt_client_publish_begin_batch)
+    size_t   batch_flush_bytes;       // auto-flush threshold, 0 = 16 KB
+    uint32_t batch_flush_interval_ms; // auto-flush age, 0 = bytes only
+
+    // QoS 1/2 publishing
+    uint16_t receive_maximum;         // in-flight window, 0 = 64
+    mqtt_delivery_callback_t on_delivered; // can be NULL
+
+    // Memory for stored outbound messages (see mqtt_pool.h)
+    void    *pool_region;             // static slab, NULL = malloc'd
+    size_t   pool_region_size;        // 0 = receive_maximum blocks
+    size_t   pool_block_size;         // 0 = 256 bytes
+    size_t   pool_mem_cap;            // 0 = unlimited heap fallback
+
+    // Session resumption and reconnect
+    bool     persistent_session;      // CONNECT with clean_session = 0
+    bool     auto_reconnect;          // reconnect instead of failing on I/O errors
+    uint32_t reconnect_min_ms;        // first backoff step, 0 = 1 s
+    uint32_t reconnect_max_ms;        // backoff ceiling, 0 = 60 s
+    size_t   offline_queue_max;       // QoS 0 messages held while reconnecting, 0 = 1024
+    mqtt_connection_callback_t on_connection; // can be NULL
+
+    // Crash-safe outbound store (see mqtt_store.h). QoS 1/2 messages and
+    // the offline queue are kept in memory only unless store_dir is set;
+    // with it they are also logged there and resent after a restart,
+    // which needs the same receive_maximum as the run that stored them.
+    const char *store_dir;
+    size_t   store_segment_size;      // 0 = 4 MiB
+    uint32_t store_sync_every;        // msync after this many records, 0 = off
+    uint32_t store_sync_interval_ms;  // msync dirty records this often, 0 = off
+
+    // Outbound backpressure. The backlog is what publishes handed over
+    // but the socket has not taken yet: tx_buffered_bytes plus frames
+    // queued by mqtt_client_publish_concurrent(). A PUBLISH that would
+    // take it past tx_queue_max is handled as tx_overflow says; an empty
+    // backlog always takes one message, and other packets are never held
+    // back. BLOCK waits for the socket on the driving thread (without
+    // reading meanwhile) and for the driving thread on producer threads.
+    size_t   tx_queue_max;            // 0 = unbounded
+    mqtt_tx_overflow_t tx_overflow;   // 0 = reject
+    uint32_t tx_block_timeout_ms;     // longest BLOCK wait, 0 = no limit
+    size_t   tx_high_watermark;       // congested from here, 0 = tx_queue_max
+    size_t   tx_low_watermark;        // relieved at or below, 0 = high / 2
+    mqtt_tx_pressure_callback_t on_tx_pressure; // can be NULL
+
+    void *user_data;                  // passed to callbacks that take it
 } mqtt_client_config_t;
 
+/**
+ * With store_dir set, messages an earlier run left unacknowledged are
+ * loaded here and go out, in publish order, with the first connect.
+ *
+ * @return client, or NULL on invalid configuration or store error
+ */
 mqtt_client_t *mqtt_client_create(const mqtt_client_config_t *cfg);
 void mqtt_client_destroy(mqtt_client_t *client);
 
+/**
+ * Connect and complete the CONNECT/CONNACK handshake.
+ *
+ * Unacknowledged QoS 1/2 messages and QoS 0 messages queued while
+ * reconnecting are then resent in publish order with one flush: with a
+ * resumed session (persistent_session and session present) as DUP
+ * retransmissions, otherwise as new messages.
+ *
+ * With auto_reconnect, later connection failures are not reported by
+ * mqtt_client_loop()/mqtt_client_tick(): the client reconnects with
+ * exponential backoff and full jitter, and publishes made meanwhile are
+ * queued.
+ *
+ * @return 0 on success, -1 on error
+ */
 int  mqtt_client_connect(mqtt_client_t *client);
+
+/**
+ * Start connecting without blocking, for clients driven by an event
+ * loop (mqtt_loop_t or the caller's own poll on mqtt_client_fd()).
+ *
+ * Switches the client to non-blocking mode. Name resolution runs off
+ * the calling thread (see mqtt_resolver.h), TCP attempts race over the
+ * broker's addresses (see mqtt_connector.h), and the TLS handshake,
+ * CONNECT and CONNACK then advance from mqtt_client_loop(),
+ * mqtt_client_process_write() and mqtt_client_tick() as the descriptor
+ * becomes ready. The whole sequence is bounded by connect_timeout_ms.
+ *
+ * The outcome is reported through on_connection. With auto_reconnect a
+ * failed attempt is retried with backoff, like a lost connection;
+ * without it, mqtt_client_loop()/mqtt_client_tick() return -1.
+ * Transports without non-blocking connect (e.g. mqtt_transport_mem.h)
+ * connect right here instead.
+ *
+ * @return 0 if connecting (or already connected), -1 on error
+ */
+int  mqtt_client_connect_async(mqtt_client_t *client);
+
+/**
+ * True while a connect started by mqtt_client_connect_async() (or a
+ * non-blocking reconnect) waits for the socket, handshake or CONNACK.
+ */
+bool mqtt_client_is_connecting(const mqtt_client_t *client);
+
+/**
+ * Close the connection (or stop reconnecting). Unacknowledged messages
+ * are kept for the next mqtt_client_connect().
+ */
 void mqtt_client_disconnect(mqtt_client_t *client);
 
+/**
+ * True while auto_reconnect is waiting to (re)establish a lost connection.
+ */
+bool mqtt_client_is_reconnecting(const mqtt_client_t *client);
+
+/**
+ * Session-present flag of the last CONNACK: the broker still had our
+ * subscriptions and unacknowledged messages.
+ */
+bool mqtt_client_session_present(const mqtt_client_t *client);
+
+/**
+ * Process incoming data.
+ *
+ * Blocking mode (default): waits for data, then dispatches every
+ * complete packet it read. The wait ends early at the next keep-alive
+ * deadline so PINGREQs go out on an idle connection.
+ * Non-blocking mode: reads until the socket is drained, dispatches what
+ * arrived and returns 0 without waiting.
+ *
+ * While reconnecting: attempts the reconnect once it is due; blocking
+ * mode sleeps until then.
+ * While connecting (see mqtt_client_connect_async()): advances the
+ * connect and, once CONNACK is in, serves what arrived behind it.
+ *
+ * @return 0 on success, -1 on error or closed connection (never for
+ *         connection failures when auto_reconnect is set)
+ */
 int  mqtt_client_loop(mqtt_client_t *client);
 
+/**
+ * Switch between blocking (default) and non-blocking socket mode.
+ *
+ * May be called before mqtt_client_connect(); the CONNECT handshake
+ * of mqtt_client_connect() itself is always blocking, that of
+ * mqtt_client_connect_async() and of reconnects in non-blocking mode
+ * never is. In non-blocking mode, packets the socket
+ * cannot take right away are queued and finished by
+ * mqtt_client_process_write(), and subscribe calls do not wait for
+ * their SUBACK.
+ */
+int  mqtt_client_set_nonblocking(mqtt_client_t *client, bool enable);
+
+/**
+ * Socket descriptor for readiness polling, or -1 when not connected.
+ * While connecting it may change from one call to the next.
+ */
+int  mqtt_client_fd(const mqtt_client_t *client);
+
+/**
+ * The transport the client connects through, e.g. for
+ * mqtt_transport_tls_get_stats().
+ */
+mqtt_transport_t *mqtt_client_transport(const mqtt_client_t *client);
+
+bool mqtt_client_is_connected(const mqtt_client_t *client);
+
+/**
+ * True when queued outbound data is waiting for the socket to become
+ * writable.
+ */
+bool mqtt_client_wants_write(const mqtt_client_t *client);
+
+/**
+ * Continue sending queued data once the socket is writable, then send
+ * frames queued by mqtt_client_publish_concurrent().
+ *
+ * @return 0 on success, -1 on error
+ */
+int  mqtt_client_process_write(mqtt_client_t *client);
+
+/**
+ * Run time-based work: batch flush interval, PINGREQ when nothing was
+ * sent for keep_alive_sec, and the PINGRESP timeout.
+ *
+ * now_ms comes from mqtt_time_now_ms(). Called by mqtt_client_loop()
+ * itself and by mqtt_loop_t when the client's deadline is reached.
+ *
+ * @return 0 on success, -1 on error (including a missed PINGRESP)
+ */
+int  mqtt_client_tick(mqtt_client_t *client, uint64_t now_ms);
+
+/**
+ * When mqtt_client_tick() next has work to do.
+ *
+ * @return time in mqtt_time_now_ms() units, UINT64_MAX if none
+ */
+uint64_t mqtt_client_next_deadline_ms(const mqtt_client_t *client);
+
+/**
+ * Install the hook mqtt_loop_t uses to reschedule the client. One
+ * hook per client; NULL removes it.
+ */
+void mqtt_client_set_deadline_hook(mqtt_client_t *client,
+                                   mqtt_client_deadline_hook_t hook,
+                                   void *ctx);
+
 /**
  * Publish a QoS 0 message.
  */
@@ -46,10 +374,268 @@ int mqtt_client_publish_qos0(mqtt_client_t *client,
                              const uint8_t *payload,
                              size_t payload_len);
 
+/**
+ * Publish with QoS 0, 1 or 2.
+ *
+ * QoS 1/2 messages are pipelined: the call returns right after sending
+ * and the acknowledgement is processed later by mqtt_client_loop(),
+ * which then calls on_delivered. Up to receive_maximum messages may be
+ * outstanding at once.
+ *
+ * @return packet id (> 0) for QoS 1/2, 0 for QoS 0,
+ *         MQTT_CLIENT_ERR_INFLIGHT_FULL if the window is full,
+ *         MQTT_CLIENT_ERR_NO_MEMORY if pool_mem_cap is reached,
+ *         MQTT_CLIENT_ERR_QUEUE_FULL if tx_queue_max leaves no room,
+ *         -1 on error
+ */
+int mqtt_client_publish(mqtt_client_t *client,
+                        const char *topic,
+                        const uint8_t *payload,
+                        size_t payload_len,
+                        uint8_t qos,
+                        bool retain);
+
+/**
+ * QoS 0 publish that may be called from any number of threads at once,
+ * alongside the thread driving the client.
+ *
+ * The calling thread encodes the frame into its own buffer and pushes
+ * it onto the client's lock-free outbound queue: it never waits on the
+ * socket, a lock or another producer. The thread driving the client
+ * sends queued frames with vectored writes, in queue order, on its next
+ * mqtt_client_process_write(), mqtt_client_loop() or mqtt_client_flush();
+ * while disconnected they wait for the connection. Order relative to
+ * the driving thread's own publishes is not defined.
+ *
+ * mqtt_loop_t wakes itself when frames are queued; other drivers set a
+ * wakeup hook with mqtt_client_set_wakeup_hook().
+ *
+ * Queued frames count against tx_queue_max, connected or not. With
+ * MQTT_TX_OVERFLOW_DROP_OLDEST the frame is queued anyway and the
+ * driving thread drops the oldest ones on its next step; with
+ * MQTT_TX_OVERFLOW_BLOCK the caller sleeps until that thread has sent
+ * enough, so it must not be the driving thread itself.
+ *
+ * @return 0 if queued, MQTT_CLIENT_ERR_QUEUE_FULL if tx_queue_max
+ *         leaves no room, -1 on error
+ */
+int mqtt_client_publish_concurrent(mqtt_client_t *client,
+                                   const char *topic,
+                                   const uint8_t *payload,
+                                   size_t payload_len);
+
+/**
+ * Register a topic name for repeated publishing.
+ *
+ * The name is validated and its length-prefixed encoding built once;
+ * mqtt_client_publish_to() and mqtt_client_publish_concurrent_to() then
+ * send those bytes as they are, with no strlen(), validation or copy of
+ * the topic per message. Registering a name again returns the same
+ * handle. Handles stay valid until mqtt_client_destroy(), across
+ * reconnects.
+ *
+ * Call it from the thread driving the client; the handle may then be
+ * used from any thread.
+ *
+ * @return handle, or NULL if the topic name is invalid or memory runs out
+ */
+const mqtt_client_topic_t *mqtt_client_topic_register(mqtt_client_t *client,
+                                                      const char *topic);
+
+/**
+ * mqtt_client_publish() to a registered topic.
+ *
+ * @return as mqtt_client_publish()
+ */
+int mqtt_client_publish_to(mqtt_client_t *client,
+                           const mqtt_client_topic_t *topic,
+                           const uint8_t *payload,
+                           size_t payload_len,
+                           uint8_t qos,
+                           bool retain);
+
+/**
+ * mqtt_client_publish_concurrent() to a registered topic.
+ *
+ * @return as mqtt_client_publish_concurrent()
+ */
+int mqtt_client_publish_concurrent_to(mqtt_client_t *client,
+                                      const mqtt_client_topic_t *topic,
+                                      const uint8_t *payload,
+                                      size_t payload_len);
+
+/**
+ * Install the hook mqtt_client_publish_concurrent() calls to wake the
+ * writer; mqtt_loop_t installs its own. Set it before producers start.
+ * NULL removes it, but a producer already past the check may still
+ * call the old hook, so its ctx must stay valid until producers stop.
+ */
+void mqtt_client_set_wakeup_hook(mqtt_client_t *client,
+                                 mqtt_client_wakeup_hook_t hook,
+                                 void *ctx);
+
+/**
+ * Number of QoS 1/2 messages awaiting acknowledgement.
+ */
+size_t mqtt_client_inflight_count(const mqtt_client_t *client);
+
+/**
+ * Hit/miss counters and memory high-water mark of the outbound
+ * message pool.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_client_get_pool_stats(const mqtt_client_t *client,
+                               mqtt_pool_stats_t *stats);
+
+/* Packet types are 4 bits: 1 = CONNECT ... 14 = DISCONNECT. */
+#define MQTT_PACKET_TYPES 16
+
+/**
+ * Counters kept by every client since it was created.
+ *
+ * Totals only grow; the queue depths are gauges as of the client's last
+ * step. Transport calls are system calls for plain TCP, so
+ * send_calls / packets_out is the syscall cost per packet.
+ */
+typedef struct {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t packets_in[MQTT_PACKET_TYPES];  // by packet type
+    uint64_t packets_out[MQTT_PACKET_TYPES];
+    uint64_t recv_calls;           // transport recv()
+    uint64_t send_calls;           // transport send()/sendv()
+    uint64_t send_would_block;     // of those, refused by a full socket
+    uint64_t decode_errors;        // malformed packets from the broker
+
+    uint64_t inflight;             // QoS 1/2 messages awaiting their ack
+    uint64_t inflight_max;         // high-water mark of inflight
+    uint64_t offline_queued;       // QoS 0 messages held while reconnecting
+    uint64_t tx_buffered_bytes;    // batched or not yet taken by the socket
+    uint64_t tx_dropped;           // QoS 0 messages dropped by tx_overflow
+    uint64_t tx_rejected;          // publishes refused by tx_queue_max
+    uint64_t pending_subscribes;   // SUBSCRIBE packets awaiting their SUBACK
+
+    uint64_t connection_losses;
+    uint64_t reconnects;           // successful reconnects
+    uint64_t reconnect_failures;
+    uint64_t ping_timeouts;        // of the losses, missing PINGRESP
+
+    // QoS 1/2 publish to PUBACK/PUBCOMP, in microseconds
+    mqtt_histogram_snapshot_t ack_latency_us;
+} mqtt_client_stats_t;
+
+/**
+ * Copy the client's counters. Safe to call from any thread while
+ * another one drives the client; the values are then read one by one,
+ * not as an atomic snapshot.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_client_get_stats(const mqtt_client_t *client, mqtt_client_stats_t *stats);
+
+/**
+ * Render stats in the Prometheus text exposition format.
+ *
+ * @param labels  extra labels for every series, e.g. "client=\"a\"",
+ *                NULL or "" for none
+ * @return length of the full text (as snprintf: output was truncated if
+ *         it is >= size), -1 on error
+ */
+int mqtt_client_stats_format_prometheus(const mqtt_client_stats_t *stats,
+                                        const char *labels,
+                                        char *buf, size_t size);
+
+/**
+ * Start batching publishes.
+ *
+ * Subsequent mqtt_client_publish_qos0() calls append their packets to a
+ * per-client buffer instead of sending each one. The buffer is sent in
+ * one go when it reaches batch_flush_bytes, when its oldest packet is
+ * older than batch_flush_interval_ms (checked on publish and in
+ * mqtt_client_loop), or on mqtt_client_flush().
+ *
+ * The socket is corked (TCP_CORK) meanwhile, so the kernel sends full
+ * segments only. A flush for batch_flush_interval_ms and a PINGREQ
+ * also push out the partial segment. So with the interval set, nothing
+ * queued while batching (publishes, acks, SUBSCRIBEs) waits in the
+ * client or the kernel much longer than the interval, given that
+ * mqtt_client_loop() or mqtt_client_tick() runs by the deadline
+ * mqtt_client_next_deadline_ms() reports. Without it, bytes can wait
+ * until batch_flush_bytes is reached or mqtt_client_flush().
+ */
+int mqtt_client_publish_begin_batch(mqtt_client_t *client);
+
+/**
+ * Send all batched packets and leave batch mode.
+ */
+int mqtt_client_flush(mqtt_client_t *client);
+
 /**
  * Subscribe to a topic with QoS 0.
+ *
+ * Blocking mode: waits for the SUBACK; PUBLISH packets arriving first
+ * are dispatched normally. Non-blocking mode: returns once sent.
  */
 int mqtt_client_subscribe_qos0(mqtt_client_t *client,
                                const char *topic);
 
+/**
+ * Subscribe to many topic filters without waiting.
+ *
+ * Filters are packed into as few SUBSCRIBE packets as the packet size
+ * limit allows and sent together. Each SUBACK is matched to its packet
+ * id in mqtt_client_loop(), which calls cb (may be NULL) with the
+ * per-filter return codes. qos may be NULL for QoS 0 everywhere.
+ *
+ * @return number of SUBSCRIBE packets sent, or -1 on error
+ */
+int mqtt_client_subscribe_many(mqtt_client_t *client,
+                               const char *const *filters,
+                               const uint8_t *qos,
+                               size_t count,
+                               mqtt_suback_callback_t cb,
+                               void *ctx);
+
+/**
+ * Number of SUBSCRIBE packets still waiting for their SUBACK.
+ */
+size_t mqtt_client_pending_subscribe_count(const mqtt_client_t *client);
+
+/**
+ * Route messages matching filter ('+' and '#' allowed) to handler.
+ *
+ * Every matching handler is called for an incoming PUBLISH; on_message(_view)
+ * only receives messages no handler matched. Handlers must not add or
+ * remove handlers while being called. Adding a filter again replaces
+ * its handler.
+ *
+ * @return 0 on success, -1 on invalid filter or allocation failure
+ */
+int mqtt_client_add_handler(mqtt_client_t *client,
+                            const char *filter,
+                            mqtt_topic_handler_t handler,
+                            void *ctx);
+
+/**
+ * Drop the handler of filter. No UNSUBSCRIBE is sent.
+ *
+ * @return 0 on success, -1 if filter had no handler
+ */
+int mqtt_client_remove_handler(mqtt_client_t *client, const char *filter);
+
+/**
+ * mqtt_client_add_handler() followed by a SUBSCRIBE for filter.
+ *
+ * Does not wait for the SUBACK. The handler stays registered even if
+ * the broker refuses the subscription.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_client_subscribe_handler(mqtt_client_t *client,
+                                  const char *filter,
+                                  uint8_t qos,
+                                  mqtt_topic_handler_t handler,
+                                  void *ctx);
+
 #endif // MQTT_CLIENT_H
@@ -0,0 +1,54 @@
+#ifndef MQTT_CONNECTOR_H
+#define MQTT_CONNECTOR_H
+
+#include <stdint.h>
+
+/**
+ * Non-blocking TCP connection establishment.
+ *
+ * Resolves the host through mqtt_resolver.h and races connection
+ * attempts over the addresses ("Happy Eyeballs", RFC 8305): addresses
+ * alternate between IPv6 and IPv4, and a new attempt starts whenever the
+ * previous one fails or has not finished after
+ * MQTT_CONNECTOR_ATTEMPT_DELAY_MS. The first socket to connect wins; the
+ * others are closed. Nothing here blocks, so one event loop can bring up
+ * many connections at once.
+ */
+
+/* Head start each attempt gets before the next address is tried. */
+#define MQTT_CONNECTOR_ATTEMPT_DELAY_MS 250
+
+/**
+ * One connection being set up.
+ */
+typedef struct mqtt_connector mqtt_connector_t;
+
+/**
+ * Start connecting to host:port.
+ *
+ * @return connector, or NULL on error
+ */
+mqtt_connector_t *mqtt_connector_start(const char *host, uint16_t port);
+
+/**
+ * Descriptor that becomes readable when mqtt_connector_poll() may make
+ * progress (an epoll fd on Linux). Stays the same for the connector's
+ * lifetime.
+ */
+int mqtt_connector_fd(const mqtt_connector_t *c);
+
+/**
+ * Advance the attempts.
+ *
+ * @return connected non-blocking socket, now owned by the caller;
+ *         MQTT_TRANSPORT_WOULD_BLOCK while attempts are still running;
+ *         -1 once every address failed
+ */
+int mqtt_connector_poll(mqtt_connector_t *c);
+
+/**
+ * Cancel any attempts still running and free the connector.
+ */
+void mqtt_connector_free(mqtt_connector_t *c);
+
+#endif // MQTT_CONNECTOR_H
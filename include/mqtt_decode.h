@@ -1,9 +1,32 @@
 #ifndef MQTT_DECODE_H
 #define MQTT_DECODE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * Decode the variable-length "Remaining Length" field (1..4 bytes).
+ *
+ * buf points at the first length byte, i.e. just past the packet type.
+ *
+ * @return number of bytes used by the field on success,
+ *         0 if more bytes are needed, -1 if malformed
+ */
+int mqtt_decode_remaining_length(const uint8_t *buf, size_t len,
+                                 size_t *remaining_len);
+
+/**
+ * Find the boundary of the first MQTT packet in a byte stream.
+ *
+ * frame_len is set to the full packet size (fixed header included)
+ * as soon as the remaining length is known, even if the packet is
+ * not complete yet.
+ *
+ * @return 1 = complete packet available, 0 = need more bytes, -1 = malformed
+ */
+int mqtt_decode_frame(const uint8_t *buf, size_t len, size_t *frame_len);
+
 /**
  * Decode MQTT CONNACK packet.
  *
@@ -12,16 +35,124 @@
 int mqtt_decode_connack(const uint8_t *buf, size_t len);
 
 /**
- * Decode MQTT SUBACK for single topic.
+ * Decode MQTT CONNACK packet, reporting the session-present flag and
+ * the return code (0 = accepted, 1-5 = refused).
+ *
+ * @return 0 = connection accepted, non-zero = refused or malformed
+ */
+int mqtt_decode_connack_ex(const uint8_t *buf, size_t len,
+                           bool *session_present,
+                           uint8_t *return_code);
+
+/**
+ * Decode MQTT SUBACK.
+ *
+ * return_codes points into buf: one byte per filter of the matching
+ * SUBSCRIBE, 0x00-0x02 = granted QoS, 0x80 = failure. A rejected filter
+ * is reported there, not as a decode error.
+ *
+ * @return 0 = success, non-zero = malformed packet
+ */
+int mqtt_decode_suback(const uint8_t *buf, size_t len,
+                       uint16_t *packet_id,
+                       const uint8_t **return_codes,
+                       size_t *count);
+
+/**
+ * Decode PUBACK / PUBREC / PUBREL / PUBCOMP (packet id only).
+ *
+ * buf holds one whole packet of len bytes; any other packet type or
+ * wrong fixed-header flags are rejected.
  *
  * @return 0 = success, non-zero = failure
  */
-int mqtt_decode_suback(const uint8_t *buf, size_t len);
+int mqtt_decode_ack(const uint8_t *buf, size_t len, uint16_t *packet_id);
+
+/**
+ * A decoded PUBLISH whose topic and payload point into the packet.
+ *
+ * topic is not NUL-terminated; the view is valid as long as the
+ * buffer passed to mqtt_decode_publish_view() is.
+ */
+typedef struct {
+    const char    *topic;
+    size_t         topic_len;
+    const uint8_t *payload;
+    size_t         payload_len;
+    uint16_t       packet_id;   // 0 for QoS 0
+    uint8_t        qos;
+    bool           retain;
+    bool           dup;
+} mqtt_publish_view_t;
+
+/**
+ * Decode a PUBLISH packet of any QoS without copying.
+ *
+ * @return 0 = success, non-zero = malformed packet
+ */
+int mqtt_decode_publish_view(const uint8_t *buf, size_t len,
+                             mqtt_publish_view_t *out);
+
+/**
+ * Packet types: the high nibble of the first byte.
+ */
+typedef enum {
+    MQTT_PACKET_CONNECT     = 1,
+    MQTT_PACKET_CONNACK     = 2,
+    MQTT_PACKET_PUBLISH     = 3,
+    MQTT_PACKET_PUBACK      = 4,
+    MQTT_PACKET_PUBREC      = 5,
+    MQTT_PACKET_PUBREL      = 6,
+    MQTT_PACKET_PUBCOMP     = 7,
+    MQTT_PACKET_SUBSCRIBE   = 8,
+    MQTT_PACKET_SUBACK      = 9,
+    MQTT_PACKET_UNSUBSCRIBE = 10,
+    MQTT_PACKET_UNSUBACK    = 11,
+    MQTT_PACKET_PINGREQ     = 12,
+    MQTT_PACKET_PINGRESP    = 13,
+    MQTT_PACKET_DISCONNECT  = 14,
+} mqtt_packet_type_t;
+
+/**
+ * Any packet a broker sends, decoded without copying. Pointers refer
+ * into the buffer passed to mqtt_decode_packet().
+ */
+typedef struct {
+    mqtt_packet_type_t type;
+    uint16_t           packet_id;   // acks, SUBACK, UNSUBACK, QoS 1/2 PUBLISH; else 0
+    union {
+        mqtt_publish_view_t publish;
+        struct {
+            bool    session_present;
+            uint8_t return_code;        // 0 accepted, 1-5 refused
+        } connack;
+        struct {
+            const uint8_t *return_codes; // 0x00-0x02 granted QoS, 0x80 failure
+            size_t         count;
+        } suback;
+    };
+} mqtt_packet_t;
+
+/**
+ * Decode and validate one packet as a client receives it.
+ *
+ * buf must hold exactly one complete frame (see mqtt_decode_frame()).
+ * Checks in one pass, without allocating or logging: the type is one a
+ * server sends, the fixed-header flags are the required ones, the
+ * remaining length matches both the frame and the packet's layout,
+ * packet ids are non-zero, PUBLISH has QoS 0-2 (DUP clear at QoS 0) and
+ * a valid topic name (see mqtt_validate.h), and CONNACK and SUBACK carry
+ * defined codes.
+ *
+ * @return 0 = valid, -1 = malformed or not a server-to-client packet
+ */
+int mqtt_decode_packet(const uint8_t *buf, size_t len, mqtt_packet_t *out);
 
 /**
  * Decode MQTT PUBLISH (QoS 0) packet.
  *
- * topic_buf will be null-terminated on success.
+ * topic_buf will be null-terminated on success. Copies the topic;
+ * mqtt_decode_publish_view() does not and has no topic length limit.
  *
  * @return 0 = success, non-zero = failure
  */
@@ -3,9 +3,22 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Strings are checked with mqtt_validate.h before anything is written:
+ * client id and username must be valid UTF-8, topic names must not hold
+ * wildcards and topic filters must place them correctly. The password
+ * is binary data and not checked.
+ *
+ * Sizing: every mqtt_encode_*_size() function returns the exact length
+ * of the packet the matching encoder writes for the same arguments, or
+ * 0 if it cannot be encoded. Callers size pool blocks or buffers with
+ * it, then encode into exactly that much storage.
+ */
 
 /**
- * Encode MQTT CONNECT packet into buffer.
+ * Encode MQTT CONNECT packet into buffer (clean session).
  *
  * @return length of encoded packet, or -1 on error
  */
@@ -13,14 +26,133 @@ int mqtt_encode_connect(uint8_t *buf, size_t bufsize,
                         const char *client_id,
                         uint16_t keep_alive);
 
+/**
+ * CONNECT fields beyond the client id.
+ */
+typedef struct {
+    const char *client_id;
+    uint16_t    keep_alive;
+    bool        clean_session;  // false = resume the broker-side session
+
+    const char *username;       // NULL = none
+    const char *password;       // NULL = none; MQTT 3.1.1 requires a username
+
+    // Last will, published by the broker if the connection drops
+    // without a DISCONNECT
+    const char    *will_topic;       // NULL = no will
+    const uint8_t *will_payload;
+    size_t         will_payload_len; // up to 65535
+    uint8_t        will_qos;
+    bool           will_retain;
+} mqtt_connect_options_t;
+
+/**
+ * Encode MQTT CONNECT packet from options.
+ *
+ * @return length of encoded packet, or -1 on error (including invalid
+ *         options, e.g. a password without a username)
+ */
+int mqtt_encode_connect_ex(uint8_t *buf, size_t bufsize,
+                           const mqtt_connect_options_t *opts);
+
+/**
+ * Size of the CONNECT packet mqtt_encode_connect_ex() writes for opts.
+ *
+ * @return packet length, or 0 if opts are invalid
+ */
+size_t mqtt_encode_connect_size(const mqtt_connect_options_t *opts);
+
 /**
  * Encode MQTT PUBLISH (QoS 0) packet.
+ *
+ * @return length of encoded packet, or -1 on error
  */
 int mqtt_encode_publish_qos0(uint8_t *buf, size_t bufsize,
                              const char *topic,
                              const uint8_t *payload,
                              size_t payload_len);
 
+/**
+ * Encode a topic name the way PUBLISH carries it: 2-byte length, then
+ * the bytes. The result can be kept and sent as is with any number of
+ * PUBLISH packets (see mqtt_encode_publish_fixed_header()).
+ *
+ * @return 2 + topic_len, or -1 if the topic name is invalid or buf too
+ *         small
+ */
+int mqtt_encode_topic(uint8_t *buf, size_t bufsize,
+                      const char *topic, size_t topic_len);
+
+/**
+ * Encode the fixed header of a PUBLISH: first byte and remaining length.
+ *
+ * The caller sends the rest, remaining_len bytes, from its own buffers:
+ * an encoded topic, the packet id for QoS 1/2, then the payload.
+ *
+ * @return length of encoded header (2..5 bytes), or -1 on error
+ */
+int mqtt_encode_publish_fixed_header(uint8_t *buf, size_t bufsize,
+                                     uint8_t qos, bool retain,
+                                     size_t remaining_len);
+
+/**
+ * Size of a PUBLISH with this topic length, payload length and QoS,
+ * as mqtt_encode_publish() writes it.
+ *
+ * @return packet length, or 0 if it exceeds the protocol limits
+ */
+size_t mqtt_encode_publish_size(size_t topic_len, size_t payload_len, uint8_t qos);
+
+/**
+ * Encode a complete MQTT PUBLISH packet with any QoS.
+ *
+ * packet_id is written only for QoS 1 and 2 (and must be non-zero there).
+ *
+ * @return length of encoded packet, or -1 on error
+ */
+int mqtt_encode_publish(uint8_t *buf, size_t bufsize,
+                        const char *topic,
+                        const uint8_t *payload,
+                        size_t payload_len,
+                        uint8_t qos,
+                        bool retain,
+                        uint16_t packet_id);
+
+/**
+ * Encode a 4-byte acknowledgement carrying only a packet id.
+ *
+ * first_byte selects the packet: 0x40 PUBACK, 0x50 PUBREC,
+ * 0x62 PUBREL, 0x70 PUBCOMP.
+ *
+ * @return 4, or -1 on error
+ */
+int mqtt_encode_ack(uint8_t *buf, size_t bufsize,
+                    uint8_t first_byte,
+                    uint16_t packet_id);
+
+/**
+ * Encode MQTT SUBSCRIBE packet carrying several topic filters.
+ *
+ * qos may be NULL to request QoS 0 for every filter.
+ *
+ * @return length of encoded packet, or -1 on error
+ */
+int mqtt_encode_subscribe(uint8_t *buf, size_t bufsize,
+                          uint16_t packet_id,
+                          const char *const *filters,
+                          const uint8_t *qos,
+                          size_t count);
+
+/**
+ * Size of the SUBSCRIBE packet mqtt_encode_subscribe() writes for these
+ * filters.
+ *
+ * @return packet length, or 0 if a filter or QoS is invalid
+ */
+size_t mqtt_encode_subscribe_size(const char *const *filters,
+                                  const uint8_t *qos,
+                                  size_t count);
+
 /**
  * Encode MQTT SUBSCRIBE packet (single topic, QoS 0).
  *
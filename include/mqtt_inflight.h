@@ -0,0 +1,90 @@
+#ifndef MQTT_INFLIGHT_H
+#define MQTT_INFLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Packet ids 1..MQTT_INFLIGHT_MAX_PACKET_ID are used for QoS 1/2
+ * PUBLISH; the ids above it are left for SUBSCRIBE/UNSUBSCRIBE so the
+ * two never collide.
+ */
+#define MQTT_INFLIGHT_MAX_PACKET_ID 0xF000u
+
+/**
+ * Where an outgoing QoS 1/2 PUBLISH is in its handshake.
+ */
+typedef enum {
+    MQTT_INFLIGHT_FREE = 0,
+    MQTT_INFLIGHT_WAIT_PUBACK,   // QoS 1: PUBLISH sent
+    MQTT_INFLIGHT_WAIT_PUBREC,   // QoS 2: PUBLISH sent
+    MQTT_INFLIGHT_WAIT_PUBCOMP,  // QoS 2: PUBREL sent
+} mqtt_inflight_state_t;
+
+typedef struct {
+    uint16_t packet_id;
+    uint8_t  state;              // mqtt_inflight_state_t
+    uint8_t  qos;
+    bool     sent;               // handed to a connection at least once
+    uint8_t *frame;              // encoded PUBLISH kept for retransmission
+    size_t   frame_len;
+    uint64_t sent_ms;
+    uint64_t seq;                // publish order, kept on replay
+    uint64_t published_ns;       // for the ack latency, 0 = restored from the store
+} mqtt_inflight_msg_t;
+
+/**
+ * Fixed-size table of outstanding messages.
+ *
+ * Packet ids are handed out so that (id - 1) % window is the slot the
+ * message lives in: acquire, lookup and release are all O(1) and need
+ * no per-message allocation.
+ */
+typedef struct {
+    mqtt_inflight_msg_t *slots;
+    uint16_t            *generation; // per slot, picks the next id for it
+    uint16_t            *free_stack; // indices of free slots
+    uint16_t             nfree;
+    uint16_t             window;
+} mqtt_inflight_table_t;
+
+/**
+ * @param window  number of messages that may be outstanding at once
+ *                (1..MQTT_INFLIGHT_MAX_PACKET_ID)
+ * @return 0 on success, -1 on error
+ */
+int  mqtt_inflight_init(mqtt_inflight_table_t *t, uint16_t window);
+void mqtt_inflight_cleanup(mqtt_inflight_table_t *t);
+
+/**
+ * Take a free slot and assign it a packet id.
+ *
+ * @return slot, or NULL when the window is full
+ */
+mqtt_inflight_msg_t *mqtt_inflight_acquire(mqtt_inflight_table_t *t);
+
+/**
+ * Take the slot of a specific packet id, for a message restored from an
+ * earlier run. Later ids for that slot follow on from it.
+ *
+ * @return slot, or NULL when packet_id does not map to a free slot
+ *         (e.g. it was handed out with a different window)
+ */
+mqtt_inflight_msg_t *mqtt_inflight_claim(mqtt_inflight_table_t *t,
+                                         uint16_t packet_id);
+
+/**
+ * @return the in-use slot for packet_id, or NULL if none
+ */
+mqtt_inflight_msg_t *mqtt_inflight_lookup(mqtt_inflight_table_t *t,
+                                          uint16_t packet_id);
+
+/**
+ * Return a slot to the free pool. The caller owns msg->frame.
+ */
+void mqtt_inflight_release(mqtt_inflight_table_t *t, mqtt_inflight_msg_t *msg);
+
+uint16_t mqtt_inflight_count(const mqtt_inflight_table_t *t);
+
+#endif // MQTT_INFLIGHT_H
@@ -0,0 +1,70 @@
+#ifndef MQTT_LOG_H
+#define MQTT_LOG_H
+
+#include <stdatomic.h>
+
+/**
+ * Diagnostics from the library, through one process-wide hook.
+ *
+ * A message below the current threshold costs one relaxed load and a
+ * compare: its arguments are not evaluated and nothing is formatted.
+ * Building with MQTT_LOG_MAX_LEVEL lower removes the messages above it
+ * from the binary altogether.
+ */
+typedef enum {
+    MQTT_LOG_ERROR = 0,  // an operation failed
+    MQTT_LOG_WARN  = 1,  // recovered from: connection lost, message dropped
+    MQTT_LOG_INFO  = 2,  // connection lifecycle
+    MQTT_LOG_DEBUG = 3,  // per packet
+} mqtt_log_level_t;
+
+/* Threshold that lets no message through. */
+#define MQTT_LOG_OFF (-1)
+
+/* Compile-time ceiling, e.g. -DMQTT_LOG_MAX_LEVEL=1 keeps errors and warnings. */
+#ifndef MQTT_LOG_MAX_LEVEL
+#define MQTT_LOG_MAX_LEVEL 3
+#endif
+
+/**
+ * Receives each message that passes the threshold, formatted and
+ * without a trailing newline. Called from whichever thread logged.
+ */
+typedef void (*mqtt_log_callback_t)(mqtt_log_level_t level,
+                                    const char *message,
+                                    void *ctx);
+
+/**
+ * Route messages to cb instead of stderr. Set it before any client
+ * runs; NULL restores the default.
+ */
+void mqtt_log_set_callback(mqtt_log_callback_t cb, void *ctx);
+
+/**
+ * Let messages up to `level` through (MQTT_LOG_OFF = none). Defaults to
+ * MQTT_LOG_INFO. May be changed at any time, from any thread.
+ */
+void mqtt_log_set_level(int level);
+int  mqtt_log_get_level(void);
+
+// Internal: read by MQTT_LOG() before formatting; use mqtt_log_set_level().
+extern atomic_int mqtt_log_threshold;
+
+void mqtt_log_write(mqtt_log_level_t level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#define MQTT_LOG(level, ...)                                                \
+    do {                                                                    \
+        if ((level) <= MQTT_LOG_MAX_LEVEL &&                                \
+            (int)(level) <= atomic_load_explicit(&mqtt_log_threshold,       \
+                                                 memory_order_relaxed)) {   \
+            mqtt_log_write((level), __VA_ARGS__);                           \
+        }                                                                   \
+    } while (0)
+
+#define MQTT_LOG_ERROR(...) MQTT_LOG(MQTT_LOG_ERROR, __VA_ARGS__)
+#define MQTT_LOG_WARN(...)  MQTT_LOG(MQTT_LOG_WARN,  __VA_ARGS__)
+#define MQTT_LOG_INFO(...)  MQTT_LOG(MQTT_LOG_INFO,  __VA_ARGS__)
+#define MQTT_LOG_DEBUG(...) MQTT_LOG(MQTT_LOG_DEBUG, __VA_ARGS__)
+
+#endif // MQTT_LOG_H
@@ -0,0 +1,74 @@
+#ifndef MQTT_LOOP_H
+#define MQTT_LOOP_H
+
+#include <stdbool.h>
+#include "mqtt_client.h"
+
+/**
+ * Event loop driving many non-blocking clients from a single thread.
+ *
+ * Readable sockets are handed to mqtt_client_loop(), writable ones to
+ * mqtt_client_process_write(), and each client is ticked when its next
+ * deadline (keep-alive, batch flush) comes up on a timer wheel. Message
+ * callbacks therefore run on the loop thread.
+ */
+typedef struct mqtt_loop mqtt_loop_t;
+
+mqtt_loop_t *mqtt_loop_create(void);
+
+/**
+ * Destroy the loop. Registered clients are removed but not disconnected.
+ */
+void mqtt_loop_destroy(mqtt_loop_t *loop);
+
+/**
+ * Register a connected client, or one still connecting after
+ * mqtt_client_connect_async(). The client is switched to non-blocking
+ * mode and is driven by the loop from now on, including the rest of its
+ * connect.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_loop_add(mqtt_loop_t *loop, mqtt_client_t *client);
+
+/**
+ * Unregister a client (it stays connected, in non-blocking mode).
+ *
+ * @return 0 on success, -1 if the client is not registered
+ */
+int mqtt_loop_remove(mqtt_loop_t *loop, mqtt_client_t *client);
+
+/**
+ * Number of registered clients. A client whose connection fails is
+ * disconnected and dropped from the loop automatically, unless it has
+ * auto_reconnect: then it stays registered and the loop performs the
+ * reconnect when its backoff expires.
+ */
+size_t mqtt_loop_client_count(const mqtt_loop_t *loop);
+
+/**
+ * Wait up to timeout_ms (-1 = forever) for I/O and process it.
+ *
+ * @return number of I/O events handled, or -1 on error
+ */
+int mqtt_loop_run_once(mqtt_loop_t *loop, int timeout_ms);
+
+/**
+ * Run until mqtt_loop_stop() is called.
+ *
+ * @return 0 when stopped, -1 on error
+ */
+int mqtt_loop_run(mqtt_loop_t *loop);
+
+/**
+ * Ask mqtt_loop_run() to return. Safe to call from any thread.
+ */
+void mqtt_loop_stop(mqtt_loop_t *loop);
+
+/**
+ * Make a blocked mqtt_loop_run_once() return early. Safe to call from
+ * any thread.
+ */
+void mqtt_loop_wakeup(mqtt_loop_t *loop);
+
+#endif // MQTT_LOOP_H
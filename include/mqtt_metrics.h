@@ -0,0 +1,75 @@
+#ifndef MQTT_METRICS_H
+#define MQTT_METRICS_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Counters and histograms written by one thread and readable from any.
+ *
+ * An update is a relaxed load plus a relaxed store, not a locked
+ * read-modify-write: with a single writer no increment can be lost, and
+ * the cost stays that of a plain add. Readers see every value whole,
+ * but values read together are not a consistent snapshot.
+ */
+typedef _Atomic uint64_t mqtt_counter_t;
+
+static inline void mqtt_counter_add(mqtt_counter_t *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+static inline void mqtt_counter_set(mqtt_counter_t *c, uint64_t v) {
+    atomic_store_explicit(c, v, memory_order_relaxed);
+}
+
+static inline uint64_t mqtt_counter_get(const mqtt_counter_t *c) {
+    return atomic_load_explicit((mqtt_counter_t *)c, memory_order_relaxed);
+}
+
+/**
+ * Power-of-two buckets: bucket 0 counts zeros, bucket 1 ones, bucket i
+ * (i >= 2) values in (2^(i-2), 2^(i-1)], and the last one everything
+ * larger. With microseconds that spans up to about a minute.
+ */
+#define MQTT_HISTOGRAM_BUCKETS 28
+
+typedef struct {
+    mqtt_counter_t count;
+    mqtt_counter_t sum;
+    mqtt_counter_t buckets[MQTT_HISTOGRAM_BUCKETS];
+} mqtt_histogram_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[MQTT_HISTOGRAM_BUCKETS];
+} mqtt_histogram_snapshot_t;
+
+static inline void mqtt_histogram_record(mqtt_histogram_t *h, uint64_t value) {
+    size_t i = value <= 1 ? (size_t)value
+                          : (size_t)(65 - __builtin_clzll(value - 1));
+    if (i >= MQTT_HISTOGRAM_BUCKETS) i = MQTT_HISTOGRAM_BUCKETS - 1;
+    mqtt_counter_add(&h->buckets[i], 1);
+    mqtt_counter_add(&h->sum, value);
+    mqtt_counter_add(&h->count, 1);
+}
+
+void mqtt_histogram_read(const mqtt_histogram_t *h, mqtt_histogram_snapshot_t *out);
+
+/**
+ * Largest value bucket i holds (UINT64_MAX for the last one).
+ */
+uint64_t mqtt_histogram_bucket_bound(size_t i);
+
+/**
+ * Estimate the q-quantile (0..1) as the upper bound of the bucket that
+ * holds it: never low, and high by less than a factor of two.
+ *
+ * @return the estimate, 0 if the histogram is empty, UINT64_MAX if it
+ *         falls in the last bucket
+ */
+uint64_t mqtt_histogram_quantile(const mqtt_histogram_snapshot_t *s, double q);
+
+#endif // MQTT_METRICS_H
@@ -0,0 +1,94 @@
+#ifndef MQTT_MOCK_BROKER_H
+#define MQTT_MOCK_BROKER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mqtt_transport.h"
+
+/**
+ * Minimal MQTT 3.1.1 broker for tests and benchmarks, embedded in the
+ * calling process.
+ *
+ * It answers CONNECT, SUBSCRIBE, UNSUBSCRIBE and PINGREQ, acknowledges
+ * QoS 1/2 publishes (PUBACK, PUBREC/PUBCOMP) and forwards every PUBLISH
+ * to each connection with a matching filter (`+` / `#` wildcards). Sessions,
+ * retained messages, wills and authentication are not supported: every
+ * CONNACK reports a fresh session and subscriptions are granted QoS 0,
+ * so forwarded messages are QoS 0.
+ *
+ * Clients reach it over TCP on the loopback interface or, with no
+ * sockets at all, through mqtt_mock_broker_transport().
+ */
+typedef struct mqtt_mock_broker mqtt_mock_broker_t;
+
+typedef struct {
+    const char *host;       // listen address, NULL = "127.0.0.1"
+    uint16_t    port;       // 0 = any free port, see mqtt_mock_broker_port()
+    bool        no_tcp;     // in-memory connections only
+} mqtt_mock_broker_config_t;
+
+typedef struct {
+    uint64_t connections;   // accepted so far
+    uint64_t publishes_in;
+    uint64_t publishes_out; // forwarded to subscribers
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+} mqtt_mock_broker_stats_t;
+
+/**
+ * Create a broker and start listening. Nothing is served until
+ * mqtt_mock_broker_start() or mqtt_mock_broker_poll() is called.
+ *
+ * @param cfg  NULL = defaults
+ * @return broker, or NULL on error
+ */
+mqtt_mock_broker_t *mqtt_mock_broker_create(const mqtt_mock_broker_config_t *cfg);
+
+/**
+ * Serve from a background thread until mqtt_mock_broker_destroy().
+ * Needed when a client in the same thread blocks, e.g. in
+ * mqtt_client_connect() waiting for CONNACK.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_mock_broker_start(mqtt_mock_broker_t *broker);
+
+/**
+ * Serve one round from the calling thread: wait up to timeout_ms
+ * (-1 = no limit) for activity, then handle whatever is ready. Not to
+ * be mixed with mqtt_mock_broker_start().
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_mock_broker_poll(mqtt_mock_broker_t *broker, int timeout_ms);
+
+/**
+ * @return TCP port the broker listens on, 0 with no_tcp
+ */
+uint16_t mqtt_mock_broker_port(const mqtt_mock_broker_t *broker);
+
+/**
+ * In-memory transport connected to this broker; set it as the client's
+ * config.transport. Every connect() opens a new broker connection, so
+ * auto-reconnect works. The caller destroys it (before the broker) with
+ * mqtt_transport_destroy().
+ *
+ * @return transport, or NULL on allocation failure
+ */
+mqtt_transport_t *mqtt_mock_broker_transport(mqtt_mock_broker_t *broker);
+
+/**
+ * Force every client connection closed, as a broker restart would.
+ */
+void mqtt_mock_broker_drop_clients(mqtt_mock_broker_t *broker);
+
+void mqtt_mock_broker_get_stats(const mqtt_mock_broker_t *broker,
+                                mqtt_mock_broker_stats_t *stats);
+
+/**
+ * Stop serving, close all connections and free the broker.
+ */
+void mqtt_mock_broker_destroy(mqtt_mock_broker_t *broker);
+
+#endif // MQTT_MOCK_BROKER_H
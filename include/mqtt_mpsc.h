@@ -0,0 +1,42 @@
+#ifndef MQTT_MPSC_H
+#define MQTT_MPSC_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+/**
+ * Intrusive lock-free multi-producer / single-consumer queue
+ * (Vyukov's algorithm).
+ *
+ * Producers never wait on each other or on the consumer: a push is one
+ * atomic exchange plus one store. Embed mqtt_mpsc_node_t in the queued
+ * object and recover it with offsetof() after a pop.
+ */
+typedef struct mqtt_mpsc_node {
+    _Atomic(struct mqtt_mpsc_node *) next;
+} mqtt_mpsc_node_t;
+
+typedef struct {
+    _Atomic(mqtt_mpsc_node_t *) head;  // producers push here
+    mqtt_mpsc_node_t           *tail;  // consumer pops here
+    mqtt_mpsc_node_t            stub;
+} mqtt_mpsc_t;
+
+void mqtt_mpsc_init(mqtt_mpsc_t *q);
+
+/**
+ * Enqueue a node. Safe to call from any number of threads.
+ */
+void mqtt_mpsc_push(mqtt_mpsc_t *q, mqtt_mpsc_node_t *node);
+
+/**
+ * Dequeue the oldest node. Consumer thread only.
+ *
+ * May return NULL while a concurrent push is half done; the pushing
+ * thread is then responsible for waking the consumer again.
+ *
+ * @return node, or NULL if the queue is (momentarily) empty
+ */
+mqtt_mpsc_node_t *mqtt_mpsc_pop(mqtt_mpsc_t *q);
+
+#endif // MQTT_MPSC_H
@@ -0,0 +1,57 @@
+#ifndef MQTT_POOL_H
+#define MQTT_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Fixed-size block allocator for outbound PUBLISH frames.
+ *
+ * Frames up to block_size come from a slab (a caller-supplied static
+ * region or one malloc at init) with O(1) alloc/free through a free
+ * list. Larger frames, or any frame once the slab is exhausted, fall
+ * back to malloc as long as the memory cap allows it.
+ */
+typedef struct {
+    size_t hits;              // served from the slab
+    size_t misses;            // served from the heap fallback
+    size_t failures;          // refused: memory cap reached or malloc failed
+    size_t in_use_bytes;      // slab blocks + heap bytes currently handed out
+    size_t high_water_bytes;  // peak of in_use_bytes
+} mqtt_pool_stats_t;
+
+typedef struct {
+    uint8_t *region;
+    size_t   region_size;
+    bool     owns_region;
+
+    size_t   block_size;
+    void    *free_list;       // next pointer stored in the free block itself
+
+    size_t   mem_cap;         // 0 = unlimited
+    mqtt_pool_stats_t stats;
+} mqtt_pool_t;
+
+/**
+ * @param region       static memory for the slab, or NULL to allocate it
+ * @param region_size  slab size in bytes (may be 0: heap only)
+ * @param block_size   slab block size (rounded up to pointer alignment)
+ * @param mem_cap      limit on in_use_bytes, 0 = unlimited
+ * @return 0 on success, -1 on error
+ */
+int  mqtt_pool_init(mqtt_pool_t *pool, void *region, size_t region_size,
+                    size_t block_size, size_t mem_cap);
+void mqtt_pool_cleanup(mqtt_pool_t *pool);
+
+/**
+ * @return memory for `size` bytes, or NULL when the cap is reached
+ */
+void *mqtt_pool_alloc(mqtt_pool_t *pool, size_t size);
+
+/**
+ * Release memory from mqtt_pool_alloc(); size must match the request.
+ */
+void mqtt_pool_free(mqtt_pool_t *pool, void *ptr, size_t size);
+
+#endif // MQTT_POOL_H
@@ -0,0 +1,61 @@
+#ifndef MQTT_RESOLVER_H
+#define MQTT_RESOLVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * Asynchronous host name resolution with a process-wide cache.
+ *
+ * getaddrinfo() blocks, so lookups run on a small pool of resolver
+ * threads. Concurrent lookups of the same host and port share one
+ * getaddrinfo() call and the answer is cached for a while, so bringing
+ * up thousands of clients against one broker costs a single lookup.
+ * Numeric addresses and cache hits complete without any thread.
+ */
+
+/* Most addresses kept from one lookup. */
+#define MQTT_RESOLVE_MAX_ADDRS 16
+
+typedef struct {
+    struct sockaddr_storage addr;
+    socklen_t               len;
+} mqtt_resolved_addr_t;
+
+/**
+ * One lookup, owned by the caller.
+ */
+typedef struct mqtt_resolve mqtt_resolve_t;
+
+/**
+ * Start resolving host:port for a TCP connection.
+ *
+ * If the answer is not known right away, a resolver thread writes an
+ * 8-byte value to notify_fd (an eventfd, or -1 for none) once
+ * mqtt_resolve_result() has it.
+ *
+ * @return lookup, or NULL on allocation failure
+ */
+mqtt_resolve_t *mqtt_resolve_start(const char *host, uint16_t port, int notify_fd);
+
+/**
+ * @return 1 when resolved (addrs, in getaddrinfo order, stay valid until
+ *         mqtt_resolve_free()), 0 while the lookup runs, -1 if it failed
+ */
+int mqtt_resolve_result(const mqtt_resolve_t *r,
+                        const mqtt_resolved_addr_t **addrs,
+                        size_t *naddrs);
+
+/**
+ * Free the lookup. notify_fd is not written once this returns, even if
+ * the getaddrinfo() call behind it is still running.
+ */
+void mqtt_resolve_free(mqtt_resolve_t *r);
+
+/**
+ * Forget all cached answers, e.g. after the broker moved.
+ */
+void mqtt_resolve_flush_cache(void);
+
+#endif // MQTT_RESOLVER_H
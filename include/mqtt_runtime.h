@@ -0,0 +1,78 @@
+#ifndef MQTT_RUNTIME_H
+#define MQTT_RUNTIME_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "mqtt_client.h"
+
+/**
+ * Multi-threaded I/O runtime: N threads, each running its own
+ * mqtt_loop_t, with clients sharded across them.
+ *
+ * Once a client is handed to the runtime it belongs to one loop thread;
+ * its callbacks run there and other threads talk to it only through
+ * mqtt_runtime_publish(), which enqueues on the client's lock-free
+ * outbound queue (see mqtt_client_publish_concurrent()).
+ */
+typedef struct mqtt_runtime mqtt_runtime_t;
+
+/**
+ * A client registered with the runtime.
+ */
+typedef struct mqtt_runtime_session mqtt_runtime_session_t;
+
+typedef struct {
+    size_t num_threads;   // loop threads, 0 = one per online CPU
+    bool   pin_threads;   // pin thread i to CPU (first_cpu + i) % ncpus
+    int    first_cpu;
+} mqtt_runtime_config_t;
+
+/**
+ * Create the runtime and start its loop threads.
+ */
+mqtt_runtime_t *mqtt_runtime_create(const mqtt_runtime_config_t *cfg);
+
+/**
+ * Stop and join all threads. Clients are removed from their loops but
+ * stay connected and are not destroyed; publishes still queued stay
+ * with their client and go out on its next flush or loop call.
+ */
+void mqtt_runtime_destroy(mqtt_runtime_t *rt);
+
+size_t mqtt_runtime_num_threads(const mqtt_runtime_t *rt);
+
+/**
+ * Hand a connected client, or one started with
+ * mqtt_client_connect_async(), over to one of the loop threads
+ * (round-robin).
+ *
+ * The caller must not use the client directly afterwards, except to
+ * destroy it after mqtt_runtime_destroy().
+ *
+ * A loop thread that fails stops and takes no more clients; if none is
+ * left running this fails.
+ *
+ * @return session handle, or NULL on error
+ */
+mqtt_runtime_session_t *mqtt_runtime_add_client(mqtt_runtime_t *rt,
+                                                mqtt_client_t *client);
+
+/**
+ * Queue a QoS 0 publish for the session's client. Safe to call from any
+ * thread; topic and payload are copied, and the call never blocks on
+ * the socket or on a lock.
+ *
+ * The frame is encoded on the calling thread; the loop thread sends
+ * everything queued for a client with vectored writes.
+ *
+ * @return 0 if queued, -1 on error, including when the client could
+ *         not be added to its loop or its loop thread has failed (both
+ *         are logged when they happen)
+ */
+int mqtt_runtime_publish(mqtt_runtime_session_t *session,
+                         const char *topic,
+                         const uint8_t *payload,
+                         size_t payload_len);
+
+#endif // MQTT_RUNTIME_H
@@ -0,0 +1,137 @@
+#ifndef MQTT_STORE_H
+#define MQTT_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Crash-safe log of outbound messages.
+ *
+ * Records are appended to memory-mapped segment files in one directory:
+ * a PUBLISH frame when it is stored, a small tombstone when it is
+ * acknowledged. An in-memory index by packet id (plus a FIFO for QoS 0
+ * messages queued offline, which leave strictly in order) tracks which
+ * records are still needed and how many each segment holds.
+ *
+ * A segment whose records are all acknowledged is deleted once every
+ * older one is. When a new segment is started and the oldest one is
+ * mostly acknowledged, its few live records are copied forward so it
+ * can go too. Recovery therefore scans roughly the unacknowledged data,
+ * not the whole history.
+ *
+ * The mapping is shared with the page cache, so a crashed process loses
+ * nothing that was appended. The sync policies bound what a power loss
+ * or kernel crash can cost: records appended since the last msync() may
+ * be lost, and acknowledgements since then may be replayed.
+ */
+typedef struct mqtt_store mqtt_store_t;
+
+typedef struct {
+    const char *dir;              // created if missing
+    size_t      segment_size;     // 0 = 4 MiB; larger frames get a larger segment
+    uint32_t    sync_every;       // msync after this many records, 0 = off
+    uint32_t    sync_interval_ms; // msync dirty records this often, 0 = off
+} mqtt_store_config_t;
+
+/**
+ * One live message, as handed back by mqtt_store_recover().
+ */
+typedef struct {
+    uint64_t       seq;        // publish order
+    uint16_t       packet_id;  // 0 = QoS 0 message queued offline
+    bool           released;   // QoS 2 past PUBREC: only PUBREL is left
+    const uint8_t *frame;      // valid during the callback only
+    size_t         frame_len;
+} mqtt_store_record_t;
+
+/**
+ * @return 0 to continue, non-zero to stop the recovery with an error
+ */
+typedef int (*mqtt_store_recover_fn)(const mqtt_store_record_t *rec, void *ctx);
+
+typedef struct {
+    size_t   segments;
+    size_t   live_records;
+    size_t   live_bytes;       // of records still needed
+    uint64_t syncs;
+} mqtt_store_stats_t;
+
+/**
+ * Open (or create) the store in cfg->dir and rebuild its index from the
+ * segments on disk. A torn record at the end of the last segment, left
+ * by a crash in the middle of an append, is discarded.
+ *
+ * @return store, or NULL on error
+ */
+mqtt_store_t *mqtt_store_open(const mqtt_store_config_t *cfg);
+
+/**
+ * Sync and close. Live records stay on disk for the next open.
+ */
+void mqtt_store_close(mqtt_store_t *store);
+
+/**
+ * Call fn for each live record, in publish order.
+ *
+ * @return 0 on success, -1 if fn failed
+ */
+int mqtt_store_recover(mqtt_store_t *store, mqtt_store_recover_fn fn, void *ctx);
+
+/**
+ * Highest sequence number ever stored; new messages must use higher ones.
+ */
+uint64_t mqtt_store_last_seq(const mqtt_store_t *store);
+
+/**
+ * Append a message. packet_id 0 stores a QoS 0 message queued offline;
+ * these must be put in increasing seq order.
+ *
+ * @return 0 on success, -1 on I/O error or allocation failure
+ */
+int mqtt_store_put(mqtt_store_t *store, uint16_t packet_id, uint64_t seq,
+                   const uint8_t *frame, size_t frame_len);
+
+/**
+ * Record that the QoS 2 message packet_id got its PUBREC.
+ *
+ * @return 0 on success, -1 on error or unknown packet id
+ */
+int mqtt_store_pubrel(mqtt_store_t *store, uint16_t packet_id);
+
+/**
+ * Forget the QoS 1/2 message packet_id (PUBACK/PUBCOMP received).
+ *
+ * @return 0 on success, -1 on error or unknown packet id
+ */
+int mqtt_store_release(mqtt_store_t *store, uint16_t packet_id);
+
+/**
+ * Forget every QoS 0 offline message up to and including seq.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_store_release_offline(mqtt_store_t *store, uint64_t seq);
+
+/**
+ * msync() everything appended so far.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_store_sync(mqtt_store_t *store);
+
+/**
+ * Apply sync_interval_ms; call it by mqtt_store_next_sync_ms().
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_store_tick(mqtt_store_t *store, uint64_t now_ms);
+
+/**
+ * @return when mqtt_store_tick() has a sync to do, or UINT64_MAX
+ */
+uint64_t mqtt_store_next_sync_ms(const mqtt_store_t *store);
+
+void mqtt_store_get_stats(const mqtt_store_t *store, mqtt_store_stats_t *stats);
+
+#endif // MQTT_STORE_H
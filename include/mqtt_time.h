@@ -0,0 +1,21 @@
+#ifndef MQTT_TIME_H
+#define MQTT_TIME_H
+
+#include <stdint.h>
+
+/**
+ * Monotonic clock in milliseconds (arbitrary epoch).
+ */
+uint64_t mqtt_time_now_ms(void);
+
+/**
+ * Same clock in nanoseconds, for measuring short intervals.
+ */
+uint64_t mqtt_time_now_ns(void);
+
+/**
+ * Sleep for ms milliseconds (resumes after signals).
+ */
+void mqtt_time_sleep_ms(uint64_t ms);
+
+#endif // MQTT_TIME_H
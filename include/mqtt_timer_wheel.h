@@ -0,0 +1,76 @@
+#ifndef MQTT_TIMER_WHEEL_H
+#define MQTT_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Resolution of the wheel; timers never fire early, at most this late. */
+#ifndef MQTT_TIMER_WHEEL_TICK_MS
+#define MQTT_TIMER_WHEEL_TICK_MS 10
+#endif
+
+#define MQTT_TIMER_WHEEL_LEVELS    4
+#define MQTT_TIMER_WHEEL_L0_BITS   8  // 256 slots of one tick
+#define MQTT_TIMER_WHEEL_LN_BITS   6  // 64 slots per upper level
+
+/**
+ * A timer embedded in its owner. Zero-initialise (or leave unscheduled)
+ * before first use; an unscheduled timer has next == NULL.
+ */
+typedef struct mqtt_timer {
+    struct mqtt_timer *next;
+    struct mqtt_timer *prev;
+    uint64_t           expires;  // in ticks
+} mqtt_timer_t;
+
+/**
+ * Hierarchical timing wheel: scheduling and cancelling are O(1), and
+ * advancing one tick touches one slot (plus an occasional cascade of
+ * an upper-level slot), however many timers are pending.
+ *
+ * With 10 ms ticks the levels cover 2.56 s, 164 s, 2.9 h and 7.8 days;
+ * later deadlines are clamped to the end of the last level.
+ */
+typedef struct {
+    mqtt_timer_t l0[1u << MQTT_TIMER_WHEEL_L0_BITS];
+    mqtt_timer_t ln[MQTT_TIMER_WHEEL_LEVELS - 1][1u << MQTT_TIMER_WHEEL_LN_BITS];
+    uint64_t     next_tick;      // first tick not processed yet
+    size_t       count;
+} mqtt_timer_wheel_t;
+
+/**
+ * Called for each expired timer, which is no longer scheduled and may
+ * be rescheduled or freed from inside the callback.
+ */
+typedef void (*mqtt_timer_expired_fn)(mqtt_timer_t *timer, void *ctx);
+
+void mqtt_timer_wheel_init(mqtt_timer_wheel_t *w, uint64_t now_ms);
+
+/**
+ * (Re)arm timer to expire at expires_ms. A time in the past makes it
+ * expire on the next advance.
+ */
+void mqtt_timer_schedule(mqtt_timer_wheel_t *w, mqtt_timer_t *timer,
+                         uint64_t expires_ms);
+
+void mqtt_timer_cancel(mqtt_timer_wheel_t *w, mqtt_timer_t *timer);
+
+bool mqtt_timer_pending(const mqtt_timer_t *timer);
+
+/**
+ * Fire every timer due at or before now_ms.
+ *
+ * @return number of timers fired
+ */
+size_t mqtt_timer_wheel_advance(mqtt_timer_wheel_t *w, uint64_t now_ms,
+                                mqtt_timer_expired_fn cb, void *ctx);
+
+/**
+ * How long a poller may sleep before the wheel needs advancing.
+ *
+ * @return milliseconds, or -1 when no timer is pending
+ */
+int mqtt_timer_wheel_timeout_ms(const mqtt_timer_wheel_t *w, uint64_t now_ms);
+
+#endif // MQTT_TIMER_WHEEL_H
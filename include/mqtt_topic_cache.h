@@ -0,0 +1,66 @@
+#ifndef MQTT_TOPIC_CACHE_H
+#define MQTT_TOPIC_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Interned topic names for repeated publishing.
+ *
+ * Each name is validated and encoded once, as the length-prefixed bytes
+ * a PUBLISH carries, and the entry keeps its address until the cache is
+ * cleaned up; a pointer to it is the handle publishers hold. Entries are
+ * read-only after creation, so handles may be used from any thread;
+ * interning itself is not thread-safe.
+ *
+ * An entry also has room for per-connection state. MQTT 5 topic aliases
+ * go there: a publish by handle would look at alias, send the name with
+ * a new alias or an empty name with an established one, and
+ * mqtt_topic_cache_clear_aliases() forgets them all when the connection
+ * goes. MQTT 3.1.1 has no aliases, so alias stays 0.
+ */
+
+typedef struct mqtt_topic_entry mqtt_topic_entry_t;
+
+struct mqtt_topic_entry {
+    mqtt_topic_entry_t *next;       // hash chain
+    uint32_t            hash;
+    uint16_t            alias;      // topic alias on this connection, 0 = none
+    size_t              wire_len;   // 2 + name length
+    uint8_t             wire[];     // length prefix, name, then a NUL
+};
+
+typedef struct {
+    mqtt_topic_entry_t **buckets;
+    size_t               nbuckets;  // power of two, 0 until first use
+    size_t               count;
+} mqtt_topic_cache_t;
+
+void mqtt_topic_cache_init(mqtt_topic_cache_t *cache);
+void mqtt_topic_cache_cleanup(mqtt_topic_cache_t *cache);
+
+/**
+ * Entry for a topic name, created on first use.
+ *
+ * @return entry, or NULL if the name is invalid (see
+ *         mqtt_validate_topic_name()) or memory runs out
+ */
+mqtt_topic_entry_t *mqtt_topic_cache_intern(mqtt_topic_cache_t *cache,
+                                            const char *topic, size_t len);
+
+/** The name, NUL-terminated. */
+static inline const char *mqtt_topic_entry_name(const mqtt_topic_entry_t *e) {
+    return (const char *)e->wire + 2;
+}
+
+static inline size_t mqtt_topic_entry_name_len(const mqtt_topic_entry_t *e) {
+    return e->wire_len - 2;
+}
+
+/**
+ * Forget every topic alias, e.g. once the connection that assigned them
+ * is gone.
+ */
+void mqtt_topic_cache_clear_aliases(mqtt_topic_cache_t *cache);
+
+#endif // MQTT_TOPIC_CACHE_H
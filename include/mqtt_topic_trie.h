@@ -0,0 +1,84 @@
+#ifndef MQTT_TOPIC_TRIE_H
+#define MQTT_TOPIC_TRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Handler attached to a topic filter.
+ *
+ * topic is not NUL-terminated in general; use topic_len.
+ */
+typedef void (*mqtt_topic_handler_t)(const char *topic,
+                                     size_t topic_len,
+                                     const uint8_t *payload,
+                                     size_t payload_len,
+                                     void *ctx);
+
+typedef struct mqtt_topic_node mqtt_topic_node_t;
+
+/**
+ * Topic filters split on '/', one trie node per level.
+ *
+ * Literal children are kept sorted and found by binary search; '+' and
+ * '#' children have their own pointers. Matching a topic follows, from
+ * every node reached, its literal child and its '+' child for the next
+ * level, so the paths can double per level: up to 2^depth nodes when
+ * '+' filters overlap at every level, and never more than the trie
+ * holds. Filters that share no path with the topic cost nothing, so the
+ * number of subscriptions alone does not slow matching down.
+ */
+typedef struct {
+    mqtt_topic_node_t *root;
+    size_t             count; // filters with a handler
+} mqtt_topic_trie_t;
+
+void mqtt_topic_trie_init(mqtt_topic_trie_t *trie);
+void mqtt_topic_trie_cleanup(mqtt_topic_trie_t *trie);
+
+/**
+ * Check MQTT 3.1.1 filter rules: non-empty, '+' and '#' occupy a whole
+ * level, '#' only as the last level, valid UTF-8 without NUL. Same as
+ * mqtt_validate_topic_filter().
+ *
+ * @return 1 if valid, 0 otherwise
+ */
+int mqtt_topic_filter_valid(const char *filter, size_t len);
+
+/**
+ * Attach handler to filter, replacing any handler it already had.
+ *
+ * @return 0 on success, -1 on invalid filter or allocation failure
+ */
+int mqtt_topic_trie_insert(mqtt_topic_trie_t *trie,
+                           const char *filter, size_t len,
+                           mqtt_topic_handler_t handler, void *ctx);
+
+/**
+ * Handler attached to exactly this filter (no wildcard matching).
+ *
+ * @return 1 and the handler and ctx if there is one, 0 otherwise
+ */
+int mqtt_topic_trie_get(const mqtt_topic_trie_t *trie,
+                        const char *filter, size_t len,
+                        mqtt_topic_handler_t *handler, void **ctx);
+
+/**
+ * Detach the handler from filter and prune nodes left empty.
+ *
+ * @return 0 on success, -1 if filter had no handler
+ */
+int mqtt_topic_trie_remove(mqtt_topic_trie_t *trie,
+                           const char *filter, size_t len);
+
+/**
+ * Call the handler of every filter matching topic. Wildcards at the
+ * first level do not match topics starting with '$'.
+ *
+ * @return number of handlers called
+ */
+size_t mqtt_topic_trie_dispatch(const mqtt_topic_trie_t *trie,
+                                const char *topic, size_t topic_len,
+                                const uint8_t *payload, size_t payload_len);
+
+#endif // MQTT_TOPIC_TRIE_H
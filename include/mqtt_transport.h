@@ -3,6 +3,89 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Returned by send/recv functions when a non-blocking socket has no
+ * room / no data right now.
+ */
+#define MQTT_TRANSPORT_WOULD_BLOCK (-2)
+
+/**
+ * One element of a scatter/gather send.
+ */
+typedef struct {
+    const void *base;
+    size_t      len;
+} mqtt_iovec_t;
+
+typedef struct mqtt_transport mqtt_transport_t;
+
+/**
+ * Operations of a transport (plain TCP, TLS, ...). send, sendv and recv
+ * follow the socket helpers below: a byte count (possibly short),
+ * MQTT_TRANSPORT_WOULD_BLOCK, 0 from recv when the peer closed, or -1.
+ *
+ * A transport object carries one connection at a time and is reused
+ * across reconnects, so it can keep state such as a TLS session.
+ */
+typedef struct {
+    const char *name;
+
+    /** Blocking connect, including any handshake. @return 0 or -1 */
+    int    (*connect)(mqtt_transport_t *t, const char *host, uint16_t port);
+    int    (*send)(mqtt_transport_t *t, const void *buf, size_t len);
+    int    (*sendv)(mqtt_transport_t *t, const mqtt_iovec_t *iov, size_t iovcnt);
+    int    (*recv)(mqtt_transport_t *t, void *buf, size_t maxlen);
+    /** Close the connection; the transport can connect again. */
+    void   (*close)(mqtt_transport_t *t);
+    /** Socket to poll, -1 when not connected. */
+    int    (*fd)(const mqtt_transport_t *t);
+    /** Bytes recv can return without the socket becoming readable. */
+    size_t (*pending)(const mqtt_transport_t *t);
+    void   (*destroy)(mqtt_transport_t *t);
+
+    /*
+     * Optional non-blocking connect; NULL where only connect is offered.
+     * connect_start begins connecting, connect_continue advances it when
+     * fd() is ready. Both return 0 once connected (handshake included),
+     * MQTT_TRANSPORT_WOULD_BLOCK while in progress, or -1. fd() may
+     * change between calls, so pollers must re-read it.
+     */
+    int    (*connect_start)(mqtt_transport_t *t, const char *host, uint16_t port);
+    int    (*connect_continue)(mqtt_transport_t *t);
+} mqtt_transport_ops_t;
+
+/**
+ * Base of every transport; implementations embed it as first member.
+ */
+struct mqtt_transport {
+    const mqtt_transport_ops_t *ops;
+};
+
+/**
+ * Plain TCP transport on top of the socket helpers below.
+ *
+ * @return transport, or NULL on allocation failure
+ */
+mqtt_transport_t *mqtt_transport_tcp_create(void);
+
+/**
+ * Plain TCP transport around an already connected socket (e.g. from
+ * accept()), which it takes ownership of.
+ *
+ * @return transport, or NULL on allocation failure (fd is then closed)
+ */
+mqtt_transport_t *mqtt_transport_tcp_adopt(int fd);
+
+/**
+ * Close any connection and free the transport.
+ */
+void mqtt_transport_destroy(mqtt_transport_t *t);
+
+/*
+ * POSIX socket helpers, shared by the built-in transports.
+ */
 
 /**
  * Connect to a TCP server.
@@ -17,17 +100,64 @@ int mqtt_transport_connect(const char *host, uint16_t port);
 /**
  * Send data over an open socket.
  *
- * @return number of bytes sent, or -1 on error.
+ * @return number of bytes sent, MQTT_TRANSPORT_WOULD_BLOCK, or -1 on error.
  */
 int mqtt_transport_send(int sockfd, const void *buf, size_t len);
 
+/**
+ * Send several buffers with a single system call (writev/sendmsg).
+ *
+ * Like mqtt_transport_send, this may send fewer bytes than the total.
+ *
+ * @return number of bytes sent, MQTT_TRANSPORT_WOULD_BLOCK, or -1 on error.
+ */
+int mqtt_transport_sendv(int sockfd, const mqtt_iovec_t *iov, size_t iovcnt);
+
 /**
  * Receive data from an open socket.
  *
- * @return number of bytes received, 0 if connection closed, or -1 on error.
+ * @return number of bytes received, 0 if connection closed,
+ *         MQTT_TRANSPORT_WOULD_BLOCK, or -1 on error.
  */
 int mqtt_transport_recv(int sockfd, void *buf, size_t maxlen);
 
+/**
+ * Wait until the socket is readable (or closed).
+ *
+ * @param timeout_ms  -1 = no limit
+ * @return 1 if readable, 0 on timeout, -1 on error
+ */
+int mqtt_transport_wait_readable(int sockfd, int timeout_ms);
+
+/**
+ * Wait until the socket can take more data, as
+ * mqtt_transport_wait_readable().
+ */
+int mqtt_transport_wait_writable(int sockfd, int timeout_ms);
+
+/**
+ * Switch the socket between blocking and non-blocking mode.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_transport_set_nonblocking(int sockfd, bool enable);
+
+/**
+ * Hold back partial TCP segments (TCP_CORK) while enabled; disabling
+ * pushes out anything still queued. No-op where unsupported and on
+ * descriptors that are not TCP sockets.
+ */
+void mqtt_transport_set_cork(int sockfd, bool enable);
+
+/**
+ * Send what the kernel holds back right now, past both the cork and
+ * Nagle's algorithm, leaving the socket options as they were. Uncorking
+ * alone is not enough: Nagle may still hold a small segment until the
+ * peer's delayed ACK. No-op where unsupported and on descriptors that
+ * are not TCP sockets.
+ */
+void mqtt_transport_push(int sockfd);
+
 /**
  * Close the socket.
  */
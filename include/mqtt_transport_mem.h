@@ -0,0 +1,47 @@
+#ifndef MQTT_TRANSPORT_MEM_H
+#define MQTT_TRANSPORT_MEM_H
+
+#include "mqtt_transport.h"
+
+/**
+ * In-memory transports: two ends joined by byte queues, no sockets.
+ *
+ * Each end behaves like a connected TCP socket. recv returns what the
+ * other end sent, MQTT_TRANSPORT_WOULD_BLOCK when empty and its fd is
+ * non-blocking, and 0 once the other end has closed. The fd is the read
+ * side of a pipe that is readable exactly while recv has something to
+ * report, so an end can be polled or added to an mqtt_loop_t.
+ *
+ * send never blocks: queues grow as needed, as a socket with an
+ * unbounded buffer would. The two ends may be used from different
+ * threads.
+ */
+
+/**
+ * Create two ends already connected to each other. connect() on either
+ * succeeds while the pair is open; there is no reconnecting.
+ *
+ * @return 0 on success, -1 on error
+ */
+int mqtt_transport_mem_pair(mqtt_transport_t **a, mqtt_transport_t **b);
+
+/**
+ * Called by a connecting end with the other end of its new pair. The
+ * callee owns it when it accepts; a refused end is destroyed.
+ *
+ * @return 0 to accept, -1 to refuse (the connect fails)
+ */
+typedef int (*mqtt_transport_mem_accept_fn)(mqtt_transport_t *server,
+                                            const char *host, uint16_t port,
+                                            void *ctx);
+
+/**
+ * Client end that makes a new pair on every connect() and hands the
+ * other end to accept, so it can reconnect like a socket.
+ *
+ * @return transport, or NULL on allocation failure
+ */
+mqtt_transport_t *mqtt_transport_mem_create(mqtt_transport_mem_accept_fn accept,
+                                            void *ctx);
+
+#endif // MQTT_TRANSPORT_MEM_H
@@ -0,0 +1,43 @@
+#ifndef MQTT_TRANSPORT_TLS_H
+#define MQTT_TRANSPORT_TLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mqtt_transport.h"
+
+/**
+ * TLS settings; every field may be left zero.
+ */
+typedef struct mqtt_tls_config {
+    const char *ca_file;        // PEM bundle to verify the broker, NULL = system store
+    const char *cert_file;      // client certificate (PEM), optional
+    const char *key_file;       // its private key (PEM)
+    const char *server_name;    // SNI and name to verify, NULL = the connect host
+    bool        insecure;       // skip certificate verification (testing only)
+    bool        no_resumption;  // always do a full handshake
+} mqtt_tls_config_t;
+
+typedef struct {
+    uint64_t handshakes;        // completed, full or resumed
+    uint64_t resumed;           // of which abbreviated with a session ticket
+} mqtt_tls_stats_t;
+
+/**
+ * TLS transport (OpenSSL).
+ *
+ * The session (ticket) from each connection is offered on the next one,
+ * so a reconnect after a broker restart or network blip costs an
+ * abbreviated handshake instead of a full key exchange and certificate
+ * check. The session is dropped when a handshake fails.
+ *
+ * @return transport, or NULL on error or when built without OpenSSL
+ */
+mqtt_transport_t *mqtt_transport_tls_create(const mqtt_tls_config_t *cfg);
+
+/**
+ * @return 0 on success, -1 if t is not a TLS transport
+ */
+int mqtt_transport_tls_get_stats(const mqtt_transport_t *t, mqtt_tls_stats_t *stats);
+
+#endif // MQTT_TRANSPORT_TLS_H
@@ -0,0 +1,59 @@
+#ifndef MQTT_VALIDATE_H
+#define MQTT_VALIDATE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Validation of MQTT strings and topics.
+ *
+ * MQTT strings must be well-formed UTF-8 and must not contain U+0000
+ * [MQTT-1.5.3-1], [MQTT-1.5.3-2]; overlong forms, surrogates and code
+ * points above U+10FFFF are ill-formed. The control characters and
+ * noncharacters the spec only advises against are accepted.
+ *
+ * On x86 the checks run 16 bytes at a time with SSE2 or 32 with AVX2
+ * (the latter validating multi-byte sequences in vector registers as
+ * well), picked once at run time from what the CPU supports. Other
+ * machines use the scalar code.
+ */
+
+/**
+ * @return true if s[0..len) is a valid MQTT string
+ */
+bool mqtt_validate_utf8(const void *s, size_t len);
+
+/**
+ * A topic name as used in PUBLISH: 1 to 65535 bytes of valid MQTT
+ * string without the wildcards '+' and '#' [MQTT-3.3.2-2].
+ */
+bool mqtt_validate_topic_name(const char *topic, size_t len);
+
+/**
+ * A topic filter as used in SUBSCRIBE: 1 to 65535 bytes of valid MQTT
+ * string in which '+' fills a whole level and '#' is a whole, last
+ * level [MQTT-4.7.1-2], [MQTT-4.7.1-3].
+ */
+bool mqtt_validate_topic_filter(const char *filter, size_t len);
+
+typedef enum {
+    MQTT_VALIDATE_AUTO = 0,     // best the CPU supports
+    MQTT_VALIDATE_SCALAR,
+    MQTT_VALIDATE_SSE2,
+    MQTT_VALIDATE_AVX2,
+} mqtt_validate_impl_t;
+
+/**
+ * Pin the implementation, e.g. to benchmark one against another.
+ * Affects every thread; results never differ between implementations.
+ *
+ * @return 0 on success, -1 if this CPU or build lacks it
+ */
+int mqtt_validate_set_impl(mqtt_validate_impl_t impl);
+
+/**
+ * @return "scalar", "sse2" or "avx2"
+ */
+const char *mqtt_validate_impl_name(void);
+
+#endif // MQTT_VALIDATE_H
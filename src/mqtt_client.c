@@ -2,240 +2,2946 @@
 #include "mqtt_transport.h"
 #include "mqtt_encode.h"
 #include "mqtt_decode.h"
+#include "mqtt_time.h"
+#include "mqtt_inflight.h"
+#include "mqtt_metrics.h"
+#include "mqtt_mpsc.h"
+#include "mqtt_pool.h"
+#include "mqtt_store.h"
+#include "mqtt_topic_cache.h"
+#include "mqtt_topic_trie.h"
+#include "mqtt_validate.h"
+#include "mqtt_log.h"
 
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 
-#define MQTT_RX_BUFFER_SIZE 1024
+/* Initial receive buffer size; also the minimum room offered to each recv(). */
+#define MQTT_RX_BUFFER_SIZE 16384
+
+/* Largest packet we accept from the broker (the spec allows ~256 MB). */
+#ifndef MQTT_RX_MAX_PACKET_SIZE
+#define MQTT_RX_MAX_PACKET_SIZE (256u * 1024u)
+#endif
+
+/* Batch size that triggers an automatic flush when the config leaves it 0. */
+#define MQTT_BATCH_FLUSH_BYTES_DEFAULT 16384
+
+/* Outstanding QoS 1/2 messages when receive_maximum is left 0. */
+#define MQTT_RECEIVE_MAXIMUM_DEFAULT 64
+
+/* Slab block size for outbound frames when pool_block_size is left 0. */
+#define MQTT_POOL_BLOCK_SIZE_DEFAULT 256
+
+/* Upper bound for one SUBSCRIBE built by mqtt_client_subscribe_many(). */
+#ifndef MQTT_SUBSCRIBE_MAX_PACKET_SIZE
+#define MQTT_SUBSCRIBE_MAX_PACKET_SIZE (64u * 1024u)
+#endif
+
+/*
+ * Most buffers one write takes besides tx_buf: the pieces of a packet,
+ * or a batch of frames from the concurrent publish queue.
+ */
+#define MQTT_CLIENT_MAX_IOV 63
+
+/* Queued frames sent per drain before the writer lets other I/O run. */
+#define MQTT_CLIENT_QUEUE_BUDGET 4096
+
+/*
+ * Queued frames up to this size are copied together into tx_buf rather
+ * than given an iovec each: for tiny frames one memcpy is cheaper than
+ * the kernel walking a segment per frame.
+ */
+#define MQTT_CLIENT_QUEUE_COPY_MAX 512
+
+/* Non-blocking connect limit when connect_timeout_ms is left 0. */
+#define MQTT_CONNECT_TIMEOUT_MS_DEFAULT 10000
+
+/* Reconnect backoff bounds when the config leaves them 0. */
+#define MQTT_RECONNECT_MIN_MS_DEFAULT 1000
+#define MQTT_RECONNECT_MAX_MS_DEFAULT 60000
+
+/* QoS 0 messages held while reconnecting when offline_queue_max is left 0. */
+#define MQTT_OFFLINE_QUEUE_MAX_DEFAULT 1024
+
+// A SUBSCRIBE waiting for its SUBACK
+typedef struct {
+    uint16_t               packet_id;
+    size_t                 first_index; // of its first filter in the caller's array
+    size_t                 count;
+    mqtt_suback_callback_t cb;
+    void                  *ctx;
+} mqtt_pending_sub_t;
+
+// A QoS 0 PUBLISH made while reconnecting, stored in the pool
+typedef struct mqtt_offline_msg {
+    struct mqtt_offline_msg *next;
+    uint64_t seq;
+    size_t   frame_len;
+    uint8_t  frame[];
+} mqtt_offline_msg_t;
+
+// A QoS 0 PUBLISH from mqtt_client_publish_concurrent(), encoded by the
+// producer and freed by the writer once sent
+typedef struct {
+    mqtt_mpsc_node_t node;    // must stay first
+    size_t           frame_len;
+    uint8_t          frame[];
+} mqtt_queued_frame_t;
+
+// Live counters behind mqtt_client_get_stats(). Only the thread driving
+// the client writes them; any thread may read (see mqtt_metrics.h).
+typedef struct {
+    mqtt_counter_t bytes_in;
+    mqtt_counter_t bytes_out;
+    mqtt_counter_t packets_in[MQTT_PACKET_TYPES];
+    mqtt_counter_t packets_out[MQTT_PACKET_TYPES];
+    mqtt_counter_t recv_calls;
+    mqtt_counter_t send_calls;
+    mqtt_counter_t send_would_block;
+    mqtt_counter_t decode_errors;
+    mqtt_counter_t inflight;
+    mqtt_counter_t inflight_max;
+    mqtt_counter_t offline_queued;
+    mqtt_counter_t tx_buffered_bytes;
+    mqtt_counter_t tx_dropped;
+    mqtt_counter_t tx_rejected;    // also counted by producer threads
+    mqtt_counter_t pending_subscribes;
+    mqtt_counter_t connection_losses;
+    mqtt_counter_t reconnects;
+    mqtt_counter_t reconnect_failures;
+    mqtt_counter_t ping_timeouts;
+    mqtt_histogram_t ack_latency_us;
+} mqtt_client_metrics_t;
 
 // Internal structure definition
 struct mqtt_client {
     mqtt_client_config_t cfg;
-    int  sockfd;
+    mqtt_transport_t *transport;
+    bool owns_transport;
     bool connected;
+    bool nonblocking;
+
+    // Non-blocking connect in progress: the transport connects first,
+    // then CONNECT goes out and connack_pending is set.
+    bool     connecting;
+    bool     connack_pending;
+    uint64_t connect_deadline_ms;
     uint16_t next_packet_id;
+
+    // Receive buffer: complete frames are dispatched straight out of it,
+    // a trailing partial frame is kept at the front for the next read.
+    uint8_t *rx_buf;
+    size_t   rx_len;
+    size_t   rx_cap;
+
+    // Outbound bytes not handed to the socket yet: batched PUBLISH frames
+    // and, in non-blocking mode, whatever a short write left behind.
+    // [tx_off, tx_len) is still to be sent.
+    uint8_t *tx_buf;
+    size_t   tx_off;
+    size_t   tx_len;
+    size_t   tx_cap;
+    bool     tx_blocked;         // socket was full; wait for writability
+    size_t   tx_mark;            // a frame starts here, at or before the
+                                 // first one not yet started on the wire
+
+    // Backpressure (tx_queue_max and the watermarks). outq_bytes counts
+    // the frames in outq; producers blocked by MQTT_TX_OVERFLOW_BLOCK
+    // sleep on tx_wait_cond. tx_recheck asks the driving thread to apply
+    // the limits after a producer pushed the backlog past one.
+    size_t          tx_high;
+    size_t          tx_low;
+    bool            tx_congested;    // on_tx_pressure last said so
+    atomic_size_t   outq_bytes;
+    atomic_bool     tx_recheck;
+    atomic_uint     tx_waiters;
+    pthread_mutex_t tx_wait_lock;
+    pthread_cond_t  tx_wait_cond;
+
+    bool     batching;
+    size_t   batch_flush_bytes;
+    uint64_t batch_started_ms;   // when the oldest buffered frame was added
+
+    // Keep-alive: a PINGREQ goes out after keep_alive_sec without any
+    // outbound traffic; its PINGRESP must come back within ping_timeout.
+    uint64_t last_tx_ms;
+    uint64_t ping_sent_ms;
+    bool     ping_outstanding;
+
+    // Auto-reconnect: after a failure the socket is closed and the next
+    // attempt is due at reconnect_at_ms (exponential backoff, full jitter).
+    bool     reconnecting;
+    uint32_t reconnect_attempts;
+    uint64_t reconnect_at_ms;
+    uint64_t rng;                // xorshift64* state for the jitter
+    bool     session_present;    // from the last CONNACK
+
+    // Inbound QoS 2: one bit per packet id delivered and not yet released
+    // by PUBREL, so a redelivered PUBLISH is not handed to the app twice.
+    // Allocated on the first QoS 2 message.
+    uint8_t *qos2_rx;
+
+    // Publish order across the in-flight table and the offline queue
+    uint64_t publish_seq;
+    mqtt_offline_msg_t *offline_head;
+    mqtt_offline_msg_t *offline_tail;
+    size_t              offline_count;
+
+    // Told when mqtt_client_next_deadline_ms() may have moved earlier
+    mqtt_client_deadline_hook_t deadline_hook;
+    void                       *deadline_hook_ctx;
+
+    // Frames from mqtt_client_publish_concurrent(). outq_signaled is set
+    // by the first producer after a drain, which then calls wakeup_hook.
+    mqtt_mpsc_t                          outq;
+    atomic_bool                          outq_signaled;
+    _Atomic(mqtt_client_wakeup_hook_t)   wakeup_hook;
+    _Atomic(void *)                      wakeup_hook_ctx;
+
+    // Outgoing QoS 1/2 messages awaiting their acknowledgement
+    mqtt_inflight_table_t inflight;
+
+    // Storage for encoded frames that outlive the publish call
+    mqtt_pool_t pool;
+
+    // Optional on-disk copy of the in-flight table and offline queue
+    mqtt_store_t *store;
+
+    // Outstanding SUBSCRIBE packets (few at a time: linear lookup)
+    mqtt_pending_sub_t *pending_subs;
+    size_t              npending_subs;
+    size_t              pending_subs_cap;
+
+    // Per-subscription handlers, matched against each incoming topic
+    mqtt_topic_trie_t routes;
+
+    // Topics registered with mqtt_client_topic_register()
+    mqtt_topic_cache_t topics;
+
+    mqtt_client_metrics_t metrics;
 };
 
+/*
+ * Publish the queue depths to the metrics. Called wherever one of them
+ * may have moved; four relaxed stores, cheap enough for every packet.
+ */
+static void mqtt_client_update_gauges(mqtt_client_t *client) {
+    mqtt_client_metrics_t *m = &client->metrics;
+    uint64_t inflight = mqtt_inflight_count(&client->inflight);
+
+    mqtt_counter_set(&m->inflight, inflight);
+    if (inflight > mqtt_counter_get(&m->inflight_max))
+        mqtt_counter_set(&m->inflight_max, inflight);
+    mqtt_counter_set(&m->offline_queued, client->offline_count);
+    mqtt_counter_set(&m->tx_buffered_bytes, client->tx_len - client->tx_off);
+    mqtt_counter_set(&m->pending_subscribes, client->npending_subs);
+}
+
+/* Count one outbound packet by the type in its first header byte. */
+static void mqtt_client_count_out(mqtt_client_t *client, uint8_t header) {
+    mqtt_counter_add(&client->metrics.packets_out[header >> 4], 1);
+}
+
+/* Put a message an earlier run left in the store back where it was. */
+static int mqtt_client_restore(const mqtt_store_record_t *rec, void *ctx) {
+    mqtt_client_t *client = (mqtt_client_t *)ctx;
+
+    if (rec->packet_id == 0) {
+        mqtt_offline_msg_t *m = (mqtt_offline_msg_t *)mqtt_pool_alloc(
+            &client->pool, sizeof(*m) + rec->frame_len);
+        if (!m) {
+            MQTT_LOG_ERROR("Outbound message memory exhausted");
+            return -1;
+        }
+        memcpy(m->frame, rec->frame, rec->frame_len);
+        m->frame_len = rec->frame_len;
+        m->seq = rec->seq;
+        m->next = NULL;
+
+        if (client->offline_tail) client->offline_tail->next = m;
+        else                      client->offline_head = m;
+        client->offline_tail = m;
+        client->offline_count++;
+        return 0;
+    }
+
+    // Same id as before: a resumed session on the broker may know it.
+    mqtt_inflight_msg_t *msg = mqtt_inflight_claim(&client->inflight, rec->packet_id);
+    if (!msg) {
+        MQTT_LOG_ERROR("Stored message %u does not fit receive_maximum %u",
+                       rec->packet_id, client->inflight.window);
+        return -1;
+    }
+
+    msg->qos  = (uint8_t)((rec->frame[0] >> 1) & 0x03);
+    msg->seq  = rec->seq;
+    msg->sent = true;
+    if (rec->released) {
+        // Only PUBREL is left to send; the frame is not needed.
+        msg->state = MQTT_INFLIGHT_WAIT_PUBCOMP;
+        return 0;
+    }
+
+    msg->frame = (uint8_t *)mqtt_pool_alloc(&client->pool, rec->frame_len);
+    if (!msg->frame) {
+        MQTT_LOG_ERROR("Outbound message memory exhausted");
+        mqtt_inflight_release(&client->inflight, msg);
+        return -1;
+    }
+    memcpy(msg->frame, rec->frame, rec->frame_len);
+    msg->frame_len = rec->frame_len;
+    msg->state = msg->qos == 1 ? MQTT_INFLIGHT_WAIT_PUBACK
+                               : MQTT_INFLIGHT_WAIT_PUBREC;
+    return 0;
+}
+
+static int mqtt_client_open_store(mqtt_client_t *client) {
+    mqtt_store_config_t scfg = {
+        .dir              = client->cfg.store_dir,
+        .segment_size     = client->cfg.store_segment_size,
+        .sync_every       = client->cfg.store_sync_every,
+        .sync_interval_ms = client->cfg.store_sync_interval_ms,
+    };
+    client->store = mqtt_store_open(&scfg);
+    if (!client->store) return -1;
+
+    if (mqtt_store_recover(client->store, mqtt_client_restore, client) != 0) {
+        MQTT_LOG_ERROR("Failed to restore stored messages");
+        return -1;
+    }
+    client->publish_seq = mqtt_store_last_seq(client->store);
+
+    size_t n = mqtt_inflight_count(&client->inflight) + client->offline_count;
+    if (n > 0) MQTT_LOG_INFO("Restored %zu stored message(s)", n);
+    mqtt_client_update_gauges(client);
+    return 0;
+}
+
 mqtt_client_t *mqtt_client_create(const mqtt_client_config_t *cfg) {
-    if (!cfg || !cfg->host || cfg->port == 0) {
-        fprintf(stderr, "mqtt_client_create: invalid configuration\n");
+    // A custom transport may not need a port (e.g. in-memory).
+    if (!cfg || !cfg->host || (cfg->port == 0 && !cfg->transport)) {
+        MQTT_LOG_ERROR("mqtt_client_create: invalid configuration");
         return NULL;
     }
 
     mqtt_client_t *client = (mqtt_client_t *)calloc(1, sizeof(mqtt_client_t));
     if (!client) {
-        perror("calloc");
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    client->rx_buf = (uint8_t *)malloc(MQTT_RX_BUFFER_SIZE);
+    if (!client->rx_buf) {
+        MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+        free(client);
+        return NULL;
+    }
+    client->rx_cap = MQTT_RX_BUFFER_SIZE;
+    client->rx_len = 0;
+
+    uint16_t window = cfg->receive_maximum ? cfg->receive_maximum
+                                           : MQTT_RECEIVE_MAXIMUM_DEFAULT;
+    if (window > MQTT_INFLIGHT_MAX_PACKET_ID) window = MQTT_INFLIGHT_MAX_PACKET_ID;
+    if (mqtt_inflight_init(&client->inflight, window) != 0) {
+        free(client->rx_buf);
+        free(client);
         return NULL;
     }
 
+    // By default the slab holds one full window of small messages.
+    size_t block_size  = cfg->pool_block_size ? cfg->pool_block_size
+                                               : MQTT_POOL_BLOCK_SIZE_DEFAULT;
+    size_t region_size = cfg->pool_region ? cfg->pool_region_size
+                       : cfg->pool_region_size ? cfg->pool_region_size
+                       : (size_t)window * block_size;
+    if (mqtt_pool_init(&client->pool, cfg->pool_region, region_size,
+                       block_size, cfg->pool_mem_cap) != 0) {
+        mqtt_inflight_cleanup(&client->inflight);
+        free(client->rx_buf);
+        free(client);
+        return NULL;
+    }
+
+    mqtt_topic_trie_init(&client->routes);
+    mqtt_topic_cache_init(&client->topics);
+    mqtt_mpsc_init(&client->outq);
+
+    // Blocked producers time out against the monotonic clock.
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&client->tx_wait_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+    pthread_mutex_init(&client->tx_wait_lock, NULL);
+
     client->cfg = *cfg;
-    client->sockfd = -1;
     client->connected = false;
-    client->next_packet_id = 1;
+    client->next_packet_id = MQTT_INFLIGHT_MAX_PACKET_ID + 1;
+    client->batch_flush_bytes = cfg->batch_flush_bytes
+                                    ? cfg->batch_flush_bytes
+                                    : MQTT_BATCH_FLUSH_BYTES_DEFAULT;
+    client->tx_high = cfg->tx_high_watermark ? cfg->tx_high_watermark
+                                             : cfg->tx_queue_max;
+    client->tx_low  = cfg->tx_low_watermark ? cfg->tx_low_watermark
+                                            : client->tx_high / 2;
+    if (client->tx_high > 0 && client->tx_low >= client->tx_high)
+        client->tx_low = client->tx_high - 1;
+
+    // Different per client and per process, so a fleet does not share
+    // one backoff schedule.
+    client->rng = mqtt_time_now_ms() ^ ((uint64_t)(uintptr_t)client << 16) ^
+                  ((uint64_t)getpid() << 40);
+    if (client->rng == 0) client->rng = 0x9E3779B97F4A7C15ull;
+
+    if (cfg->transport) {
+        client->transport = cfg->transport;
+    } else {
+        client->transport = cfg->tls ? mqtt_transport_tls_create(cfg->tls)
+                                     : mqtt_transport_tcp_create();
+        client->owns_transport = true;
+    }
+    if (!client->transport) {
+        mqtt_client_destroy(client);
+        return NULL;
+    }
 
+    if (cfg->store_dir && mqtt_client_open_store(client) != 0) {
+        mqtt_client_destroy(client);
+        return NULL;
+    }
     return client;
 }
 
 void mqtt_client_destroy(mqtt_client_t *client) {
     if (!client) return;
 
-    if (client->connected)
+    if (client->connected || client->connecting)
         mqtt_client_disconnect(client);
 
+    for (uint16_t i = 0; i < client->inflight.window; ++i) {
+        mqtt_inflight_msg_t *msg = &client->inflight.slots[i];
+        mqtt_pool_free(&client->pool, msg->frame, msg->frame_len);
+    }
+    while (client->offline_head) {
+        mqtt_offline_msg_t *m = client->offline_head;
+        client->offline_head = m->next;
+        mqtt_pool_free(&client->pool, m, sizeof(*m) + m->frame_len);
+    }
+    mqtt_mpsc_node_t *node;
+    while ((node = mqtt_mpsc_pop(&client->outq)) != NULL) {
+        free(node);
+    }
+    mqtt_inflight_cleanup(&client->inflight);
+    mqtt_pool_cleanup(&client->pool);
+    mqtt_store_close(client->store); // what is left there is resent next run
+    if (client->owns_transport) mqtt_transport_destroy(client->transport);
+    free(client->pending_subs);
+    mqtt_topic_trie_cleanup(&client->routes);
+    mqtt_topic_cache_cleanup(&client->topics);
+    pthread_cond_destroy(&client->tx_wait_cond);
+    pthread_mutex_destroy(&client->tx_wait_lock);
+
+    free(client->qos2_rx);
+    free(client->rx_buf);
+    free(client->tx_buf);
     free(client);
 }
 
-static uint16_t mqtt_client_get_next_packet_id(mqtt_client_t *client) {
-    uint16_t id = client->next_packet_id++;
-    if (client->next_packet_id == 0) {
-        client->next_packet_id = 1;
+/* Make sure rx_buf can hold at least `size` bytes in total. */
+static int mqtt_client_rx_reserve(mqtt_client_t *client, size_t size) {
+    if (size <= client->rx_cap) return 0;
+
+    size_t cap = client->rx_cap;
+    while (cap < size) cap *= 2;
+
+    uint8_t *p = (uint8_t *)realloc(client->rx_buf, cap);
+    if (!p) {
+        MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+        return -1;
     }
-    return id;
+    client->rx_buf = p;
+    client->rx_cap = cap;
+    return 0;
 }
 
-int mqtt_client_connect(mqtt_client_t *client) {
-    if (!client) return -1;
+/*
+ * Look for a complete frame at `offset` in the receive buffer.
+ *
+ * @return 1 = complete frame, 0 = need more bytes, -1 = protocol error
+ */
+static int mqtt_client_rx_frame_at(mqtt_client_t *client, size_t offset,
+                                   size_t *frame_len) {
+    size_t len = 0;
+    int st = mqtt_decode_frame(client->rx_buf + offset,
+                               client->rx_len - offset, &len);
+    if (st < 0) {
+        MQTT_LOG_ERROR("Malformed remaining length from broker");
+        mqtt_counter_add(&client->metrics.decode_errors, 1);
+        return -1;
+    }
+    if (len > MQTT_RX_MAX_PACKET_SIZE) {
+        MQTT_LOG_ERROR("Incoming packet too large (%zu bytes)", len);
+        mqtt_counter_add(&client->metrics.decode_errors, 1);
+        return -1;
+    }
+    if (st == 1) *frame_len = len;
+    return st;
+}
 
-    if (client->connected) {
-        fprintf(stderr, "mqtt_client_connect: already connected\n");
-        return 0;
+/* Drop `n` bytes from the front of the receive buffer. */
+static void mqtt_client_rx_consume(mqtt_client_t *client, size_t n) {
+    if (n < client->rx_len) {
+        memmove(client->rx_buf, client->rx_buf + n, client->rx_len - n);
     }
+    client->rx_len -= n;
+}
 
-    printf("Connecting to %s:%u ...\n",
-           client->cfg.host,
-           (unsigned int)client->cfg.port);
+/*
+ * Read once from the socket into the free tail of the receive buffer.
+ *
+ * @return bytes read, 0 if the connection was closed, -1 on error
+ */
+static int mqtt_client_rx_fill(mqtt_client_t *client) {
+    // If the pending partial frame announced its size, make room for all of it.
+    size_t want = client->rx_len + MQTT_RX_BUFFER_SIZE / 4;
+    size_t frame_len = 0;
+    if (mqtt_decode_frame(client->rx_buf, client->rx_len, &frame_len) == 0 &&
+        frame_len > want && frame_len <= MQTT_RX_MAX_PACKET_SIZE) {
+        want = frame_len;
+    }
+    if (mqtt_client_rx_reserve(client, want) != 0) return -1;
 
-    int sockfd = mqtt_transport_connect(client->cfg.host, client->cfg.port);
-    if (sockfd < 0) {
-        fprintf(stderr, "TCP connection failed.\n");
-        return -1;
+    int r = client->transport->ops->recv(client->transport,
+                                         client->rx_buf + client->rx_len,
+                                         client->rx_cap - client->rx_len);
+    mqtt_counter_add(&client->metrics.recv_calls, 1);
+    if (r > 0) {
+        client->rx_len += (size_t)r;
+        mqtt_counter_add(&client->metrics.bytes_in, (uint64_t)r);
     }
+    return r;
+}
 
-    client->sockfd = sockfd;
+/*
+ * Block until at least one complete frame sits at the front of the
+ * receive buffer.
+ *
+ * @return 0 on success (frame_len set), -1 on error or closed connection
+ */
+static int mqtt_client_rx_read_frame(mqtt_client_t *client, size_t *frame_len) {
+    for (;;) {
+        int st = mqtt_client_rx_frame_at(client, 0, frame_len);
+        if (st < 0) return -1;
+        if (st == 1) return 0;
 
-    // --- MQTT CONNECT ---
-    uint8_t packet[256];
-    int len = mqtt_encode_connect(packet, sizeof(packet),
-                                  client->cfg.client_id,
-                                  client->cfg.keep_alive_sec);
-    if (len < 0) {
-        fprintf(stderr, "Failed to encode CONNECT packet\n");
-        mqtt_transport_close(client->sockfd);
-        client->sockfd = -1;
-        return -1;
+        int r = mqtt_client_rx_fill(client);
+        if (r <= 0) return -1;
     }
+}
 
-    if (mqtt_transport_send(client->sockfd, packet, len) != len) {
-        fprintf(stderr, "Error sending CONNECT packet\n");
-        mqtt_transport_close(client->sockfd);
-        client->sockfd = -1;
-        return -1;
+/* One transport sendv(), counted. */
+static int mqtt_client_sendv(mqtt_client_t *client,
+                             const mqtt_iovec_t *iov, size_t iovcnt) {
+    int sent = client->transport->ops->sendv(client->transport, iov, iovcnt);
+    mqtt_counter_add(&client->metrics.send_calls, 1);
+    if (sent > 0) mqtt_counter_add(&client->metrics.bytes_out, (uint64_t)sent);
+    else if (sent == MQTT_TRANSPORT_WOULD_BLOCK)
+        mqtt_counter_add(&client->metrics.send_would_block, 1);
+    return sent;
+}
+
+/*
+ * Send a packet made of several buffers, resuming after short writes.
+ * The iovec array is modified while doing so.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int mqtt_client_sendv_all(mqtt_client_t *client,
+                                 mqtt_iovec_t *iov, size_t iovcnt) {
+    while (iovcnt > 0) {
+        int sent = mqtt_client_sendv(client, iov, iovcnt);
+        if (sent <= 0) return -1;
+
+        size_t n = (size_t)sent;
+        while (iovcnt > 0 && n >= iov->len) {
+            n -= iov->len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->base = (const uint8_t *)iov->base + n;
+            iov->len -= n;
+        }
     }
+    return 0;
+}
 
-    uint8_t resp[4];
-    int r = mqtt_transport_recv(client->sockfd, resp, sizeof(resp));
-    if (r <= 0) {
-        fprintf(stderr, "Error receiving CONNACK\n");
-        mqtt_transport_close(client->sockfd);
-        client->sockfd = -1;
-        return -1;
+/*
+ * Where the first frame in tx_buf not yet started on the wire begins;
+ * the one before it may be partly sent. Advances tx_mark to there.
+ */
+static size_t mqtt_client_tx_head_end(mqtt_client_t *client) {
+    while (client->tx_mark < client->tx_off) {
+        size_t frame_len = 0;
+        if (mqtt_decode_frame(client->tx_buf + client->tx_mark,
+                              client->tx_len - client->tx_mark, &frame_len) < 0 ||
+            frame_len == 0) {
+            client->tx_mark = client->tx_len; // not our framing; drop nothing
+            break;
+        }
+        client->tx_mark += frame_len;
     }
+    return client->tx_mark;
+}
 
-    if (mqtt_decode_connack(resp, r) != 0) {
-        fprintf(stderr, "Invalid CONNACK response\n");
-        mqtt_transport_close(client->sockfd);
-        client->sockfd = -1;
-        return -1;
+/*
+ * Bytes from `offset` into the frames in iov to the end of the frame
+ * that offset falls in: 0 if a frame starts right there.
+ */
+static size_t mqtt_client_iov_frame_rest(const mqtt_iovec_t *iov, size_t iovcnt,
+                                         size_t offset) {
+    size_t frame = 0;   // stream offset of the current frame
+    size_t base = 0;    // stream offset of iov[0]
+
+    while (frame < offset) {
+        // Its fixed header may straddle buffers: gather up to 5 bytes.
+        while (iovcnt > 0 && base + iov->len <= frame) {
+            base += iov->len;
+            iov++;
+            iovcnt--;
+        }
+        uint8_t hdr[5];
+        size_t got = 0, skip = frame - base;
+        for (size_t i = 0; i < iovcnt && got < sizeof(hdr); ++i, skip = 0) {
+            size_t n = iov[i].len - skip;
+            if (n > sizeof(hdr) - got) n = sizeof(hdr) - got;
+            memcpy(hdr + got, (const uint8_t *)iov[i].base + skip, n);
+            got += n;
+        }
+
+        size_t frame_len = 0;
+        if (mqtt_decode_frame(hdr, got, &frame_len) < 0 || frame_len == 0) return 0;
+        frame += frame_len;
+    }
+    return frame - offset;
+}
+
+/* Make sure tx_buf can take `extra` more bytes after the queued ones. */
+static int mqtt_client_tx_reserve(mqtt_client_t *client, size_t extra) {
+    // Reclaim the already-sent prefix before growing.
+    if (client->tx_off > 0) {
+        size_t head = mqtt_client_tx_head_end(client);
+        memmove(client->tx_buf, client->tx_buf + client->tx_off,
+                client->tx_len - client->tx_off);
+        client->tx_len -= client->tx_off;
+        client->tx_mark = head - client->tx_off;
+        client->tx_off = 0;
     }
 
-    printf("CONNACK received → MQTT CONNECT success!\n");
+    size_t size = client->tx_len + extra;
+    if (size <= client->tx_cap) return 0;
 
-    client->connected = true;
+    size_t cap = client->tx_cap ? client->tx_cap : MQTT_BATCH_FLUSH_BYTES_DEFAULT;
+    while (cap < size) cap *= 2;
+
+    uint8_t *p = (uint8_t *)realloc(client->tx_buf, cap);
+    if (!p) {
+        MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+        return -1;
+    }
+    client->tx_buf = p;
+    client->tx_cap = cap;
     return 0;
 }
 
-void mqtt_client_disconnect(mqtt_client_t *client) {
-    if (!client) return;
-    if (!client->connected) return;
-
-    printf("Closing TCP connection.\n");
-    mqtt_transport_close(client->sockfd);
+static int mqtt_client_tx_append(mqtt_client_t *client,
+                                 const void *data, size_t len) {
+    if (mqtt_client_tx_reserve(client, len) != 0) return -1;
+    memcpy(client->tx_buf + client->tx_len, data, len);
+    client->tx_len += len;
+    return 0;
+}
 
-    client->sockfd = -1;
-    client->connected = false;
+/* Outbound backlog as tx_queue_max counts it. Any thread. */
+static size_t mqtt_client_tx_backlog(const mqtt_client_t *client) {
+    return (size_t)mqtt_counter_get(&client->metrics.tx_buffered_bytes) +
+           atomic_load_explicit(&client->outq_bytes, memory_order_relaxed);
 }
 
-int mqtt_client_loop(mqtt_client_t *client) {
-    if (!client || !client->connected) {
-        fprintf(stderr, "mqtt_client_loop: not connected\n");
-        return -1;
+/*
+ * The backlog moved: publish the gauge, tell on_tx_pressure when a
+ * watermark was crossed and wake producers waiting for room.
+ */
+static void mqtt_client_tx_changed(mqtt_client_t *client) {
+    mqtt_counter_set(&client->metrics.tx_buffered_bytes, client->tx_len - client->tx_off);
+    if (client->tx_high == 0 && client->cfg.tx_overflow != MQTT_TX_OVERFLOW_BLOCK)
+        return;
+
+    size_t backlog = mqtt_client_tx_backlog(client);
+    if (client->tx_high > 0) {
+        bool congested = client->tx_congested ? backlog > client->tx_low
+                                              : backlog >= client->tx_high;
+        if (congested != client->tx_congested) {
+            client->tx_congested = congested;
+            if (client->cfg.on_tx_pressure)
+                client->cfg.on_tx_pressure(client, congested, client->cfg.user_data);
+        }
     }
 
-    uint8_t buf[MQTT_RX_BUFFER_SIZE];
+    // Pairs with the fence in mqtt_client_tx_wait(): either the producer
+    // sees the smaller backlog or we see it waiting.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&client->tx_waiters, memory_order_relaxed) > 0) {
+        pthread_mutex_lock(&client->tx_wait_lock);
+        pthread_cond_broadcast(&client->tx_wait_cond);
+        pthread_mutex_unlock(&client->tx_wait_lock);
+    }
+}
 
-    int r = mqtt_transport_recv(client->sockfd, buf, sizeof(buf));
-    if (r < 0) {
-        fprintf(stderr, "Error receiving data\n");
-        return -1;
+/*
+ * Send a packet made of several buffers. Bytes already queued in tx_buf
+ * go first, in the same system call, so packet order is preserved.
+ *
+ * On a blocking socket this returns once everything is sent. On a
+ * non-blocking socket it writes what the socket accepts and copies the
+ * rest into tx_buf; mqtt_client_process_write() finishes the job.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int mqtt_client_write(mqtt_client_t *client,
+                             const mqtt_iovec_t *iov, size_t iovcnt) {
+    mqtt_iovec_t vec[MQTT_CLIENT_MAX_IOV + 1];
+    size_t queued = client->tx_len - client->tx_off;
+    size_t n = 0;
+
+    if (iovcnt > MQTT_CLIENT_MAX_IOV) return -1;
+
+    if (queued > 0) {
+        vec[n].base = client->tx_buf + client->tx_off;
+        vec[n].len  = queued;
+        n++;
     }
-    if (r == 0) {
-        fprintf(stderr, "Connection closed by broker\n");
-        return -1;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        if (iov[i].len > 0) vec[n++] = iov[i];
     }
+    if (n == 0) return 0;
 
-    uint8_t packet_type = buf[0] >> 4;
+    if (!client->nonblocking) {
+        int rc = mqtt_client_sendv_all(client, vec, n);
+        client->tx_len = 0;
+        client->tx_off = 0;
+        client->tx_mark = 0;
+        mqtt_client_tx_changed(client);
+        if (rc == 0) client->last_tx_ms = mqtt_time_now_ms();
+        return rc;
+    }
 
-    if (packet_type == 3) { // PUBLISH
-        char topic[256];
-        const uint8_t *payload = NULL;
-        size_t payload_len = 0;
-
-        if (mqtt_decode_publish_qos0(buf, (size_t)r,
-                                     topic, sizeof(topic),
-                                     &payload, &payload_len) == 0) {
-            printf("Incoming PUBLISH: topic='%s', payload_len=%zu\n",
-                   topic, payload_len);
-            if (client->cfg.on_message) {
-                client->cfg.on_message(topic, payload, payload_len);
-            }
-        } else {
-            fprintf(stderr, "Failed to decode PUBLISH packet\n");
+    // A short write need not mean the socket is full (the transport may
+    // cap iovecs or TLS records per call), and with edge-triggered
+    // readiness no further event would come: keep going until it is.
+    mqtt_iovec_t *v = vec;
+    size_t vn = n;
+    bool progressed = false;
+    while (vn > 0) {
+        int sent = mqtt_client_sendv(client, v, vn);
+        if (sent == MQTT_TRANSPORT_WOULD_BLOCK || sent == 0) break;
+        if (sent < 0) return -1;
+        progressed = true;
+
+        size_t done = (size_t)sent;
+        while (vn > 0 && done >= v->len) {
+            done -= v->len;
+            v++;
+            vn--;
         }
-    } else if (packet_type == 13) { // PINGRESP
-        printf("PINGRESP received (not used yet).\n");
+        if (vn > 0) {
+            v->base = (const uint8_t *)v->base + done;
+            v->len -= done;
+        }
+    }
+    if (progressed) client->last_tx_ms = mqtt_time_now_ms();
+
+    if (queued > 0 && v == vec) {
+        // Part of tx_buf itself is still unsent.
+        client->tx_off = client->tx_len - v->len;
+        v++;
+        vn--;
     } else {
-        printf("Received packet type %u (ignored in this simple client)\n",
-               packet_type);
+        // The leftover may start inside a frame; note where the next
+        // whole one begins.
+        size_t left = 0, total = 0;
+        for (size_t i = 0; i < vn; ++i) left += v[i].len;
+        for (size_t i = 0; i < iovcnt; ++i) total += iov[i].len;
+        client->tx_mark = left > 0 ? mqtt_client_iov_frame_rest(iov, iovcnt, total - left)
+                                   : 0;
+        client->tx_len = 0;
+        client->tx_off = 0;
+    }
+
+    // Keep whatever the socket did not take, in order.
+    for (; vn > 0; v++, vn--) {
+        if (mqtt_client_tx_append(client, v->base, v->len) != 0) return -1;
     }
 
+    client->tx_blocked = client->tx_len > client->tx_off;
+    mqtt_client_tx_changed(client);
     return 0;
 }
 
-int mqtt_client_publish_qos0(mqtt_client_t *client,
-                             const char *topic,
-                             const uint8_t *payload,
-                             size_t payload_len) {
-    if (!client || !client->connected) {
-        fprintf(stderr, "mqtt_client_publish_qos0: not connected\n");
-        return -1;
+/* Push everything queued in tx_buf out. */
+static int mqtt_client_tx_flush(mqtt_client_t *client) {
+    return mqtt_client_write(client, NULL, 0);
+}
+
+/*
+ * While batching the socket is corked, and the kernel may hold a
+ * partial segment back for up to 200 ms. Send it now, staying corked
+ * for what follows.
+ */
+static void mqtt_client_tx_push(mqtt_client_t *client) {
+    if (client->batching) mqtt_transport_push(mqtt_client_fd(client));
+}
+
+/* Flush tx_buf for a deadline: the bytes must reach the wire now. */
+static int mqtt_client_tx_flush_now(mqtt_client_t *client) {
+    int rc = mqtt_client_tx_flush(client);
+    mqtt_client_tx_push(client);
+    return rc;
+}
+
+/*
+ * Send one packet, honouring batch mode. While batching, small packets
+ * are appended to tx_buf; large ones are not copied but go out together
+ * with the pending batch bytes in one sendmsg().
+ */
+static int mqtt_client_send_packet(mqtt_client_t *client,
+                                   const mqtt_iovec_t *iov, size_t iovcnt) {
+    mqtt_client_count_out(client, *(const uint8_t *)iov[0].base);
+    if (!client->batching) return mqtt_client_write(client, iov, iovcnt);
+
+    size_t frame_len = 0;
+    for (size_t i = 0; i < iovcnt; ++i) frame_len += iov[i].len;
+
+    if (frame_len >= client->batch_flush_bytes) {
+        return mqtt_client_write(client, iov, iovcnt);
     }
 
-    uint8_t packet[512];
-    int len = mqtt_encode_publish_qos0(packet, sizeof(packet),
-                                       topic, payload, payload_len);
-    if (len < 0) {
-        fprintf(stderr, "Failed to encode PUBLISH packet\n");
+    uint64_t now = mqtt_time_now_ms();
+    bool starts_batch = client->tx_len == client->tx_off;
+    if (starts_batch) client->batch_started_ms = now;
+
+    if (mqtt_client_tx_reserve(client, frame_len) != 0)
         return -1;
+    for (size_t i = 0; i < iovcnt; ++i) {
+        if (iov[i].len == 0) continue;
+        memcpy(client->tx_buf + client->tx_len, iov[i].base, iov[i].len);
+        client->tx_len += iov[i].len;
     }
 
-    int sent = mqtt_transport_send(client->sockfd, packet, len);
-    if (sent != len) {
-        fprintf(stderr, "Failed to send full PUBLISH packet\n");
-        return -1;
+    if (client->cfg.batch_flush_interval_ms > 0 &&
+        now - client->batch_started_ms >= client->cfg.batch_flush_interval_ms) {
+        return mqtt_client_tx_flush_now(client);
+    }
+    if (client->tx_len - client->tx_off >= client->batch_flush_bytes) {
+        return mqtt_client_tx_flush(client);
     }
 
-    printf("PUBLISH sent to topic '%s', payload_len=%zu\n", topic, payload_len);
+    mqtt_client_tx_changed(client);
+
+    // The flush interval now sets the next deadline.
+    if (starts_batch && client->cfg.batch_flush_interval_ms > 0 &&
+        client->deadline_hook) {
+        client->deadline_hook(client, client->deadline_hook_ctx);
+    }
     return 0;
 }
 
-int mqtt_client_subscribe_qos0(mqtt_client_t *client,
-                               const char *topic) {
-    if (!client || !client->connected) {
-        fprintf(stderr, "mqtt_client_subscribe_qos0: not connected\n");
-        return -1;
+/* QoS 0 PUBLISH, the only packets backpressure may discard. */
+static bool mqtt_client_droppable(uint8_t header) {
+    return (header & 0xF6) == 0x30;
+}
+
+/*
+ * Discard queued QoS 0 PUBLISH frames, oldest first, until `excess`
+ * bytes are gone or none are left: from tx_buf, sparing a frame already
+ * started on the wire and other packet types, then from the concurrent
+ * publish queue. Runs on the driving thread.
+ */
+static void mqtt_client_tx_drop(mqtt_client_t *client, size_t excess) {
+    size_t dropped = 0, count = 0;
+    size_t pos = mqtt_client_tx_head_end(client);
+    size_t run = 0;     // droppable bytes just before pos
+
+    for (;;) {
+        size_t frame_len = 0;
+        bool more = pos < client->tx_len &&
+                    mqtt_decode_frame(client->tx_buf + pos, client->tx_len - pos,
+                                      &frame_len) == 1;
+        if (more && dropped + run < excess &&
+            mqtt_client_droppable(client->tx_buf[pos])) {
+            run += frame_len;
+            pos += frame_len;
+            count++;
+            continue;
+        }
+        if (run > 0) {
+            // Slide what is kept ahead of the run (usually just the
+            // partly sent head frame) over it.
+            size_t start = pos - run;
+            memmove(client->tx_buf + client->tx_off + run,
+                    client->tx_buf + client->tx_off, start - client->tx_off);
+            client->tx_off  += run;
+            client->tx_mark += run;
+            dropped += run;
+            run = 0;
+            if (client->tx_off == client->tx_len) {
+                client->tx_off = client->tx_len = client->tx_mark = 0;
+                client->tx_blocked = false;
+            }
+        }
+        if (!more || dropped >= excess) break;
+        pos += frame_len;
     }
 
-    uint8_t packet[256];
-    uint16_t packet_id = mqtt_client_get_next_packet_id(client);
+    mqtt_mpsc_node_t *node;
+    while (dropped < excess && (node = mqtt_mpsc_pop(&client->outq)) != NULL) {
+        mqtt_queued_frame_t *f = (mqtt_queued_frame_t *)node;
+        atomic_fetch_sub_explicit(&client->outq_bytes, f->frame_len,
+                                  memory_order_relaxed);
+        dropped += f->frame_len;
+        count++;
+        free(f);
+    }
 
-    int len = mqtt_encode_subscribe_qos0(packet, sizeof(packet),
-                                         packet_id, topic);
-    if (len < 0) {
-        fprintf(stderr, "Failed to encode SUBSCRIBE packet\n");
-        return -1;
+    if (count > 0) {
+        MQTT_LOG_DEBUG("Send queue full, dropped %zu QoS 0 messages", count);
+        mqtt_counter_add(&client->metrics.tx_dropped, count);
+        mqtt_client_tx_changed(client);
+    }
+}
+
+/*
+ * Apply the limits after producers pushed the backlog past a watermark
+ * or tx_queue_max. Runs on the driving thread.
+ */
+static void mqtt_client_tx_recheck(mqtt_client_t *client) {
+    if (!atomic_load_explicit(&client->tx_recheck, memory_order_relaxed) ||
+        !atomic_exchange(&client->tx_recheck, false)) {
+        return;
+    }
+
+    size_t max = client->cfg.tx_queue_max;
+    size_t backlog = mqtt_client_tx_backlog(client);
+    if (client->cfg.tx_overflow == MQTT_TX_OVERFLOW_DROP_OLDEST && max > 0 &&
+        backlog > max) {
+        mqtt_client_tx_drop(client, backlog - max);
+    }
+    mqtt_client_tx_changed(client);
+}
+
+/*
+ * Mark the concurrent publish queue as having work and, unless someone
+ * already did, tell the writer through the wakeup hook.
+ */
+static void mqtt_client_signal_writer(mqtt_client_t *client, bool wake) {
+    // A plain load first keeps producers from bouncing the cache line
+    // while the writer is already on its way.
+    if (atomic_load(&client->outq_signaled) ||
+        atomic_exchange(&client->outq_signaled, true) || !wake) {
+        return;
+    }
+
+    mqtt_client_wakeup_hook_t hook =
+        atomic_load_explicit(&client->wakeup_hook, memory_order_acquire);
+    if (hook) {
+        hook(client, atomic_load_explicit(&client->wakeup_hook_ctx,
+                                          memory_order_relaxed));
+    }
+}
+
+/*
+ * Send frames queued by mqtt_client_publish_concurrent(), a batch per
+ * vectored write, until the queue is empty or the socket is full. Runs
+ * on the thread driving the client.
+ *
+ * A batch is up to batch_flush_bytes of small frames coalesced in
+ * tx_buf, followed by larger frames sent straight from their buffers.
+ *
+ * @return 0 on success, -1 on a write error
+ */
+static int mqtt_client_drain_queue(mqtt_client_t *client) {
+    mqtt_client_tx_recheck(client);
+    if (!client->connected || client->tx_blocked) return 0;
+    if (!atomic_load_explicit(&client->outq_signaled, memory_order_relaxed)) return 0;
+
+    // Cleared before popping: a producer that pushes after this point
+    // signals again, so nothing is left behind unnoticed.
+    atomic_store(&client->outq_signaled, false);
+
+    size_t budget = MQTT_CLIENT_QUEUE_BUDGET;
+    for (;;) {
+        mqtt_queued_frame_t *batch[MQTT_CLIENT_MAX_IOV];
+        mqtt_iovec_t iov[MQTT_CLIENT_MAX_IOV];
+        mqtt_mpsc_node_t *node;
+        size_t n = 0, popped = 0, copied = 0, bytes = 0;
+        int rc = 0;
+        while (n < MQTT_CLIENT_MAX_IOV && copied < client->batch_flush_bytes &&
+               (node = mqtt_mpsc_pop(&client->outq)) != NULL) {
+            mqtt_queued_frame_t *f = (mqtt_queued_frame_t *)node;
+            mqtt_client_count_out(client, f->frame[0]);
+            bytes += f->frame_len;
+            popped++;
+
+            // Only ahead of the first iovec, so the order is kept.
+            if (n == 0 && f->frame_len <= MQTT_CLIENT_QUEUE_COPY_MAX) {
+                rc = mqtt_client_tx_append(client, f->frame, f->frame_len);
+                copied += f->frame_len;
+                free(f);
+                if (rc != 0) break;
+                continue;
+            }
+            batch[n] = f;
+            iov[n].base = f->frame;
+            iov[n].len  = f->frame_len;
+            n++;
+        }
+        if (popped == 0) return 0;
+        atomic_fetch_sub_explicit(&client->outq_bytes, bytes, memory_order_relaxed);
+
+        // Whatever the socket does not take is copied to tx_buf.
+        if (rc == 0) rc = mqtt_client_write(client, iov, n);
+        for (size_t i = 0; i < n; ++i) free(batch[i]);
+
+        // Frames may be left: a full socket or a reconnect brings the
+        // writer back by itself, a spent budget needs a wakeup.
+        if (rc != 0 || client->tx_blocked) {
+            mqtt_client_signal_writer(client, false);
+            return rc;
+        }
+        if (budget <= popped) {
+            mqtt_client_signal_writer(client, true);
+            return 0;
+        }
+        budget -= popped;
+    }
+}
+
+/*
+ * MQTT_TX_OVERFLOW_BLOCK on the driving thread: push queued data out,
+ * waiting for the socket, until `len` more bytes fit.
+ *
+ * @return 0 once they fit, MQTT_CLIENT_ERR_QUEUE_FULL on timeout,
+ *         -1 on a write error
+ */
+static int mqtt_client_tx_make_room(mqtt_client_t *client, size_t len) {
+    size_t max = client->cfg.tx_queue_max;
+    uint32_t limit = client->cfg.tx_block_timeout_ms;
+    uint64_t start = mqtt_time_now_ms();
+
+    for (;;) {
+        if ((client->tx_len > client->tx_off && mqtt_client_tx_flush(client) != 0) ||
+            mqtt_client_drain_queue(client) != 0) {
+            return -1;
+        }
+        size_t backlog = mqtt_client_tx_backlog(client);
+        if (backlog == 0 || backlog + len <= max) return 0;
+
+        int wait = -1;
+        if (limit > 0) {
+            uint64_t waited = mqtt_time_now_ms() - start;
+            if (waited >= limit) return MQTT_CLIENT_ERR_QUEUE_FULL;
+            wait = (int)(limit - waited);
+        }
+        mqtt_transport_t *t = client->transport;
+        int r = mqtt_transport_wait_writable(t->ops->fd(t), wait);
+        if (r < 0) return -1;
+        if (r == 0) return MQTT_CLIENT_ERR_QUEUE_FULL;
     }
+}
+
+/*
+ * Admit a `len`-byte PUBLISH from the driving thread under tx_queue_max,
+ * as tx_overflow says.
+ *
+ * @return 0 if admitted, MQTT_CLIENT_ERR_QUEUE_FULL, or -1 on a write
+ *         error
+ */
+static int mqtt_client_tx_admit(mqtt_client_t *client, size_t len) {
+    size_t max = client->cfg.tx_queue_max;
+    if (max == 0 || !client->connected) return 0;
+
+    size_t backlog = mqtt_client_tx_backlog(client);
+    if (backlog == 0 || backlog + len <= max) return 0;
+
+    if (client->cfg.tx_overflow == MQTT_TX_OVERFLOW_DROP_OLDEST) {
+        mqtt_client_tx_drop(client, backlog + len - max);
+        backlog = mqtt_client_tx_backlog(client);
+        if (backlog == 0 || backlog + len <= max) return 0;
+    } else if (client->cfg.tx_overflow == MQTT_TX_OVERFLOW_BLOCK) {
+        int rc = mqtt_client_tx_make_room(client, len);
+        if (rc != MQTT_CLIENT_ERR_QUEUE_FULL) return rc;
+    }
+
+    atomic_fetch_add_explicit(&client->metrics.tx_rejected, 1, memory_order_relaxed);
+    return MQTT_CLIENT_ERR_QUEUE_FULL;
+}
+
+/*
+ * MQTT_TX_OVERFLOW_BLOCK on a producer thread: sleep until the driving
+ * thread has made room for `len` more bytes.
+ *
+ * @return 0 once they fit, MQTT_CLIENT_ERR_QUEUE_FULL on timeout
+ */
+static int mqtt_client_tx_wait(mqtt_client_t *client, size_t len) {
+    size_t max = client->cfg.tx_queue_max;
+    uint32_t limit = client->cfg.tx_block_timeout_ms;
+    struct timespec deadline;
+
+    if (limit > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec  += limit / 1000;
+        deadline.tv_nsec += (long)(limit % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    int rc = 0;
+    pthread_mutex_lock(&client->tx_wait_lock);
+    atomic_fetch_add(&client->tx_waiters, 1);
+    for (;;) {
+        // Pairs with the fence in mqtt_client_tx_changed().
+        atomic_thread_fence(memory_order_seq_cst);
+        size_t backlog = mqtt_client_tx_backlog(client);
+        if (backlog == 0 || backlog + len <= max) break;
+
+        int r = limit > 0 ? pthread_cond_timedwait(&client->tx_wait_cond,
+                                                   &client->tx_wait_lock, &deadline)
+                          : pthread_cond_wait(&client->tx_wait_cond, &client->tx_wait_lock);
+        if (r == ETIMEDOUT) {
+            rc = MQTT_CLIENT_ERR_QUEUE_FULL;
+            break;
+        }
+    }
+    atomic_fetch_sub(&client->tx_waiters, 1);
+    pthread_mutex_unlock(&client->tx_wait_lock);
+    return rc;
+}
 
-    if (mqtt_transport_send(client->sockfd, packet, len) != len) {
-        fprintf(stderr, "Failed to send SUBSCRIBE packet\n");
+/* SUBSCRIBE/UNSUBSCRIBE ids; the range below belongs to in-flight PUBLISH. */
+static uint16_t mqtt_client_get_next_packet_id(mqtt_client_t *client) {
+    uint16_t id = client->next_packet_id++;
+    if (client->next_packet_id == 0) {
+        client->next_packet_id = MQTT_INFLIGHT_MAX_PACKET_ID + 1;
+    }
+    return id;
+}
+
+/*
+ * Append our CONNECT packet to tx_buf, which is sized for it exactly
+ * (a will payload may make it large).
+ *
+ * @return packet length, or -1 on error
+ */
+static int mqtt_client_encode_connect(mqtt_client_t *client) {
+    const mqtt_client_config_t *cfg = &client->cfg;
+    mqtt_connect_options_t opts = {
+        .client_id        = cfg->client_id,
+        .keep_alive       = cfg->keep_alive_sec,
+        .clean_session    = !cfg->persistent_session,
+        .username         = cfg->username,
+        .password         = cfg->password,
+        .will_topic       = cfg->will_topic,
+        .will_payload     = cfg->will_payload,
+        .will_payload_len = cfg->will_payload_len,
+        .will_qos         = cfg->will_qos,
+        .will_retain      = cfg->will_retain,
+    };
+    size_t size = mqtt_encode_connect_size(&opts);
+    if (size == 0) {
+        MQTT_LOG_ERROR("Invalid CONNECT options");
         return -1;
     }
+    if (mqtt_client_tx_reserve(client, size) != 0) return -1;
 
-    // Wait for SUBACK (very simple, blocking)
-    uint8_t resp[16];
-    int r = mqtt_transport_recv(client->sockfd, resp, sizeof(resp));
-    if (r <= 0) {
-        fprintf(stderr, "Error receiving SUBACK\n");
+    uint8_t *buf = client->tx_buf + client->tx_len;
+    int len = mqtt_encode_connect_ex(buf, size, &opts);
+    if (len < 0) {
+        MQTT_LOG_ERROR("Failed to encode CONNECT packet");
         return -1;
     }
+    mqtt_client_count_out(client, buf[0]);
+    client->tx_len += (size_t)len;
+    return len;
+}
 
-    if (mqtt_decode_suback(resp, (size_t)r) != 0) {
-        fprintf(stderr, "SUBACK decode failed\n");
+/*
+ * Take the CONNACK at the front of the receive buffer. Anything the
+ * broker sent right after it stays buffered for the loop.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int mqtt_client_handle_connack(mqtt_client_t *client, size_t frame_len) {
+    uint8_t return_code = 0;
+    mqtt_counter_add(&client->metrics.packets_in[client->rx_buf[0] >> 4], 1);
+    if (mqtt_decode_connack_ex(client->rx_buf, frame_len,
+                               &client->session_present, &return_code) != 0) {
+        MQTT_LOG_ERROR("Invalid CONNACK response");
+        mqtt_counter_add(&client->metrics.decode_errors, 1);
         return -1;
     }
+    mqtt_client_rx_consume(client, frame_len);
+
+    // A new session forgets which QoS 2 messages the old one delivered.
+    if (!client->session_present && client->qos2_rx) {
+        memset(client->qos2_rx, 0, 65536 / 8);
+    }
 
-    printf("SUBACK received → subscription to '%s' successful.\n", topic);
+    MQTT_LOG_INFO("CONNACK received → MQTT CONNECT success!%s",
+                  client->session_present ? " (session present)" : "");
     return 0;
 }
 
+/*
+ * TCP connect, CONNECT and CONNACK. On failure the socket is closed
+ * again and the client left disconnected.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int mqtt_client_open(mqtt_client_t *client) {
+    MQTT_LOG_INFO("Connecting to %s:%u ...",
+                  client->cfg.host,
+                  (unsigned int)client->cfg.port);
+
+    mqtt_transport_t *t = client->transport;
+    if (t->ops->connect(t, client->cfg.host, client->cfg.port) != 0) {
+        MQTT_LOG_ERROR("Connection failed (%s).", t->ops->name);
+        return -1;
+    }
+
+    // --- MQTT CONNECT ---
+    int len = mqtt_client_encode_connect(client);
+    if (len < 0) {
+        t->ops->close(t);
+        return -1;
+    }
+
+    mqtt_counter_add(&client->metrics.send_calls, 1);
+    int sent = t->ops->send(t, client->tx_buf + client->tx_off, (size_t)len);
+    client->tx_off = client->tx_len = client->tx_mark = 0;
+    if (sent != len) {
+        MQTT_LOG_ERROR("Error sending CONNECT packet");
+        t->ops->close(t);
+        return -1;
+    }
+    mqtt_counter_add(&client->metrics.bytes_out, (uint64_t)len);
+
+    client->rx_len = 0;
+
+    size_t frame_len = 0;
+    if (mqtt_client_rx_read_frame(client, &frame_len) != 0) {
+        MQTT_LOG_ERROR("Error receiving CONNACK");
+        t->ops->close(t);
+        return -1;
+    }
+    if (mqtt_client_handle_connack(client, frame_len) != 0) {
+        t->ops->close(t);
+        return -1;
+    }
+
+    if (client->nonblocking &&
+        mqtt_transport_set_nonblocking(t->ops->fd(t), true) != 0) {
+        t->ops->close(t);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * One step of a non-blocking connect: transport connect (and any
+ * handshake), then CONNECT, then CONNACK, each as far as the socket
+ * allows.
+ *
+ * @return 0 once CONNACK is in, MQTT_TRANSPORT_WOULD_BLOCK while in
+ *         progress, -1 on error
+ */
+static int mqtt_client_connect_step(mqtt_client_t *client) {
+    mqtt_transport_t *t = client->transport;
+
+    if (!client->connack_pending) {
+        int rc = t->ops->connect_continue(t);
+        if (rc == MQTT_TRANSPORT_WOULD_BLOCK) return rc;
+        if (rc != 0) {
+            MQTT_LOG_ERROR("Connection failed (%s).", t->ops->name);
+            return -1;
+        }
+
+        if (mqtt_client_encode_connect(client) < 0) return -1;
+
+        client->connack_pending = true;
+        client->rx_len = 0;
+        if (mqtt_client_tx_flush(client) != 0) {
+            MQTT_LOG_ERROR("Error sending CONNECT packet");
+            return -1;
+        }
+    } else if (client->tx_blocked && mqtt_client_tx_flush(client) != 0) {
+        MQTT_LOG_ERROR("Error sending CONNECT packet");
+        return -1;
+    }
+
+    for (;;) {
+        size_t frame_len = 0;
+        int st = mqtt_client_rx_frame_at(client, 0, &frame_len);
+        if (st < 0) return -1;
+        if (st == 1) return mqtt_client_handle_connack(client, frame_len);
+
+        int r = mqtt_client_rx_fill(client);
+        if (r == MQTT_TRANSPORT_WOULD_BLOCK) return r;
+        if (r <= 0) {
+            MQTT_LOG_ERROR("Error receiving CONNACK");
+            return -1;
+        }
+    }
+}
+
+static int mqtt_client_seq_cmp(const void *a, const void *b) {
+    const mqtt_inflight_msg_t *x = *(const mqtt_inflight_msg_t *const *)a;
+    const mqtt_inflight_msg_t *y = *(const mqtt_inflight_msg_t *const *)b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+/*
+ * Resend what the previous connection left unfinished, in publish
+ * order: unacknowledged QoS 1/2 messages (as DUP, or PUBREL for QoS 2
+ * messages past PUBREC, when the session was resumed) merged with the
+ * QoS 0 messages queued while offline. Everything is appended to tx_buf
+ * and goes out with a single flush.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int mqtt_client_replay(mqtt_client_t *client) {
+    size_t n = mqtt_inflight_count(&client->inflight);
+    mqtt_inflight_msg_t **msgs = NULL;
+
+    if (n > 0) {
+        msgs = (mqtt_inflight_msg_t **)malloc(n * sizeof(*msgs));
+        if (!msgs) {
+            MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+            return -1;
+        }
+        size_t k = 0;
+        for (uint16_t i = 0; i < client->inflight.window && k < n; ++i) {
+            if (client->inflight.slots[i].state != MQTT_INFLIGHT_FREE)
+                msgs[k++] = &client->inflight.slots[i];
+        }
+        qsort(msgs, k, sizeof(*msgs), mqtt_client_seq_cmp);
+        n = k;
+    }
+
+    uint64_t now = mqtt_time_now_ms();
+    uint64_t offline_seq = 0;
+    size_t replayed = 0;
+    size_t k = 0;
+    int rc = 0;
+
+    // A message whose append fails stays queued, in memory and on disk.
+    while (k < n || client->offline_head) {
+        mqtt_offline_msg_t *off = client->offline_head;
+
+        if (off && (k == n || off->seq < msgs[k]->seq)) {
+            rc = mqtt_client_tx_append(client, off->frame, off->frame_len);
+            if (rc != 0) break;
+            mqtt_client_count_out(client, off->frame[0]);
+            offline_seq = off->seq;
+            client->offline_head = off->next;
+            client->offline_count--;
+            mqtt_pool_free(&client->pool, off, sizeof(*off) + off->frame_len);
+            replayed++;
+            continue;
+        }
+
+        mqtt_inflight_msg_t *msg = msgs[k];
+        if (msg->state == MQTT_INFLIGHT_WAIT_PUBCOMP) {
+            if (!client->session_present) {
+                // The broker took ownership with its PUBREC; the session
+                // that would complete the exchange is gone.
+                uint16_t packet_id = msg->packet_id;
+                k++;
+                mqtt_inflight_release(&client->inflight, msg);
+                if (client->store) mqtt_store_release(client->store, packet_id);
+                if (client->cfg.on_delivered) {
+                    client->cfg.on_delivered(packet_id, client->cfg.user_data);
+                }
+                continue;
+            }
+            uint8_t pubrel[4];
+            mqtt_encode_ack(pubrel, sizeof(pubrel), 0x62, msg->packet_id);
+            rc = mqtt_client_tx_append(client, pubrel, sizeof(pubrel));
+            if (rc != 0) break;
+            mqtt_client_count_out(client, pubrel[0]);
+        } else {
+            // DUP only tells a resumed session it may have seen this before.
+            if (client->session_present && msg->sent) msg->frame[0] |= 0x08;
+            else                                      msg->frame[0] &= (uint8_t)~0x08;
+            rc = mqtt_client_tx_append(client, msg->frame, msg->frame_len);
+            if (rc != 0) break;
+            mqtt_client_count_out(client, msg->frame[0]);
+        }
+        k++;
+        msg->sent = true;
+        msg->sent_ms = now;
+        replayed++;
+    }
+    free(msgs);
+
+    if (client->offline_head == NULL) client->offline_tail = NULL;
+    mqtt_client_update_gauges(client);
+    if (client->store && offline_seq != 0 &&
+        mqtt_store_release_offline(client->store, offline_seq) != 0) {
+        MQTT_LOG_ERROR("Failed to update the message store");
+    }
+    if (rc != 0) return -1;
+
+    if (replayed > 0) {
+        MQTT_LOG_INFO("Replaying %zu queued message(s)", replayed);
+        return mqtt_client_tx_flush(client);
+    }
+    return 0;
+}
+
+/* The handshake succeeded: reset connection state and replay. */
+static int mqtt_client_established(mqtt_client_t *client) {
+    client->connected = true;
+    client->reconnecting = false;
+    client->reconnect_attempts = 0;
+    client->last_tx_ms = mqtt_time_now_ms();
+    client->ping_outstanding = false;
+
+    if (mqtt_client_replay(client) != 0 || mqtt_client_drain_queue(client) != 0) {
+        MQTT_LOG_ERROR("Failed to replay queued messages");
+        return -1;
+    }
+
+    if (client->cfg.on_connection) {
+        client->cfg.on_connection(client, true, client->session_present,
+                                  client->cfg.user_data);
+    }
+    return 0;
+}
+
+/* Close the socket and forget everything tied to this connection. */
+static void mqtt_client_reset_connection(mqtt_client_t *client) {
+    client->transport->ops->close(client->transport);
+
+    client->connected = false;
+    client->connecting = false;
+    client->connack_pending = false;
+    client->batching = false;
+    client->tx_blocked = false;
+    client->tx_off = 0;
+    client->tx_len = 0;
+    client->tx_mark = 0;
+    client->rx_len = 0;
+    client->ping_outstanding = false;
+
+    // Their SUBACKs can no longer arrive: report each SUBSCRIBE as failed.
+    size_t npending = client->npending_subs;
+    client->npending_subs = 0;
+    for (size_t i = 0; i < npending; ++i) {
+        const mqtt_pending_sub_t *p = &client->pending_subs[i];
+        if (p->cb) p->cb(p->packet_id, p->first_index, NULL, p->count, p->ctx);
+    }
+    mqtt_topic_cache_clear_aliases(&client->topics);
+    mqtt_client_update_gauges(client);
+    mqtt_client_tx_changed(client);
+}
+
+static uint64_t mqtt_client_random(mqtt_client_t *client) {
+    uint64_t x = client->rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    client->rng = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/*
+ * Next attempt after min_ms * 2^attempts (capped at max_ms), with full
+ * jitter: anywhere in (0, cap], so clients dropped by the same broker
+ * restart do not come back in lockstep.
+ */
+static void mqtt_client_schedule_reconnect(mqtt_client_t *client, uint64_t now) {
+    uint64_t min = client->cfg.reconnect_min_ms ? client->cfg.reconnect_min_ms
+                                                : MQTT_RECONNECT_MIN_MS_DEFAULT;
+    uint64_t max = client->cfg.reconnect_max_ms ? client->cfg.reconnect_max_ms
+                                                : MQTT_RECONNECT_MAX_MS_DEFAULT;
+    if (max < min) max = min;
+
+    uint64_t cap = min;
+    for (uint32_t i = 0; i < client->reconnect_attempts && cap < max; ++i) cap *= 2;
+    if (cap > max) cap = max;
+
+    client->reconnect_at_ms = now + 1 + mqtt_client_random(client) % cap;
+}
+
+/*
+ * The connection failed. Without auto_reconnect that is the caller's
+ * error to report. With it, the socket is closed, unsent bytes are
+ * dropped (QoS 1/2 messages stay in the in-flight table for replay)
+ * and a reconnect is scheduled.
+ *
+ * @return -1 without auto_reconnect, 0 otherwise
+ */
+static int mqtt_client_connection_lost(mqtt_client_t *client) {
+    if (!client->cfg.auto_reconnect) return -1;
+    if (!client->connected) return 0;
+
+    MQTT_LOG_WARN("Connection lost, reconnecting");
+    mqtt_counter_add(&client->metrics.connection_losses, 1);
+    mqtt_client_reset_connection(client);
+
+    client->reconnecting = true;
+    client->reconnect_attempts = 0;
+    mqtt_client_schedule_reconnect(client, mqtt_time_now_ms());
+
+    if (client->cfg.on_connection) {
+        client->cfg.on_connection(client, false, false, client->cfg.user_data);
+    }
+    if (client->deadline_hook) {
+        client->deadline_hook(client, client->deadline_hook_ctx);
+    }
+    return 0;
+}
+
+/*
+ * A non-blocking connect failed. While reconnecting (or with
+ * auto_reconnect) the next attempt is scheduled; otherwise the caller
+ * is told through on_connection.
+ *
+ * @return 0 if another attempt will follow, -1 otherwise
+ */
+static int mqtt_client_connect_failed(mqtt_client_t *client) {
+    mqtt_client_reset_connection(client);
+
+    if (client->reconnecting) {
+        mqtt_counter_add(&client->metrics.reconnect_failures, 1);
+        client->reconnect_attempts++;
+    } else if (client->cfg.auto_reconnect) {
+        client->reconnecting = true;
+        client->reconnect_attempts = 0;
+    } else {
+        if (client->cfg.on_connection) {
+            client->cfg.on_connection(client, false, false, client->cfg.user_data);
+        }
+        return -1;
+    }
+
+    mqtt_client_schedule_reconnect(client, mqtt_time_now_ms());
+    MQTT_LOG_WARN("Connect attempt failed, next in %llu ms",
+                  (unsigned long long)(client->reconnect_at_ms - mqtt_time_now_ms()));
+    if (client->deadline_hook) {
+        client->deadline_hook(client, client->deadline_hook_ctx);
+    }
+    return 0;
+}
+
+/*
+ * Drive a non-blocking connect as far as the socket allows and, once
+ * CONNACK is in, bring the connection up.
+ *
+ * @return 0 on progress or success, -1 if the connect failed for good
+ */
+static int mqtt_client_advance_connect(mqtt_client_t *client) {
+    int rc = mqtt_client_connect_step(client);
+    if (rc == MQTT_TRANSPORT_WOULD_BLOCK) return 0;
+    if (rc != 0) return mqtt_client_connect_failed(client);
+
+    client->connecting = false;
+    client->connack_pending = false;
+    if (client->reconnecting) mqtt_counter_add(&client->metrics.reconnects, 1);
+
+    if (mqtt_client_established(client) != 0 &&
+        mqtt_client_connection_lost(client) != 0) {
+        mqtt_client_reset_connection(client);
+        return -1;
+    }
+    return 0;
+}
+
+/* Whether connects can go through mqtt_client_advance_connect(). */
+static bool mqtt_client_can_connect_async(const mqtt_client_t *client) {
+    return client->nonblocking && client->transport->ops->connect_start;
+}
+
+/* Begin a non-blocking connect, bounded by connect_timeout_ms. */
+static int mqtt_client_start_connect(mqtt_client_t *client, uint64_t now_ms) {
+    MQTT_LOG_INFO("Connecting to %s:%u ...",
+                  client->cfg.host,
+                  (unsigned int)client->cfg.port);
+
+    uint32_t timeout = client->cfg.connect_timeout_ms ? client->cfg.connect_timeout_ms
+                                                      : MQTT_CONNECT_TIMEOUT_MS_DEFAULT;
+    client->connecting = true;
+    client->connack_pending = false;
+    client->connect_deadline_ms = now_ms + timeout;
+
+    mqtt_transport_t *t = client->transport;
+    int rc = t->ops->connect_start(t, client->cfg.host, client->cfg.port);
+    if (rc != 0 && rc != MQTT_TRANSPORT_WOULD_BLOCK) {
+        MQTT_LOG_ERROR("Connection failed (%s).", t->ops->name);
+        return mqtt_client_connect_failed(client);
+    }
+    return mqtt_client_advance_connect(client);
+}
+
+/* Reconnect if the backoff has run out; reschedule on failure. */
+static int mqtt_client_try_reconnect(mqtt_client_t *client, uint64_t now_ms) {
+    if (now_ms < client->reconnect_at_ms) return 0;
+
+    // Non-blocking clients must not stall their loop on a slow broker.
+    if (mqtt_client_can_connect_async(client)) {
+        return mqtt_client_start_connect(client, now_ms);
+    }
+
+    if (mqtt_client_open(client) == 0) {
+        mqtt_counter_add(&client->metrics.reconnects, 1);
+        if (mqtt_client_established(client) != 0) {
+            return mqtt_client_connection_lost(client);
+        }
+        return 0;
+    }
+
+    mqtt_counter_add(&client->metrics.reconnect_failures, 1);
+    client->reconnect_attempts++;
+    mqtt_client_schedule_reconnect(client, mqtt_time_now_ms());
+    MQTT_LOG_WARN("Reconnect attempt %u failed, next in %llu ms",
+                  client->reconnect_attempts,
+                  (unsigned long long)(client->reconnect_at_ms - mqtt_time_now_ms()));
+    return 0;
+}
+
+int mqtt_client_connect(mqtt_client_t *client) {
+    if (!client) return -1;
+
+    if (client->connected) {
+        MQTT_LOG_WARN("mqtt_client_connect: already connected");
+        return 0;
+    }
+
+    client->reconnecting = false;
+    if (mqtt_client_open(client) != 0) return -1;
+
+    if (mqtt_client_established(client) != 0) {
+        if (mqtt_client_connection_lost(client) != 0) {
+            mqtt_client_reset_connection(client);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int mqtt_client_connect_async(mqtt_client_t *client) {
+    if (!client) return -1;
+
+    if (client->connected || client->connecting) {
+        MQTT_LOG_WARN("mqtt_client_connect_async: already connected");
+        return 0;
+    }
+
+    client->reconnecting = false;
+    if (mqtt_client_set_nonblocking(client, true) != 0) return -1;
+    if (!mqtt_client_can_connect_async(client)) return mqtt_client_connect(client);
+    return mqtt_client_start_connect(client, mqtt_time_now_ms());
+}
+
+void mqtt_client_disconnect(mqtt_client_t *client) {
+    if (!client) return;
+
+    // Nothing was established yet; abandon the attempt.
+    if (client->connecting) {
+        MQTT_LOG_INFO("Connect to %s:%u abandoned.",
+                      client->cfg.host, (unsigned int)client->cfg.port);
+        mqtt_client_reset_connection(client);
+        client->reconnecting = false;
+        return;
+    }
+
+    // The socket is already closed; just stop trying.
+    if (client->reconnecting) {
+        client->reconnecting = false;
+        return;
+    }
+    if (!client->connected) return;
+
+    if (mqtt_client_tx_flush(client) != 0) {
+        MQTT_LOG_ERROR("Failed to flush batched PUBLISH packets");
+    }
+    if (client->batching) {
+        mqtt_transport_set_cork(mqtt_client_fd(client), false);
+    }
+
+    MQTT_LOG_INFO("Closing TCP connection.");
+    mqtt_client_reset_connection(client);
+}
+
+/* PUBACK, PUBREC or PUBCOMP for one of our QoS 1/2 messages. */
+static int mqtt_client_handle_ack(mqtt_client_t *client, const mqtt_packet_t *pkt) {
+    uint8_t packet_type = (uint8_t)pkt->type;
+    uint16_t packet_id = pkt->packet_id;
+    mqtt_inflight_msg_t *msg = mqtt_inflight_lookup(&client->inflight, packet_id);
+    if (!msg) {
+        MQTT_LOG_WARN("Ack type %u for unknown packet id %u",
+                      packet_type, packet_id);
+        return 0;
+    }
+
+    // QoS 2 step 2: the broker owns the message now; answer with PUBREL.
+    // A PUBREC repeated after that means the broker has not seen our
+    // PUBREL: send it again, the state stays as it is.
+    if (packet_type == MQTT_PACKET_PUBREC &&
+        (msg->state == MQTT_INFLIGHT_WAIT_PUBREC ||
+         msg->state == MQTT_INFLIGHT_WAIT_PUBCOMP)) {
+        uint8_t pubrel[4];
+        mqtt_encode_ack(pubrel, sizeof(pubrel), 0x62, packet_id);
+        mqtt_iovec_t iov = { pubrel, sizeof(pubrel) };
+        if (mqtt_client_send_packet(client, &iov, 1) != 0) {
+            MQTT_LOG_ERROR("Failed to send PUBREL");
+            return -1;
+        }
+        if (msg->state == MQTT_INFLIGHT_WAIT_PUBCOMP) return 0;
+
+        mqtt_pool_free(&client->pool, msg->frame, msg->frame_len);
+        msg->frame = NULL;
+        msg->frame_len = 0;
+        msg->state = MQTT_INFLIGHT_WAIT_PUBCOMP;
+        if (client->store && mqtt_store_pubrel(client->store, packet_id) != 0) {
+            MQTT_LOG_ERROR("Failed to update the message store");
+        }
+        return 0;
+    }
+
+    if ((packet_type == MQTT_PACKET_PUBACK && msg->state == MQTT_INFLIGHT_WAIT_PUBACK) ||
+        (packet_type == MQTT_PACKET_PUBCOMP && msg->state == MQTT_INFLIGHT_WAIT_PUBCOMP)) {
+        // Restored messages have no publish time from this process.
+        if (msg->published_ns != 0) {
+            mqtt_histogram_record(&client->metrics.ack_latency_us,
+                                  (mqtt_time_now_ns() - msg->published_ns) / 1000u);
+        }
+        mqtt_pool_free(&client->pool, msg->frame, msg->frame_len);
+        mqtt_inflight_release(&client->inflight, msg);
+        mqtt_client_update_gauges(client);
+        if (client->store && mqtt_store_release(client->store, packet_id) != 0) {
+            MQTT_LOG_ERROR("Failed to update the message store");
+        }
+        if (client->cfg.on_delivered) {
+            client->cfg.on_delivered(packet_id, client->cfg.user_data);
+        }
+        return 0;
+    }
+
+    MQTT_LOG_WARN("Unexpected ack type %u for packet id %u",
+                  packet_type, packet_id);
+    return 0;
+}
+
+static mqtt_pending_sub_t *mqtt_client_find_pending_sub(mqtt_client_t *client,
+                                                        uint16_t packet_id) {
+    for (size_t i = 0; i < client->npending_subs; ++i) {
+        if (client->pending_subs[i].packet_id == packet_id)
+            return &client->pending_subs[i];
+    }
+    return NULL;
+}
+
+/* Drop a pending SUBSCRIBE without calling its callback. */
+static void mqtt_client_forget_pending_sub(mqtt_client_t *client, uint16_t packet_id) {
+    mqtt_pending_sub_t *p = mqtt_client_find_pending_sub(client, packet_id);
+    if (!p) return;
+    *p = client->pending_subs[--client->npending_subs];
+    mqtt_counter_set(&client->metrics.pending_subscribes, client->npending_subs);
+}
+
+static int mqtt_client_handle_suback(mqtt_client_t *client, const mqtt_packet_t *pkt) {
+    uint16_t packet_id = pkt->packet_id;
+    const uint8_t *codes = pkt->suback.return_codes;
+    size_t count = pkt->suback.count;
+
+    mqtt_pending_sub_t *p = mqtt_client_find_pending_sub(client, packet_id);
+    if (!p) {
+        MQTT_LOG_WARN("SUBACK for unknown packet id %u", packet_id);
+        return 0;
+    }
+
+    mqtt_pending_sub_t done = *p;
+    *p = client->pending_subs[--client->npending_subs];
+    mqtt_counter_set(&client->metrics.pending_subscribes, client->npending_subs);
+
+    if (count != done.count) {
+        MQTT_LOG_WARN("SUBACK carries %zu return codes, expected %zu",
+                      count, done.count);
+        if (count > done.count) count = done.count;
+    }
+
+    if (done.cb) {
+        done.cb(packet_id, done.first_index, codes, count, done.ctx);
+    }
+    return 0;
+}
+
+/* Hand a message no topic handler took to the configured callback. */
+static void mqtt_client_deliver(mqtt_client_t *client,
+                                const mqtt_publish_view_t *msg) {
+    if (client->cfg.on_message_view) {
+        client->cfg.on_message_view(msg->topic, msg->topic_len,
+                                    msg->payload, msg->payload_len,
+                                    client->cfg.user_data);
+        return;
+    }
+    if (!client->cfg.on_message) return;
+
+    // The legacy callback wants a NUL-terminated topic.
+    char stack_topic[256];
+    char *topic = stack_topic;
+    if (msg->topic_len >= sizeof(stack_topic)) {
+        topic = (char *)malloc(msg->topic_len + 1);
+        if (!topic) {
+            MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+            return;
+        }
+    }
+    memcpy(topic, msg->topic, msg->topic_len);
+    topic[msg->topic_len] = '\0';
+
+    client->cfg.on_message(topic, msg->payload, msg->payload_len);
+
+    if (topic != stack_topic) free(topic);
+}
+
+/* Send PUBACK, PUBREC or PUBCOMP (by first byte) for an inbound message. */
+static int mqtt_client_send_ack(mqtt_client_t *client, uint8_t header,
+                                uint16_t packet_id) {
+    uint8_t ack[4];
+    mqtt_encode_ack(ack, sizeof(ack), header, packet_id);
+    mqtt_iovec_t iov = { ack, sizeof(ack) };
+    if (mqtt_client_send_packet(client, &iov, 1) != 0) {
+        MQTT_LOG_ERROR("Failed to send ack type %u for packet id %u",
+                       (unsigned int)(header >> 4), packet_id);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Incoming message. QoS 1 is acknowledged after delivery. QoS 2 is
+ * delivered once per packet id until the broker's PUBREL, however often
+ * the PUBLISH is resent, and answered with PUBREC each time.
+ */
+static int mqtt_client_handle_publish(mqtt_client_t *client, const mqtt_packet_t *pkt) {
+    const mqtt_publish_view_t *msg = &pkt->publish;
+    bool deliver = true;
+
+    if (msg->qos == 2) {
+        if (!client->qos2_rx) {
+            client->qos2_rx = (uint8_t *)calloc(1, 65536 / 8);
+            if (!client->qos2_rx) {
+                MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+                return -1;
+            }
+        }
+        uint8_t bit = (uint8_t)(1u << (msg->packet_id & 7));
+        deliver = (client->qos2_rx[msg->packet_id >> 3] & bit) == 0;
+        client->qos2_rx[msg->packet_id >> 3] |= bit;
+    }
+
+    if (deliver) {
+        MQTT_LOG_DEBUG("Incoming PUBLISH: topic='%.*s', qos=%u, payload_len=%zu",
+                       (int)msg->topic_len, msg->topic, msg->qos, msg->payload_len);
+        size_t handled = mqtt_topic_trie_dispatch(&client->routes,
+                                                  msg->topic, msg->topic_len,
+                                                  msg->payload, msg->payload_len);
+        if (handled == 0) {
+            mqtt_client_deliver(client, msg);
+        }
+    }
+
+    // A callback may have disconnected us; the broker resends next session.
+    if (msg->qos == 0 || !client->connected) return 0;
+    return mqtt_client_send_ack(client, msg->qos == 1 ? 0x40 : 0x50, msg->packet_id);
+}
+
+/* QoS 2 step 3 from the broker: forget the packet id, answer with PUBCOMP. */
+static int mqtt_client_handle_pubrel(mqtt_client_t *client, const mqtt_packet_t *pkt) {
+    uint16_t packet_id = pkt->packet_id;
+    if (client->qos2_rx) {
+        client->qos2_rx[packet_id >> 3] &= (uint8_t)~(1u << (packet_id & 7));
+    }
+    return mqtt_client_send_ack(client, 0x70, packet_id);
+}
+
+static int mqtt_client_handle_unsuback(mqtt_client_t *client, const mqtt_packet_t *pkt) {
+    (void)client;
+    MQTT_LOG_DEBUG("UNSUBACK for packet id %u", pkt->packet_id);
+    return 0;
+}
+
+static int mqtt_client_handle_pingresp(mqtt_client_t *client, const mqtt_packet_t *pkt) {
+    (void)pkt;
+    client->ping_outstanding = false;
+    return 0;
+}
+
+typedef int (*mqtt_client_packet_handler_t)(mqtt_client_t *client,
+                                            const mqtt_packet_t *pkt);
+
+/*
+ * Handlers by packet type for everything that may arrive once connected.
+ * CONNACK is taken by the connect path; a second one is a protocol error
+ * like any packet only a client sends.
+ */
+static const mqtt_client_packet_handler_t mqtt_client_packet_handlers[16] = {
+    [MQTT_PACKET_PUBLISH]  = mqtt_client_handle_publish,
+    [MQTT_PACKET_PUBACK]   = mqtt_client_handle_ack,
+    [MQTT_PACKET_PUBREC]   = mqtt_client_handle_ack,
+    [MQTT_PACKET_PUBREL]   = mqtt_client_handle_pubrel,
+    [MQTT_PACKET_PUBCOMP]  = mqtt_client_handle_ack,
+    [MQTT_PACKET_SUBACK]   = mqtt_client_handle_suback,
+    [MQTT_PACKET_UNSUBACK] = mqtt_client_handle_unsuback,
+    [MQTT_PACKET_PINGRESP] = mqtt_client_handle_pingresp,
+};
+
+/*
+ * Handle one complete packet from the broker.
+ *
+ * @return 0 on success, -1 if the packet is malformed or unexpected (the
+ *         connection must be closed [MQTT-4.8.0-1]) or a reply failed
+ */
+static int mqtt_client_handle_packet(mqtt_client_t *client,
+                                     const uint8_t *buf, size_t len) {
+    uint8_t packet_type = buf[0] >> 4;
+    mqtt_packet_t pkt;
+
+    mqtt_counter_add(&client->metrics.packets_in[packet_type], 1);
+
+    mqtt_client_packet_handler_t handler = mqtt_client_packet_handlers[packet_type];
+    if (!handler || mqtt_decode_packet(buf, len, &pkt) != 0) {
+        MQTT_LOG_ERROR("Malformed or unexpected packet (type %u, %zu bytes)",
+                       packet_type, len);
+        mqtt_counter_add(&client->metrics.decode_errors, 1);
+        return -1;
+    }
+    return handler(client, &pkt);
+}
+
+/*
+ * Dispatch every complete frame in the receive buffer and keep the
+ * trailing partial frame (if any) for the next read.
+ *
+ * @return number of frames dispatched, or -1 on protocol error or when
+ *         a reply could not be sent
+ */
+static int mqtt_client_rx_drain(mqtt_client_t *client) {
+    size_t offset = 0;
+    size_t frame_len = 0;
+    int frames = 0;
+    int st;
+
+    while ((st = mqtt_client_rx_frame_at(client, offset, &frame_len)) == 1) {
+        int rc = mqtt_client_handle_packet(client, client->rx_buf + offset, frame_len);
+        offset += frame_len;
+        frames++;
+
+        // A callback disconnected us; the receive buffer was reset.
+        if (!client->connected) return frames;
+        if (rc != 0) return -1;
+    }
+
+    mqtt_client_rx_consume(client, offset);
+    return st < 0 ? -1 : frames;
+}
+
+int mqtt_client_loop(mqtt_client_t *client) {
+    if (!client || (!client->connected && !client->reconnecting && !client->connecting)) {
+        MQTT_LOG_ERROR("mqtt_client_loop: not connected");
+        return -1;
+    }
+
+    if (client->connecting) {
+        if (mqtt_client_advance_connect(client) != 0) return -1;
+        if (!client->connected) return 0;
+        // Connected: serve whatever arrived behind the CONNACK.
+    }
+
+    if (client->reconnecting) {
+        if (!client->nonblocking) {
+            uint64_t now = mqtt_time_now_ms();
+            if (client->reconnect_at_ms > now)
+                mqtt_time_sleep_ms(client->reconnect_at_ms - now);
+        }
+        return mqtt_client_tick(client, mqtt_time_now_ms());
+    }
+
+    if (mqtt_client_tick(client, mqtt_time_now_ms()) != 0) return -1;
+    if (!client->connected) return 0; // lost during the tick, reconnecting
+
+    if (mqtt_client_drain_queue(client) != 0) {
+        MQTT_LOG_ERROR("Error sending queued data");
+        return mqtt_client_connection_lost(client);
+    }
+
+    if (client->nonblocking) {
+        // Readiness may be edge-triggered: read until the socket is empty.
+        for (;;) {
+            if (mqtt_client_rx_drain(client) < 0)
+                return mqtt_client_connection_lost(client);
+            if (!client->connected) return 0;
+
+            int r = mqtt_client_rx_fill(client);
+            if (r == MQTT_TRANSPORT_WOULD_BLOCK) return 0;
+            if (r < 0) {
+                MQTT_LOG_ERROR("Error receiving data");
+                return mqtt_client_connection_lost(client);
+            }
+            if (r == 0) {
+                MQTT_LOG_WARN("Connection closed by broker");
+                return mqtt_client_connection_lost(client);
+            }
+        }
+    }
+
+    // Frames left over from an earlier read are served without a syscall.
+    size_t frame_len = 0;
+    int st = mqtt_client_rx_frame_at(client, 0, &frame_len);
+    if (st < 0) return mqtt_client_connection_lost(client);
+
+    if (st == 0) {
+        // Sleep no longer than the next keep-alive / flush deadline.
+        uint64_t deadline = mqtt_client_next_deadline_ms(client);
+        if (deadline != UINT64_MAX) {
+            uint64_t now = mqtt_time_now_ms();
+            uint64_t wait = deadline > now ? deadline - now : 0;
+            // Data already decrypted by the transport will not wake poll().
+            mqtt_transport_t *t = client->transport;
+            int ready = t->ops->pending(t) > 0 ? 1 : mqtt_transport_wait_readable(
+                t->ops->fd(t), wait > INT_MAX ? INT_MAX : (int)wait);
+            if (ready < 0) return mqtt_client_connection_lost(client);
+            if (ready == 0) return mqtt_client_tick(client, mqtt_time_now_ms());
+        }
+
+        int r = mqtt_client_rx_fill(client);
+        if (r < 0) {
+            MQTT_LOG_ERROR("Error receiving data");
+            return mqtt_client_connection_lost(client);
+        }
+        if (r == 0) {
+            MQTT_LOG_WARN("Connection closed by broker");
+            return mqtt_client_connection_lost(client);
+        }
+    }
+
+    if (mqtt_client_rx_drain(client) < 0) return mqtt_client_connection_lost(client);
+    return 0;
+}
+
+int mqtt_client_process_write(mqtt_client_t *client) {
+    if (!client) return -1;
+    mqtt_client_tx_recheck(client); // even while disconnected
+    if (client->connecting) return mqtt_client_advance_connect(client);
+    if (!client->connected) return client->reconnecting ? 0 : -1;
+
+    if ((client->tx_blocked && mqtt_client_tx_flush(client) != 0) ||
+        mqtt_client_drain_queue(client) != 0) {
+        MQTT_LOG_ERROR("Error sending queued data");
+        return mqtt_client_connection_lost(client);
+    }
+    return 0;
+}
+
+/* How long a PINGREQ may go unanswered. */
+static uint64_t mqtt_client_ping_timeout_ms(const mqtt_client_t *client) {
+    return client->cfg.ping_timeout_ms ? client->cfg.ping_timeout_ms
+                                       : (uint64_t)client->cfg.keep_alive_sec * 1000u;
+}
+
+int mqtt_client_tick(mqtt_client_t *client, uint64_t now_ms) {
+    if (!client) return -1;
+    if (client->store && mqtt_store_tick(client->store, now_ms) != 0) {
+        MQTT_LOG_ERROR("Failed to sync the message store");
+    }
+    if (client->connecting) {
+        if (now_ms < client->connect_deadline_ms) return 0;
+        MQTT_LOG_ERROR("Connect to %s:%u timed out",
+                       client->cfg.host, (unsigned int)client->cfg.port);
+        return mqtt_client_connect_failed(client);
+    }
+    if (client->reconnecting) return mqtt_client_try_reconnect(client, now_ms);
+    if (!client->connected) return -1;
+
+    if (client->batching && client->tx_len > client->tx_off &&
+        client->cfg.batch_flush_interval_ms > 0 &&
+        now_ms - client->batch_started_ms >= client->cfg.batch_flush_interval_ms) {
+        if (mqtt_client_tx_flush_now(client) != 0)
+            return mqtt_client_connection_lost(client);
+    }
+
+    if (client->cfg.keep_alive_sec == 0) return 0;
+
+    if (client->ping_outstanding) {
+        if (now_ms - client->ping_sent_ms >= mqtt_client_ping_timeout_ms(client)) {
+            MQTT_LOG_WARN("PINGRESP not received within %llu ms",
+                          (unsigned long long)mqtt_client_ping_timeout_ms(client));
+            mqtt_counter_add(&client->metrics.ping_timeouts, 1);
+            return mqtt_client_connection_lost(client);
+        }
+        return 0;
+    }
+
+    // Any packet we sent in the interval already counts as keep-alive.
+    if (now_ms - client->last_tx_ms >= (uint64_t)client->cfg.keep_alive_sec * 1000u) {
+        static const uint8_t pingreq[2] = { 0xC0, 0x00 };
+        mqtt_iovec_t iov = { pingreq, sizeof(pingreq) };
+
+        // Written directly, so a pending batch goes out in front of it,
+        // and not left to the cork: its answer is on a deadline.
+        mqtt_client_count_out(client, pingreq[0]);
+        if (mqtt_client_write(client, &iov, 1) != 0) {
+            MQTT_LOG_ERROR("Error sending PINGREQ");
+            return mqtt_client_connection_lost(client);
+        }
+        mqtt_client_tx_push(client);
+        client->ping_outstanding = true;
+        client->ping_sent_ms = now_ms;
+        client->last_tx_ms = now_ms;
+    }
+    return 0;
+}
+
+uint64_t mqtt_client_next_deadline_ms(const mqtt_client_t *client) {
+    uint64_t deadline = UINT64_MAX;
+    if (!client) return deadline;
+
+    uint64_t sync = mqtt_store_next_sync_ms(client->store);
+    if (client->connecting) {
+        return sync < client->connect_deadline_ms ? sync : client->connect_deadline_ms;
+    }
+    if (client->reconnecting) {
+        return sync < client->reconnect_at_ms ? sync : client->reconnect_at_ms;
+    }
+    if (!client->connected) return deadline;
+    deadline = sync;
+
+    if (client->batching && client->tx_len > client->tx_off &&
+        client->cfg.batch_flush_interval_ms > 0) {
+        uint64_t flush = client->batch_started_ms + client->cfg.batch_flush_interval_ms;
+        if (flush < deadline) deadline = flush;
+    }
+
+    if (client->cfg.keep_alive_sec > 0) {
+        uint64_t ka = client->ping_outstanding
+            ? client->ping_sent_ms + mqtt_client_ping_timeout_ms(client)
+            : client->last_tx_ms + (uint64_t)client->cfg.keep_alive_sec * 1000u;
+        if (ka < deadline) deadline = ka;
+    }
+    return deadline;
+}
+
+void mqtt_client_set_deadline_hook(mqtt_client_t *client,
+                                   mqtt_client_deadline_hook_t hook,
+                                   void *ctx) {
+    if (!client) return;
+    client->deadline_hook = hook;
+    client->deadline_hook_ctx = ctx;
+}
+
+void mqtt_client_set_wakeup_hook(mqtt_client_t *client,
+                                 mqtt_client_wakeup_hook_t hook,
+                                 void *ctx) {
+    if (!client) return;
+    // A producer that sees the new hook also sees its ctx. On removal
+    // the old ctx stays in place for producers that loaded the old hook.
+    if (hook) atomic_store_explicit(&client->wakeup_hook_ctx, ctx, memory_order_relaxed);
+    atomic_store_explicit(&client->wakeup_hook, hook, memory_order_release);
+}
+
+int mqtt_client_set_nonblocking(mqtt_client_t *client, bool enable) {
+    if (!client) return -1;
+    if (client->connecting && !enable) {
+        MQTT_LOG_ERROR("mqtt_client_set_nonblocking: connect in progress");
+        return -1;
+    }
+
+    if (client->connected &&
+        mqtt_transport_set_nonblocking(mqtt_client_fd(client), enable) != 0) {
+        return -1;
+    }
+    client->nonblocking = enable;
+    return 0;
+}
+
+int mqtt_client_fd(const mqtt_client_t *client) {
+    if (!client || !client->transport) return -1;
+    return client->transport->ops->fd(client->transport);
+}
+
+mqtt_transport_t *mqtt_client_transport(const mqtt_client_t *client) {
+    return client ? client->transport : NULL;
+}
+
+bool mqtt_client_is_connected(const mqtt_client_t *client) {
+    return client && client->connected;
+}
+
+bool mqtt_client_is_reconnecting(const mqtt_client_t *client) {
+    return client && client->reconnecting;
+}
+
+bool mqtt_client_is_connecting(const mqtt_client_t *client) {
+    return client && client->connecting;
+}
+
+bool mqtt_client_session_present(const mqtt_client_t *client) {
+    return client && client->session_present;
+}
+
+bool mqtt_client_wants_write(const mqtt_client_t *client) {
+    return client && client->tx_blocked;
+}
+
+/*
+ * Log an outbound message in the store. The first record since the last
+ * sync starts the sync interval, which may move the next deadline.
+ */
+static int mqtt_client_store_put(mqtt_client_t *client, uint16_t packet_id,
+                                 uint64_t seq, const uint8_t *frame,
+                                 size_t frame_len) {
+    bool clean = mqtt_store_next_sync_ms(client->store) == UINT64_MAX;
+    if (mqtt_store_put(client->store, packet_id, seq, frame, frame_len) != 0) {
+        MQTT_LOG_ERROR("Failed to store PUBLISH packet");
+        return -1;
+    }
+    if (clean && client->deadline_hook &&
+        mqtt_store_next_sync_ms(client->store) != UINT64_MAX) {
+        client->deadline_hook(client, client->deadline_hook_ctx);
+    }
+    return 0;
+}
+
+/*
+ * A topic to publish to. A registered one carries its length prefix and
+ * name encoded once (wire); a string gets its prefix encoded per call.
+ */
+typedef struct {
+    const uint8_t *wire;        // 2-byte length, then the name; NULL for a string
+    const char    *name;
+    size_t         name_len;
+} mqtt_client_topic_ref_t;
+
+static int mqtt_client_topic_ref(mqtt_client_topic_ref_t *ref, const char *topic) {
+    size_t len = topic ? strlen(topic) : 0;
+    if (!mqtt_validate_topic_name(topic, len)) {
+        MQTT_LOG_ERROR("Invalid topic name");
+        return -1;
+    }
+    ref->wire     = NULL;
+    ref->name     = topic;
+    ref->name_len = len;
+    return 0;
+}
+
+static int mqtt_client_topic_ref_handle(mqtt_client_topic_ref_t *ref,
+                                        const mqtt_client_topic_t *topic) {
+    if (!topic) {
+        MQTT_LOG_ERROR("Invalid topic handle");
+        return -1;
+    }
+    ref->wire     = topic->wire;
+    ref->name     = mqtt_topic_entry_name(topic);
+    ref->name_len = mqtt_topic_entry_name_len(topic);
+    return 0;
+}
+
+/*
+ * A PUBLISH as iovecs over the caller's memory: fixed header, topic,
+ * packet id for QoS 1/2, payload. Only the fixed header (and, for a
+ * string topic, its length prefix) is encoded here.
+ */
+typedef struct {
+    uint8_t      header[8];
+    uint8_t      packet_id[2];
+    mqtt_iovec_t iov[4];
+    size_t       iovcnt;
+    size_t       frame_len;
+} mqtt_client_publish_frame_t;
+
+static int mqtt_client_publish_layout(mqtt_client_publish_frame_t *f,
+                                      const mqtt_client_topic_ref_t *topic,
+                                      const uint8_t *payload,
+                                      size_t payload_len,
+                                      uint8_t qos,
+                                      bool retain,
+                                      uint16_t packet_id) {
+    size_t rem = 2 + topic->name_len + (qos > 0 ? 2 : 0);
+    if (payload_len > SIZE_MAX - rem) return -1;
+    rem += payload_len;
+
+    int hlen = mqtt_encode_publish_fixed_header(f->header, sizeof(f->header),
+                                                qos, retain, rem);
+    if (hlen < 0) return -1;
+
+    f->iovcnt = 0;
+    if (topic->wire) {
+        f->iov[f->iovcnt++] = (mqtt_iovec_t){ f->header, (size_t)hlen };
+        f->iov[f->iovcnt++] = (mqtt_iovec_t){ topic->wire, 2 + topic->name_len };
+    } else {
+        f->header[hlen]     = (uint8_t)(topic->name_len >> 8);
+        f->header[hlen + 1] = (uint8_t)(topic->name_len & 0xFF);
+        f->iov[f->iovcnt++] = (mqtt_iovec_t){ f->header, (size_t)hlen + 2 };
+        f->iov[f->iovcnt++] = (mqtt_iovec_t){ topic->name, topic->name_len };
+    }
+    if (qos > 0) {
+        f->packet_id[0] = (uint8_t)(packet_id >> 8);
+        f->packet_id[1] = (uint8_t)(packet_id & 0xFF);
+        f->iov[f->iovcnt++] = (mqtt_iovec_t){ f->packet_id, 2 };
+    }
+    f->iov[f->iovcnt++] = (mqtt_iovec_t){ payload, payload_len };
+    f->frame_len = (size_t)hlen + rem;
+    return 0;
+}
+
+/* Copy a laid-out PUBLISH into one buffer of frame_len bytes. */
+static void mqtt_client_publish_gather(const mqtt_client_publish_frame_t *f,
+                                       uint8_t *dst) {
+    for (size_t i = 0; i < f->iovcnt; ++i) {
+        if (f->iov[i].len == 0) continue;
+        memcpy(dst, f->iov[i].base, f->iov[i].len);
+        dst += f->iov[i].len;
+    }
+}
+
+/*
+ * Copy a QoS 0 PUBLISH made while reconnecting into the pool; it goes
+ * out with the replay once the connection is back.
+ */
+static int mqtt_client_offline_push(mqtt_client_t *client,
+                                    const mqtt_client_topic_ref_t *topic,
+                                    const uint8_t *payload,
+                                    size_t payload_len,
+                                    bool retain) {
+    size_t max = client->cfg.offline_queue_max ? client->cfg.offline_queue_max
+                                               : MQTT_OFFLINE_QUEUE_MAX_DEFAULT;
+    if (client->offline_count >= max) {
+        MQTT_LOG_WARN("Offline queue full, message dropped");
+        return MQTT_CLIENT_ERR_OFFLINE_FULL;
+    }
+
+    mqtt_client_publish_frame_t f;
+    if (mqtt_client_publish_layout(&f, topic, payload, payload_len, 0, retain, 0) != 0) {
+        MQTT_LOG_ERROR("Failed to encode PUBLISH packet");
+        return -1;
+    }
+
+    size_t frame_len = f.frame_len;
+    mqtt_offline_msg_t *m = (mqtt_offline_msg_t *)mqtt_pool_alloc(
+        &client->pool, sizeof(*m) + frame_len);
+    if (!m) {
+        MQTT_LOG_ERROR("Outbound message memory exhausted");
+        return MQTT_CLIENT_ERR_NO_MEMORY;
+    }
+
+    mqtt_client_publish_gather(&f, m->frame);
+    m->frame_len = frame_len;
+    m->seq = ++client->publish_seq;
+    m->next = NULL;
+
+    if (client->store &&
+        mqtt_client_store_put(client, 0, m->seq, m->frame, m->frame_len) != 0) {
+        mqtt_pool_free(&client->pool, m, sizeof(*m) + frame_len);
+        return -1;
+    }
+
+    if (client->offline_tail) client->offline_tail->next = m;
+    else                      client->offline_head = m;
+    client->offline_tail = m;
+    client->offline_count++;
+    mqtt_counter_set(&client->metrics.offline_queued, client->offline_count);
+    return 0;
+}
+
+static int mqtt_client_publish_qos0_ref(mqtt_client_t *client,
+                                        const mqtt_client_topic_ref_t *topic,
+                                        const uint8_t *payload,
+                                        size_t payload_len,
+                                        bool retain) {
+    if (client->reconnecting) {
+        return mqtt_client_offline_push(client, topic, payload, payload_len, retain);
+    }
+    if (!client->connected) {
+        MQTT_LOG_ERROR("mqtt_client_publish_qos0: not connected");
+        return -1;
+    }
+
+    // Only the header is encoded here; topic and payload go out from the
+    // caller's memory (or the registered topic's) in the same system call.
+    mqtt_client_publish_frame_t f;
+    if (mqtt_client_publish_layout(&f, topic, payload, payload_len, 0, retain, 0) != 0) {
+        MQTT_LOG_ERROR("Failed to encode PUBLISH packet");
+        return -1;
+    }
+
+    int rc = mqtt_client_tx_admit(client, f.frame_len);
+    if (rc == MQTT_CLIENT_ERR_QUEUE_FULL) return rc;
+    if (rc != 0) {
+        MQTT_LOG_ERROR("Failed to send queued data");
+        mqtt_client_connection_lost(client);
+        return -1;
+    }
+
+    if (mqtt_client_send_packet(client, f.iov, f.iovcnt) != 0) {
+        // At most once: a QoS 0 message caught in a failing write is dropped.
+        MQTT_LOG_ERROR("Failed to send full PUBLISH packet");
+        mqtt_client_connection_lost(client);
+        return -1;
+    }
+
+    if (!client->batching) {
+        MQTT_LOG_DEBUG("PUBLISH sent to topic '%.*s', payload_len=%zu",
+                       (int)topic->name_len, topic->name, payload_len);
+    }
+    return 0;
+}
+
+int mqtt_client_publish_qos0(mqtt_client_t *client,
+                             const char *topic,
+                             const uint8_t *payload,
+                             size_t payload_len) {
+    if (!client) return -1;
+
+    mqtt_client_topic_ref_t ref;
+    if (mqtt_client_topic_ref(&ref, topic) != 0) return -1;
+    return mqtt_client_publish_qos0_ref(client, &ref, payload, payload_len, false);
+}
+
+static int mqtt_client_publish_concurrent_ref(mqtt_client_t *client,
+                                              const mqtt_client_topic_ref_t *topic,
+                                              const uint8_t *payload,
+                                              size_t payload_len) {
+    // Touches nothing the writer owns: the frame is complete before it
+    // is pushed and the queue is the only shared state.
+    mqtt_client_publish_frame_t pf;
+    if (mqtt_client_publish_layout(&pf, topic, payload, payload_len, 0, false, 0) != 0) {
+        MQTT_LOG_ERROR("Failed to encode PUBLISH packet");
+        return -1;
+    }
+
+    size_t frame_len = pf.frame_len;
+    size_t max = client->cfg.tx_queue_max;
+    size_t backlog = max > 0 ? mqtt_client_tx_backlog(client) : 0;
+    if (backlog > 0 && backlog + frame_len > max) {
+        int rc = MQTT_CLIENT_ERR_QUEUE_FULL;
+        if (client->cfg.tx_overflow == MQTT_TX_OVERFLOW_DROP_OLDEST) rc = 0;
+        else if (client->cfg.tx_overflow == MQTT_TX_OVERFLOW_BLOCK)
+            rc = mqtt_client_tx_wait(client, frame_len);
+        if (rc != 0) {
+            atomic_fetch_add_explicit(&client->metrics.tx_rejected, 1,
+                                      memory_order_relaxed);
+            return rc;
+        }
+    }
+
+    mqtt_queued_frame_t *f = (mqtt_queued_frame_t *)malloc(sizeof(*f) + frame_len);
+    if (!f) {
+        MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+        return -1;
+    }
+    mqtt_client_publish_gather(&pf, f->frame);
+    f->frame_len = frame_len;
+
+    backlog = atomic_fetch_add_explicit(&client->outq_bytes, frame_len,
+                                        memory_order_relaxed) + frame_len +
+              (size_t)mqtt_counter_get(&client->metrics.tx_buffered_bytes);
+    mqtt_mpsc_push(&client->outq, &f->node);
+    mqtt_client_signal_writer(client, true);
+
+    // Across the high watermark or past the limit: the writer may already
+    // be signalled but stuck on a full socket, so get its attention
+    // separately.
+    bool crossed = client->tx_high > 0 && backlog >= client->tx_high &&
+                   backlog - frame_len < client->tx_high;
+    if ((crossed || (max > 0 && backlog > max)) &&
+        !atomic_load_explicit(&client->tx_recheck, memory_order_relaxed) &&
+        !atomic_exchange(&client->tx_recheck, true)) {
+        mqtt_client_wakeup_hook_t hook =
+            atomic_load_explicit(&client->wakeup_hook, memory_order_acquire);
+        if (hook) {
+            hook(client, atomic_load_explicit(&client->wakeup_hook_ctx,
+                                              memory_order_relaxed));
+        }
+    }
+    return 0;
+}
+
+int mqtt_client_publish_concurrent(mqtt_client_t *client,
+                                   const char *topic,
+                                   const uint8_t *payload,
+                                   size_t payload_len) {
+    if (!client || !topic) return -1;
+
+    mqtt_client_topic_ref_t ref;
+    if (mqtt_client_topic_ref(&ref, topic) != 0) return -1;
+    return mqtt_client_publish_concurrent_ref(client, &ref, payload, payload_len);
+}
+
+int mqtt_client_publish_concurrent_to(mqtt_client_t *client,
+                                      const mqtt_client_topic_t *topic,
+                                      const uint8_t *payload,
+                                      size_t payload_len) {
+    if (!client) return -1;
+
+    mqtt_client_topic_ref_t ref;
+    if (mqtt_client_topic_ref_handle(&ref, topic) != 0) return -1;
+    return mqtt_client_publish_concurrent_ref(client, &ref, payload, payload_len);
+}
+
+static int mqtt_client_publish_ref(mqtt_client_t *client,
+                                   const mqtt_client_topic_ref_t *topic,
+                                   const uint8_t *payload,
+                                   size_t payload_len,
+                                   uint8_t qos,
+                                   bool retain) {
+    if (!client->connected && !client->reconnecting) {
+        MQTT_LOG_ERROR("mqtt_client_publish: not connected");
+        return -1;
+    }
+    if (qos > 2) return -1;
+
+    // QoS 0, retained or not, takes the copy-free path.
+    if (qos == 0) {
+        return mqtt_client_publish_qos0_ref(client, topic, payload, payload_len, retain);
+    }
+
+    // The packet id is filled in below; the length does not depend on it.
+    mqtt_client_publish_frame_t f;
+    if (mqtt_client_publish_layout(&f, topic, payload, payload_len, qos, retain, 0) != 0) {
+        MQTT_LOG_ERROR("PUBLISH packet too large");
+        return -1;
+    }
+    size_t frame_len = f.frame_len;
+
+    int rc = mqtt_client_tx_admit(client, frame_len);
+    if (rc == MQTT_CLIENT_ERR_QUEUE_FULL) return rc;
+    if (rc != 0) {
+        MQTT_LOG_ERROR("Failed to send queued data");
+        if (mqtt_client_connection_lost(client) != 0 || !client->reconnecting) return -1;
+        // Reconnecting now: the message waits for the replay instead.
+    }
+
+    mqtt_inflight_msg_t *msg = mqtt_inflight_acquire(&client->inflight);
+    if (!msg) return MQTT_CLIENT_ERR_INFLIGHT_FULL;
+
+    // The encoded packet outlives this call: it is kept for retransmission.
+    msg->frame = (uint8_t *)mqtt_pool_alloc(&client->pool, frame_len);
+    if (!msg->frame) {
+        MQTT_LOG_ERROR("Outbound message memory exhausted");
+        mqtt_inflight_release(&client->inflight, msg);
+        return MQTT_CLIENT_ERR_NO_MEMORY;
+    }
+    msg->frame_len = frame_len;
+
+    f.packet_id[0] = (uint8_t)(msg->packet_id >> 8);
+    f.packet_id[1] = (uint8_t)(msg->packet_id & 0xFF);
+    mqtt_client_publish_gather(&f, msg->frame);
+
+    msg->qos       = qos;
+    msg->state     = qos == 1 ? MQTT_INFLIGHT_WAIT_PUBACK
+                              : MQTT_INFLIGHT_WAIT_PUBREC;
+    msg->seq       = ++client->publish_seq;
+    msg->published_ns = mqtt_time_now_ns();
+
+    if (client->store &&
+        mqtt_client_store_put(client, msg->packet_id, msg->seq,
+                              msg->frame, msg->frame_len) != 0) {
+        mqtt_pool_free(&client->pool, msg->frame, msg->frame_len);
+        mqtt_inflight_release(&client->inflight, msg);
+        return -1;
+    }
+    mqtt_client_update_gauges(client);
+
+    // Kept for the replay once the connection is back.
+    if (client->reconnecting) return msg->packet_id;
+
+    msg->sent      = true;
+    msg->sent_ms   = mqtt_time_now_ms();
+
+    mqtt_iovec_t iov = { msg->frame, msg->frame_len };
+    if (mqtt_client_send_packet(client, &iov, 1) != 0) {
+        MQTT_LOG_ERROR("Failed to send PUBLISH packet");
+        if (mqtt_client_connection_lost(client) == 0) return msg->packet_id;
+        if (client->store) mqtt_store_release(client->store, msg->packet_id);
+        mqtt_pool_free(&client->pool, msg->frame, msg->frame_len);
+        mqtt_inflight_release(&client->inflight, msg);
+        mqtt_client_update_gauges(client);
+        return -1;
+    }
+
+    return msg->packet_id;
+}
+
+int mqtt_client_publish(mqtt_client_t *client,
+                        const char *topic,
+                        const uint8_t *payload,
+                        size_t payload_len,
+                        uint8_t qos,
+                        bool retain) {
+    if (!client) return -1;
+
+    mqtt_client_topic_ref_t ref;
+    if (mqtt_client_topic_ref(&ref, topic) != 0) return -1;
+    return mqtt_client_publish_ref(client, &ref, payload, payload_len, qos, retain);
+}
+
+int mqtt_client_publish_to(mqtt_client_t *client,
+                           const mqtt_client_topic_t *topic,
+                           const uint8_t *payload,
+                           size_t payload_len,
+                           uint8_t qos,
+                           bool retain) {
+    if (!client) return -1;
+
+    mqtt_client_topic_ref_t ref;
+    if (mqtt_client_topic_ref_handle(&ref, topic) != 0) return -1;
+    return mqtt_client_publish_ref(client, &ref, payload, payload_len, qos, retain);
+}
+
+const mqtt_client_topic_t *mqtt_client_topic_register(mqtt_client_t *client,
+                                                      const char *topic) {
+    if (!client || !topic) return NULL;
+    return mqtt_topic_cache_intern(&client->topics, topic, strlen(topic));
+}
+
+size_t mqtt_client_inflight_count(const mqtt_client_t *client) {
+    return client ? mqtt_inflight_count(&client->inflight) : 0;
+}
+
+int mqtt_client_get_pool_stats(const mqtt_client_t *client,
+                               mqtt_pool_stats_t *stats) {
+    if (!client || !stats) return -1;
+    *stats = client->pool.stats;
+    return 0;
+}
+
+int mqtt_client_get_stats(const mqtt_client_t *client, mqtt_client_stats_t *stats) {
+    if (!client || !stats) return -1;
+    const mqtt_client_metrics_t *m = &client->metrics;
+
+    stats->bytes_in  = mqtt_counter_get(&m->bytes_in);
+    stats->bytes_out = mqtt_counter_get(&m->bytes_out);
+    for (size_t i = 0; i < MQTT_PACKET_TYPES; ++i) {
+        stats->packets_in[i]  = mqtt_counter_get(&m->packets_in[i]);
+        stats->packets_out[i] = mqtt_counter_get(&m->packets_out[i]);
+    }
+    stats->recv_calls         = mqtt_counter_get(&m->recv_calls);
+    stats->send_calls         = mqtt_counter_get(&m->send_calls);
+    stats->send_would_block   = mqtt_counter_get(&m->send_would_block);
+    stats->decode_errors      = mqtt_counter_get(&m->decode_errors);
+    stats->inflight           = mqtt_counter_get(&m->inflight);
+    stats->inflight_max       = mqtt_counter_get(&m->inflight_max);
+    stats->offline_queued     = mqtt_counter_get(&m->offline_queued);
+    stats->tx_buffered_bytes  = mqtt_counter_get(&m->tx_buffered_bytes);
+    stats->tx_dropped         = mqtt_counter_get(&m->tx_dropped);
+    stats->tx_rejected        = mqtt_counter_get(&m->tx_rejected);
+    stats->pending_subscribes = mqtt_counter_get(&m->pending_subscribes);
+    stats->connection_losses  = mqtt_counter_get(&m->connection_losses);
+    stats->reconnects         = mqtt_counter_get(&m->reconnects);
+    stats->reconnect_failures = mqtt_counter_get(&m->reconnect_failures);
+    stats->ping_timeouts      = mqtt_counter_get(&m->ping_timeouts);
+    mqtt_histogram_read(&m->ack_latency_us, &stats->ack_latency_us);
+    return 0;
+}
+
+int mqtt_client_publish_begin_batch(mqtt_client_t *client) {
+    if (client && client->reconnecting) return 0; // publishes are queued anyway
+    if (!client || !client->connected) {
+        MQTT_LOG_ERROR("mqtt_client_publish_begin_batch: not connected");
+        return -1;
+    }
+    if (client->batching) return 0;
+
+    if (mqtt_client_tx_reserve(client, client->batch_flush_bytes) != 0)
+        return -1;
+
+    // Corking lets the kernel fill whole segments across automatic flushes.
+    mqtt_transport_set_cork(mqtt_client_fd(client), true);
+    client->batching = true;
+    return 0;
+}
+
+int mqtt_client_flush(mqtt_client_t *client) {
+    if (client && client->reconnecting) return 0;
+    if (!client || !client->connected) {
+        MQTT_LOG_ERROR("mqtt_client_flush: not connected");
+        return -1;
+    }
+
+    int rc = mqtt_client_tx_flush(client);
+    if (rc == 0) rc = mqtt_client_drain_queue(client);
+    if (client->batching) {
+        // Uncorking pushes out whatever the kernel is still holding back.
+        mqtt_transport_set_cork(mqtt_client_fd(client), false);
+        client->batching = false;
+    }
+
+    if (rc != 0) {
+        MQTT_LOG_ERROR("Failed to flush batched PUBLISH packets");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Build SUBSCRIBE packets for all filters straight into tx_buf, packing
+ * as many filters per packet as MQTT_SUBSCRIBE_MAX_PACKET_SIZE allows,
+ * then send them with a single write. All or nothing: on error no
+ * pending entry stays registered, so no callback fires, and unless the
+ * write itself failed (the connection is then broken) no packet stays
+ * queued.
+ *
+ * @return number of SUBSCRIBE packets, or -1 on error
+ */
+static int mqtt_client_subscribe_packets(mqtt_client_t *client,
+                                         const char *const *filters,
+                                         const uint8_t *qos,
+                                         size_t count,
+                                         mqtt_suback_callback_t cb,
+                                         void *ctx,
+                                         uint16_t *last_packet_id) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!filters[i] || !mqtt_validate_topic_filter(filters[i], strlen(filters[i]))) {
+            MQTT_LOG_ERROR("Invalid topic filter at index %zu", i);
+            return -1;
+        }
+    }
+
+    // Where to roll back to. tx_reserve() may move the unsent bytes to
+    // the front of tx_buf, so the mark is kept relative to tx_off.
+    size_t tx_unsent = client->tx_len - client->tx_off;
+    size_t npending  = client->npending_subs;
+    size_t first = 0;
+    int packets = 0;
+
+    while (first < count) {
+        // Fixed header (<= 5) + packet id, then as many filters as fit.
+        size_t size = 5 + 2;
+        size_t n = 0;
+        while (first + n < count) {
+            size_t flen = strlen(filters[first + n]);
+            if (n > 0 && size + 2 + flen + 1 > MQTT_SUBSCRIBE_MAX_PACKET_SIZE)
+                break;
+            size += 2 + flen + 1;
+            n++;
+        }
+
+        if (client->npending_subs == client->pending_subs_cap) {
+            size_t cap = client->pending_subs_cap ? client->pending_subs_cap * 2 : 8;
+            mqtt_pending_sub_t *p = (mqtt_pending_sub_t *)realloc(
+                client->pending_subs, cap * sizeof(*p));
+            if (!p) {
+                MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+                goto fail;
+            }
+            client->pending_subs = p;
+            client->pending_subs_cap = cap;
+        }
+
+        uint16_t packet_id = mqtt_client_get_next_packet_id(client);
+        if (mqtt_client_find_pending_sub(client, packet_id)) {
+            MQTT_LOG_ERROR("Too many outstanding SUBSCRIBE packets");
+            goto fail;
+        }
+
+        if (mqtt_client_tx_reserve(client, size) != 0) goto fail;
+        int len = mqtt_encode_subscribe(client->tx_buf + client->tx_len,
+                                        client->tx_cap - client->tx_len,
+                                        packet_id, filters + first,
+                                        qos ? qos + first : NULL, n);
+        if (len < 0) {
+            MQTT_LOG_ERROR("Failed to encode SUBSCRIBE packet");
+            goto fail;
+        }
+        client->tx_len += (size_t)len;
+
+        mqtt_pending_sub_t *p = &client->pending_subs[client->npending_subs++];
+        p->packet_id   = packet_id;
+        p->first_index = first;
+        p->count       = n;
+        p->cb          = cb;
+        p->ctx         = ctx;
+
+        *last_packet_id = packet_id;
+        first += n;
+        packets++;
+    }
+    for (int i = 0; i < packets; ++i)
+        mqtt_client_count_out(client, (uint8_t)(MQTT_PACKET_SUBSCRIBE << 4));
+    mqtt_client_update_gauges(client);
+
+    if (!client->batching && mqtt_client_tx_flush(client) != 0) {
+        // Some of the bytes may be on the wire already: only the pending
+        // entries can be taken back.
+        MQTT_LOG_ERROR("Failed to send SUBSCRIBE packet");
+        client->npending_subs = npending;
+        mqtt_client_update_gauges(client);
+        return -1;
+    }
+    return packets;
+
+fail:
+    client->tx_len = client->tx_off + tx_unsent;
+    client->npending_subs = npending;
+    return -1;
+}
+
+int mqtt_client_subscribe_many(mqtt_client_t *client,
+                               const char *const *filters,
+                               const uint8_t *qos,
+                               size_t count,
+                               mqtt_suback_callback_t cb,
+                               void *ctx) {
+    if (!client || !client->connected) {
+        MQTT_LOG_ERROR("mqtt_client_subscribe_many: not connected");
+        return -1;
+    }
+    if (!filters || count == 0) return -1;
+
+    uint16_t last_id = 0;
+    return mqtt_client_subscribe_packets(client, filters, qos, count,
+                                         cb, ctx, &last_id);
+}
+
+int mqtt_client_add_handler(mqtt_client_t *client,
+                            const char *filter,
+                            mqtt_topic_handler_t handler,
+                            void *ctx) {
+    if (!client || !filter) return -1;
+    return mqtt_topic_trie_insert(&client->routes, filter, strlen(filter),
+                                  handler, ctx);
+}
+
+int mqtt_client_remove_handler(mqtt_client_t *client, const char *filter) {
+    if (!client || !filter) return -1;
+    return mqtt_topic_trie_remove(&client->routes, filter, strlen(filter));
+}
+
+int mqtt_client_subscribe_handler(mqtt_client_t *client,
+                                  const char *filter,
+                                  uint8_t qos,
+                                  mqtt_topic_handler_t handler,
+                                  void *ctx) {
+    if (!client || !client->connected) {
+        MQTT_LOG_ERROR("mqtt_client_subscribe_handler: not connected");
+        return -1;
+    }
+    if (qos > 2) return -1;
+
+    // Route first: messages may follow the SUBACK immediately. On failure
+    // the filter gets back whatever handler it had before.
+    mqtt_topic_handler_t old_handler = NULL;
+    void *old_ctx = NULL;
+    bool had = filter && mqtt_topic_trie_get(&client->routes, filter, strlen(filter),
+                                             &old_handler, &old_ctx);
+    if (mqtt_client_add_handler(client, filter, handler, ctx) != 0) return -1;
+
+    uint16_t packet_id = 0;
+    if (mqtt_client_subscribe_packets(client, &filter, &qos, 1,
+                                      NULL, NULL, &packet_id) < 0) {
+        if (had) mqtt_client_add_handler(client, filter, old_handler, old_ctx);
+        else     mqtt_client_remove_handler(client, filter);
+        return -1;
+    }
+    return 0;
+}
+
+size_t mqtt_client_pending_subscribe_count(const mqtt_client_t *client) {
+    return client ? client->npending_subs : 0;
+}
+
+static void mqtt_client_subscribe_qos0_done(uint16_t packet_id,
+                                            size_t first_index,
+                                            const uint8_t *return_codes,
+                                            size_t count,
+                                            void *ctx) {
+    (void)packet_id;
+    (void)first_index;
+    *(int *)ctx = (return_codes && count == 1 && return_codes[0] != 0x80) ? 0 : -1;
+}
+
+int mqtt_client_subscribe_qos0(mqtt_client_t *client,
+                               const char *topic) {
+    if (!client || !client->connected) {
+        MQTT_LOG_ERROR("mqtt_client_subscribe_qos0: not connected");
+        return -1;
+    }
+
+    // In non-blocking mode this call returns before the SUBACK, so no
+    // callback may point at this stack frame.
+    int result = 1; // still pending
+    uint16_t packet_id = 0;
+    if (mqtt_client_subscribe_packets(client, &topic, NULL, 1,
+                                      client->nonblocking ? NULL
+                                                          : mqtt_client_subscribe_qos0_done,
+                                      client->nonblocking ? NULL : &result,
+                                      &packet_id) < 0) {
+        return -1;
+    }
+
+    // An event loop owns the socket; the SUBACK arrives through mqtt_client_loop.
+    if (client->nonblocking) return 0;
+
+    // From here on the pending entry points at `result` on this stack;
+    // every failure must drop it before returning.
+
+    // In batch mode the SUBSCRIBE is still queued; the SUBACK we are about
+    // to wait for cannot come before it goes out.
+    if (client->batching && mqtt_client_tx_flush_now(client) != 0) {
+        MQTT_LOG_ERROR("Failed to send SUBSCRIBE packet");
+        goto lost;
+    }
+
+    // Wait for our SUBACK, dispatching anything that arrives before it.
+    while (mqtt_client_find_pending_sub(client, packet_id)) {
+        size_t frame_len = 0;
+        if (mqtt_client_rx_read_frame(client, &frame_len) != 0) {
+            MQTT_LOG_ERROR("Error receiving SUBACK");
+            goto lost;
+        }
+        int rc = mqtt_client_handle_packet(client, client->rx_buf, frame_len);
+        if (!client->connected) goto fail;
+        mqtt_client_rx_consume(client, frame_len);
+        if (rc != 0) goto lost;
+    }
+
+    if (result != 0) {
+        MQTT_LOG_WARN("Subscription to '%s' refused", topic);
+        return -1;
+    }
+
+    MQTT_LOG_INFO("SUBACK received → subscription to '%s' successful.", topic);
+    return 0;
+
+lost:
+    mqtt_client_forget_pending_sub(client, packet_id);
+    mqtt_client_connection_lost(client);
+    return -1;
+fail:
+    mqtt_client_forget_pending_sub(client, packet_id);
+    return -1;
+}
+
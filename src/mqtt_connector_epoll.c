@@ -0,0 +1,287 @@
+#include "mqtt_connector.h"
+#include "mqtt_resolver.h"
+#include "mqtt_transport.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+/* epoll data tags; everything below is an index into addrs. */
+#define MQTT_CONNECTOR_TAG_RESOLVE UINT32_MAX
+#define MQTT_CONNECTOR_TAG_TIMER   (UINT32_MAX - 1)
+
+struct mqtt_connector {
+    int             epfd;       // what the caller polls
+    int             notifyfd;   // eventfd written by the resolver, -1 once resolved
+    int             timerfd;    // next attempt is due
+    char           *host;       // for log messages
+    uint16_t        port;
+    mqtt_resolve_t *resolve;    // NULL once resolved
+
+    // Addresses in the order they are tried, and one socket per address
+    // while its attempt runs.
+    mqtt_resolved_addr_t addrs[MQTT_RESOLVE_MAX_ADDRS];
+    int                  socks[MQTT_RESOLVE_MAX_ADDRS];
+    size_t               naddrs;
+    size_t               next;      // first address not tried yet
+    size_t               active;    // attempts running
+};
+
+static int mqtt_connector_watch(mqtt_connector_t *c, int fd, uint32_t events, uint32_t tag) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(c->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        MQTT_LOG_ERROR("epoll_ctl: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Take the resolved addresses, alternating between address families and
+ * starting with the family getaddrinfo() preferred (RFC 8305 section 4).
+ */
+static void mqtt_connector_sort(mqtt_connector_t *c, const mqtt_resolved_addr_t *addrs,
+                                size_t naddrs) {
+    sa_family_t first = addrs[0].addr.ss_family;
+    size_t a = 0, b = 0;    // next of the first family / of the others
+
+    c->naddrs = 0;
+    while (c->naddrs < naddrs) {
+        bool took = false;
+        while (a < naddrs && addrs[a].addr.ss_family != first) a++;
+        if (a < naddrs) {
+            c->addrs[c->naddrs++] = addrs[a++];
+            took = true;
+        }
+        while (b < naddrs && addrs[b].addr.ss_family == first) b++;
+        if (b < naddrs) {
+            c->addrs[c->naddrs++] = addrs[b++];
+            took = true;
+        }
+        if (!took) break;
+    }
+}
+
+static void mqtt_connector_arm_timer(mqtt_connector_t *c, uint32_t ms) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec  = ms / 1000;
+    its.it_value.tv_nsec = (long)(ms % 1000) * 1000000L;
+    if (timerfd_settime(c->timerfd, 0, &its, NULL) != 0)
+        MQTT_LOG_ERROR("timerfd_settime: %s", strerror(errno));
+}
+
+static void mqtt_connector_drop(mqtt_connector_t *c, size_t i) {
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->socks[i], NULL);
+    close(c->socks[i]);
+    c->socks[i] = -1;
+    c->active--;
+}
+
+/* Hand socket i to the caller and cancel the other attempts. */
+static int mqtt_connector_win(mqtt_connector_t *c, size_t i) {
+    int fd = c->socks[i];
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, fd, NULL);
+    c->socks[i] = -1;
+    c->active--;
+
+    for (size_t j = 0; j < c->next; j++) {
+        if (c->socks[j] >= 0) mqtt_connector_drop(c, j);
+    }
+    c->next = c->naddrs;
+    mqtt_connector_arm_timer(c, 0);
+    return fd;
+}
+
+/*
+ * Start attempts until one is in progress or the addresses run out.
+ *
+ * @return connected socket, or MQTT_TRANSPORT_WOULD_BLOCK
+ */
+static int mqtt_connector_attempt(mqtt_connector_t *c) {
+    while (c->next < c->naddrs) {
+        size_t i = c->next++;
+        const mqtt_resolved_addr_t *a = &c->addrs[i];
+
+        int fd = socket(a->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            MQTT_LOG_ERROR("socket: %s", strerror(errno));
+            continue;
+        }
+        c->socks[i] = fd;
+        c->active++;
+
+        if (connect(fd, (const struct sockaddr *)&a->addr, a->len) == 0)
+            return mqtt_connector_win(c, i);
+        if (errno != EINPROGRESS) {
+            MQTT_LOG_DEBUG("connect: %s", strerror(errno));
+            c->socks[i] = -1;
+            c->active--;
+            close(fd);
+            continue;
+        }
+        if (mqtt_connector_watch(c, fd, EPOLLOUT, (uint32_t)i) != 0) {
+            c->socks[i] = -1;
+            c->active--;
+            close(fd);
+            continue;
+        }
+        mqtt_connector_arm_timer(c, MQTT_CONNECTOR_ATTEMPT_DELAY_MS);
+        break;
+    }
+    return MQTT_TRANSPORT_WOULD_BLOCK;
+}
+
+/*
+ * @return 1 once addresses are known, 0 while the lookup runs, -1 if it
+ *         failed
+ */
+static int mqtt_connector_resolved(mqtt_connector_t *c) {
+    if (!c->resolve) return 1;
+
+    // Clear the wakeup first so an answer arriving now sets it again.
+    uint64_t v;
+    if (read(c->notifyfd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+        MQTT_LOG_ERROR("read(eventfd): %s", strerror(errno));
+
+    const mqtt_resolved_addr_t *addrs;
+    size_t naddrs;
+    int rc = mqtt_resolve_result(c->resolve, &addrs, &naddrs);
+    if (rc <= 0) return rc;
+
+    mqtt_connector_sort(c, addrs, naddrs);
+    mqtt_resolve_free(c->resolve);
+    c->resolve = NULL;
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->notifyfd, NULL);
+    close(c->notifyfd);
+    c->notifyfd = -1;
+    return 1;
+}
+
+mqtt_connector_t *mqtt_connector_start(const char *host, uint16_t port) {
+    mqtt_connector_t *c = (mqtt_connector_t *)calloc(1, sizeof(*c));
+    if (!c) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    c->epfd = c->notifyfd = c->timerfd = -1;
+    c->port = port;
+    for (size_t i = 0; i < MQTT_RESOLVE_MAX_ADDRS; i++) {
+        c->socks[i] = -1;
+    }
+
+    c->host = strdup(host);
+    if (!c->host) {
+        MQTT_LOG_ERROR("strdup: %s", strerror(errno));
+        goto fail;
+    }
+    c->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (c->epfd < 0) {
+        MQTT_LOG_ERROR("epoll_create1: %s", strerror(errno));
+        goto fail;
+    }
+    c->notifyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->notifyfd < 0) {
+        MQTT_LOG_ERROR("eventfd: %s", strerror(errno));
+        goto fail;
+    }
+    c->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (c->timerfd < 0) {
+        MQTT_LOG_ERROR("timerfd_create: %s", strerror(errno));
+        goto fail;
+    }
+    if (mqtt_connector_watch(c, c->notifyfd, EPOLLIN, MQTT_CONNECTOR_TAG_RESOLVE) != 0 ||
+        mqtt_connector_watch(c, c->timerfd, EPOLLIN, MQTT_CONNECTOR_TAG_TIMER) != 0)
+        goto fail;
+
+    c->resolve = mqtt_resolve_start(host, port, c->notifyfd);
+    if (!c->resolve) goto fail;
+
+    // Cache hits and numeric hosts need no wakeup; make the first poll
+    // see them anyway.
+    uint64_t one = 1;
+    if (write(c->notifyfd, &one, sizeof(one)) < 0)
+        MQTT_LOG_ERROR("write(eventfd): %s", strerror(errno));
+    return c;
+
+fail:
+    mqtt_connector_free(c);
+    return NULL;
+}
+
+int mqtt_connector_fd(const mqtt_connector_t *c) {
+    return c->epfd;
+}
+
+int mqtt_connector_poll(mqtt_connector_t *c) {
+    int rc = mqtt_connector_resolved(c);
+    if (rc < 0) {
+        MQTT_LOG_ERROR("Failed to resolve %s", c->host);
+        return -1;
+    }
+    if (rc == 0) return MQTT_TRANSPORT_WOULD_BLOCK;
+
+    struct epoll_event events[MQTT_RESOLVE_MAX_ADDRS + 2];
+    int n = epoll_wait(c->epfd, events, (int)(sizeof(events) / sizeof(events[0])), 0);
+    if (n < 0 && errno != EINTR) {
+        MQTT_LOG_ERROR("epoll_wait: %s", strerror(errno));
+        return -1;
+    }
+
+    bool due = false;   // the running attempt had its head start
+    for (int k = 0; k < n; k++) {
+        uint32_t tag = events[k].data.u32;
+        if (tag == MQTT_CONNECTOR_TAG_RESOLVE) continue;
+        if (tag == MQTT_CONNECTOR_TAG_TIMER) {
+            uint64_t v;
+            if (read(c->timerfd, &v, sizeof(v)) > 0) due = true;
+            continue;
+        }
+
+        size_t i = tag;
+        if (c->socks[i] < 0) continue;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->socks[i], SOL_SOCKET, SO_ERROR, &err, &len) != 0) err = errno;
+        if (err == 0) return mqtt_connector_win(c, i);
+
+        MQTT_LOG_DEBUG("connect: %s", strerror(err));
+        mqtt_connector_drop(c, i);
+    }
+
+    if (due || c->active == 0) {
+        int fd = mqtt_connector_attempt(c);
+        if (fd >= 0) return fd;
+    }
+
+    if (c->active == 0 && c->next >= c->naddrs) {
+        MQTT_LOG_ERROR("Failed to connect to %s:%u", c->host, (unsigned int)c->port);
+        return -1;
+    }
+    return MQTT_TRANSPORT_WOULD_BLOCK;
+}
+
+void mqtt_connector_free(mqtt_connector_t *c) {
+    if (!c) return;
+
+    // Before closing notifyfd, which the resolver writes until then.
+    mqtt_resolve_free(c->resolve);
+    for (size_t i = 0; i < MQTT_RESOLVE_MAX_ADDRS; i++) {
+        if (c->socks[i] >= 0) close(c->socks[i]);
+    }
+    if (c->notifyfd >= 0) close(c->notifyfd);
+    if (c->timerfd >= 0) close(c->timerfd);
+    if (c->epfd >= 0) close(c->epfd);
+    free(c->host);
+    free(c);
+}
@@ -1,89 +1,276 @@
 #include "mqtt_decode.h"
+#include "mqtt_log.h"
+#include "mqtt_validate.h"
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 
+int mqtt_decode_remaining_length(const uint8_t *buf, size_t len,
+                                 size_t *remaining_len) {
+    size_t value = 0;
+    size_t multiplier = 1;
+
+    for (size_t i = 0; i < 4; ++i) {
+        if (i >= len) return 0; // need more bytes
+
+        value += (size_t)(buf[i] & 0x7F) * multiplier;
+        if ((buf[i] & 0x80) == 0) {
+            *remaining_len = value;
+            return (int)(i + 1);
+        }
+        multiplier *= 128;
+    }
+
+    // Continuation bit set on the 4th byte: not a valid MQTT length
+    return -1;
+}
+
+int mqtt_decode_frame(const uint8_t *buf, size_t len, size_t *frame_len) {
+    if (len < 2) return 0;
+
+    size_t remaining_len = 0;
+    int n = mqtt_decode_remaining_length(&buf[1], len - 1, &remaining_len);
+    if (n <= 0) return n;
+
+    // Report the full size even if not all of it has arrived yet, so the
+    // caller can make room for it before the next read.
+    *frame_len = 1 + (size_t)n + remaining_len;
+
+    return len >= *frame_len ? 1 : 0;
+}
+
 int mqtt_decode_connack(const uint8_t *buf, size_t len) {
+    bool session_present = false;
+    uint8_t return_code = 0;
+    return mqtt_decode_connack_ex(buf, len, &session_present, &return_code);
+}
+
+int mqtt_decode_connack_ex(const uint8_t *buf, size_t len,
+                           bool *session_present,
+                           uint8_t *return_code) {
     if (len < 4) return -1;
 
     if (buf[0] != 0x20) {
-        fprintf(stderr, "Not a CONNACK packet\n");
+        MQTT_LOG_ERROR("Not a CONNACK packet");
+        return -1;
+    }
+
+    if (buf[1] != 2 || (buf[2] & 0xFE) != 0) {
+        MQTT_LOG_ERROR("Malformed CONNACK packet");
         return -1;
     }
 
-    // buf[1] = remaining length (expect 2)
+    *session_present = (buf[2] & 0x01) != 0;
+    *return_code = buf[3];
+
     if (buf[3] != 0) {
-        fprintf(stderr, "CONNACK error code: %d\n", buf[3]);
+        MQTT_LOG_ERROR("CONNACK error code: %d", buf[3]);
         return -1;
     }
 
     return 0;
 }
 
-int mqtt_decode_suback(const uint8_t *buf, size_t len) {
+int mqtt_decode_suback(const uint8_t *buf, size_t len,
+                       uint16_t *packet_id,
+                       const uint8_t **return_codes,
+                       size_t *count) {
     if (len < 5) {
-        fprintf(stderr, "SUBACK too short\n");
+        MQTT_LOG_ERROR("SUBACK too short");
         return -1;
     }
 
     if ((buf[0] & 0xF0) != 0x90) {
-        fprintf(stderr, "Not a SUBACK packet\n");
+        MQTT_LOG_ERROR("Not a SUBACK packet");
         return -1;
     }
 
-    // buf[1] = remaining length, should be >= 3 (packet id + one return code)
-    uint8_t return_code = buf[len - 1];
-    if (return_code == 0x80) {
-        fprintf(stderr, "Subscription failed (return code 0x80)\n");
+    size_t remaining_len = 0;
+    int n = mqtt_decode_remaining_length(&buf[1], len - 1, &remaining_len);
+    if (n <= 0 || remaining_len < 3 || len != 1 + (size_t)n + remaining_len) {
+        MQTT_LOG_ERROR("SUBACK: bad remaining length");
         return -1;
     }
 
+    const uint8_t *ptr = &buf[1 + n];
+    *packet_id    = (uint16_t)((ptr[0] << 8) | ptr[1]);
+    *return_codes = ptr + 2;
+    *count        = remaining_len - 2;
+
     return 0;
 }
 
-int mqtt_decode_publish_qos0(const uint8_t *buf, size_t len,
-                             char *topic_buf, size_t topic_buf_size,
-                             const uint8_t **payload,
-                             size_t *payload_len) {
-    if (len < 4) return -1;
+int mqtt_decode_ack(const uint8_t *buf, size_t len, uint16_t *packet_id) {
+    if (len != 4) {
+        MQTT_LOG_ERROR("Malformed acknowledgement: %zu bytes", len);
+        return -1;
+    }
 
-    uint8_t packet_type = buf[0] >> 4;
-    if (packet_type != 3) {
-        fprintf(stderr, "Not a PUBLISH packet\n");
+    // PUBREL has flags 0010, the others 0000 [MQTT-3.6.1-1].
+    uint8_t type = buf[0] >> 4;
+    uint8_t flags = type == MQTT_PACKET_PUBREL ? 0x02 : 0x00;
+    if (type < MQTT_PACKET_PUBACK || type > MQTT_PACKET_PUBCOMP ||
+        (buf[0] & 0x0F) != flags || buf[1] != 0x02) {
+        MQTT_LOG_ERROR("Malformed acknowledgement (type %u)", (unsigned int)type);
         return -1;
     }
 
-    uint8_t remaining_len = buf[1];
-    if (len < (size_t)(2 + remaining_len)) {
-        fprintf(stderr, "PUBLISH: incomplete packet\n");
+    *packet_id = (uint16_t)((buf[2] << 8) | buf[3]);
+    return 0;
+}
+
+/*
+ * PUBLISH variable header and payload: `p` points past the fixed
+ * header, whose first byte is `header`.
+ *
+ * @return 0 = success, -1 = malformed
+ */
+static int mqtt_decode_publish_body(uint8_t header, const uint8_t *p,
+                                    size_t remaining_len,
+                                    mqtt_publish_view_t *out) {
+    uint8_t qos = (header >> 1) & 0x03;
+    bool dup = (header & 0x08) != 0;
+    if (qos == 3 || (qos == 0 && dup)) return -1;   // [MQTT-3.3.1-4], [MQTT-3.3.1-2]
+
+    if (remaining_len < 2) return -1;
+    size_t topic_len = ((size_t)p[0] << 8) | p[1];
+    size_t fixed = 2 + topic_len + (qos > 0 ? 2 : 0);
+    if (remaining_len < fixed) return -1;
+    if (!mqtt_validate_topic_name((const char *)p + 2, topic_len)) return -1;
+
+    out->topic     = (const char *)p + 2;
+    out->topic_len = topic_len;
+    out->packet_id = 0;
+    if (qos > 0) {
+        out->packet_id = (uint16_t)((p[2 + topic_len] << 8) | p[3 + topic_len]);
+        if (out->packet_id == 0) return -1;             // [MQTT-2.3.1-1]
+    }
+    out->payload     = p + fixed;
+    out->payload_len = remaining_len - fixed;
+    out->qos         = qos;
+    out->retain      = (header & 0x01) != 0;
+    out->dup         = dup;
+    return 0;
+}
+
+int mqtt_decode_publish_view(const uint8_t *buf, size_t len,
+                             mqtt_publish_view_t *out) {
+    if (len < 2) return -1;
+
+    if ((buf[0] >> 4) != MQTT_PACKET_PUBLISH) {
+        MQTT_LOG_ERROR("Not a PUBLISH packet");
         return -1;
     }
 
-    const uint8_t *ptr = &buf[2];
-    size_t bytes_left = remaining_len;
+    size_t remaining_len = 0;
+    int n = mqtt_decode_remaining_length(&buf[1], len - 1, &remaining_len);
+    if (n <= 0 || len < 1 + (size_t)n + remaining_len) {
+        MQTT_LOG_ERROR("PUBLISH: incomplete packet");
+        return -1;
+    }
 
-    if (bytes_left < 2) return -1;
+    if (mqtt_decode_publish_body(buf[0], &buf[1 + n], remaining_len, out) != 0) {
+        MQTT_LOG_ERROR("Malformed PUBLISH packet");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * What a server may send, by packet type: the low nibble the first byte
+ * must carry and the exact remaining length (-1 = variable). Types a
+ * server never sends are left zeroed.
+ */
+typedef struct {
+    bool    from_server;
+    uint8_t flags;
+    int     remaining_len;
+} mqtt_packet_rule_t;
 
-    uint16_t topic_len = (uint16_t)(ptr[0] << 8) | ptr[1];
-    ptr += 2;
-    bytes_left -= 2;
+static const mqtt_packet_rule_t mqtt_packet_rules[16] = {
+    [MQTT_PACKET_CONNACK]  = { true, 0x0,  2 },
+    [MQTT_PACKET_PUBLISH]  = { true, 0x0, -1 },  // flags vary, see the body
+    [MQTT_PACKET_PUBACK]   = { true, 0x0,  2 },
+    [MQTT_PACKET_PUBREC]   = { true, 0x0,  2 },
+    [MQTT_PACKET_PUBREL]   = { true, 0x2,  2 },
+    [MQTT_PACKET_PUBCOMP]  = { true, 0x0,  2 },
+    [MQTT_PACKET_SUBACK]   = { true, 0x0, -1 },
+    [MQTT_PACKET_UNSUBACK] = { true, 0x0,  2 },
+    [MQTT_PACKET_PINGRESP] = { true, 0x0,  0 },
+};
 
-    if (bytes_left < topic_len) return -1;
-    if (topic_len + 1 > topic_buf_size) {
-        fprintf(stderr, "Topic buffer too small\n");
+int mqtt_decode_packet(const uint8_t *buf, size_t len, mqtt_packet_t *out) {
+    if (len < 2) return -1;
+
+    uint8_t type = buf[0] >> 4;
+    const mqtt_packet_rule_t *rule = &mqtt_packet_rules[type];
+    if (!rule->from_server) return -1;
+    if (type != MQTT_PACKET_PUBLISH && (buf[0] & 0x0F) != rule->flags) return -1;
+
+    size_t remaining_len = 0;
+    int n = mqtt_decode_remaining_length(&buf[1], len - 1, &remaining_len);
+    if (n <= 0 || len != 1 + (size_t)n + remaining_len) return -1;
+    if (rule->remaining_len >= 0 && remaining_len != (size_t)rule->remaining_len)
         return -1;
+
+    const uint8_t *p = &buf[1 + n];
+    out->type = (mqtt_packet_type_t)type;
+    out->packet_id = 0;
+
+    switch (type) {
+    case MQTT_PACKET_CONNACK:
+        // Session present only with an accepted connection [MQTT-3.2.2-4].
+        if ((p[0] & 0xFE) != 0 || p[1] > 5 || (p[1] != 0 && p[0] != 0)) return -1;
+        out->connack.session_present = p[0] != 0;
+        out->connack.return_code     = p[1];
+        return 0;
+
+    case MQTT_PACKET_PUBLISH:
+        if (mqtt_decode_publish_body(buf[0], p, remaining_len, &out->publish) != 0)
+            return -1;
+        out->packet_id = out->publish.packet_id;
+        return 0;
+
+    case MQTT_PACKET_PINGRESP:
+        return 0;
+
+    case MQTT_PACKET_SUBACK:
+        if (remaining_len < 3) return -1;
+        for (size_t i = 2; i < remaining_len; ++i) {
+            if (p[i] > 2 && p[i] != 0x80) return -1;
+        }
+        out->suback.return_codes = p + 2;
+        out->suback.count        = remaining_len - 2;
+        break;
+
+    default:    // PUBACK, PUBREC, PUBREL, PUBCOMP, UNSUBACK
+        break;
     }
 
-    memcpy(topic_buf, ptr, topic_len);
-    topic_buf[topic_len] = '\0';
+    out->packet_id = (uint16_t)((p[0] << 8) | p[1]);
+    return out->packet_id != 0 ? 0 : -1;
+}
+
+int mqtt_decode_publish_qos0(const uint8_t *buf, size_t len,
+                             char *topic_buf, size_t topic_buf_size,
+                             const uint8_t **payload,
+                             size_t *payload_len) {
+    mqtt_publish_view_t view;
+    if (mqtt_decode_publish_view(buf, len, &view) != 0) return -1;
 
-    ptr += topic_len;
-    bytes_left -= topic_len;
+    // QoS0 => no packet identifier field, payload follows the topic
+    if (view.qos != 0) return -1;
+
+    if (view.topic_len + 1 > topic_buf_size) {
+        MQTT_LOG_ERROR("Topic buffer too small");
+        return -1;
+    }
 
-    // QoS0 => no packet identifier field, payload starts here
-    *payload = ptr;
-    *payload_len = bytes_left;
+    memcpy(topic_buf, view.topic, view.topic_len);
+    topic_buf[view.topic_len] = '\0';
 
+    *payload = view.payload;
+    *payload_len = view.payload_len;
     return 0;
 }
 
@@ -1,39 +1,121 @@
 #include "mqtt_encode.h"
+#include "mqtt_validate.h"
 #include <stdint.h>
 #include <string.h>
 
-/* Helper: write MQTT UTF-8 string (2-byte length prefix) */
-static uint8_t *encode_string(uint8_t *ptr, const char *str) {
-    size_t len = strlen(str);
+/* Helper: write MQTT binary data (2-byte length prefix) */
+static uint8_t *encode_bytes(uint8_t *ptr, const void *data, size_t len) {
     *ptr++ = (uint8_t)(len >> 8);
     *ptr++ = (uint8_t)(len & 0xFF);
-    memcpy(ptr, str, len);
+    if (len > 0) memcpy(ptr, data, len);
     return ptr + len;
 }
 
-/* Remaining length encoder (only supports <128 for simplicity). */
+/* Helper: write MQTT UTF-8 string (2-byte length prefix), validated by the caller */
+static uint8_t *encode_string(uint8_t *ptr, const char *str) {
+    return encode_bytes(ptr, str, strlen(str));
+}
+
+/* Largest value the 4-byte remaining length field can carry. */
+#define MQTT_MAX_REMAINING_LENGTH 268435455u
+
+/* Remaining length encoder (1..4 bytes, 7 bits per byte). */
 static int encode_remaining_length(uint8_t *ptr, size_t remaining_len) {
-    if (remaining_len > 127) {
-        return -1; // simple client, no multi-byte remaining length
+    if (remaining_len > MQTT_MAX_REMAINING_LENGTH) {
+        return -1;
+    }
+
+    int n = 0;
+    do {
+        uint8_t byte = (uint8_t)(remaining_len % 128);
+        remaining_len /= 128;
+        if (remaining_len > 0) byte |= 0x80;
+        ptr[n++] = byte;
+    } while (remaining_len > 0);
+
+    return n;
+}
+
+/* Whole packet size for a remaining length, 0 if it cannot be encoded. */
+static size_t packet_size(size_t remaining_len) {
+    if (remaining_len > MQTT_MAX_REMAINING_LENGTH) return 0;
+    size_t rl_len = remaining_len < 128 ? 1 : remaining_len < 16384 ? 2
+                  : remaining_len < 2097152 ? 3 : 4;
+    return 1 + rl_len + remaining_len;
+}
+
+/*
+ * Check CONNECT options and work out the connect flags.
+ *
+ * @return remaining length, or 0 if the options are invalid
+ */
+static size_t connect_remaining_length(const mqtt_connect_options_t *opts,
+                                       uint8_t *flags) {
+    if (!opts || !opts->client_id) return 0;
+
+    size_t client_id_len = strlen(opts->client_id);
+    if (client_id_len > 0xFFFF || !mqtt_validate_utf8(opts->client_id, client_id_len))
+        return 0;
+
+    // Variable header: protocol name (2+4) + level + flags + keep alive (2)
+    size_t len = 10 + 2 + client_id_len;
+    uint8_t f = opts->clean_session ? 0x02 : 0x00;
+
+    if (opts->will_topic) {
+        size_t topic_len = strlen(opts->will_topic);
+        if (!mqtt_validate_topic_name(opts->will_topic, topic_len) || opts->will_qos > 2 ||
+            opts->will_payload_len > 0xFFFF ||
+            (opts->will_payload_len > 0 && !opts->will_payload)) {
+            return 0;
+        }
+        f |= (uint8_t)(0x04 | (opts->will_qos << 3) | (opts->will_retain ? 0x20 : 0x00));
+        len += 2 + topic_len + 2 + opts->will_payload_len;
+    }
+    if (opts->username) {
+        size_t username_len = strlen(opts->username);
+        if (username_len > 0xFFFF || !mqtt_validate_utf8(opts->username, username_len))
+            return 0;
+        f |= 0x80;
+        len += 2 + username_len;
     }
-    *ptr = (uint8_t)remaining_len;
-    return 1;
+    if (opts->password) {
+        size_t password_len = strlen(opts->password);
+        if (!opts->username || password_len > 0xFFFF) return 0; // [MQTT-3.1.2-22]
+        f |= 0x40;
+        len += 2 + password_len;
+    }
+
+    *flags = f;
+    return len;
 }
 
 int mqtt_encode_connect(uint8_t *buf, size_t bufsize,
                         const char *client_id,
                         uint16_t keep_alive) {
+    mqtt_connect_options_t opts = {
+        .client_id     = client_id,
+        .keep_alive    = keep_alive,
+        .clean_session = true,
+    };
+    return mqtt_encode_connect_ex(buf, bufsize, &opts);
+}
+
+size_t mqtt_encode_connect_size(const mqtt_connect_options_t *opts) {
+    uint8_t flags;
+    size_t remaining_len = connect_remaining_length(opts, &flags);
+    return remaining_len ? packet_size(remaining_len) : 0;
+}
+
+int mqtt_encode_connect_ex(uint8_t *buf, size_t bufsize,
+                           const mqtt_connect_options_t *opts) {
 
     const char *protocol_name = "MQTT";
     uint8_t protocol_level = 4; // MQTT v3.1.1
-    uint8_t connect_flags = 0;  // no will, no username, no password
-
-    size_t payload_len = 2 + strlen(client_id); // length-prefix + client_id
-    size_t vh_len      = 10; // protocol name (2+4) + level + flags + keep_alive(2)
-    size_t remaining_len = vh_len + payload_len;
+    uint8_t connect_flags = 0;
 
-    if (remaining_len > 127) return -1;
-    if (bufsize < remaining_len + 2) return -1;
+    size_t remaining_len = connect_remaining_length(opts, &connect_flags);
+    if (remaining_len == 0) return -1;
+    if (bufsize < packet_size(remaining_len)) return -1;
 
     uint8_t *ptr = buf;
 
@@ -45,11 +127,17 @@ int mqtt_encode_connect(uint8_t *buf, size_t bufsize,
     ptr = encode_string(ptr, protocol_name); // Protocol Name
     *ptr++ = protocol_level;                // Protocol Level
     *ptr++ = connect_flags;                 // Connect Flags
-    *ptr++ = (uint8_t)(keep_alive >> 8);    // Keep Alive MSB
-    *ptr++ = (uint8_t)(keep_alive & 0xFF);  // Keep Alive LSB
+    *ptr++ = (uint8_t)(opts->keep_alive >> 8);   // Keep Alive MSB
+    *ptr++ = (uint8_t)(opts->keep_alive & 0xFF); // Keep Alive LSB
 
-    // Payload (Client ID)
-    ptr = encode_string(ptr, client_id);
+    // Payload, in the order the flags announce it
+    ptr = encode_string(ptr, opts->client_id);
+    if (opts->will_topic) {
+        ptr = encode_string(ptr, opts->will_topic);
+        ptr = encode_bytes(ptr, opts->will_payload, opts->will_payload_len);
+    }
+    if (opts->username) ptr = encode_string(ptr, opts->username);
+    if (opts->password) ptr = encode_string(ptr, opts->password);
 
     return (int)(ptr - buf);
 }
@@ -58,23 +146,60 @@ int mqtt_encode_publish_qos0(uint8_t *buf, size_t bufsize,
                              const char *topic,
                              const uint8_t *payload,
                              size_t payload_len) {
+    return mqtt_encode_publish(buf, bufsize, topic, payload, payload_len,
+                               0, false, 0);
+}
 
-    size_t topic_len    = strlen(topic);
-    size_t vh_len       = 2 + topic_len; // topic length prefix + topic
-    size_t remaining_len = vh_len + payload_len;
+int mqtt_encode_topic(uint8_t *buf, size_t bufsize,
+                      const char *topic, size_t topic_len) {
+    if (!mqtt_validate_topic_name(topic, topic_len)) return -1;
+    if (bufsize < 2 + topic_len) return -1;
+    return (int)(encode_bytes(buf, topic, topic_len) - buf);
+}
 
-    if (remaining_len > 127) return -1;
-    if (bufsize < remaining_len + 2) return -1;
+int mqtt_encode_publish_fixed_header(uint8_t *buf, size_t bufsize,
+                                     uint8_t qos, bool retain,
+                                     size_t remaining_len) {
+    if (qos > 2 || bufsize < 5) return -1;
 
-    uint8_t *ptr = buf;
+    buf[0] = (uint8_t)(0x30 | (qos << 1) | (retain ? 0x01 : 0x00));
+    int n = encode_remaining_length(buf + 1, remaining_len);
+    return n < 0 ? -1 : 1 + n;
+}
 
-    // Fixed header: PUBLISH, QoS 0, DUP=0, RETAIN=0
-    *ptr++ = 0x30; // 0011 0000
+size_t mqtt_encode_publish_size(size_t topic_len, size_t payload_len, uint8_t qos) {
+    if (qos > 2 || topic_len > 0xFFFF) return 0;
+    if (payload_len > MQTT_MAX_REMAINING_LENGTH) return 0; // keeps the sum below from wrapping
+    return packet_size(2 + topic_len + (qos > 0 ? 2 : 0) + payload_len);
+}
+
+int mqtt_encode_publish(uint8_t *buf, size_t bufsize,
+                        const char *topic,
+                        const uint8_t *payload,
+                        size_t payload_len,
+                        uint8_t qos,
+                        bool retain,
+                        uint16_t packet_id) {
 
-    ptr += encode_remaining_length(ptr, remaining_len);
+    if (qos > 0 && packet_id == 0) return -1;
 
-    // Variable header: Topic Name
+    size_t topic_len = strlen(topic);
+    if (!mqtt_validate_topic_name(topic, topic_len)) return -1;
+    size_t size = mqtt_encode_publish_size(topic_len, payload_len, qos);
+    if (size == 0 || bufsize < size) return -1;
+
+    uint8_t *ptr = buf;
+
+    // Fixed header: PUBLISH, DUP=0, QoS, RETAIN
+    *ptr++ = (uint8_t)(0x30 | (qos << 1) | (retain ? 0x01 : 0x00));
+    ptr   += encode_remaining_length(ptr, 2 + topic_len + (qos > 0 ? 2 : 0) + payload_len);
+
+    // Variable header: Topic Name [+ Packet Identifier]
     ptr = encode_string(ptr, topic);
+    if (qos > 0) {
+        *ptr++ = (uint8_t)(packet_id >> 8);
+        *ptr++ = (uint8_t)(packet_id & 0xFF);
+    }
 
     // Payload
     if (payload_len > 0 && payload != NULL) {
@@ -85,32 +210,71 @@ int mqtt_encode_publish_qos0(uint8_t *buf, size_t bufsize,
     return (int)(ptr - buf);
 }
 
-int mqtt_encode_subscribe_qos0(uint8_t *buf, size_t bufsize,
-                               uint16_t packet_id,
-                               const char *topic) {
+int mqtt_encode_ack(uint8_t *buf, size_t bufsize,
+                    uint8_t first_byte,
+                    uint16_t packet_id) {
+    if (bufsize < 4) return -1;
 
-    size_t topic_len    = strlen(topic);
-    size_t payload_len  = 2 + topic_len + 1; // topic string + requested QoS
-    size_t vh_len       = 2;                 // packet identifier
-    size_t remaining_len = vh_len + payload_len;
+    buf[0] = first_byte;
+    buf[1] = 0x02; // remaining length: packet identifier only
+    buf[2] = (uint8_t)(packet_id >> 8);
+    buf[3] = (uint8_t)(packet_id & 0xFF);
+    return 4;
+}
+
+/* Packet identifier plus (filter + requested QoS) per filter. */
+static size_t subscribe_remaining_length(const char *const *filters, size_t count) {
+    size_t len = 2;
+    for (size_t i = 0; i < count; ++i) {
+        len += 2 + strlen(filters[i]) + 1;
+    }
+    return len;
+}
 
-    if (remaining_len > 127) return -1;
-    if (bufsize < remaining_len + 2) return -1;
+size_t mqtt_encode_subscribe_size(const char *const *filters,
+                                  const uint8_t *qos,
+                                  size_t count) {
+    if (count == 0) return 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!mqtt_validate_topic_filter(filters[i], strlen(filters[i]))) return 0;
+        if (qos && qos[i] > 2) return 0;
+    }
+    return packet_size(subscribe_remaining_length(filters, count));
+}
+
+int mqtt_encode_subscribe(uint8_t *buf, size_t bufsize,
+                          uint16_t packet_id,
+                          const char *const *filters,
+                          const uint8_t *qos,
+                          size_t count) {
+
+    if (packet_id == 0) return -1;
+
+    size_t size = mqtt_encode_subscribe_size(filters, qos, count);
+    if (size == 0 || bufsize < size) return -1;
 
     uint8_t *ptr = buf;
 
     // Fixed header: SUBSCRIBE (1000), QoS1 (0010) => 1000 0010 => 0x82
     *ptr++ = 0x82;
-    ptr   += encode_remaining_length(ptr, remaining_len);
+    ptr   += encode_remaining_length(ptr, subscribe_remaining_length(filters, count));
 
     // Variable header: Packet Identifier
     *ptr++ = (uint8_t)(packet_id >> 8);
     *ptr++ = (uint8_t)(packet_id & 0xFF);
 
-    // Payload: Topic Filter + Requested QoS
-    ptr = encode_string(ptr, topic);
-    *ptr++ = 0x00; // Requested QoS 0
+    // Payload: (Topic Filter + Requested QoS) * count
+    for (size_t i = 0; i < count; ++i) {
+        ptr = encode_string(ptr, filters[i]);
+        *ptr++ = qos ? qos[i] : 0x00;
+    }
 
     return (int)(ptr - buf);
 }
 
+int mqtt_encode_subscribe_qos0(uint8_t *buf, size_t bufsize,
+                               uint16_t packet_id,
+                               const char *topic) {
+    return mqtt_encode_subscribe(buf, bufsize, packet_id, &topic, NULL, 1);
+}
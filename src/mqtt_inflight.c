@@ -0,0 +1,103 @@
+#include "mqtt_inflight.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int mqtt_inflight_init(mqtt_inflight_table_t *t, uint16_t window) {
+    memset(t, 0, sizeof(*t));
+    if (window == 0 || window > MQTT_INFLIGHT_MAX_PACKET_ID) return -1;
+
+    t->slots      = (mqtt_inflight_msg_t *)calloc(window, sizeof(*t->slots));
+    t->generation = (uint16_t *)calloc(window, sizeof(*t->generation));
+    t->free_stack = (uint16_t *)malloc(window * sizeof(*t->free_stack));
+    if (!t->slots || !t->generation || !t->free_stack) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        mqtt_inflight_cleanup(t);
+        return -1;
+    }
+
+    // Lowest slot on top, so ids start at 1.
+    for (uint16_t i = 0; i < window; ++i) {
+        t->free_stack[i] = (uint16_t)(window - 1 - i);
+    }
+    t->nfree  = window;
+    t->window = window;
+    return 0;
+}
+
+void mqtt_inflight_cleanup(mqtt_inflight_table_t *t) {
+    free(t->slots);
+    free(t->generation);
+    free(t->free_stack);
+    memset(t, 0, sizeof(*t));
+}
+
+mqtt_inflight_msg_t *mqtt_inflight_acquire(mqtt_inflight_table_t *t) {
+    if (t->nfree == 0) return NULL;
+
+    uint16_t slot = t->free_stack[--t->nfree];
+
+    // id = 1 + slot + generation * window, staying inside the PUBLISH id
+    // range; the generation moves on so a reused slot gets a fresh id.
+    uint32_t id = 1u + slot + (uint32_t)t->generation[slot] * t->window;
+    if (id > MQTT_INFLIGHT_MAX_PACKET_ID) {
+        t->generation[slot] = 0;
+        id = 1u + slot;
+    }
+    t->generation[slot]++;
+
+    mqtt_inflight_msg_t *msg = &t->slots[slot];
+    memset(msg, 0, sizeof(*msg));
+    msg->packet_id = (uint16_t)id;
+    return msg;
+}
+
+mqtt_inflight_msg_t *mqtt_inflight_claim(mqtt_inflight_table_t *t,
+                                         uint16_t packet_id) {
+    if (packet_id == 0 || packet_id > MQTT_INFLIGHT_MAX_PACKET_ID ||
+        t->window == 0) {
+        return NULL;
+    }
+
+    uint16_t slot = (uint16_t)((packet_id - 1u) % t->window);
+    for (uint16_t i = 0; i < t->nfree; ++i) {
+        if (t->free_stack[i] != slot) continue;
+
+        t->free_stack[i] = t->free_stack[--t->nfree];
+        t->generation[slot] = (uint16_t)((packet_id - 1u) / t->window + 1u);
+
+        mqtt_inflight_msg_t *msg = &t->slots[slot];
+        memset(msg, 0, sizeof(*msg));
+        msg->packet_id = packet_id;
+        return msg;
+    }
+    return NULL;
+}
+
+mqtt_inflight_msg_t *mqtt_inflight_lookup(mqtt_inflight_table_t *t,
+                                          uint16_t packet_id) {
+    if (packet_id == 0 || packet_id > MQTT_INFLIGHT_MAX_PACKET_ID ||
+        t->window == 0) {
+        return NULL;
+    }
+
+    mqtt_inflight_msg_t *msg = &t->slots[(packet_id - 1u) % t->window];
+    if (msg->state == MQTT_INFLIGHT_FREE || msg->packet_id != packet_id) {
+        return NULL;
+    }
+    return msg;
+}
+
+void mqtt_inflight_release(mqtt_inflight_table_t *t, mqtt_inflight_msg_t *msg) {
+    msg->state     = MQTT_INFLIGHT_FREE;
+    msg->frame     = NULL;
+    msg->frame_len = 0;
+    t->free_stack[t->nfree++] = (uint16_t)(msg - t->slots);
+}
+
+uint16_t mqtt_inflight_count(const mqtt_inflight_table_t *t) {
+    return (uint16_t)(t->window - t->nfree);
+}
@@ -0,0 +1,54 @@
+#include "mqtt_log.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+atomic_int mqtt_log_threshold = MQTT_LOG_INFO;
+
+static mqtt_log_callback_t mqtt_log_cb;
+static void               *mqtt_log_ctx;
+
+void mqtt_log_set_callback(mqtt_log_callback_t cb, void *ctx) {
+    mqtt_log_cb  = cb;
+    mqtt_log_ctx = ctx;
+}
+
+void mqtt_log_set_level(int level) {
+    atomic_store_explicit(&mqtt_log_threshold, level, memory_order_relaxed);
+}
+
+int mqtt_log_get_level(void) {
+    return atomic_load_explicit(&mqtt_log_threshold, memory_order_relaxed);
+}
+
+void mqtt_log_write(mqtt_log_level_t level, const char *fmt, ...) {
+    char stack_buf[256];
+    char *msg = stack_buf;
+
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(stack_buf, sizeof(stack_buf), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+
+    // Rare long message (e.g. a long topic): format it again on the heap.
+    if ((size_t)n >= sizeof(stack_buf)) {
+        char *p = (char *)malloc((size_t)n + 1);
+        if (p) {
+            va_start(ap, fmt);
+            vsnprintf(p, (size_t)n + 1, fmt, ap);
+            va_end(ap);
+            msg = p;
+        }
+    }
+
+    if (mqtt_log_cb) {
+        mqtt_log_cb(level, msg, mqtt_log_ctx);
+    } else {
+        // One call, so lines from different threads do not interleave.
+        fprintf(stderr, "%s\n", msg);
+    }
+
+    if (msg != stack_buf) free(msg);
+}
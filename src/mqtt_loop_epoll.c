@@ -0,0 +1,439 @@
+#include "mqtt_loop.h"
+#include "mqtt_time.h"
+#include "mqtt_timer_wheel.h"
+#include "mqtt_mpsc.h"
+#include "mqtt_log.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Events fetched per epoll_wait() call. */
+#define MQTT_LOOP_MAX_EVENTS 256
+
+/* Clients with queued frames served per iteration before I/O goes again. */
+#define MQTT_LOOP_READY_BUDGET MQTT_LOOP_MAX_EVENTS
+
+/*
+ * Per-client registration; epoll hands this back with each event.
+ * Producer threads hold on to it through the client's wakeup hook, so
+ * it is recycled rather than freed until the loop is destroyed.
+ */
+typedef struct mqtt_loop_reg {
+    mqtt_timer_t   timer;    // first: the wheel hands back &reg->timer
+    mqtt_loop_t   *loop;
+    mqtt_client_t *client;   // NULL once released
+    size_t         index;    // position in loop->regs
+    bool           armed;    // fd is in the epoll set
+    int            fd;       // what was armed; changes while connecting
+
+    mqtt_mpsc_node_t       ready_node;  // in loop->ready while queued
+    atomic_bool            queued;
+    struct mqtt_loop_reg  *next_free;
+} mqtt_loop_reg_t;
+
+struct mqtt_loop {
+    int  epfd;
+    int  wakefd;             // eventfd used by mqtt_loop_wakeup()
+    atomic_bool stop;
+
+    mqtt_loop_reg_t **regs;
+    size_t            nregs;
+    size_t            cap;
+
+    // Registrations removed while an epoll batch is being dispatched;
+    // freed once the batch is done since later events may reference them.
+    bool              dispatching;
+    mqtt_loop_reg_t **dead;
+    size_t            ndead;
+    size_t            dead_cap;
+    mqtt_loop_reg_t  *free_regs;
+
+    // Clients whose concurrent publish queue has frames, pushed by
+    // producer threads through mqtt_loop_client_wakeup().
+    mqtt_mpsc_t       ready;
+    atomic_bool       wake_pending;  // a wakeup is already on its way
+
+    // One timer per client at its next keep-alive / flush deadline, so
+    // a tick only visits clients that actually have work due.
+    mqtt_timer_wheel_t timers;
+};
+
+mqtt_loop_t *mqtt_loop_create(void) {
+    mqtt_loop_t *loop = (mqtt_loop_t *)calloc(1, sizeof(mqtt_loop_t));
+    if (!loop) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        MQTT_LOG_ERROR("epoll_create1: %s", strerror(errno));
+        free(loop);
+        return NULL;
+    }
+
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakefd < 0) {
+        MQTT_LOG_ERROR("eventfd: %s", strerror(errno));
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the wakeup descriptor
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) != 0) {
+        MQTT_LOG_ERROR("epoll_ctl: %s", strerror(errno));
+        close(loop->wakefd);
+        close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+
+    mqtt_timer_wheel_init(&loop->timers, mqtt_time_now_ms());
+    mqtt_mpsc_init(&loop->ready);
+    return loop;
+}
+
+void mqtt_loop_destroy(mqtt_loop_t *loop) {
+    if (!loop) return;
+
+    for (size_t i = 0; i < loop->nregs; ++i) {
+        // Removed, not disconnected: the client outlives its registration.
+        mqtt_client_set_deadline_hook(loop->regs[i]->client, NULL, NULL);
+        mqtt_client_set_wakeup_hook(loop->regs[i]->client, NULL, NULL);
+        free(loop->regs[i]);
+    }
+    while (loop->free_regs) {
+        mqtt_loop_reg_t *reg = loop->free_regs;
+        loop->free_regs = reg->next_free;
+        free(reg);
+    }
+    free(loop->regs);
+    free(loop->dead);
+    close(loop->wakefd);
+    close(loop->epfd);
+    free(loop);
+}
+
+/*
+ * Add the client's descriptor to epoll. Edge-triggered with EPOLLOUT
+ * always armed: the client reads until EAGAIN, and a writability edge
+ * arrives whenever a full socket buffer drains, so no epoll_ctl(MOD) is
+ * needed on the hot path.
+ */
+static int mqtt_loop_arm(mqtt_loop_t *loop, mqtt_loop_reg_t *reg, int fd) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = reg;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) != 0 &&
+        (errno != EEXIST || epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) != 0)) {
+        MQTT_LOG_ERROR("epoll_ctl: %s", strerror(errno));
+        return -1;
+    }
+    reg->armed = true;
+    reg->fd    = fd;
+    return 0;
+}
+
+/*
+ * Bring the registration in line with the client: arm the descriptor of
+ * a client that is (re)connecting or whose connect moved from one
+ * descriptor to the next (the old one was closed and left epoll by
+ * itself), and put its timer at the current deadline.
+ *
+ * @return 0 on success, -1 if the new descriptor could not be added
+ */
+static int mqtt_loop_schedule(mqtt_loop_t *loop, mqtt_loop_reg_t *reg) {
+    int fd = mqtt_client_fd(reg->client);
+    if (fd < 0) {
+        reg->armed = false;
+    } else if ((!reg->armed || fd != reg->fd) && mqtt_loop_arm(loop, reg, fd) != 0) {
+        return -1;
+    }
+
+    uint64_t deadline = mqtt_client_next_deadline_ms(reg->client);
+    if (deadline == UINT64_MAX) {
+        mqtt_timer_cancel(&loop->timers, &reg->timer);
+    } else {
+        mqtt_timer_schedule(&loop->timers, &reg->timer, deadline);
+    }
+    return 0;
+}
+
+static void mqtt_loop_deadline_changed(mqtt_client_t *client, void *ctx) {
+    (void)client;
+    mqtt_loop_reg_t *reg = (mqtt_loop_reg_t *)ctx;
+
+    // A new flush deadline, a lost connection or a failed connect, none
+    // of which needs a new descriptor armed.
+    mqtt_loop_schedule(reg->loop, reg);
+}
+
+/*
+ * Wakeup hook, called on producer threads: queue the registration for
+ * mqtt_client_process_write() and wake the loop thread once.
+ */
+static void mqtt_loop_client_wakeup(mqtt_client_t *client, void *ctx) {
+    (void)client;
+    mqtt_loop_reg_t *reg = (mqtt_loop_reg_t *)ctx;
+    mqtt_loop_t *loop = reg->loop;
+
+    if (atomic_exchange(&reg->queued, true)) return;
+    mqtt_mpsc_push(&loop->ready, &reg->ready_node);
+    if (!atomic_exchange(&loop->wake_pending, true)) {
+        mqtt_loop_wakeup(loop);
+    }
+}
+
+int mqtt_loop_add(mqtt_loop_t *loop, mqtt_client_t *client) {
+    if (!loop || !client) return -1;
+
+    int fd = mqtt_client_fd(client);
+    if (fd < 0) {
+        MQTT_LOG_ERROR("mqtt_loop_add: client not connected or connecting");
+        return -1;
+    }
+
+    if (loop->nregs == loop->cap) {
+        size_t cap = loop->cap ? loop->cap * 2 : 64;
+        mqtt_loop_reg_t **regs = (mqtt_loop_reg_t **)realloc(loop->regs,
+                                                             cap * sizeof(*regs));
+        if (!regs) {
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            return -1;
+        }
+        loop->regs = regs;
+        loop->cap  = cap;
+
+        // Reserve matching room for deferred frees so release never fails.
+        mqtt_loop_reg_t **dead = (mqtt_loop_reg_t **)realloc(loop->dead,
+                                                             cap * sizeof(*dead));
+        if (!dead) {
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            return -1;
+        }
+        loop->dead     = dead;
+        loop->dead_cap = cap;
+    }
+
+    // A recycled registration may still sit in the ready queue from a
+    // late wakeup; that only costs its new client a spurious write pass.
+    mqtt_loop_reg_t *reg = loop->free_regs;
+    if (reg) {
+        loop->free_regs = reg->next_free;
+    } else {
+        reg = (mqtt_loop_reg_t *)calloc(1, sizeof(*reg));
+        if (!reg) {
+            MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+            return -1;
+        }
+        reg->loop = loop;
+    }
+    reg->client = client;
+    reg->index  = loop->nregs;
+    reg->armed  = false;
+
+    if (mqtt_client_set_nonblocking(client, true) != 0 ||
+        mqtt_loop_arm(loop, reg, fd) != 0) {
+        reg->client = NULL;
+        reg->next_free = loop->free_regs;
+        loop->free_regs = reg;
+        return -1;
+    }
+
+    loop->regs[loop->nregs++] = reg;
+    mqtt_client_set_deadline_hook(client, mqtt_loop_deadline_changed, reg);
+    mqtt_client_set_wakeup_hook(client, mqtt_loop_client_wakeup, reg);
+    mqtt_loop_schedule(loop, reg);
+
+    // Frames published before the client got here go out right away.
+    mqtt_loop_client_wakeup(client, reg);
+    return 0;
+}
+
+/*
+ * Take a registration out of epoll and the client array, then recycle
+ * it now or, during dispatch, once the current epoll batch is done.
+ */
+static void mqtt_loop_release(mqtt_loop_t *loop, mqtt_loop_reg_t *reg) {
+    int fd = mqtt_client_fd(reg->client);
+    if (reg->armed && fd >= 0 && fd == reg->fd) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    mqtt_timer_cancel(&loop->timers, &reg->timer);
+    mqtt_client_set_deadline_hook(reg->client, NULL, NULL);
+    mqtt_client_set_wakeup_hook(reg->client, NULL, NULL);
+
+    // Swap-remove keeps the array dense.
+    mqtt_loop_reg_t *last = loop->regs[--loop->nregs];
+    loop->regs[reg->index] = last;
+    last->index = reg->index;
+
+    reg->client = NULL;
+    if (loop->dispatching) {
+        loop->dead[loop->ndead++] = reg;
+    } else {
+        reg->next_free = loop->free_regs;
+        loop->free_regs = reg;
+    }
+}
+
+int mqtt_loop_remove(mqtt_loop_t *loop, mqtt_client_t *client) {
+    if (!loop || !client) return -1;
+
+    for (size_t i = 0; i < loop->nregs; ++i) {
+        if (loop->regs[i]->client == client) {
+            mqtt_loop_release(loop, loop->regs[i]);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t mqtt_loop_client_count(const mqtt_loop_t *loop) {
+    return loop ? loop->nregs : 0;
+}
+
+/* Connection failed: close it and forget the client. */
+static void mqtt_loop_drop(mqtt_loop_t *loop, mqtt_loop_reg_t *reg) {
+    mqtt_client_t *client = reg->client;
+    mqtt_loop_release(loop, reg);
+    mqtt_client_disconnect(client);
+}
+
+/* A client's deadline came up on the wheel. */
+static void mqtt_loop_timer_expired(mqtt_timer_t *timer, void *ctx) {
+    mqtt_loop_t *loop = (mqtt_loop_t *)ctx;
+    mqtt_loop_reg_t *reg = (mqtt_loop_reg_t *)timer;
+
+    if (mqtt_client_tick(reg->client, mqtt_time_now_ms()) != 0 ||
+        mqtt_loop_schedule(loop, reg) != 0) {
+        mqtt_loop_drop(loop, reg);
+    }
+}
+
+/* Send what producer threads queued since the last iteration. */
+static void mqtt_loop_run_ready(mqtt_loop_t *loop) {
+    size_t budget = MQTT_LOOP_READY_BUDGET;
+    mqtt_mpsc_node_t *node;
+
+    // Cleared before popping: a producer that pushes after this point
+    // sends a fresh wakeup, so nothing is left behind unnoticed.
+    atomic_store(&loop->wake_pending, false);
+
+    while (budget > 0 && (node = mqtt_mpsc_pop(&loop->ready)) != NULL) {
+        mqtt_loop_reg_t *reg = (mqtt_loop_reg_t *)(
+            (char *)node - offsetof(mqtt_loop_reg_t, ready_node));
+        atomic_store(&reg->queued, false);
+        budget--;
+
+        if (!reg->client) continue; // released since it was queued
+        if (mqtt_client_process_write(reg->client) != 0 ||
+            mqtt_loop_schedule(loop, reg) != 0) {
+            mqtt_loop_drop(loop, reg);
+        }
+    }
+
+    // Out of budget: come straight back after one round of I/O.
+    if (budget == 0 && !atomic_exchange(&loop->wake_pending, true)) {
+        mqtt_loop_wakeup(loop);
+    }
+}
+
+int mqtt_loop_run_once(mqtt_loop_t *loop, int timeout_ms) {
+    if (!loop) return -1;
+
+    struct epoll_event events[MQTT_LOOP_MAX_EVENTS];
+
+    // Never sleep past the next client deadline.
+    int until_timer = mqtt_timer_wheel_timeout_ms(&loop->timers, mqtt_time_now_ms());
+    if (until_timer >= 0 && (timeout_ms < 0 || timeout_ms > until_timer))
+        timeout_ms = until_timer;
+
+    int n = epoll_wait(loop->epfd, events, MQTT_LOOP_MAX_EVENTS, timeout_ms);
+    if (n < 0) {
+        if (errno == EINTR) return 0;
+        MQTT_LOG_ERROR("epoll_wait: %s", strerror(errno));
+        return -1;
+    }
+
+    loop->dispatching = true;
+
+    for (int i = 0; i < n; ++i) {
+        mqtt_loop_reg_t *reg = (mqtt_loop_reg_t *)events[i].data.ptr;
+        uint32_t ev = events[i].events;
+
+        if (!reg) {
+            uint64_t v;
+            if (read(loop->wakefd, &v, sizeof(v)) < 0 && errno != EAGAIN)
+                MQTT_LOG_ERROR("read(eventfd): %s", strerror(errno));
+            continue;
+        }
+        if (!reg->client) continue; // removed earlier in this batch
+
+        int rc = 0;
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            rc = mqtt_client_loop(reg->client);
+        }
+        if (rc == 0 && reg->client && (ev & EPOLLOUT)) {
+            rc = mqtt_client_process_write(reg->client);
+        }
+        if (rc == 0 && reg->client) {
+            // Traffic moved the keep-alive deadline, or the connection
+            // was lost and a reconnect is due instead.
+            rc = mqtt_loop_schedule(loop, reg);
+        }
+        if (rc != 0 && reg->client) {
+            mqtt_loop_drop(loop, reg);
+        }
+    }
+
+    mqtt_loop_run_ready(loop);
+
+    mqtt_timer_wheel_advance(&loop->timers, mqtt_time_now_ms(),
+                             mqtt_loop_timer_expired, loop);
+
+    loop->dispatching = false;
+    for (size_t i = 0; i < loop->ndead; ++i) {
+        loop->dead[i]->next_free = loop->free_regs;
+        loop->free_regs = loop->dead[i];
+    }
+    loop->ndead = 0;
+
+    return n;
+}
+
+int mqtt_loop_run(mqtt_loop_t *loop) {
+    if (!loop) return -1;
+
+    while (!atomic_load(&loop->stop)) {
+        if (mqtt_loop_run_once(loop, -1) < 0) return -1;
+    }
+    atomic_store(&loop->stop, false);
+    return 0;
+}
+
+void mqtt_loop_stop(mqtt_loop_t *loop) {
+    if (!loop) return;
+
+    atomic_store(&loop->stop, true);
+    mqtt_loop_wakeup(loop);
+}
+
+void mqtt_loop_wakeup(mqtt_loop_t *loop) {
+    if (!loop) return;
+
+    uint64_t one = 1;
+    if (write(loop->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        MQTT_LOG_ERROR("write(eventfd): %s", strerror(errno));
+}
@@ -0,0 +1,186 @@
+#include "mqtt_metrics.h"
+#include "mqtt_client.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+void mqtt_histogram_read(const mqtt_histogram_t *h, mqtt_histogram_snapshot_t *out) {
+    // Buckets first: a record landing meanwhile can then only make
+    // count/sum lead the buckets, never trail them.
+    for (size_t i = 0; i < MQTT_HISTOGRAM_BUCKETS; ++i) {
+        out->buckets[i] = mqtt_counter_get(&h->buckets[i]);
+    }
+    out->sum   = mqtt_counter_get(&h->sum);
+    out->count = mqtt_counter_get(&h->count);
+}
+
+uint64_t mqtt_histogram_bucket_bound(size_t i) {
+    if (i >= MQTT_HISTOGRAM_BUCKETS - 1) return UINT64_MAX;
+    return i <= 1 ? (uint64_t)i : (uint64_t)1 << (i - 1);
+}
+
+uint64_t mqtt_histogram_quantile(const mqtt_histogram_snapshot_t *s, double q) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < MQTT_HISTOGRAM_BUCKETS; ++i) total += s->buckets[i];
+    if (total == 0) return 0;
+
+    if (q < 0.0) q = 0.0;
+    if (q > 1.0) q = 1.0;
+    uint64_t rank = (uint64_t)(q * (double)total + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < MQTT_HISTOGRAM_BUCKETS; ++i) {
+        seen += s->buckets[i];
+        if (seen >= rank) return mqtt_histogram_bucket_bound(i);
+    }
+    return UINT64_MAX;
+}
+
+// Output cursor with snprintf semantics: counts what did not fit.
+typedef struct {
+    char  *buf;
+    size_t size;
+    size_t len;
+} mqtt_metrics_out_t;
+
+static void mqtt_metrics_printf(mqtt_metrics_out_t *o, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = o->len < o->size ? o->size - o->len : 0;
+    int n = vsnprintf(room ? o->buf + o->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n > 0) o->len += (size_t)n;
+}
+
+/* One sample: name{labels,extra} value */
+static void mqtt_metrics_sample(mqtt_metrics_out_t *o, const char *name,
+                                const char *labels, const char *extra,
+                                uint64_t value) {
+    bool l = labels && *labels;
+    bool e = extra && *extra;
+    mqtt_metrics_printf(o, "%s%s%s%s%s%s %llu\n", name,
+                        l || e ? "{" : "", l ? labels : "",
+                        l && e ? "," : "", e ? extra : "",
+                        l || e ? "}" : "", (unsigned long long)value);
+}
+
+static void mqtt_metrics_single(mqtt_metrics_out_t *o, const char *name,
+                                const char *type, const char *help,
+                                const char *labels, uint64_t value) {
+    mqtt_metrics_printf(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    mqtt_metrics_sample(o, name, labels, NULL, value);
+}
+
+static const char *const mqtt_packet_type_names[MQTT_PACKET_TYPES] = {
+    NULL, "connect", "connack", "publish", "puback", "pubrec", "pubrel",
+    "pubcomp", "subscribe", "suback", "unsubscribe", "unsuback",
+    "pingreq", "pingresp", "disconnect", NULL,
+};
+
+int mqtt_client_stats_format_prometheus(const mqtt_client_stats_t *stats,
+                                        const char *labels,
+                                        char *buf, size_t size) {
+    if (!stats || (!buf && size > 0)) return -1;
+
+    mqtt_metrics_out_t o = { buf, size, 0 };
+    if (size > 0) buf[0] = '\0';
+
+    mqtt_metrics_printf(&o, "# HELP mqtt_client_bytes_total Bytes through the transport.\n"
+                            "# TYPE mqtt_client_bytes_total counter\n");
+    mqtt_metrics_sample(&o, "mqtt_client_bytes_total", labels, "direction=\"in\"",
+                        stats->bytes_in);
+    mqtt_metrics_sample(&o, "mqtt_client_bytes_total", labels, "direction=\"out\"",
+                        stats->bytes_out);
+
+    mqtt_metrics_printf(&o, "# HELP mqtt_client_packets_total MQTT packets by type.\n"
+                            "# TYPE mqtt_client_packets_total counter\n");
+    for (size_t i = 0; i < MQTT_PACKET_TYPES; ++i) {
+        if (!mqtt_packet_type_names[i]) continue;
+        char extra[64];
+        snprintf(extra, sizeof(extra), "direction=\"in\",type=\"%s\"",
+                 mqtt_packet_type_names[i]);
+        mqtt_metrics_sample(&o, "mqtt_client_packets_total", labels, extra,
+                            stats->packets_in[i]);
+        snprintf(extra, sizeof(extra), "direction=\"out\",type=\"%s\"",
+                 mqtt_packet_type_names[i]);
+        mqtt_metrics_sample(&o, "mqtt_client_packets_total", labels, extra,
+                            stats->packets_out[i]);
+    }
+
+    mqtt_metrics_printf(&o, "# HELP mqtt_client_transport_calls_total Transport "
+                            "send/recv calls (system calls for TCP).\n"
+                            "# TYPE mqtt_client_transport_calls_total counter\n");
+    mqtt_metrics_sample(&o, "mqtt_client_transport_calls_total", labels, "op=\"recv\"",
+                        stats->recv_calls);
+    mqtt_metrics_sample(&o, "mqtt_client_transport_calls_total", labels, "op=\"send\"",
+                        stats->send_calls);
+
+    mqtt_metrics_single(&o, "mqtt_client_send_would_block_total", "counter",
+                        "Sends refused by a full socket.", labels,
+                        stats->send_would_block);
+    mqtt_metrics_single(&o, "mqtt_client_decode_errors_total", "counter",
+                        "Malformed packets from the broker.", labels,
+                        stats->decode_errors);
+    mqtt_metrics_single(&o, "mqtt_client_inflight", "gauge",
+                        "QoS 1/2 messages awaiting their acknowledgement.", labels,
+                        stats->inflight);
+    mqtt_metrics_single(&o, "mqtt_client_inflight_max", "gauge",
+                        "High-water mark of mqtt_client_inflight.", labels,
+                        stats->inflight_max);
+    mqtt_metrics_single(&o, "mqtt_client_offline_queued", "gauge",
+                        "QoS 0 messages held while reconnecting.", labels,
+                        stats->offline_queued);
+    mqtt_metrics_single(&o, "mqtt_client_tx_buffered_bytes", "gauge",
+                        "Outbound bytes not yet taken by the transport.", labels,
+                        stats->tx_buffered_bytes);
+    mqtt_metrics_single(&o, "mqtt_client_tx_dropped_total", "counter",
+                        "QoS 0 messages dropped to stay under tx_queue_max.", labels,
+                        stats->tx_dropped);
+    mqtt_metrics_single(&o, "mqtt_client_tx_rejected_total", "counter",
+                        "Publishes refused by tx_queue_max.", labels,
+                        stats->tx_rejected);
+    mqtt_metrics_single(&o, "mqtt_client_pending_subscribes", "gauge",
+                        "SUBSCRIBE packets awaiting their SUBACK.", labels,
+                        stats->pending_subscribes);
+    mqtt_metrics_single(&o, "mqtt_client_connection_losses_total", "counter",
+                        "Connections lost.", labels, stats->connection_losses);
+    mqtt_metrics_single(&o, "mqtt_client_reconnects_total", "counter",
+                        "Successful reconnects.", labels, stats->reconnects);
+    mqtt_metrics_single(&o, "mqtt_client_reconnect_failures_total", "counter",
+                        "Failed reconnect attempts.", labels,
+                        stats->reconnect_failures);
+    mqtt_metrics_single(&o, "mqtt_client_ping_timeouts_total", "counter",
+                        "Connections lost to a missing PINGRESP.", labels,
+                        stats->ping_timeouts);
+
+    // Histogram buckets are cumulative, with bounds in seconds.
+    const mqtt_histogram_snapshot_t *h = &stats->ack_latency_us;
+    mqtt_metrics_printf(&o, "# HELP mqtt_client_ack_latency_seconds QoS 1/2 "
+                            "publish to PUBACK/PUBCOMP.\n"
+                            "# TYPE mqtt_client_ack_latency_seconds histogram\n");
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < MQTT_HISTOGRAM_BUCKETS; ++i) {
+        cumulative += h->buckets[i];
+        char extra[48];
+        uint64_t bound = mqtt_histogram_bucket_bound(i);
+        if (bound == UINT64_MAX) {
+            snprintf(extra, sizeof(extra), "le=\"+Inf\"");
+        } else {
+            snprintf(extra, sizeof(extra), "le=\"%.6f\"", (double)bound / 1e6);
+        }
+        mqtt_metrics_sample(&o, "mqtt_client_ack_latency_seconds_bucket", labels,
+                            extra, cumulative);
+    }
+    bool l = labels && *labels;
+    mqtt_metrics_printf(&o, "mqtt_client_ack_latency_seconds_sum%s%s%s %.6f\n",
+                        l ? "{" : "", l ? labels : "", l ? "}" : "",
+                        (double)h->sum / 1e6);
+    mqtt_metrics_sample(&o, "mqtt_client_ack_latency_seconds_count", labels, NULL,
+                        cumulative);
+
+    if (o.len > INT_MAX) return -1;
+    return (int)o.len;
+}
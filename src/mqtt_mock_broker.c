@@ -0,0 +1,652 @@
+#include "mqtt_mock_broker.h"
+#include "mqtt_decode.h"
+#include "mqtt_topic_trie.h"
+#include "mqtt_transport_mem.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Free space made in a receive buffer before each read. */
+#define MQTT_MOCK_RX_CHUNK 65536
+
+typedef struct {
+    mqtt_transport_t *t;
+    uint8_t  *rx;
+    size_t    rx_len;
+    size_t    rx_cap;
+    uint8_t  *tx;               // not yet accepted by the transport
+    size_t    tx_len;
+    size_t    tx_cap;
+    char    **filters;
+    size_t    nfilters;
+    bool      connected;        // CONNECT received
+    bool      dead;             // closed at the end of the round
+    uint8_t   qos2[65536 / 8];  // QoS 2 ids between PUBREC and PUBREL
+} mqtt_mock_conn_t;
+
+struct mqtt_mock_broker {
+    pthread_mutex_t    lock;    // everything below but the fds
+    int                listen_fd;
+    uint16_t           port;
+    int                wake[2];
+
+    mqtt_mock_conn_t **conns;
+    size_t             nconns;
+    size_t             conns_cap;
+
+    // In-memory connections waiting for the serving thread
+    mqtt_transport_t **pending;
+    size_t             npending;
+    size_t             pending_cap;
+
+    struct pollfd     *pfds;
+    size_t             pfds_cap;
+
+    bool               drop;
+    bool               stop;
+    bool               running;
+    pthread_t          thread;
+    mqtt_mock_broker_stats_t stats;
+};
+
+static int mqtt_mock_reserve(uint8_t **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap : 4096;
+    while (n < need) n *= 2;
+    uint8_t *p = (uint8_t *)realloc(*buf, n);
+    if (!p) {
+        MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+        return -1;
+    }
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+static void mqtt_mock_wake(mqtt_mock_broker_t *b) {
+    const uint8_t x = 1;
+    while (write(b->wake[1], &x, 1) < 0 && errno == EINTR) {
+    }
+}
+
+/*
+ * MQTT 3.1.1 matching of one filter against a topic; wildcards in the
+ * first level do not match topics starting with '$'.
+ */
+static bool mqtt_mock_topic_match(const char *filter, const char *topic, size_t topic_len) {
+    if (topic_len > 0 && topic[0] == '$' && (filter[0] == '+' || filter[0] == '#'))
+        return false;
+
+    const char *f = filter;
+    size_t ti = 0;
+    for (;;) {
+        if (f[0] == '#') return true;
+
+        const char *f_end = strchr(f, '/');
+        size_t f_len = f_end ? (size_t)(f_end - f) : strlen(f);
+        size_t t_end = ti;
+        while (t_end < topic_len && topic[t_end] != '/') t_end++;
+
+        bool plus = f_len == 1 && f[0] == '+';
+        if (!plus && (f_len != t_end - ti || memcmp(f, topic + ti, f_len) != 0))
+            return false;
+
+        bool topic_more = t_end < topic_len;
+        if (!f_end) return !topic_more;
+        f = f_end + 1;
+        ti = t_end + 1;
+        if (!topic_more) return strcmp(f, "#") == 0; // "a/#" matches "a"
+    }
+}
+
+static int mqtt_mock_add_conn(mqtt_mock_broker_t *b, mqtt_transport_t *t) {
+    if (mqtt_transport_set_nonblocking(t->ops->fd(t), true) != 0) {
+        mqtt_transport_destroy(t);
+        return -1;
+    }
+    if (b->nconns == b->conns_cap) {
+        size_t cap = b->conns_cap ? b->conns_cap * 2 : 16;
+        mqtt_mock_conn_t **conns =
+            (mqtt_mock_conn_t **)realloc(b->conns, cap * sizeof(*conns));
+        if (!conns) {
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            mqtt_transport_destroy(t);
+            return -1;
+        }
+        b->conns = conns;
+        b->conns_cap = cap;
+    }
+    mqtt_mock_conn_t *c = (mqtt_mock_conn_t *)calloc(1, sizeof(*c));
+    if (!c) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        mqtt_transport_destroy(t);
+        return -1;
+    }
+    c->t = t;
+    b->conns[b->nconns++] = c;
+    b->stats.connections++;
+    return 0;
+}
+
+static void mqtt_mock_free_conn(mqtt_mock_conn_t *c) {
+    mqtt_transport_destroy(c->t);
+    for (size_t i = 0; i < c->nfilters; i++) {
+        free(c->filters[i]);
+    }
+    free(c->filters);
+    free(c->rx);
+    free(c->tx);
+    free(c);
+}
+
+static int mqtt_mock_send(mqtt_mock_conn_t *c, const uint8_t *data, size_t len) {
+    if (mqtt_mock_reserve(&c->tx, &c->tx_cap, c->tx_len + len) != 0) return -1;
+    memcpy(c->tx + c->tx_len, data, len);
+    c->tx_len += len;
+    return 0;
+}
+
+static int mqtt_mock_send_ack(mqtt_mock_conn_t *c, uint8_t first_byte, uint16_t packet_id) {
+    const uint8_t ack[4] = { first_byte, 0x02,
+                             (uint8_t)(packet_id >> 8), (uint8_t)(packet_id & 0xFF) };
+    return mqtt_mock_send(c, ack, sizeof(ack));
+}
+
+/* Queue a QoS 0 copy of the message on every connection subscribed to it. */
+static void mqtt_mock_forward(mqtt_mock_broker_t *b, const mqtt_publish_view_t *v) {
+    size_t remaining = 2 + v->topic_len + v->payload_len;
+    uint8_t hdr[7];
+    size_t hdr_len = 0;
+    hdr[hdr_len++] = 0x30;
+    do {
+        uint8_t byte = (uint8_t)(remaining % 128);
+        remaining /= 128;
+        hdr[hdr_len++] = remaining > 0 ? (uint8_t)(byte | 0x80) : byte;
+    } while (remaining > 0);
+    hdr[hdr_len++] = (uint8_t)(v->topic_len >> 8);
+    hdr[hdr_len++] = (uint8_t)(v->topic_len & 0xFF);
+
+    for (size_t i = 0; i < b->nconns; i++) {
+        mqtt_mock_conn_t *c = b->conns[i];
+        if (!c->connected || c->dead) continue;
+
+        bool match = false;
+        for (size_t j = 0; j < c->nfilters && !match; j++) {
+            match = mqtt_mock_topic_match(c->filters[j], v->topic, v->topic_len);
+        }
+        if (!match) continue;
+
+        size_t len = hdr_len + v->topic_len + v->payload_len;
+        if (mqtt_mock_reserve(&c->tx, &c->tx_cap, c->tx_len + len) != 0) {
+            c->dead = true;
+            continue;
+        }
+        uint8_t *p = c->tx + c->tx_len;
+        memcpy(p, hdr, hdr_len);
+        memcpy(p + hdr_len, v->topic, v->topic_len);
+        if (v->payload_len > 0)
+            memcpy(p + hdr_len + v->topic_len, v->payload, v->payload_len);
+        c->tx_len += len;
+        b->stats.publishes_out++;
+    }
+}
+
+static int mqtt_mock_subscribe(mqtt_mock_conn_t *c, const uint8_t *body, size_t len) {
+    if (len < 3) return -1;
+    uint16_t packet_id = (uint16_t)((body[0] << 8) | body[1]);
+
+    // SUBACK: one return code per filter, at most len / 3 of them
+    uint8_t *ack = (uint8_t *)malloc(8 + len / 3);
+    if (!ack) {
+        MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+        return -1;
+    }
+    size_t count = 0;
+    size_t pos = 2;
+    while (pos < len) {
+        if (len - pos < 3) goto malformed;
+        size_t flen = (size_t)((body[pos] << 8) | body[pos + 1]);
+        pos += 2;
+        if (len - pos < flen + 1) goto malformed;
+        const char *filter = (const char *)body + pos;
+        pos += flen + 1; // requested QoS is ignored: everything is granted QoS 0
+
+        if (!mqtt_topic_filter_valid(filter, flen)) {
+            ack[8 + count++] = 0x80;
+            continue;
+        }
+        bool known = false;
+        for (size_t i = 0; i < c->nfilters && !known; i++) {
+            known = strlen(c->filters[i]) == flen && memcmp(c->filters[i], filter, flen) == 0;
+        }
+        if (!known) {
+            char **filters = (char **)realloc(c->filters, (c->nfilters + 1) * sizeof(*filters));
+            char *copy = filters ? strndup(filter, flen) : NULL;
+            if (filters) c->filters = filters;
+            if (!copy) {
+                MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+                free(ack);
+                return -1;
+            }
+            c->filters[c->nfilters++] = copy;
+        }
+        ack[8 + count++] = 0x00;
+    }
+
+    // Fixed header right-aligned in front of the return codes.
+    size_t remaining = 2 + count;
+    uint8_t rl[4];
+    size_t rl_len = 0;
+    do {
+        uint8_t byte = (uint8_t)(remaining % 128);
+        remaining /= 128;
+        rl[rl_len++] = remaining > 0 ? (uint8_t)(byte | 0x80) : byte;
+    } while (remaining > 0);
+    uint8_t *p = ack + 8 - 3 - rl_len;
+    p[0] = 0x90;
+    memcpy(p + 1, rl, rl_len);
+    p[1 + rl_len] = (uint8_t)(packet_id >> 8);
+    p[2 + rl_len] = (uint8_t)(packet_id & 0xFF);
+    int r = mqtt_mock_send(c, p, 3 + rl_len + count);
+    free(ack);
+    return r;
+
+malformed:
+    free(ack);
+    return -1;
+}
+
+static int mqtt_mock_unsubscribe(mqtt_mock_conn_t *c, const uint8_t *body, size_t len) {
+    if (len < 2) return -1;
+    uint16_t packet_id = (uint16_t)((body[0] << 8) | body[1]);
+
+    size_t pos = 2;
+    while (pos < len) {
+        if (len - pos < 2) return -1;
+        size_t flen = (size_t)((body[pos] << 8) | body[pos + 1]);
+        pos += 2;
+        if (len - pos < flen) return -1;
+        const char *filter = (const char *)body + pos;
+        pos += flen;
+
+        for (size_t i = 0; i < c->nfilters; i++) {
+            if (strlen(c->filters[i]) == flen && memcmp(c->filters[i], filter, flen) == 0) {
+                free(c->filters[i]);
+                c->filters[i] = c->filters[--c->nfilters];
+                break;
+            }
+        }
+    }
+    return mqtt_mock_send_ack(c, 0xB0, packet_id);
+}
+
+/*
+ * Handle one complete packet.
+ *
+ * @return 0 to go on, -1 to close the connection
+ */
+static int mqtt_mock_handle(mqtt_mock_broker_t *b, mqtt_mock_conn_t *c,
+                            const uint8_t *frame, size_t frame_len) {
+    size_t remaining = 0;
+    int n = mqtt_decode_remaining_length(frame + 1, frame_len - 1, &remaining);
+    if (n <= 0) return -1;
+    const uint8_t *body = frame + 1 + n;
+    uint8_t type = frame[0] >> 4;
+
+    if (!c->connected) {
+        if (type != 1) return -1; // CONNECT must come first
+        c->connected = true;
+        static const uint8_t connack[4] = { 0x20, 0x02, 0x00, 0x00 };
+        return mqtt_mock_send(c, connack, sizeof(connack));
+    }
+
+    switch (type) {
+    case 3: { // PUBLISH
+        mqtt_publish_view_t v;
+        if (mqtt_decode_publish_view(frame, frame_len, &v) != 0) return -1;
+        b->stats.publishes_in++;
+        if (v.qos == 1 && mqtt_mock_send_ack(c, 0x40, v.packet_id) != 0) return -1;
+        if (v.qos == 2) {
+            if (mqtt_mock_send_ack(c, 0x50, v.packet_id) != 0) return -1;
+            // A resent QoS 2 message is delivered once only.
+            uint8_t bit = (uint8_t)(1u << (v.packet_id & 7));
+            if (c->qos2[v.packet_id >> 3] & bit) return 0;
+            c->qos2[v.packet_id >> 3] |= bit;
+        }
+        mqtt_mock_forward(b, &v);
+        return 0;
+    }
+    case 6: { // PUBREL
+        if (remaining < 2) return -1;
+        uint16_t packet_id = (uint16_t)((body[0] << 8) | body[1]);
+        c->qos2[packet_id >> 3] &= (uint8_t)~(1u << (packet_id & 7));
+        return mqtt_mock_send_ack(c, 0x70, packet_id);
+    }
+    case 8: // SUBSCRIBE
+        return mqtt_mock_subscribe(c, body, remaining);
+    case 10: // UNSUBSCRIBE
+        return mqtt_mock_unsubscribe(c, body, remaining);
+    case 12: { // PINGREQ
+        static const uint8_t pingresp[2] = { 0xD0, 0x00 };
+        return mqtt_mock_send(c, pingresp, sizeof(pingresp));
+    }
+    case 14: // DISCONNECT
+        return -1;
+    case 1: // second CONNECT is a protocol violation
+        return -1;
+    default: // PUBACK, PUBREC, PUBCOMP: nothing is forwarded above QoS 0
+        return 0;
+    }
+}
+
+/* Read whatever the connection has and handle every complete packet. */
+static void mqtt_mock_read(mqtt_mock_broker_t *b, mqtt_mock_conn_t *c) {
+    for (;;) {
+        size_t want = c->rx_len + MQTT_MOCK_RX_CHUNK;
+        size_t frame_len = 0;
+        if (mqtt_decode_frame(c->rx, c->rx_len, &frame_len) == 0 && frame_len > want)
+            want = frame_len;
+        if (mqtt_mock_reserve(&c->rx, &c->rx_cap, want) != 0) {
+            c->dead = true;
+            return;
+        }
+
+        int r = c->t->ops->recv(c->t, c->rx + c->rx_len, c->rx_cap - c->rx_len);
+        if (r == MQTT_TRANSPORT_WOULD_BLOCK) return;
+        if (r <= 0) {
+            c->dead = true;
+            return;
+        }
+        c->rx_len += (size_t)r;
+        b->stats.bytes_in += (uint64_t)r;
+
+        size_t off = 0;
+        for (;;) {
+            int st = mqtt_decode_frame(c->rx + off, c->rx_len - off, &frame_len);
+            if (st < 0 || (st == 1 && mqtt_mock_handle(b, c, c->rx + off, frame_len) != 0)) {
+                c->dead = true;
+                return;
+            }
+            if (st == 0) break;
+            off += frame_len;
+        }
+        memmove(c->rx, c->rx + off, c->rx_len - off);
+        c->rx_len -= off;
+    }
+}
+
+static void mqtt_mock_flush(mqtt_mock_broker_t *b, mqtt_mock_conn_t *c) {
+    size_t off = 0;
+    while (off < c->tx_len) {
+        int r = c->t->ops->send(c->t, c->tx + off, c->tx_len - off);
+        if (r == MQTT_TRANSPORT_WOULD_BLOCK) break;
+        if (r <= 0) {
+            c->dead = true;
+            break;
+        }
+        off += (size_t)r;
+        b->stats.bytes_out += (uint64_t)r;
+    }
+    memmove(c->tx, c->tx + off, c->tx_len - off);
+    c->tx_len -= off;
+}
+
+static void mqtt_mock_accept_tcp(mqtt_mock_broker_t *b) {
+    for (;;) {
+        int fd = accept(b->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                MQTT_LOG_ERROR("accept: %s", strerror(errno));
+            return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        mqtt_transport_t *t = mqtt_transport_tcp_adopt(fd);
+        if (t) mqtt_mock_add_conn(b, t);
+    }
+}
+
+int mqtt_mock_broker_poll(mqtt_mock_broker_t *b, int timeout_ms) {
+    if (!b) return -1;
+
+    // Only the serving thread changes conns, so it may read them unlocked.
+    size_t nconns = b->nconns;
+    size_t need = 2 + nconns;
+    if (need > b->pfds_cap) {
+        struct pollfd *pfds = (struct pollfd *)realloc(b->pfds, need * 2 * sizeof(*pfds));
+        if (!pfds) {
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            return -1;
+        }
+        b->pfds = pfds;
+        b->pfds_cap = need * 2;
+    }
+    struct pollfd *pfds = b->pfds;
+    pfds[0] = (struct pollfd){ .fd = b->wake[0], .events = POLLIN };
+    pfds[1] = (struct pollfd){ .fd = b->listen_fd, .events = POLLIN };
+    for (size_t i = 0; i < nconns; i++) {
+        mqtt_mock_conn_t *c = b->conns[i];
+        pfds[2 + i] = (struct pollfd){
+            .fd = c->t->ops->fd(c->t),
+            .events = (short)(POLLIN | (c->tx_len > 0 ? POLLOUT : 0)),
+        };
+    }
+
+    int r = poll(pfds, need, timeout_ms);
+    if (r < 0) {
+        if (errno == EINTR) return 0;
+        MQTT_LOG_ERROR("poll: %s", strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&b->lock);
+
+    if (pfds[0].revents & POLLIN) {
+        uint8_t buf[64];
+        while (read(b->wake[0], buf, sizeof(buf)) > 0) {
+        }
+    }
+    for (size_t i = 0; i < b->npending; i++) {
+        mqtt_mock_add_conn(b, b->pending[i]);
+    }
+    b->npending = 0;
+    if (pfds[1].revents & POLLIN) mqtt_mock_accept_tcp(b);
+
+    if (b->drop) {
+        for (size_t i = 0; i < b->nconns; i++) {
+            b->conns[i]->dead = true;
+        }
+        b->drop = false;
+    }
+
+    for (size_t i = 0; i < nconns; i++) {
+        mqtt_mock_conn_t *c = b->conns[i];
+        if (!c->dead && (pfds[2 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+            mqtt_mock_read(b, c);
+    }
+
+    // Fan-out may have queued output on any connection.
+    size_t kept = 0;
+    for (size_t i = 0; i < b->nconns; i++) {
+        mqtt_mock_conn_t *c = b->conns[i];
+        if (!c->dead && c->tx_len > 0) mqtt_mock_flush(b, c);
+        if (c->dead) {
+            mqtt_mock_free_conn(c);
+            continue;
+        }
+        b->conns[kept++] = c;
+    }
+    b->nconns = kept;
+
+    pthread_mutex_unlock(&b->lock);
+    return 0;
+}
+
+static int mqtt_mock_accept_mem(mqtt_transport_t *server, const char *host,
+                                uint16_t port, void *ctx) {
+    (void)host;
+    (void)port;
+    mqtt_mock_broker_t *b = (mqtt_mock_broker_t *)ctx;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->npending == b->pending_cap) {
+        size_t cap = b->pending_cap ? b->pending_cap * 2 : 8;
+        mqtt_transport_t **pending =
+            (mqtt_transport_t **)realloc(b->pending, cap * sizeof(*pending));
+        if (!pending) {
+            pthread_mutex_unlock(&b->lock);
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            return -1;
+        }
+        b->pending = pending;
+        b->pending_cap = cap;
+    }
+    b->pending[b->npending++] = server;
+    pthread_mutex_unlock(&b->lock);
+
+    mqtt_mock_wake(b);
+    return 0;
+}
+
+mqtt_transport_t *mqtt_mock_broker_transport(mqtt_mock_broker_t *b) {
+    if (!b) return NULL;
+    return mqtt_transport_mem_create(mqtt_mock_accept_mem, b);
+}
+
+static int mqtt_mock_listen(mqtt_mock_broker_t *b, const mqtt_mock_broker_config_t *cfg) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg->port);
+    const char *host = cfg->host ? cfg->host : "127.0.0.1";
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        MQTT_LOG_ERROR("Invalid listen address: %s", host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        MQTT_LOG_ERROR("socket: %s", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    socklen_t addr_len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, SOMAXCONN) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0 ||
+        mqtt_transport_set_nonblocking(fd, true) != 0) {
+        MQTT_LOG_ERROR("listen: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    b->listen_fd = fd;
+    b->port = ntohs(addr.sin_port);
+    return 0;
+}
+
+mqtt_mock_broker_t *mqtt_mock_broker_create(const mqtt_mock_broker_config_t *cfg) {
+    mqtt_mock_broker_config_t defaults = {0};
+    if (!cfg) cfg = &defaults;
+
+    mqtt_mock_broker_t *b = (mqtt_mock_broker_t *)calloc(1, sizeof(*b));
+    if (!b) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    b->listen_fd = -1;
+    if (pipe(b->wake) != 0) {
+        MQTT_LOG_ERROR("pipe: %s", strerror(errno));
+        free(b);
+        return NULL;
+    }
+    fcntl(b->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(b->wake[1], F_SETFL, O_NONBLOCK);
+    pthread_mutex_init(&b->lock, NULL);
+
+    if (!cfg->no_tcp && mqtt_mock_listen(b, cfg) != 0) {
+        mqtt_mock_broker_destroy(b);
+        return NULL;
+    }
+    return b;
+}
+
+static void *mqtt_mock_thread(void *arg) {
+    mqtt_mock_broker_t *b = (mqtt_mock_broker_t *)arg;
+    for (;;) {
+        if (mqtt_mock_broker_poll(b, -1) != 0) break;
+        pthread_mutex_lock(&b->lock);
+        bool stop = b->stop;
+        pthread_mutex_unlock(&b->lock);
+        if (stop) break;
+    }
+    return NULL;
+}
+
+int mqtt_mock_broker_start(mqtt_mock_broker_t *b) {
+    if (!b || b->running) return -1;
+    if (pthread_create(&b->thread, NULL, mqtt_mock_thread, b) != 0) {
+        MQTT_LOG_ERROR("Failed to start mock broker thread");
+        return -1;
+    }
+    b->running = true;
+    return 0;
+}
+
+uint16_t mqtt_mock_broker_port(const mqtt_mock_broker_t *b) {
+    return b ? b->port : 0;
+}
+
+void mqtt_mock_broker_drop_clients(mqtt_mock_broker_t *b) {
+    if (!b) return;
+    pthread_mutex_lock(&b->lock);
+    b->drop = true;
+    pthread_mutex_unlock(&b->lock);
+    mqtt_mock_wake(b);
+}
+
+void mqtt_mock_broker_get_stats(const mqtt_mock_broker_t *b,
+                                mqtt_mock_broker_stats_t *stats) {
+    if (!b || !stats) return;
+    mqtt_mock_broker_t *mb = (mqtt_mock_broker_t *)b;
+    pthread_mutex_lock(&mb->lock);
+    *stats = b->stats;
+    pthread_mutex_unlock(&mb->lock);
+}
+
+void mqtt_mock_broker_destroy(mqtt_mock_broker_t *b) {
+    if (!b) return;
+    if (b->running) {
+        pthread_mutex_lock(&b->lock);
+        b->stop = true;
+        pthread_mutex_unlock(&b->lock);
+        mqtt_mock_wake(b);
+        pthread_join(b->thread, NULL);
+    }
+
+    for (size_t i = 0; i < b->nconns; i++) {
+        mqtt_mock_free_conn(b->conns[i]);
+    }
+    for (size_t i = 0; i < b->npending; i++) {
+        mqtt_transport_destroy(b->pending[i]);
+    }
+    if (b->listen_fd >= 0) close(b->listen_fd);
+    close(b->wake[0]);
+    close(b->wake[1]);
+    pthread_mutex_destroy(&b->lock);
+    free(b->conns);
+    free(b->pending);
+    free(b->pfds);
+    free(b);
+}
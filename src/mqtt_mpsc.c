@@ -0,0 +1,48 @@
+#include "mqtt_mpsc.h"
+
+void mqtt_mpsc_init(mqtt_mpsc_t *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+void mqtt_mpsc_push(mqtt_mpsc_t *q, mqtt_mpsc_node_t *node) {
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mqtt_mpsc_node_t *prev = atomic_exchange_explicit(&q->head, node,
+                                                      memory_order_acq_rel);
+    // Between the exchange and this store the queue looks cut short to
+    // the consumer; mqtt_mpsc_pop() reports "empty" in that window.
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+mqtt_mpsc_node_t *mqtt_mpsc_pop(mqtt_mpsc_t *q) {
+    mqtt_mpsc_node_t *tail = q->tail;
+    mqtt_mpsc_node_t *next = atomic_load_explicit(&tail->next,
+                                                  memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    // tail is the last node we can see. Only hand it out if no producer
+    // is linking a successor; re-insert the stub so tail keeps a successor.
+    mqtt_mpsc_node_t *head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail != head) return NULL;
+
+    mqtt_mpsc_push(q, &q->stub);
+
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
@@ -0,0 +1,109 @@
+#include "mqtt_pool.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_POOL_ALIGN sizeof(void *)
+
+int mqtt_pool_init(mqtt_pool_t *pool, void *region, size_t region_size,
+                   size_t block_size, size_t mem_cap) {
+    memset(pool, 0, sizeof(*pool));
+    if (block_size < sizeof(void *)) block_size = sizeof(void *);
+    block_size = (block_size + MQTT_POOL_ALIGN - 1) & ~(MQTT_POOL_ALIGN - 1);
+
+    uint8_t *base = (uint8_t *)region;
+    if (region) {
+        // Align a caller-supplied region; the slack at the front is lost.
+        uintptr_t p = (uintptr_t)base;
+        uintptr_t a = (p + MQTT_POOL_ALIGN - 1) & ~(uintptr_t)(MQTT_POOL_ALIGN - 1);
+        size_t skip = (size_t)(a - p);
+        region_size = region_size > skip ? region_size - skip : 0;
+        base += skip;
+    } else if (region_size > 0) {
+        base = (uint8_t *)malloc(region_size);
+        if (!base) {
+            MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+            return -1;
+        }
+        pool->owns_region = true;
+    }
+
+    size_t nblocks = block_size ? region_size / block_size : 0;
+
+    pool->region      = base;
+    pool->region_size = nblocks * block_size;
+    pool->block_size  = block_size;
+    pool->mem_cap     = mem_cap;
+
+    // Thread the free list through the blocks, lowest address first.
+    for (size_t i = nblocks; i > 0; --i) {
+        void *block = base + (i - 1) * block_size;
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+    }
+    return 0;
+}
+
+void mqtt_pool_cleanup(mqtt_pool_t *pool) {
+    if (pool->owns_region) free(pool->region);
+    memset(pool, 0, sizeof(*pool));
+}
+
+static bool mqtt_pool_owns(const mqtt_pool_t *pool, const void *ptr) {
+    const uint8_t *p = (const uint8_t *)ptr;
+    return p >= pool->region && p < pool->region + pool->region_size;
+}
+
+static void mqtt_pool_account(mqtt_pool_t *pool, size_t bytes) {
+    pool->stats.in_use_bytes += bytes;
+    if (pool->stats.in_use_bytes > pool->stats.high_water_bytes) {
+        pool->stats.high_water_bytes = pool->stats.in_use_bytes;
+    }
+}
+
+void *mqtt_pool_alloc(mqtt_pool_t *pool, size_t size) {
+    if (size == 0) size = 1;
+
+    bool from_slab = size <= pool->block_size && pool->free_list != NULL;
+    size_t charge = from_slab ? pool->block_size : size;
+
+    if (pool->mem_cap > 0 && pool->stats.in_use_bytes + charge > pool->mem_cap) {
+        pool->stats.failures++;
+        return NULL;
+    }
+
+    if (from_slab) {
+        void *block = pool->free_list;
+        pool->free_list = *(void **)block;
+        pool->stats.hits++;
+        mqtt_pool_account(pool, charge);
+        return block;
+    }
+
+    void *p = malloc(size);
+    if (!p) {
+        pool->stats.failures++;
+        return NULL;
+    }
+    pool->stats.misses++;
+    mqtt_pool_account(pool, charge);
+    return p;
+}
+
+void mqtt_pool_free(mqtt_pool_t *pool, void *ptr, size_t size) {
+    if (!ptr) return;
+    if (size == 0) size = 1;
+
+    if (mqtt_pool_owns(pool, ptr)) {
+        *(void **)ptr = pool->free_list;
+        pool->free_list = ptr;
+        pool->stats.in_use_bytes -= pool->block_size;
+        return;
+    }
+
+    free(ptr);
+    pool->stats.in_use_bytes -= size;
+}
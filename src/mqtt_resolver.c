@@ -0,0 +1,317 @@
+#include "mqtt_resolver.h"
+#include "mqtt_time.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Threads running getaddrinfo(); started as lookups queue up. */
+#define MQTT_RESOLVE_THREADS 4
+
+/* How long an answer is reused; failures are retried sooner. */
+#define MQTT_RESOLVE_TTL_MS          60000
+#define MQTT_RESOLVE_NEGATIVE_TTL_MS 5000
+
+/* Cached host:port pairs before old ones are evicted. */
+#define MQTT_RESOLVE_CACHE_MAX 256
+
+typedef struct mqtt_resolve_entry mqtt_resolve_entry_t;
+
+struct mqtt_resolve {
+    mqtt_resolve_entry_t *entry;        // waiting on it, NULL once done
+    mqtt_resolve_t       *next_waiter;
+    int                   notify_fd;
+    int                   status;       // 1 resolved, 0 running, -1 failed
+    size_t                naddrs;
+    mqtt_resolved_addr_t  addrs[MQTT_RESOLVE_MAX_ADDRS];
+};
+
+/* A cached host:port; stays put while its lookup runs. */
+struct mqtt_resolve_entry {
+    mqtt_resolve_entry_t *next;         // cache list
+    mqtt_resolve_entry_t *next_queued;  // waiting for a resolver thread
+    char                 *host;
+    uint16_t              port;
+    int                   status;       // as in mqtt_resolve
+    uint64_t              expires_ms;
+    size_t                naddrs;
+    mqtt_resolved_addr_t  addrs[MQTT_RESOLVE_MAX_ADDRS];
+    mqtt_resolve_t       *waiters;
+};
+
+static struct {
+    pthread_mutex_t       lock;
+    pthread_cond_t        work;
+    mqtt_resolve_entry_t *entries;
+    size_t                nentries;
+    mqtt_resolve_entry_t *queue_head;
+    mqtt_resolve_entry_t *queue_tail;
+    size_t                nthreads;
+    size_t                idle;
+} mqtt_resolver = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+};
+
+/*
+ * Run getaddrinfo() and keep up to MQTT_RESOLVE_MAX_ADDRS answers.
+ *
+ * @return 0 on success, -1 on failure (logged unless `quiet`)
+ */
+static int mqtt_resolve_lookup(const char *host, uint16_t port, int flags,
+                               bool quiet, mqtt_resolved_addr_t *addrs,
+                               size_t *naddrs) {
+    struct addrinfo hints;
+    struct addrinfo *result;
+    char port_str[8];
+
+    snprintf(port_str, sizeof(port_str), "%u", (unsigned int)port);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = flags;
+
+    int s = getaddrinfo(host, port_str, &hints, &result);
+    if (s != 0) {
+        if (!quiet) MQTT_LOG_ERROR("getaddrinfo(%s): %s", host, gai_strerror(s));
+        return -1;
+    }
+
+    size_t n = 0;
+    for (struct addrinfo *rp = result; rp && n < MQTT_RESOLVE_MAX_ADDRS; rp = rp->ai_next) {
+        if (rp->ai_addrlen > sizeof(addrs[n].addr)) continue;
+        memcpy(&addrs[n].addr, rp->ai_addr, rp->ai_addrlen);
+        addrs[n].len = rp->ai_addrlen;
+        n++;
+    }
+    freeaddrinfo(result);
+
+    *naddrs = n;
+    return n > 0 ? 0 : -1;
+}
+
+/* Hand an answer to a waiting lookup and wake its owner. Lock held. */
+static void mqtt_resolve_complete(mqtt_resolve_t *r, const mqtt_resolve_entry_t *e) {
+    r->entry  = NULL;
+    r->status = e->status;
+    r->naddrs = e->naddrs;
+    memcpy(r->addrs, e->addrs, e->naddrs * sizeof(e->addrs[0]));
+
+    if (r->notify_fd >= 0) {
+        uint64_t one = 1;
+        if (write(r->notify_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            MQTT_LOG_ERROR("write(eventfd): %s", strerror(errno));
+    }
+}
+
+static void *mqtt_resolve_thread(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&mqtt_resolver.lock);
+    for (;;) {
+        while (!mqtt_resolver.queue_head) {
+            mqtt_resolver.idle++;
+            pthread_cond_wait(&mqtt_resolver.work, &mqtt_resolver.lock);
+            mqtt_resolver.idle--;
+        }
+        mqtt_resolve_entry_t *e = mqtt_resolver.queue_head;
+        mqtt_resolver.queue_head = e->next_queued;
+        if (!mqtt_resolver.queue_head) mqtt_resolver.queue_tail = NULL;
+        pthread_mutex_unlock(&mqtt_resolver.lock);
+
+        // The entry is not evicted while its lookup runs.
+        mqtt_resolved_addr_t addrs[MQTT_RESOLVE_MAX_ADDRS];
+        size_t naddrs = 0;
+        int rc = mqtt_resolve_lookup(e->host, e->port, 0, false, addrs, &naddrs);
+
+        pthread_mutex_lock(&mqtt_resolver.lock);
+        e->status = rc == 0 ? 1 : -1;
+        e->naddrs = rc == 0 ? naddrs : 0;
+        memcpy(e->addrs, addrs, e->naddrs * sizeof(addrs[0]));
+        e->expires_ms = mqtt_time_now_ms() +
+            (rc == 0 ? MQTT_RESOLVE_TTL_MS : MQTT_RESOLVE_NEGATIVE_TTL_MS);
+
+        while (e->waiters) {
+            mqtt_resolve_t *r = e->waiters;
+            e->waiters = r->next_waiter;
+            mqtt_resolve_complete(r, e);
+        }
+    }
+    return NULL;
+}
+
+static void mqtt_resolve_entry_free(mqtt_resolve_entry_t *e) {
+    free(e->host);
+    free(e);
+}
+
+/* Make room for one more entry, dropping expired ones first. Lock held. */
+static void mqtt_resolve_evict(uint64_t now) {
+    mqtt_resolve_entry_t **pp = &mqtt_resolver.entries;
+    mqtt_resolve_entry_t **oldest = NULL;
+
+    while (*pp) {
+        mqtt_resolve_entry_t *e = *pp;
+        if (e->status == 0) {           // lookup running
+            pp = &e->next;
+            continue;
+        }
+        if (e->expires_ms <= now) {
+            *pp = e->next;
+            mqtt_resolve_entry_free(e);
+            mqtt_resolver.nentries--;
+            continue;
+        }
+        if (!oldest || e->expires_ms < (*oldest)->expires_ms) oldest = pp;
+        pp = &e->next;
+    }
+
+    if (mqtt_resolver.nentries >= MQTT_RESOLVE_CACHE_MAX && oldest) {
+        mqtt_resolve_entry_t *e = *oldest;
+        *oldest = e->next;
+        mqtt_resolve_entry_free(e);
+        mqtt_resolver.nentries--;
+    }
+}
+
+/* Cache entry for host:port, created if missing. Lock held. */
+static mqtt_resolve_entry_t *mqtt_resolve_entry_get(const char *host, uint16_t port,
+                                                    uint64_t now) {
+    for (mqtt_resolve_entry_t *e = mqtt_resolver.entries; e; e = e->next) {
+        if (e->port == port && strcmp(e->host, host) == 0) return e;
+    }
+
+    if (mqtt_resolver.nentries >= MQTT_RESOLVE_CACHE_MAX) mqtt_resolve_evict(now);
+
+    mqtt_resolve_entry_t *e = (mqtt_resolve_entry_t *)calloc(1, sizeof(*e));
+    char *copy = e ? strdup(host) : NULL;
+    if (!copy) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        free(e);
+        return NULL;
+    }
+    e->host   = copy;
+    e->port   = port;
+    e->status = -1;                     // nothing known yet
+    e->next   = mqtt_resolver.entries;
+    mqtt_resolver.entries = e;
+    mqtt_resolver.nentries++;
+    return e;
+}
+
+/* Queue the entry's lookup, adding a thread if none is free. Lock held. */
+static void mqtt_resolve_enqueue(mqtt_resolve_entry_t *e) {
+    e->status = 0;
+    e->next_queued = NULL;
+    if (mqtt_resolver.queue_tail) mqtt_resolver.queue_tail->next_queued = e;
+    else                          mqtt_resolver.queue_head = e;
+    mqtt_resolver.queue_tail = e;
+
+    if (mqtt_resolver.idle == 0 && mqtt_resolver.nthreads < MQTT_RESOLVE_THREADS) {
+        pthread_attr_t attr;
+        pthread_t thread;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int rc = pthread_create(&thread, &attr, mqtt_resolve_thread, NULL);
+        pthread_attr_destroy(&attr);
+        if (rc == 0) {
+            mqtt_resolver.nthreads++;
+        } else {
+            MQTT_LOG_ERROR("pthread_create: %s", strerror(rc));
+        }
+    }
+    pthread_cond_signal(&mqtt_resolver.work);
+}
+
+mqtt_resolve_t *mqtt_resolve_start(const char *host, uint16_t port, int notify_fd) {
+    if (!host) return NULL;
+
+    mqtt_resolve_t *r = (mqtt_resolve_t *)calloc(1, sizeof(*r));
+    if (!r) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    r->notify_fd = -1;                  // no wakeup for answers known now
+
+    // An IP address in text form needs neither a thread nor the cache.
+    if (mqtt_resolve_lookup(host, port, AI_NUMERICHOST, true, r->addrs, &r->naddrs) == 0) {
+        r->status = 1;
+        return r;
+    }
+
+    pthread_mutex_lock(&mqtt_resolver.lock);
+    uint64_t now = mqtt_time_now_ms();
+    mqtt_resolve_entry_t *e = mqtt_resolve_entry_get(host, port, now);
+    if (!e) {
+        pthread_mutex_unlock(&mqtt_resolver.lock);
+        r->status = -1;
+        return r;
+    }
+
+    if (e->status != 0 && e->expires_ms > now) {
+        mqtt_resolve_complete(r, e);
+        pthread_mutex_unlock(&mqtt_resolver.lock);
+        return r;
+    }
+
+    if (e->status != 0) mqtt_resolve_enqueue(e);
+    r->status      = 0;
+    r->notify_fd   = notify_fd;
+    r->entry       = e;
+    r->next_waiter = e->waiters;
+    e->waiters     = r;
+    pthread_mutex_unlock(&mqtt_resolver.lock);
+    return r;
+}
+
+int mqtt_resolve_result(const mqtt_resolve_t *r,
+                        const mqtt_resolved_addr_t **addrs,
+                        size_t *naddrs) {
+    if (!r) return -1;
+
+    pthread_mutex_lock(&mqtt_resolver.lock);
+    int status = r->status;
+    pthread_mutex_unlock(&mqtt_resolver.lock);
+
+    if (status == 1) {
+        *addrs  = r->addrs;
+        *naddrs = r->naddrs;
+    }
+    return status;
+}
+
+void mqtt_resolve_free(mqtt_resolve_t *r) {
+    if (!r) return;
+
+    pthread_mutex_lock(&mqtt_resolver.lock);
+    if (r->entry) {
+        mqtt_resolve_t **pp = &r->entry->waiters;
+        while (*pp != r) pp = &(*pp)->next_waiter;
+        *pp = r->next_waiter;
+    }
+    pthread_mutex_unlock(&mqtt_resolver.lock);
+    free(r);
+}
+
+void mqtt_resolve_flush_cache(void) {
+    pthread_mutex_lock(&mqtt_resolver.lock);
+    mqtt_resolve_entry_t **pp = &mqtt_resolver.entries;
+    while (*pp) {
+        mqtt_resolve_entry_t *e = *pp;
+        if (e->status == 0) {           // its thread still needs it
+            pp = &e->next;
+            continue;
+        }
+        *pp = e->next;
+        mqtt_resolve_entry_free(e);
+        mqtt_resolver.nentries--;
+    }
+    pthread_mutex_unlock(&mqtt_resolver.lock);
+}
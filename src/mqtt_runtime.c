@@ -0,0 +1,260 @@
+#define _GNU_SOURCE
+#include "mqtt_runtime.h"
+#include "mqtt_loop.h"
+#include "mqtt_mpsc.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct mqtt_runtime_shard mqtt_runtime_shard_t;
+
+struct mqtt_runtime_session {
+    mqtt_client_t        *client;
+    mqtt_runtime_shard_t *shard;
+
+    // Set by the shard thread if the client could not join its loop
+    atomic_bool failed;
+
+    // Owned by the shard thread
+    mqtt_runtime_session_t *next;        // all sessions of the shard
+    bool attached;
+};
+
+// Hands a new session to its shard thread. Publishes do not come this
+// way: they go straight onto the client's own queue.
+typedef struct {
+    mqtt_mpsc_node_t        node;  // must stay first
+    mqtt_runtime_session_t *session;
+} mqtt_runtime_cmd_t;
+
+struct mqtt_runtime_shard {
+    mqtt_runtime_t *rt;
+    size_t          index;
+    mqtt_loop_t    *loop;
+    pthread_t       thread;
+    bool            started;
+
+    mqtt_mpsc_t     queue;
+    atomic_bool     wake_pending;  // a wakeup is already on its way
+    atomic_bool     failed;        // the thread stopped on a loop error
+
+    mqtt_runtime_session_t *sessions;
+};
+
+struct mqtt_runtime {
+    mqtt_runtime_config_t cfg;
+    atomic_bool           stop;
+    atomic_size_t         next_shard;
+
+    mqtt_runtime_shard_t *shards;
+    size_t                nshards;
+};
+
+static void mqtt_runtime_pin(mqtt_runtime_shard_t *shard) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus <= 0) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((size_t)(shard->rt->cfg.first_cpu + (int)shard->index) % (size_t)ncpus,
+            &set);
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        MQTT_LOG_ERROR("pthread_setaffinity_np: %s", strerror(rc));
+    }
+}
+
+static void mqtt_runtime_drain(mqtt_runtime_shard_t *shard, bool shutting_down) {
+    mqtt_mpsc_node_t *node;
+
+    // Cleared before popping: a producer that pushes after this point
+    // sends a fresh wakeup, so nothing is left behind unnoticed.
+    atomic_store(&shard->wake_pending, false);
+
+    while ((node = mqtt_mpsc_pop(&shard->queue)) != NULL) {
+        mqtt_runtime_session_t *session = ((mqtt_runtime_cmd_t *)node)->session;
+        free(node);
+
+        session->next = shard->sessions;
+        shard->sessions = session;
+        if (shutting_down) continue;
+        if (mqtt_loop_add(shard->loop, session->client) == 0) {
+            session->attached = true;
+        } else {
+            MQTT_LOG_ERROR("Loop thread %zu: could not add client", shard->index);
+            atomic_store(&session->failed, true);
+        }
+    }
+}
+
+static void *mqtt_runtime_thread(void *arg) {
+    mqtt_runtime_shard_t *shard = (mqtt_runtime_shard_t *)arg;
+
+    if (shard->rt->cfg.pin_threads) mqtt_runtime_pin(shard);
+
+    while (!atomic_load(&shard->rt->stop)) {
+        if (mqtt_loop_run_once(shard->loop, -1) < 0) {
+            // Its clients are no longer driven; new ones go elsewhere.
+            MQTT_LOG_ERROR("Loop thread %zu stopped on a loop error", shard->index);
+            atomic_store(&shard->failed, true);
+            break;
+        }
+        mqtt_runtime_drain(shard, false);
+    }
+    return NULL;
+}
+
+mqtt_runtime_t *mqtt_runtime_create(const mqtt_runtime_config_t *cfg) {
+    mqtt_runtime_t *rt = (mqtt_runtime_t *)calloc(1, sizeof(mqtt_runtime_t));
+    if (!rt) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+
+    if (cfg) rt->cfg = *cfg;
+    if (rt->cfg.num_threads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        rt->cfg.num_threads = ncpus > 0 ? (size_t)ncpus : 1;
+    }
+
+    rt->shards = (mqtt_runtime_shard_t *)calloc(rt->cfg.num_threads,
+                                                sizeof(mqtt_runtime_shard_t));
+    if (!rt->shards) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        free(rt);
+        return NULL;
+    }
+    rt->nshards = rt->cfg.num_threads;
+
+    for (size_t i = 0; i < rt->nshards; ++i) {
+        mqtt_runtime_shard_t *shard = &rt->shards[i];
+        shard->rt    = rt;
+        shard->index = i;
+        mqtt_mpsc_init(&shard->queue);
+
+        shard->loop = mqtt_loop_create();
+        if (!shard->loop) {
+            mqtt_runtime_destroy(rt);
+            return NULL;
+        }
+
+        int rc = pthread_create(&shard->thread, NULL, mqtt_runtime_thread, shard);
+        if (rc != 0) {
+            MQTT_LOG_ERROR("pthread_create: %s", strerror(rc));
+            mqtt_runtime_destroy(rt);
+            return NULL;
+        }
+        shard->started = true;
+    }
+
+    return rt;
+}
+
+void mqtt_runtime_destroy(mqtt_runtime_t *rt) {
+    if (!rt) return;
+
+    atomic_store(&rt->stop, true);
+    for (size_t i = 0; i < rt->nshards; ++i) {
+        if (rt->shards[i].started) {
+            mqtt_loop_wakeup(rt->shards[i].loop);
+            pthread_join(rt->shards[i].thread, NULL);
+        }
+    }
+
+    for (size_t i = 0; i < rt->nshards; ++i) {
+        mqtt_runtime_shard_t *shard = &rt->shards[i];
+        if (!shard->loop) continue;
+
+        // Threads are gone; collect what is still queued.
+        mqtt_runtime_drain(shard, true);
+
+        mqtt_runtime_session_t *s = shard->sessions;
+        while (s) {
+            mqtt_runtime_session_t *next = s->next;
+            if (s->attached) mqtt_loop_remove(shard->loop, s->client);
+            free(s);
+            s = next;
+        }
+        mqtt_loop_destroy(shard->loop);
+    }
+
+    free(rt->shards);
+    free(rt);
+}
+
+size_t mqtt_runtime_num_threads(const mqtt_runtime_t *rt) {
+    return rt ? rt->nshards : 0;
+}
+
+static void mqtt_runtime_submit(mqtt_runtime_shard_t *shard,
+                                mqtt_runtime_cmd_t *cmd) {
+    mqtt_mpsc_push(&shard->queue, &cmd->node);
+
+    // Only the first producer after a drain pays for the eventfd write.
+    if (!atomic_exchange(&shard->wake_pending, true)) {
+        mqtt_loop_wakeup(shard->loop);
+    }
+}
+
+mqtt_runtime_session_t *mqtt_runtime_add_client(mqtt_runtime_t *rt,
+                                                mqtt_client_t *client) {
+    if (!rt || !client) return NULL;
+
+    if (!mqtt_client_is_connected(client) && !mqtt_client_is_connecting(client)) {
+        MQTT_LOG_ERROR("mqtt_runtime_add_client: client not connected or connecting");
+        return NULL;
+    }
+
+    mqtt_runtime_session_t *session =
+        (mqtt_runtime_session_t *)calloc(1, sizeof(mqtt_runtime_session_t));
+    mqtt_runtime_cmd_t *cmd =
+        (mqtt_runtime_cmd_t *)calloc(1, sizeof(mqtt_runtime_cmd_t));
+    if (!session || !cmd) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        free(session);
+        free(cmd);
+        return NULL;
+    }
+
+    // Round-robin over the threads still running.
+    mqtt_runtime_shard_t *shard = NULL;
+    for (size_t i = 0; i < rt->nshards && !shard; ++i) {
+        size_t idx = atomic_fetch_add(&rt->next_shard, 1) % rt->nshards;
+        if (!atomic_load(&rt->shards[idx].failed)) shard = &rt->shards[idx];
+    }
+    if (!shard) {
+        MQTT_LOG_ERROR("mqtt_runtime_add_client: no loop thread left running");
+        free(session);
+        free(cmd);
+        return NULL;
+    }
+    session->client = client;
+    session->shard  = shard;
+
+    cmd->session = session;
+    mqtt_runtime_submit(session->shard, cmd);
+
+    return session;
+}
+
+int mqtt_runtime_publish(mqtt_runtime_session_t *session,
+                         const char *topic,
+                         const uint8_t *payload,
+                         size_t payload_len) {
+    if (!session || atomic_load(&session->failed) ||
+        atomic_load(&session->shard->failed)) {
+        return -1;
+    }
+
+    // The client's loop thread is woken through its wakeup hook.
+    return mqtt_client_publish_concurrent(session->client, topic,
+                                          payload, payload_len);
+}
@@ -0,0 +1,920 @@
+#include "mqtt_store.h"
+#include "mqtt_time.h"
+#include "mqtt_log.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MQTT_STORE_SEGMENT_SIZE_DEFAULT (4u * 1024u * 1024u)
+
+/* Segment file header: magic, then the segment number. */
+#define MQTT_STORE_SEG_HDR 16u
+static const char mqtt_store_magic[8] = { 'M', 'Q', 'T', 'T', 'S', 'E', 'G', '1' };
+
+enum {
+    MQTT_STORE_REC_PUT     = 1, // payload: PUBLISH frame
+    MQTT_STORE_REC_PUBREL  = 2, // QoS 2 message got its PUBREC
+    MQTT_STORE_REC_RELEASE = 3, // QoS 1/2 message acknowledged
+    MQTT_STORE_REC_MARK    = 4, // seq: offline watermark, payload: last seq
+};
+
+#define MQTT_STORE_FLAG_RELEASED 0x01 // on a PUT copied after its PUBREL
+
+typedef struct {
+    uint32_t crc;        // of the rest of the header and the payload
+    uint32_t len;        // payload bytes
+    uint64_t seq;
+    uint16_t packet_id;
+    uint8_t  type;
+    uint8_t  flags;
+    uint32_t reserved;
+} mqtt_store_rec_t;
+
+/* Records start 8-byte aligned. */
+#define MQTT_STORE_REC_SIZE(len) \
+    ((sizeof(mqtt_store_rec_t) + (size_t)(len) + 7u) & ~(size_t)7u)
+
+typedef struct {
+    uint64_t segno;
+    uint8_t *map;
+    size_t   size;
+    size_t   live;        // PUT records still needed
+    size_t   live_bytes;
+} mqtt_store_segment_t;
+
+// Where a live PUT record is
+typedef struct {
+    uint64_t seq;
+    uint64_t segno;
+    size_t   off;
+    uint32_t len;         // payload bytes
+} mqtt_store_loc_t;
+
+// Index slot, open addressing on packet_id (0 = empty)
+typedef struct {
+    mqtt_store_loc_t loc;
+    uint16_t         packet_id;
+    bool             released;
+} mqtt_store_entry_t;
+
+struct mqtt_store {
+    char    *dir;
+    int      dirfd;
+    size_t   segment_size;
+    size_t   page_size;
+    uint32_t sync_every;
+    uint32_t sync_interval_ms;
+
+    // Oldest first; the last one is appended to.
+    mqtt_store_segment_t *segs;
+    size_t   nsegs;
+    size_t   segs_cap;
+    size_t   write_off;
+    size_t   synced_off;
+    uint32_t unsynced;        // records appended since the last msync
+    uint64_t dirty_since_ms;
+    uint64_t syncs;
+
+    uint64_t last_seq;
+    uint64_t watermark;       // QoS 0 records up to here are released
+
+    mqtt_store_entry_t *index;
+    size_t   index_cap;       // power of two, at most half full
+    size_t   index_count;
+
+    // QoS 0 offline records in seq order: [off_head, off_head + off_len)
+    mqtt_store_loc_t *offline;
+    size_t   off_head;
+    size_t   off_len;
+    size_t   off_cap;
+
+    bool     compacting;
+};
+
+// Built once, on the first open; stores on other threads may be using it.
+static uint32_t       mqtt_store_crc_table[256];
+static pthread_once_t mqtt_store_crc_once = PTHREAD_ONCE_INIT;
+
+static void mqtt_store_crc_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        mqtt_store_crc_table[i] = c;
+    }
+}
+
+static uint32_t mqtt_store_crc32(uint32_t crc, const uint8_t *p, size_t n) {
+    crc = ~crc;
+    while (n--) crc = mqtt_store_crc_table[(crc ^ *p++) & 0xFFu] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t mqtt_store_rec_crc(const mqtt_store_rec_t *hdr, const uint8_t *payload) {
+    uint32_t crc = mqtt_store_crc32(0, (const uint8_t *)hdr + sizeof(hdr->crc),
+                                    sizeof(*hdr) - sizeof(hdr->crc));
+    return mqtt_store_crc32(crc, payload, hdr->len);
+}
+
+static int mqtt_store_seg_path(const mqtt_store_t *s, uint64_t segno,
+                               char *path, size_t size) {
+    int n = snprintf(path, size, "%s/%016" PRIx64 ".seg", s->dir, segno);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/* Binary search; segments are sorted but numbers may have gaps. */
+static mqtt_store_segment_t *mqtt_store_seg(mqtt_store_t *s, uint64_t segno) {
+    size_t lo = 0, hi = s->nsegs;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->segs[mid].segno == segno) return &s->segs[mid];
+        if (s->segs[mid].segno < segno) lo = mid + 1;
+        else                            hi = mid;
+    }
+    return NULL;
+}
+
+static void mqtt_store_ref(mqtt_store_t *s, const mqtt_store_loc_t *loc) {
+    mqtt_store_segment_t *seg = mqtt_store_seg(s, loc->segno);
+    seg->live++;
+    seg->live_bytes += MQTT_STORE_REC_SIZE(loc->len);
+}
+
+static void mqtt_store_unref(mqtt_store_t *s, const mqtt_store_loc_t *loc) {
+    mqtt_store_segment_t *seg = mqtt_store_seg(s, loc->segno);
+    seg->live--;
+    seg->live_bytes -= MQTT_STORE_REC_SIZE(loc->len);
+}
+
+/* ---- index by packet id ---- */
+
+static size_t mqtt_store_hash(uint16_t packet_id, size_t cap) {
+    return ((size_t)packet_id * 40503u) & (cap - 1);
+}
+
+static mqtt_store_entry_t *mqtt_store_find(const mqtt_store_t *s, uint16_t packet_id) {
+    if (s->index_cap == 0 || packet_id == 0) return NULL;
+    size_t mask = s->index_cap - 1;
+    for (size_t i = mqtt_store_hash(packet_id, s->index_cap);; i = (i + 1) & mask) {
+        if (s->index[i].packet_id == packet_id) return &s->index[i];
+        if (s->index[i].packet_id == 0) return NULL;
+    }
+}
+
+/* Make room for one more entry. */
+static int mqtt_store_index_reserve(mqtt_store_t *s) {
+    if ((s->index_count + 1) * 2 <= s->index_cap) return 0;
+
+    size_t cap = s->index_cap ? s->index_cap * 2 : 64;
+    mqtt_store_entry_t *index = (mqtt_store_entry_t *)calloc(cap, sizeof(*index));
+    if (!index) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return -1;
+    }
+    for (size_t i = 0; i < s->index_cap; ++i) {
+        if (s->index[i].packet_id == 0) continue;
+        size_t j = mqtt_store_hash(s->index[i].packet_id, cap);
+        while (index[j].packet_id != 0) j = (j + 1) & (cap - 1);
+        index[j] = s->index[i];
+    }
+    free(s->index);
+    s->index = index;
+    s->index_cap = cap;
+    return 0;
+}
+
+/* Entry for packet_id, added if missing; room must be reserved. */
+static mqtt_store_entry_t *mqtt_store_index_get(mqtt_store_t *s,
+                                                uint16_t packet_id, bool *existed) {
+    size_t mask = s->index_cap - 1;
+    size_t i = mqtt_store_hash(packet_id, s->index_cap);
+    while (s->index[i].packet_id != 0 && s->index[i].packet_id != packet_id) {
+        i = (i + 1) & mask;
+    }
+    *existed = s->index[i].packet_id != 0;
+    if (!*existed) {
+        s->index[i].packet_id = packet_id;
+        s->index_count++;
+    }
+    return &s->index[i];
+}
+
+/* Linear probing without tombstones: shift later entries back. */
+static void mqtt_store_index_del(mqtt_store_t *s, mqtt_store_entry_t *e) {
+    size_t mask = s->index_cap - 1;
+    size_t i = (size_t)(e - s->index);
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (s->index[j].packet_id == 0) break;
+        size_t h = mqtt_store_hash(s->index[j].packet_id, s->index_cap);
+        // Entry j may move to i unless its home slot lies in (i, j].
+        bool stays = (i <= j) ? (h > i && h <= j) : (h > i || h <= j);
+        if (!stays) {
+            s->index[i] = s->index[j];
+            i = j;
+        }
+    }
+    memset(&s->index[i], 0, sizeof(s->index[i]));
+    s->index_count--;
+}
+
+/* ---- QoS 0 offline FIFO ---- */
+
+static int mqtt_store_offline_reserve(mqtt_store_t *s) {
+    if (s->off_head + s->off_len < s->off_cap) return 0;
+    if (s->off_head > 0) {
+        memmove(s->offline, s->offline + s->off_head, s->off_len * sizeof(*s->offline));
+        s->off_head = 0;
+        return 0;
+    }
+    size_t cap = s->off_cap ? s->off_cap * 2 : 64;
+    mqtt_store_loc_t *q = (mqtt_store_loc_t *)realloc(s->offline, cap * sizeof(*q));
+    if (!q) {
+        MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+        return -1;
+    }
+    s->offline = q;
+    s->off_cap = cap;
+    return 0;
+}
+
+static mqtt_store_loc_t *mqtt_store_offline_find(mqtt_store_t *s, uint64_t seq) {
+    size_t lo = s->off_head, hi = s->off_head + s->off_len;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->offline[mid].seq == seq) return &s->offline[mid];
+        if (s->offline[mid].seq < seq) lo = mid + 1;
+        else                           hi = mid;
+    }
+    return NULL;
+}
+
+/* ---- segments ---- */
+
+/*
+ * Map a segment file. A new one is allocated on disk up front: stores
+ * to a sparse mapping on a full disk would raise SIGBUS instead of
+ * failing cleanly.
+ */
+static uint8_t *mqtt_store_map(const char *path, size_t *size, bool create) {
+    int fd = open(path, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+    if (fd < 0) {
+        MQTT_LOG_ERROR("%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (create) {
+        int err = posix_fallocate(fd, 0, (off_t)*size);
+        if (err != 0) {
+            MQTT_LOG_ERROR("posix_fallocate %s: %s", path, strerror(err));
+            close(fd);
+            unlink(path);
+            return NULL;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            MQTT_LOG_ERROR("fstat: %s", strerror(errno));
+            close(fd);
+            return NULL;
+        }
+        *size = (size_t)st.st_size;
+        if (*size < MQTT_STORE_SEG_HDR) {
+            MQTT_LOG_ERROR("%s: truncated segment", path);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    void *map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        MQTT_LOG_ERROR("mmap: %s", strerror(errno));
+        if (create) unlink(path);
+        return NULL;
+    }
+    return (uint8_t *)map;
+}
+
+static int mqtt_store_push_segment(mqtt_store_t *s, uint64_t segno,
+                                   uint8_t *map, size_t size) {
+    if (s->nsegs == s->segs_cap) {
+        size_t cap = s->segs_cap ? s->segs_cap * 2 : 8;
+        mqtt_store_segment_t *segs = (mqtt_store_segment_t *)realloc(
+            s->segs, cap * sizeof(*segs));
+        if (!segs) {
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            return -1;
+        }
+        s->segs = segs;
+        s->segs_cap = cap;
+    }
+    mqtt_store_segment_t *seg = &s->segs[s->nsegs++];
+    memset(seg, 0, sizeof(*seg));
+    seg->segno = segno;
+    seg->map   = map;
+    seg->size  = size;
+    return 0;
+}
+
+/* Delete the oldest segments while nothing in them is needed. */
+static void mqtt_store_drop_dead(mqtt_store_t *s) {
+    size_t n = 0;
+    while (n + 1 < s->nsegs && s->segs[n].live == 0) {
+        char path[PATH_MAX];
+        if (mqtt_store_seg_path(s, s->segs[n].segno, path, sizeof(path)) == 0 &&
+            unlink(path) != 0) {
+            MQTT_LOG_ERROR("%s: %s", path, strerror(errno));
+        }
+        munmap(s->segs[n].map, s->segs[n].size);
+        n++;
+    }
+    if (n > 0) {
+        memmove(s->segs, s->segs + n, (s->nsegs - n) * sizeof(*s->segs));
+        s->nsegs -= n;
+    }
+}
+
+int mqtt_store_sync(mqtt_store_t *s) {
+    if (!s) return -1;
+    if (s->nsegs > 0 && s->write_off > s->synced_off) {
+        mqtt_store_segment_t *seg = &s->segs[s->nsegs - 1];
+        size_t start = s->synced_off & ~(s->page_size - 1);
+        if (msync(seg->map + start, s->write_off - start, MS_SYNC) != 0) {
+            MQTT_LOG_ERROR("msync: %s", strerror(errno));
+            return -1;
+        }
+        s->synced_off = s->write_off;
+        s->syncs++;
+    }
+    s->unsynced = 0;
+    return 0;
+}
+
+/* Apply the sync policies after an append. */
+static int mqtt_store_appended(mqtt_store_t *s) {
+    uint64_t now = s->sync_interval_ms ? mqtt_time_now_ms() : 0;
+    if (s->unsynced++ == 0) s->dirty_since_ms = now;
+
+    if (s->sync_every && s->unsynced >= s->sync_every) return mqtt_store_sync(s);
+    if (s->sync_interval_ms && now - s->dirty_since_ms >= s->sync_interval_ms)
+        return mqtt_store_sync(s);
+    return 0;
+}
+
+static int mqtt_store_write(mqtt_store_t *s, uint8_t type, uint8_t flags,
+                            uint16_t packet_id, uint64_t seq,
+                            const uint8_t *payload, size_t len,
+                            mqtt_store_loc_t *loc);
+
+static int mqtt_store_write_mark(mqtt_store_t *s) {
+    uint64_t last = s->last_seq;
+    return mqtt_store_write(s, MQTT_STORE_REC_MARK, 0, 0, s->watermark,
+                            (const uint8_t *)&last, sizeof(last), NULL);
+}
+
+/*
+ * Copy the live records of the oldest segment forward when they are
+ * few, so that it can be deleted instead of pinning every segment
+ * written after it.
+ */
+static int mqtt_store_compact(mqtt_store_t *s) {
+    if (s->nsegs < 2) return 0;
+
+    mqtt_store_segment_t *oldest = &s->segs[0];
+    if (oldest->live == 0 || oldest->live_bytes * 4 >= oldest->size) {
+        mqtt_store_drop_dead(s);
+        return 0;
+    }
+
+    uint64_t segno = oldest->segno;
+    const uint8_t *map = oldest->map;
+    size_t size = oldest->size;
+    size_t off = MQTT_STORE_SEG_HDR;
+    int rc = 0;
+
+    s->compacting = true;
+    while (mqtt_store_seg(s, segno)->live > 0 &&
+           off + sizeof(mqtt_store_rec_t) <= size) {
+        mqtt_store_rec_t hdr;
+        memcpy(&hdr, map + off, sizeof(hdr));
+        if (hdr.type == 0) break;
+
+        if (hdr.type == MQTT_STORE_REC_PUT) {
+            mqtt_store_loc_t *loc = NULL;
+            bool released = false;
+            if (hdr.packet_id != 0) {
+                mqtt_store_entry_t *e = mqtt_store_find(s, hdr.packet_id);
+                if (e) {
+                    loc = &e->loc;
+                    released = e->released;
+                }
+            } else {
+                loc = mqtt_store_offline_find(s, hdr.seq);
+            }
+
+            // Only the record the index points at is live.
+            if (loc && loc->segno == segno && loc->off == off) {
+                mqtt_store_loc_t moved;
+                rc = mqtt_store_write(s, MQTT_STORE_REC_PUT,
+                                      released ? MQTT_STORE_FLAG_RELEASED : 0,
+                                      hdr.packet_id, hdr.seq,
+                                      map + off + sizeof(hdr), hdr.len, &moved);
+                if (rc != 0) break;
+                mqtt_store_unref(s, loc);
+                *loc = moved;
+                mqtt_store_ref(s, loc);
+            }
+        }
+        off += MQTT_STORE_REC_SIZE(hdr.len);
+    }
+    s->compacting = false;
+
+    // The copies must be on disk before the originals go away.
+    if (rc == 0) rc = mqtt_store_sync(s);
+    if (rc == 0) mqtt_store_drop_dead(s);
+    return rc;
+}
+
+/* Seal the active segment and start a new one with room for `need`. */
+static int mqtt_store_roll(mqtt_store_t *s, size_t need) {
+    if (mqtt_store_sync(s) != 0) return -1;
+
+    size_t size = s->segment_size;
+    size_t min = MQTT_STORE_SEG_HDR + MQTT_STORE_REC_SIZE(sizeof(uint64_t)) + need;
+    if (size < min) size = (min + s->page_size - 1) & ~(s->page_size - 1);
+
+    uint64_t segno = s->nsegs ? s->segs[s->nsegs - 1].segno + 1 : 1;
+    char path[PATH_MAX];
+    if (mqtt_store_seg_path(s, segno, path, sizeof(path)) != 0) {
+        MQTT_LOG_ERROR("mqtt_store: path too long");
+        return -1;
+    }
+
+    uint8_t *map = mqtt_store_map(path, &size, true);
+    if (!map) return -1;
+    if (mqtt_store_push_segment(s, segno, map, size) != 0) {
+        munmap(map, size);
+        unlink(path);
+        return -1;
+    }
+
+    memcpy(map, mqtt_store_magic, sizeof(mqtt_store_magic));
+    memcpy(map + sizeof(mqtt_store_magic), &segno, sizeof(segno));
+    s->write_off  = MQTT_STORE_SEG_HDR;
+    s->synced_off = 0;
+
+    // The new file's directory entry must survive a crash too.
+    if (fsync(s->dirfd) != 0) MQTT_LOG_ERROR("fsync: %s", strerror(errno));
+
+    // Every segment starts with the watermark and last seq, so deleting
+    // older segments never loses them.
+    if (mqtt_store_write_mark(s) != 0) return -1;
+
+    return s->compacting ? 0 : mqtt_store_compact(s);
+}
+
+/*
+ * Append one record to the active segment, rolling to a new segment
+ * when it does not fit. loc (may be NULL) receives its position.
+ */
+static int mqtt_store_write(mqtt_store_t *s, uint8_t type, uint8_t flags,
+                            uint16_t packet_id, uint64_t seq,
+                            const uint8_t *payload, size_t len,
+                            mqtt_store_loc_t *loc) {
+    size_t need = MQTT_STORE_REC_SIZE(len);
+
+    // Compaction on a roll may fill the new segment again.
+    while (s->nsegs == 0 || s->write_off + need > s->segs[s->nsegs - 1].size) {
+        if (mqtt_store_roll(s, need) != 0) return -1;
+    }
+
+    mqtt_store_segment_t *seg = &s->segs[s->nsegs - 1];
+    mqtt_store_rec_t hdr = {
+        .crc       = 0,
+        .len       = (uint32_t)len,
+        .seq       = seq,
+        .packet_id = packet_id,
+        .type      = type,
+        .flags     = flags,
+        .reserved  = 0,
+    };
+    hdr.crc = mqtt_store_rec_crc(&hdr, payload);
+
+    uint8_t *p = seg->map + s->write_off;
+    if (len > 0) memcpy(p + sizeof(hdr), payload, len);
+    memset(p + sizeof(hdr) + len, 0, need - sizeof(hdr) - len);
+    memcpy(p, &hdr, sizeof(hdr));
+
+    if (loc) {
+        loc->seq   = seq;
+        loc->segno = seg->segno;
+        loc->off   = s->write_off;
+        loc->len   = (uint32_t)len;
+    }
+    s->write_off += need;
+    return 0;
+}
+
+/* ---- recovery ---- */
+
+static int mqtt_store_u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int mqtt_store_loc_cmp(const void *a, const void *b) {
+    const mqtt_store_loc_t *x = (const mqtt_store_loc_t *)a;
+    const mqtt_store_loc_t *y = (const mqtt_store_loc_t *)b;
+    if (x->seq != y->seq) return (x->seq > y->seq) - (x->seq < y->seq);
+    // Same message copied forward: the later copy sorts last.
+    if (x->segno != y->segno) return (x->segno > y->segno) - (x->segno < y->segno);
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+/*
+ * Apply the records of one segment to the index.
+ *
+ * @return offset after the last valid record
+ */
+static size_t mqtt_store_scan(mqtt_store_t *s, const mqtt_store_segment_t *seg,
+                              bool *torn, int *err) {
+    size_t off = MQTT_STORE_SEG_HDR;
+    *torn = false;
+    *err = 0;
+
+    while (off + sizeof(mqtt_store_rec_t) <= seg->size) {
+        mqtt_store_rec_t hdr;
+        memcpy(&hdr, seg->map + off, sizeof(hdr));
+        if (hdr.type == 0 && hdr.crc == 0 && hdr.len == 0) break;
+
+        if (hdr.type < MQTT_STORE_REC_PUT || hdr.type > MQTT_STORE_REC_MARK ||
+            MQTT_STORE_REC_SIZE(hdr.len) > seg->size - off ||
+            mqtt_store_rec_crc(&hdr, seg->map + off + sizeof(hdr)) != hdr.crc) {
+            *torn = true;
+            break;
+        }
+        const uint8_t *payload = seg->map + off + sizeof(hdr);
+
+        switch (hdr.type) {
+        case MQTT_STORE_REC_PUT: {
+            mqtt_store_loc_t loc = { hdr.seq, seg->segno, off, hdr.len };
+            if (hdr.seq > s->last_seq) s->last_seq = hdr.seq;
+            if (hdr.packet_id == 0) {
+                if (mqtt_store_offline_reserve(s) != 0) { *err = -1; return off; }
+                s->offline[s->off_head + s->off_len++] = loc;
+            } else {
+                if (mqtt_store_index_reserve(s) != 0) { *err = -1; return off; }
+                bool existed;
+                mqtt_store_entry_t *e = mqtt_store_index_get(s, hdr.packet_id, &existed);
+                e->loc = loc;
+                e->released = (hdr.flags & MQTT_STORE_FLAG_RELEASED) != 0;
+            }
+            break;
+        }
+        case MQTT_STORE_REC_PUBREL:
+        case MQTT_STORE_REC_RELEASE: {
+            mqtt_store_entry_t *e = mqtt_store_find(s, hdr.packet_id);
+            if (!e || e->loc.seq != hdr.seq) break; // superseded already
+            if (hdr.type == MQTT_STORE_REC_PUBREL) e->released = true;
+            else                                   mqtt_store_index_del(s, e);
+            break;
+        }
+        case MQTT_STORE_REC_MARK: {
+            uint64_t last = 0;
+            if (hdr.len >= sizeof(last)) memcpy(&last, payload, sizeof(last));
+            if (hdr.seq > s->watermark) s->watermark = hdr.seq;
+            if (last > s->last_seq) s->last_seq = last;
+            break;
+        }
+        }
+        off += MQTT_STORE_REC_SIZE(hdr.len);
+    }
+    return off;
+}
+
+/* Sort the offline records, drop copies and what the watermark released. */
+static void mqtt_store_settle_offline(mqtt_store_t *s) {
+    if (s->off_len == 0) return;
+
+    mqtt_store_loc_t *q = s->offline + s->off_head;
+    qsort(q, s->off_len, sizeof(*q), mqtt_store_loc_cmp);
+
+    size_t n = 0;
+    for (size_t i = 0; i < s->off_len; ++i) {
+        if (q[i].seq <= s->watermark) continue;
+        if (n > 0 && q[n - 1].seq == q[i].seq) n--; // keep the later copy
+        q[n++] = q[i];
+    }
+    s->off_len = n;
+}
+
+static int mqtt_store_load(mqtt_store_t *s) {
+    DIR *d = opendir(s->dir);
+    if (!d) {
+        MQTT_LOG_ERROR("%s: %s", s->dir, strerror(errno));
+        return -1;
+    }
+
+    uint64_t *segnos = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) {
+        char *end = NULL;
+        if (strlen(de->d_name) != 20) continue;
+        uint64_t segno = strtoull(de->d_name, &end, 16);
+        if (end != de->d_name + 16 || strcmp(end, ".seg") != 0 || segno == 0) continue;
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint64_t *p = (uint64_t *)realloc(segnos, cap * sizeof(*p));
+            if (!p) {
+                MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+                free(segnos);
+                closedir(d);
+                return -1;
+            }
+            segnos = p;
+        }
+        segnos[n++] = segno;
+    }
+    closedir(d);
+    if (n > 0) qsort(segnos, n, sizeof(*segnos), mqtt_store_u64_cmp);
+
+    int rc = 0;
+    for (size_t i = 0; i < n && rc == 0; ++i) {
+        char path[PATH_MAX];
+        size_t size = 0;
+        if (mqtt_store_seg_path(s, segnos[i], path, sizeof(path)) != 0) continue;
+
+        uint8_t *map = mqtt_store_map(path, &size, false);
+        if (!map) continue;
+        uint64_t segno = 0;
+        memcpy(&segno, map + sizeof(mqtt_store_magic), sizeof(segno));
+        if (memcmp(map, mqtt_store_magic, sizeof(mqtt_store_magic)) != 0 ||
+            segno != segnos[i]) {
+            MQTT_LOG_WARN("%s: not a store segment, ignored", path);
+            munmap(map, size);
+            continue;
+        }
+        if (mqtt_store_push_segment(s, segno, map, size) != 0) {
+            munmap(map, size);
+            rc = -1;
+            break;
+        }
+
+        bool torn = false;
+        int err = 0;
+        s->write_off = mqtt_store_scan(s, &s->segs[s->nsegs - 1], &torn, &err);
+        if (err != 0) rc = -1;
+        if (torn) {
+            // Only an append cut short by a crash should end this way.
+            MQTT_LOG_WARN("%s: discarding damaged record at offset %zu",
+                          path, s->write_off);
+            memset(map + s->write_off, 0, size - s->write_off);
+        }
+    }
+    free(segnos);
+    if (rc != 0) return -1;
+
+    mqtt_store_settle_offline(s);
+    if (s->watermark > s->last_seq) s->last_seq = s->watermark;
+    for (size_t i = 0; i < s->index_cap; ++i) {
+        if (s->index[i].packet_id != 0) mqtt_store_ref(s, &s->index[i].loc);
+    }
+    for (size_t i = 0; i < s->off_len; ++i) {
+        mqtt_store_ref(s, &s->offline[s->off_head + i]);
+    }
+    s->synced_off = s->write_off;
+
+    if (s->nsegs == 0) return mqtt_store_roll(s, 0);
+    mqtt_store_drop_dead(s);
+    return 0;
+}
+
+mqtt_store_t *mqtt_store_open(const mqtt_store_config_t *cfg) {
+    if (!cfg || !cfg->dir || !*cfg->dir) {
+        MQTT_LOG_ERROR("mqtt_store_open: invalid configuration");
+        return NULL;
+    }
+
+    mqtt_store_t *s = (mqtt_store_t *)calloc(1, sizeof(*s));
+    if (!s) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    s->dirfd = -1;
+    s->dir = strdup(cfg->dir);
+    if (!s->dir) {
+        MQTT_LOG_ERROR("strdup: %s", strerror(errno));
+        free(s);
+        return NULL;
+    }
+
+    long page = sysconf(_SC_PAGESIZE);
+    s->page_size = page > 0 ? (size_t)page : 4096u;
+    s->segment_size = cfg->segment_size ? cfg->segment_size
+                                        : MQTT_STORE_SEGMENT_SIZE_DEFAULT;
+    s->segment_size = (s->segment_size + s->page_size - 1) & ~(s->page_size - 1);
+    s->sync_every = cfg->sync_every;
+    s->sync_interval_ms = cfg->sync_interval_ms;
+    pthread_once(&mqtt_store_crc_once, mqtt_store_crc_init);
+
+    if (mkdir(s->dir, 0755) != 0 && errno != EEXIST) {
+        MQTT_LOG_ERROR("%s: %s", s->dir, strerror(errno));
+        mqtt_store_close(s);
+        return NULL;
+    }
+    s->dirfd = open(s->dir, O_RDONLY | O_DIRECTORY);
+    if (s->dirfd < 0) {
+        MQTT_LOG_ERROR("%s: %s", s->dir, strerror(errno));
+        mqtt_store_close(s);
+        return NULL;
+    }
+
+    if (mqtt_store_load(s) != 0) {
+        mqtt_store_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+void mqtt_store_close(mqtt_store_t *s) {
+    if (!s) return;
+    if (mqtt_store_sync(s) != 0) {
+        MQTT_LOG_ERROR("mqtt_store_close: final sync failed");
+    }
+    for (size_t i = 0; i < s->nsegs; ++i) {
+        munmap(s->segs[i].map, s->segs[i].size);
+    }
+    if (s->dirfd >= 0) close(s->dirfd);
+    free(s->segs);
+    free(s->index);
+    free(s->offline);
+    free(s->dir);
+    free(s);
+}
+
+typedef struct {
+    mqtt_store_loc_t loc;
+    uint16_t         packet_id;
+    bool             released;
+} mqtt_store_live_t;
+
+static int mqtt_store_live_cmp(const void *a, const void *b) {
+    uint64_t x = ((const mqtt_store_live_t *)a)->loc.seq;
+    uint64_t y = ((const mqtt_store_live_t *)b)->loc.seq;
+    return (x > y) - (x < y);
+}
+
+int mqtt_store_recover(mqtt_store_t *s, mqtt_store_recover_fn fn, void *ctx) {
+    if (!s || !fn) return -1;
+
+    size_t n = s->index_count + s->off_len;
+    if (n == 0) return 0;
+
+    mqtt_store_live_t *live = (mqtt_store_live_t *)malloc(n * sizeof(*live));
+    if (!live) {
+        MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+        return -1;
+    }
+    size_t k = 0;
+    for (size_t i = 0; i < s->index_cap; ++i) {
+        if (s->index[i].packet_id == 0) continue;
+        live[k].loc       = s->index[i].loc;
+        live[k].packet_id = s->index[i].packet_id;
+        live[k].released  = s->index[i].released;
+        k++;
+    }
+    for (size_t i = 0; i < s->off_len; ++i) {
+        live[k].loc       = s->offline[s->off_head + i];
+        live[k].packet_id = 0;
+        live[k].released  = false;
+        k++;
+    }
+    qsort(live, k, sizeof(*live), mqtt_store_live_cmp);
+
+    int rc = 0;
+    for (size_t i = 0; i < k && rc == 0; ++i) {
+        const mqtt_store_segment_t *seg = mqtt_store_seg(s, live[i].loc.segno);
+        mqtt_store_record_t rec = {
+            .seq       = live[i].loc.seq,
+            .packet_id = live[i].packet_id,
+            .released  = live[i].released,
+            .frame     = seg->map + live[i].loc.off + sizeof(mqtt_store_rec_t),
+            .frame_len = live[i].loc.len,
+        };
+        if (fn(&rec, ctx) != 0) rc = -1;
+    }
+    free(live);
+    return rc;
+}
+
+uint64_t mqtt_store_last_seq(const mqtt_store_t *s) {
+    return s ? s->last_seq : 0;
+}
+
+int mqtt_store_put(mqtt_store_t *s, uint16_t packet_id, uint64_t seq,
+                   const uint8_t *frame, size_t frame_len) {
+    if (!s || !frame || frame_len > UINT32_MAX) return -1;
+
+    // Room first, so a record never lands on disk without an index entry.
+    if (packet_id == 0 ? mqtt_store_offline_reserve(s) : mqtt_store_index_reserve(s))
+        return -1;
+
+    mqtt_store_loc_t loc;
+    if (mqtt_store_write(s, MQTT_STORE_REC_PUT, 0, packet_id, seq,
+                         frame, frame_len, &loc) != 0) {
+        return -1;
+    }
+    if (seq > s->last_seq) s->last_seq = seq;
+
+    if (packet_id == 0) {
+        s->offline[s->off_head + s->off_len++] = loc;
+    } else {
+        bool existed;
+        mqtt_store_entry_t *e = mqtt_store_index_get(s, packet_id, &existed);
+        if (existed) mqtt_store_unref(s, &e->loc);
+        e->loc = loc;
+        e->released = false;
+    }
+    mqtt_store_ref(s, &loc);
+    return mqtt_store_appended(s);
+}
+
+int mqtt_store_pubrel(mqtt_store_t *s, uint16_t packet_id) {
+    mqtt_store_entry_t *e = s ? mqtt_store_find(s, packet_id) : NULL;
+    if (!e) return -1;
+
+    if (mqtt_store_write(s, MQTT_STORE_REC_PUBREL, 0, packet_id, e->loc.seq,
+                         NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    mqtt_store_find(s, packet_id)->released = true;
+    return mqtt_store_appended(s);
+}
+
+int mqtt_store_release(mqtt_store_t *s, uint16_t packet_id) {
+    mqtt_store_entry_t *e = s ? mqtt_store_find(s, packet_id) : NULL;
+    if (!e) return -1;
+
+    if (mqtt_store_write(s, MQTT_STORE_REC_RELEASE, 0, packet_id, e->loc.seq,
+                         NULL, 0, NULL) != 0) {
+        return -1;
+    }
+    e = mqtt_store_find(s, packet_id);
+    mqtt_store_unref(s, &e->loc);
+    mqtt_store_index_del(s, e);
+    mqtt_store_drop_dead(s);
+    return mqtt_store_appended(s);
+}
+
+int mqtt_store_release_offline(mqtt_store_t *s, uint64_t seq) {
+    if (!s) return -1;
+    if (seq <= s->watermark) return 0;
+
+    s->watermark = seq;
+    if (seq > s->last_seq) s->last_seq = seq;
+    if (mqtt_store_write_mark(s) != 0) return -1;
+
+    while (s->off_len > 0 && s->offline[s->off_head].seq <= seq) {
+        mqtt_store_unref(s, &s->offline[s->off_head]);
+        s->off_head++;
+        s->off_len--;
+    }
+    if (s->off_len == 0) s->off_head = 0;
+    mqtt_store_drop_dead(s);
+    return mqtt_store_appended(s);
+}
+
+int mqtt_store_tick(mqtt_store_t *s, uint64_t now_ms) {
+    if (!s) return -1;
+    if (s->unsynced > 0 && s->sync_interval_ms &&
+        now_ms - s->dirty_since_ms >= s->sync_interval_ms) {
+        return mqtt_store_sync(s);
+    }
+    return 0;
+}
+
+uint64_t mqtt_store_next_sync_ms(const mqtt_store_t *s) {
+    if (!s || s->unsynced == 0 || s->sync_interval_ms == 0) return UINT64_MAX;
+    return s->dirty_since_ms + s->sync_interval_ms;
+}
+
+void mqtt_store_get_stats(const mqtt_store_t *s, mqtt_store_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (!s) return;
+    stats->segments     = s->nsegs;
+    stats->live_records = s->index_count + s->off_len;
+    for (size_t i = 0; i < s->nsegs; ++i) stats->live_bytes += s->segs[i].live_bytes;
+    stats->syncs        = s->syncs;
+}
@@ -0,0 +1,183 @@
+#include "mqtt_timer_wheel.h"
+
+#include <limits.h>
+#include <string.h>
+
+#define L0_SIZE  (1u << MQTT_TIMER_WHEEL_L0_BITS)
+#define L0_MASK  (L0_SIZE - 1)
+#define LN_SIZE  (1u << MQTT_TIMER_WHEEL_LN_BITS)
+#define LN_MASK  (LN_SIZE - 1)
+
+/* Ticks covered by levels 0..n inclusive. */
+#define LEVEL_SPAN(n) (1ull << (MQTT_TIMER_WHEEL_L0_BITS + (n) * MQTT_TIMER_WHEEL_LN_BITS))
+
+/* Every slot is a circular list with the slot itself as sentinel. */
+static void mqtt_timer_list_init(mqtt_timer_t *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static bool mqtt_timer_list_empty(const mqtt_timer_t *head) {
+    return head->next == head;
+}
+
+static void mqtt_timer_list_add(mqtt_timer_t *head, mqtt_timer_t *timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void mqtt_timer_list_del(mqtt_timer_t *timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* Move all timers of src onto the (empty) list dst. */
+static void mqtt_timer_list_splice(mqtt_timer_t *src, mqtt_timer_t *dst) {
+    if (mqtt_timer_list_empty(src)) {
+        mqtt_timer_list_init(dst);
+        return;
+    }
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    mqtt_timer_list_init(src);
+}
+
+/* Pick the slot for timer->expires relative to the current tick. */
+static void mqtt_timer_wheel_insert(mqtt_timer_wheel_t *w, mqtt_timer_t *timer) {
+    uint64_t e = timer->expires;
+    mqtt_timer_t *head;
+
+    if (e < w->next_tick) {
+        head = &w->l0[w->next_tick & L0_MASK];
+    } else {
+        uint64_t delta = e - w->next_tick;
+        if (delta < LEVEL_SPAN(0)) {
+            head = &w->l0[e & L0_MASK];
+        } else {
+            int level = 1;
+            while (level < MQTT_TIMER_WHEEL_LEVELS - 1 && delta >= LEVEL_SPAN(level))
+                level++;
+            if (delta >= LEVEL_SPAN(level)) {
+                e = w->next_tick + LEVEL_SPAN(level) - 1;
+                timer->expires = e;
+            }
+            unsigned shift = MQTT_TIMER_WHEEL_L0_BITS +
+                             (unsigned)(level - 1) * MQTT_TIMER_WHEEL_LN_BITS;
+            head = &w->ln[level - 1][(e >> shift) & LN_MASK];
+        }
+    }
+    mqtt_timer_list_add(head, timer);
+}
+
+/* Re-insert the timers of one upper-level slot closer to level 0. */
+static void mqtt_timer_wheel_cascade(mqtt_timer_wheel_t *w, mqtt_timer_t *slot) {
+    mqtt_timer_t list;
+    mqtt_timer_list_splice(slot, &list);
+    while (!mqtt_timer_list_empty(&list)) {
+        mqtt_timer_t *timer = list.next;
+        mqtt_timer_list_del(timer);
+        mqtt_timer_wheel_insert(w, timer);
+    }
+}
+
+void mqtt_timer_wheel_init(mqtt_timer_wheel_t *w, uint64_t now_ms) {
+    memset(w, 0, sizeof(*w));
+    for (size_t i = 0; i < L0_SIZE; ++i) {
+        mqtt_timer_list_init(&w->l0[i]);
+    }
+    for (size_t l = 0; l < MQTT_TIMER_WHEEL_LEVELS - 1; ++l) {
+        for (size_t i = 0; i < LN_SIZE; ++i) {
+            mqtt_timer_list_init(&w->ln[l][i]);
+        }
+    }
+    w->next_tick = now_ms / MQTT_TIMER_WHEEL_TICK_MS + 1;
+}
+
+void mqtt_timer_schedule(mqtt_timer_wheel_t *w, mqtt_timer_t *timer,
+                         uint64_t expires_ms) {
+    if (mqtt_timer_pending(timer)) {
+        mqtt_timer_list_del(timer);
+    } else {
+        w->count++;
+    }
+
+    // Round up so a timer never fires before its deadline.
+    timer->expires = (expires_ms + MQTT_TIMER_WHEEL_TICK_MS - 1) /
+                     MQTT_TIMER_WHEEL_TICK_MS;
+    mqtt_timer_wheel_insert(w, timer);
+}
+
+void mqtt_timer_cancel(mqtt_timer_wheel_t *w, mqtt_timer_t *timer) {
+    if (!mqtt_timer_pending(timer)) return;
+    mqtt_timer_list_del(timer);
+    w->count--;
+}
+
+bool mqtt_timer_pending(const mqtt_timer_t *timer) {
+    return timer->next != NULL;
+}
+
+size_t mqtt_timer_wheel_advance(mqtt_timer_wheel_t *w, uint64_t now_ms,
+                                mqtt_timer_expired_fn cb, void *ctx) {
+    uint64_t target = now_ms / MQTT_TIMER_WHEEL_TICK_MS;
+    size_t fired = 0;
+
+    while (w->next_tick <= target) {
+        if (w->count == 0) {
+            // Nothing to cascade or fire: jump straight to the present.
+            w->next_tick = target + 1;
+            break;
+        }
+
+        uint64_t tick = w->next_tick;
+        size_t idx = (size_t)(tick & L0_MASK);
+
+        // Level 0 wrapped: bring the next slot of each upper level down,
+        // going further up only when that level wrapped too.
+        if (idx == 0) {
+            for (int level = 1; level < MQTT_TIMER_WHEEL_LEVELS; ++level) {
+                unsigned shift = MQTT_TIMER_WHEEL_L0_BITS +
+                                 (unsigned)(level - 1) * MQTT_TIMER_WHEEL_LN_BITS;
+                size_t slot = (size_t)((tick >> shift) & LN_MASK);
+                mqtt_timer_wheel_cascade(w, &w->ln[level - 1][slot]);
+                if (slot != 0) break;
+            }
+        }
+
+        w->next_tick = tick + 1;
+
+        // Detach the slot first: callbacks may reschedule or cancel timers.
+        mqtt_timer_t due;
+        mqtt_timer_list_splice(&w->l0[idx], &due);
+        while (!mqtt_timer_list_empty(&due)) {
+            mqtt_timer_t *timer = due.next;
+            mqtt_timer_list_del(timer);
+            w->count--;
+            fired++;
+            cb(timer, ctx);
+        }
+    }
+    return fired;
+}
+
+int mqtt_timer_wheel_timeout_ms(const mqtt_timer_wheel_t *w, uint64_t now_ms) {
+    if (w->count == 0) return -1;
+
+    // The first non-empty level-0 slot, or the next cascade, whichever
+    // comes first; at most one revolution of level 0 is scanned.
+    uint64_t tick = w->next_tick;
+    while ((tick & L0_MASK) != 0 && mqtt_timer_list_empty(&w->l0[tick & L0_MASK])) {
+        tick++;
+    }
+
+    uint64_t due_ms = tick * MQTT_TIMER_WHEEL_TICK_MS;
+    if (due_ms <= now_ms) return 0;
+    uint64_t wait = due_ms - now_ms;
+    return wait > INT_MAX ? INT_MAX : (int)wait;
+}
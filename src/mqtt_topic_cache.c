@@ -0,0 +1,108 @@
+#include "mqtt_topic_cache.h"
+#include "mqtt_encode.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MQTT_TOPIC_CACHE_MIN_BUCKETS 64
+
+/* FNV-1a */
+static uint32_t mqtt_topic_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void mqtt_topic_cache_init(mqtt_topic_cache_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void mqtt_topic_cache_cleanup(mqtt_topic_cache_t *cache) {
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        mqtt_topic_entry_t *e = cache->buckets[i];
+        while (e) {
+            mqtt_topic_entry_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/* Double the table once it is as full as it is wide. */
+static int mqtt_topic_cache_grow(mqtt_topic_cache_t *cache) {
+    size_t n = cache->nbuckets ? cache->nbuckets * 2 : MQTT_TOPIC_CACHE_MIN_BUCKETS;
+    mqtt_topic_entry_t **buckets = (mqtt_topic_entry_t **)calloc(n, sizeof(*buckets));
+    if (!buckets) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        mqtt_topic_entry_t *e = cache->buckets[i];
+        while (e) {
+            mqtt_topic_entry_t *next = e->next;
+            mqtt_topic_entry_t **slot = &buckets[e->hash & (n - 1)];
+            e->next = *slot;
+            *slot = e;
+            e = next;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = n;
+    return 0;
+}
+
+mqtt_topic_entry_t *mqtt_topic_cache_intern(mqtt_topic_cache_t *cache,
+                                            const char *topic, size_t len) {
+    uint32_t hash = mqtt_topic_hash(topic, len);
+
+    if (cache->nbuckets > 0) {
+        for (mqtt_topic_entry_t *e = cache->buckets[hash & (cache->nbuckets - 1)];
+             e; e = e->next) {
+            if (e->hash == hash && mqtt_topic_entry_name_len(e) == len &&
+                memcmp(mqtt_topic_entry_name(e), topic, len) == 0)
+                return e;
+        }
+    }
+
+    if (cache->count >= cache->nbuckets && mqtt_topic_cache_grow(cache) != 0)
+        return NULL;
+
+    mqtt_topic_entry_t *e = (mqtt_topic_entry_t *)malloc(sizeof(*e) + 2 + len + 1);
+    if (!e) {
+        MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+        return NULL;
+    }
+    int n = mqtt_encode_topic(e->wire, 2 + len, topic, len);
+    if (n < 0) {
+        MQTT_LOG_ERROR("Invalid topic name");
+        free(e);
+        return NULL;
+    }
+    e->wire[n] = '\0';
+    e->wire_len = (size_t)n;
+    e->hash = hash;
+    e->alias = 0;
+
+    mqtt_topic_entry_t **slot = &cache->buckets[hash & (cache->nbuckets - 1)];
+    e->next = *slot;
+    *slot = e;
+    cache->count++;
+    return e;
+}
+
+void mqtt_topic_cache_clear_aliases(mqtt_topic_cache_t *cache) {
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        for (mqtt_topic_entry_t *e = cache->buckets[i]; e; e = e->next) {
+            e->alias = 0;
+        }
+    }
+}
@@ -0,0 +1,315 @@
+#include "mqtt_topic_trie.h"
+#include "mqtt_log.h"
+#include "mqtt_validate.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct mqtt_topic_node {
+    char                 *level;     // literal level, not NUL-terminated
+    size_t                level_len;
+
+    mqtt_topic_node_t   **children;  // literal levels, sorted
+    size_t                nchildren;
+    size_t                children_cap;
+    mqtt_topic_node_t    *plus;      // '+'
+    mqtt_topic_node_t    *hash;      // '#'
+
+    mqtt_topic_handler_t  handler;   // filter ending at this node
+    void                 *ctx;
+};
+
+static mqtt_topic_node_t *mqtt_topic_node_new(const char *level, size_t len) {
+    mqtt_topic_node_t *node = (mqtt_topic_node_t *)calloc(1, sizeof(*node));
+    if (!node) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    if (len > 0) {
+        node->level = (char *)malloc(len);
+        if (!node->level) {
+            MQTT_LOG_ERROR("malloc: %s", strerror(errno));
+            free(node);
+            return NULL;
+        }
+        memcpy(node->level, level, len);
+    }
+    node->level_len = len;
+    return node;
+}
+
+static void mqtt_topic_node_free(mqtt_topic_node_t *node) {
+    if (!node) return;
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        mqtt_topic_node_free(node->children[i]);
+    }
+    mqtt_topic_node_free(node->plus);
+    mqtt_topic_node_free(node->hash);
+    free(node->children);
+    free(node->level);
+    free(node);
+}
+
+static bool mqtt_topic_node_empty(const mqtt_topic_node_t *node) {
+    return !node->handler && node->nchildren == 0 && !node->plus && !node->hash;
+}
+
+static int mqtt_topic_level_cmp(const mqtt_topic_node_t *node,
+                                const char *level, size_t len) {
+    size_t n = node->level_len < len ? node->level_len : len;
+    int c = n ? memcmp(node->level, level, n) : 0;
+    if (c != 0) return c;
+    return (node->level_len > len) - (node->level_len < len);
+}
+
+/* Binary search; *pos is where the level is or would be inserted. */
+static mqtt_topic_node_t *mqtt_topic_find_child(const mqtt_topic_node_t *node,
+                                                const char *level, size_t len,
+                                                size_t *pos) {
+    size_t lo = 0, hi = node->nchildren;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = mqtt_topic_level_cmp(node->children[mid], level, len);
+        if (c == 0) {
+            if (pos) *pos = mid;
+            return node->children[mid];
+        }
+        if (c < 0) lo = mid + 1;
+        else       hi = mid;
+    }
+    if (pos) *pos = lo;
+    return NULL;
+}
+
+/* Find or create the child of node for one filter level. */
+static mqtt_topic_node_t *mqtt_topic_get_child(mqtt_topic_node_t *node,
+                                               const char *level, size_t len) {
+    if (len == 1 && level[0] == '+') {
+        if (!node->plus) node->plus = mqtt_topic_node_new(level, len);
+        return node->plus;
+    }
+    if (len == 1 && level[0] == '#') {
+        if (!node->hash) node->hash = mqtt_topic_node_new(level, len);
+        return node->hash;
+    }
+
+    size_t pos = 0;
+    mqtt_topic_node_t *child = mqtt_topic_find_child(node, level, len, &pos);
+    if (child) return child;
+
+    if (node->nchildren == node->children_cap) {
+        size_t cap = node->children_cap ? node->children_cap * 2 : 4;
+        mqtt_topic_node_t **c = (mqtt_topic_node_t **)realloc(
+            node->children, cap * sizeof(*c));
+        if (!c) {
+            MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+            return NULL;
+        }
+        node->children = c;
+        node->children_cap = cap;
+    }
+
+    child = mqtt_topic_node_new(level, len);
+    if (!child) return NULL;
+
+    memmove(&node->children[pos + 1], &node->children[pos],
+            (node->nchildren - pos) * sizeof(*node->children));
+    node->children[pos] = child;
+    node->nchildren++;
+    return child;
+}
+
+void mqtt_topic_trie_init(mqtt_topic_trie_t *trie) {
+    memset(trie, 0, sizeof(*trie));
+}
+
+void mqtt_topic_trie_cleanup(mqtt_topic_trie_t *trie) {
+    mqtt_topic_node_free(trie->root);
+    memset(trie, 0, sizeof(*trie));
+}
+
+int mqtt_topic_filter_valid(const char *filter, size_t len) {
+    return mqtt_validate_topic_filter(filter, len) ? 1 : 0;
+}
+
+int mqtt_topic_trie_insert(mqtt_topic_trie_t *trie,
+                           const char *filter, size_t len,
+                           mqtt_topic_handler_t handler, void *ctx) {
+    if (!handler || !mqtt_topic_filter_valid(filter, len)) {
+        MQTT_LOG_ERROR("mqtt_topic_trie_insert: invalid filter");
+        return -1;
+    }
+
+    if (!trie->root) {
+        trie->root = mqtt_topic_node_new(NULL, 0);
+        if (!trie->root) return -1;
+    }
+
+    // New nodes on a failed path stay empty and are pruned by a later
+    // remove or cleanup; they never match anything.
+    mqtt_topic_node_t *node = trie->root;
+    const char *p = filter;
+    const char *end = filter + len;
+    for (;;) {
+        const char *q = memchr(p, '/', (size_t)(end - p));
+        if (!q) q = end;
+
+        node = mqtt_topic_get_child(node, p, (size_t)(q - p));
+        if (!node) return -1;
+
+        if (q == end) break;
+        p = q + 1;
+    }
+
+    if (!node->handler) trie->count++;
+    node->handler = handler;
+    node->ctx     = ctx;
+    return 0;
+}
+
+int mqtt_topic_trie_get(const mqtt_topic_trie_t *trie,
+                        const char *filter, size_t len,
+                        mqtt_topic_handler_t *handler, void **ctx) {
+    const mqtt_topic_node_t *node = trie->root;
+    const char *p = filter;
+    const char *end = filter + len;
+    while (node) {
+        const char *q = memchr(p, '/', (size_t)(end - p));
+        if (!q) q = end;
+
+        size_t n = (size_t)(q - p);
+        if (n == 1 && p[0] == '+')      node = node->plus;
+        else if (n == 1 && p[0] == '#') node = node->hash;
+        else                            node = mqtt_topic_find_child(node, p, n, NULL);
+
+        if (q == end) break;
+        p = q + 1;
+    }
+    if (!node || !node->handler) return 0;
+
+    if (handler) *handler = node->handler;
+    if (ctx)     *ctx     = node->ctx;
+    return 1;
+}
+
+/*
+ * Remove the handler for the filter levels [p, end) below node.
+ *
+ * @return 1 if removed, 0 if not found
+ */
+static int mqtt_topic_remove_at(mqtt_topic_node_t *node,
+                                const char *p, const char *end) {
+    const char *q = memchr(p, '/', (size_t)(end - p));
+    if (!q) q = end;
+    size_t len = (size_t)(q - p);
+
+    mqtt_topic_node_t **slot = NULL;
+    size_t pos = 0;
+    if (len == 1 && p[0] == '+') {
+        slot = &node->plus;
+    } else if (len == 1 && p[0] == '#') {
+        slot = &node->hash;
+    } else if (mqtt_topic_find_child(node, p, len, &pos)) {
+        slot = &node->children[pos];
+    }
+    if (!slot || !*slot) return 0;
+
+    mqtt_topic_node_t *child = *slot;
+    int removed;
+    if (q == end) {
+        removed = child->handler != NULL;
+        child->handler = NULL;
+        child->ctx = NULL;
+    } else {
+        removed = mqtt_topic_remove_at(child, q + 1, end);
+    }
+
+    if (removed && mqtt_topic_node_empty(child)) {
+        mqtt_topic_node_free(child);
+        if (slot == &node->plus || slot == &node->hash) {
+            *slot = NULL;
+        } else {
+            memmove(&node->children[pos], &node->children[pos + 1],
+                    (node->nchildren - pos - 1) * sizeof(*node->children));
+            node->nchildren--;
+        }
+    }
+    return removed;
+}
+
+int mqtt_topic_trie_remove(mqtt_topic_trie_t *trie,
+                           const char *filter, size_t len) {
+    if (!trie->root || !mqtt_topic_filter_valid(filter, len)) return -1;
+    if (!mqtt_topic_remove_at(trie->root, filter, filter + len)) return -1;
+    trie->count--;
+    return 0;
+}
+
+typedef struct {
+    const char    *topic;
+    size_t         topic_len;
+    const uint8_t *payload;
+    size_t         payload_len;
+    size_t         calls;
+} mqtt_topic_match_t;
+
+static void mqtt_topic_call(const mqtt_topic_node_t *node,
+                            mqtt_topic_match_t *m) {
+    if (node && node->handler) {
+        node->handler(m->topic, m->topic_len, m->payload, m->payload_len,
+                      node->ctx);
+        m->calls++;
+    }
+}
+
+/* Match the topic levels [p, end) against the children of node. */
+static void mqtt_topic_match_at(const mqtt_topic_node_t *node,
+                                const char *p, const char *end,
+                                bool wildcards, mqtt_topic_match_t *m) {
+    const char *q = memchr(p, '/', (size_t)(end - p));
+    if (!q) q = end;
+
+    const mqtt_topic_node_t *next[2];
+    size_t nnext = 0;
+
+    if (wildcards) {
+        // "#" matches this level and everything below it.
+        mqtt_topic_call(node->hash, m);
+        if (node->plus) next[nnext++] = node->plus;
+    }
+    const mqtt_topic_node_t *lit =
+        mqtt_topic_find_child(node, p, (size_t)(q - p), NULL);
+    if (lit) next[nnext++] = lit;
+
+    for (size_t i = 0; i < nnext; ++i) {
+        if (q == end) {
+            mqtt_topic_call(next[i], m);
+            // "a/#" also matches "a" itself.
+            mqtt_topic_call(next[i]->hash, m);
+        } else {
+            mqtt_topic_match_at(next[i], q + 1, end, true, m);
+        }
+    }
+}
+
+size_t mqtt_topic_trie_dispatch(const mqtt_topic_trie_t *trie,
+                                const char *topic, size_t topic_len,
+                                const uint8_t *payload, size_t payload_len) {
+    if (!trie->root || trie->count == 0 || !topic) return 0;
+
+    mqtt_topic_match_t m = {
+        .topic       = topic,
+        .topic_len   = topic_len,
+        .payload     = payload,
+        .payload_len = payload_len,
+        .calls       = 0,
+    };
+
+    // "$SYS/..." style topics are not matched by leading wildcards.
+    bool wildcards = !(topic_len > 0 && topic[0] == '$');
+    mqtt_topic_match_at(trie->root, topic, topic + topic_len, wildcards, &m);
+    return m.calls;
+}
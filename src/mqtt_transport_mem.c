@@ -0,0 +1,325 @@
+#include "mqtt_transport_mem.h"
+#include "mqtt_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Bytes travelling in one direction. */
+typedef struct {
+    uint8_t *buf;
+    size_t   head;      // first unread byte
+    size_t   len;
+    size_t   cap;
+    int      sig[2];    // pipe holding one byte while recv has something to report
+    bool     signaled;
+    bool     eof;       // the writing end closed
+} mqtt_mem_queue_t;
+
+/* Shared by the two ends of a pair; queue[i] is read by end i. */
+typedef struct {
+    pthread_mutex_t  lock;
+    mqtt_mem_queue_t queue[2];
+    bool             closed[2];
+    int              refs;
+} mqtt_mem_link_t;
+
+typedef struct {
+    mqtt_transport_t base;
+    mqtt_mem_link_t *link;      // NULL when not connected
+    int              side;
+    mqtt_transport_mem_accept_fn accept;
+    void            *ctx;
+} mqtt_mem_transport_t;
+
+static const mqtt_transport_ops_t mqtt_mem_ops;
+
+static void mqtt_mem_queue_signal(mqtt_mem_queue_t *q) {
+    if (q->signaled || q->sig[1] < 0) return;
+    const uint8_t b = 1;
+    while (write(q->sig[1], &b, 1) < 0 && errno == EINTR) {
+    }
+    q->signaled = true;
+}
+
+static void mqtt_mem_queue_unsignal(mqtt_mem_queue_t *q) {
+    if (!q->signaled) return;
+    uint8_t b;
+    // The byte is there, so this does not block even on a blocking fd.
+    while (read(q->sig[0], &b, 1) < 0 && errno == EINTR) {
+    }
+    q->signaled = false;
+}
+
+static void mqtt_mem_queue_free(mqtt_mem_queue_t *q) {
+    free(q->buf);
+    q->buf = NULL;
+    q->head = q->len = q->cap = 0;
+    for (int i = 0; i < 2; i++) {
+        if (q->sig[i] >= 0) close(q->sig[i]);
+        q->sig[i] = -1;
+    }
+}
+
+static mqtt_mem_link_t *mqtt_mem_link_new(void) {
+    mqtt_mem_link_t *link = (mqtt_mem_link_t *)calloc(1, sizeof(*link));
+    if (!link) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        mqtt_mem_queue_t *q = &link->queue[i];
+        q->sig[0] = q->sig[1] = -1;
+        if (pipe(q->sig) != 0) {
+            MQTT_LOG_ERROR("pipe: %s", strerror(errno));
+            mqtt_mem_queue_free(&link->queue[0]);
+            mqtt_mem_queue_free(&link->queue[1]);
+            free(link);
+            return NULL;
+        }
+        fcntl(q->sig[1], F_SETFL, O_NONBLOCK);
+    }
+    pthread_mutex_init(&link->lock, NULL);
+    link->refs = 2;
+    return link;
+}
+
+static void mqtt_mem_link_release(mqtt_mem_link_t *link) {
+    pthread_mutex_lock(&link->lock);
+    int refs = --link->refs;
+    pthread_mutex_unlock(&link->lock);
+    if (refs > 0) return;
+
+    mqtt_mem_queue_free(&link->queue[0]);
+    mqtt_mem_queue_free(&link->queue[1]);
+    pthread_mutex_destroy(&link->lock);
+    free(link);
+}
+
+static mqtt_mem_transport_t *mqtt_mem_end_new(mqtt_mem_link_t *link, int side) {
+    mqtt_mem_transport_t *m = (mqtt_mem_transport_t *)calloc(1, sizeof(*m));
+    if (!m) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    m->base.ops = &mqtt_mem_ops;
+    m->link = link;
+    m->side = side;
+    return m;
+}
+
+/*
+ * Drop this end's queue and pipe (like closing a socket) and tell the
+ * other end, whose recv then reports EOF once it has read everything.
+ */
+static void mqtt_mem_close(mqtt_transport_t *t) {
+    mqtt_mem_transport_t *m = (mqtt_mem_transport_t *)t;
+    mqtt_mem_link_t *link = m->link;
+    if (!link) return;
+
+    pthread_mutex_lock(&link->lock);
+    link->closed[m->side] = true;
+    mqtt_mem_queue_free(&link->queue[m->side]);
+    mqtt_mem_queue_t *peer = &link->queue[1 - m->side];
+    peer->eof = true;
+    mqtt_mem_queue_signal(peer);
+    pthread_mutex_unlock(&link->lock);
+
+    mqtt_mem_link_release(link);
+    m->link = NULL;
+}
+
+static int mqtt_mem_connect(mqtt_transport_t *t, const char *host, uint16_t port) {
+    mqtt_mem_transport_t *m = (mqtt_mem_transport_t *)t;
+    if (!m->accept) {
+        // One half of a fixed pair: connected until either end closes.
+        bool open = false;
+        if (m->link) {
+            pthread_mutex_lock(&m->link->lock);
+            open = !m->link->closed[1 - m->side];
+            pthread_mutex_unlock(&m->link->lock);
+        }
+        if (open) return 0;
+        MQTT_LOG_ERROR("In-memory pair is closed");
+        return -1;
+    }
+
+    mqtt_mem_close(t);
+    mqtt_mem_link_t *link = mqtt_mem_link_new();
+    if (!link) return -1;
+    mqtt_mem_transport_t *server = mqtt_mem_end_new(link, 1);
+    if (!server) {
+        mqtt_mem_link_release(link);
+        mqtt_mem_link_release(link);
+        return -1;
+    }
+    m->link = link;
+    m->side = 0;
+
+    if (m->accept(&server->base, host, port, m->ctx) != 0) {
+        mqtt_transport_destroy(&server->base);
+        mqtt_mem_close(t);
+        return -1;
+    }
+    return 0;
+}
+
+static int mqtt_mem_sendv(mqtt_transport_t *t, const mqtt_iovec_t *iov, size_t iovcnt) {
+    mqtt_mem_transport_t *m = (mqtt_mem_transport_t *)t;
+    mqtt_mem_link_t *link = m->link;
+    if (!link) {
+        errno = ENOTCONN;
+        MQTT_LOG_ERROR("send: %s", strerror(errno));
+        return -1;
+    }
+
+    size_t total = 0;
+    for (size_t i = 0; i < iovcnt; i++) {
+        total += iov[i].len;
+    }
+    if (total > INT_MAX) total = INT_MAX;
+
+    pthread_mutex_lock(&link->lock);
+    if (link->closed[1 - m->side]) {
+        pthread_mutex_unlock(&link->lock);
+        errno = EPIPE;
+        MQTT_LOG_ERROR("send: %s", strerror(errno));
+        return -1;
+    }
+
+    mqtt_mem_queue_t *q = &link->queue[1 - m->side];
+    if (q->head + q->len + total > q->cap) {
+        if (q->head > 0) {
+            memmove(q->buf, q->buf + q->head, q->len);
+            q->head = 0;
+        }
+        if (q->len + total > q->cap) {
+            size_t cap = q->cap ? q->cap * 2 : 4096;
+            while (cap < q->len + total) cap *= 2;
+            uint8_t *buf = (uint8_t *)realloc(q->buf, cap);
+            if (!buf) {
+                pthread_mutex_unlock(&link->lock);
+                MQTT_LOG_ERROR("realloc: %s", strerror(errno));
+                return -1;
+            }
+            q->buf = buf;
+            q->cap = cap;
+        }
+    }
+
+    size_t left = total;
+    for (size_t i = 0; i < iovcnt && left > 0; i++) {
+        size_t n = iov[i].len < left ? iov[i].len : left;
+        if (n > 0) memcpy(q->buf + q->head + q->len, iov[i].base, n);
+        q->len += n;
+        left -= n;
+    }
+    if (total > 0) mqtt_mem_queue_signal(q);
+    pthread_mutex_unlock(&link->lock);
+    return (int)total;
+}
+
+static int mqtt_mem_send(mqtt_transport_t *t, const void *buf, size_t len) {
+    mqtt_iovec_t iov = { buf, len };
+    return mqtt_mem_sendv(t, &iov, 1);
+}
+
+static int mqtt_mem_recv(mqtt_transport_t *t, void *buf, size_t maxlen) {
+    mqtt_mem_transport_t *m = (mqtt_mem_transport_t *)t;
+    mqtt_mem_link_t *link = m->link;
+    if (!link) {
+        errno = ENOTCONN;
+        MQTT_LOG_ERROR("recv: %s", strerror(errno));
+        return -1;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&link->lock);
+        mqtt_mem_queue_t *q = &link->queue[m->side];
+        if (q->len > 0) {
+            size_t n = q->len < maxlen ? q->len : maxlen;
+            if (n > INT_MAX) n = INT_MAX;
+            memcpy(buf, q->buf + q->head, n);
+            q->head += n;
+            q->len -= n;
+            if (q->len == 0) {
+                q->head = 0;
+                if (!q->eof) mqtt_mem_queue_unsignal(q);
+            }
+            pthread_mutex_unlock(&link->lock);
+            return (int)n;
+        }
+        bool eof = q->eof;
+        int fd = q->sig[0];
+        pthread_mutex_unlock(&link->lock);
+        if (eof) return 0;
+
+        // Only this end changes its own pipe, so fd stays valid here.
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags < 0) {
+            MQTT_LOG_ERROR("fcntl(F_GETFL): %s", strerror(errno));
+            return -1;
+        }
+        if (flags & O_NONBLOCK) return MQTT_TRANSPORT_WOULD_BLOCK;
+        if (mqtt_transport_wait_readable(fd, -1) < 0) return -1;
+    }
+}
+
+static int mqtt_mem_fd(const mqtt_transport_t *t) {
+    const mqtt_mem_transport_t *m = (const mqtt_mem_transport_t *)t;
+    return m->link ? m->link->queue[m->side].sig[0] : -1;
+}
+
+static size_t mqtt_mem_pending(const mqtt_transport_t *t) {
+    // The fd is readable whenever there is data, as with a socket.
+    (void)t;
+    return 0;
+}
+
+static void mqtt_mem_destroy(mqtt_transport_t *t) {
+    mqtt_mem_close(t);
+    free(t);
+}
+
+static const mqtt_transport_ops_t mqtt_mem_ops = {
+    .name    = "mem",
+    .connect = mqtt_mem_connect,
+    .send    = mqtt_mem_send,
+    .sendv   = mqtt_mem_sendv,
+    .recv    = mqtt_mem_recv,
+    .close   = mqtt_mem_close,
+    .fd      = mqtt_mem_fd,
+    .pending = mqtt_mem_pending,
+    .destroy = mqtt_mem_destroy,
+};
+
+int mqtt_transport_mem_pair(mqtt_transport_t **a, mqtt_transport_t **b) {
+    mqtt_mem_link_t *link = mqtt_mem_link_new();
+    if (!link) return -1;
+
+    mqtt_mem_transport_t *x = mqtt_mem_end_new(link, 0);
+    mqtt_mem_transport_t *y = x ? mqtt_mem_end_new(link, 1) : NULL;
+    if (!y) {
+        free(x);
+        mqtt_mem_link_release(link);
+        mqtt_mem_link_release(link);
+        return -1;
+    }
+    *a = &x->base;
+    *b = &y->base;
+    return 0;
+}
+
+mqtt_transport_t *mqtt_transport_mem_create(mqtt_transport_mem_accept_fn accept,
+                                            void *ctx) {
+    mqtt_mem_transport_t *m = mqtt_mem_end_new(NULL, 0);
+    if (!m) return NULL;
+    m->accept = accept;
+    m->ctx = ctx;
+    return &m->base;
+}
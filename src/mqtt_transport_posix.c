@@ -1,11 +1,27 @@
 #include "mqtt_transport.h"
+#include "mqtt_connector.h"
+#include "mqtt_log.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
+
+/* A peer that went away must surface as EPIPE, not kill us with SIGPIPE. */
+#ifdef MSG_NOSIGNAL
+#define MQTT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define MQTT_SEND_FLAGS 0
+#endif
 
 int mqtt_transport_connect(const char *host, uint16_t port) {
     struct addrinfo hints;
@@ -21,7 +37,7 @@ int mqtt_transport_connect(const char *host, uint16_t port) {
 
     int s = getaddrinfo(host, port_str, &hints, &result);
     if (s != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+        MQTT_LOG_ERROR("getaddrinfo: %s", gai_strerror(s));
         return -1;
     }
 
@@ -41,17 +57,56 @@ int mqtt_transport_connect(const char *host, uint16_t port) {
 
     freeaddrinfo(result);
 
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+    if (sockfd >= 0) {
+        int on = 1;
+        setsockopt(sockfd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+    }
+#endif
+
     if (sockfd == -1) {
-        fprintf(stderr, "Failed to connect to %s:%u\n", host, (unsigned int)port);
+        MQTT_LOG_ERROR("Failed to connect to %s:%u", host, (unsigned int)port);
     }
 
     return sockfd;
 }
 
 int mqtt_transport_send(int sockfd, const void *buf, size_t len) {
-    ssize_t sent = send(sockfd, buf, len, 0);
+    ssize_t sent = send(sockfd, buf, len, MQTT_SEND_FLAGS);
+    if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return MQTT_TRANSPORT_WOULD_BLOCK;
+        MQTT_LOG_ERROR("send: %s", strerror(errno));
+        return -1;
+    }
+    return (int)sent;
+}
+
+/* Upper bound on iovec entries per call (a batch of queued frames). */
+#define MQTT_TRANSPORT_MAX_IOV 64
+
+int mqtt_transport_sendv(int sockfd, const mqtt_iovec_t *iov, size_t iovcnt) {
+    struct iovec vec[MQTT_TRANSPORT_MAX_IOV];
+    struct msghdr msg;
+
+    if (iovcnt > MQTT_TRANSPORT_MAX_IOV) {
+        iovcnt = MQTT_TRANSPORT_MAX_IOV; // caller resumes with the rest
+    }
+
+    for (size_t i = 0; i < iovcnt; ++i) {
+        vec[i].iov_base = (void *)iov[i].base;
+        vec[i].iov_len  = iov[i].len;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = vec;
+    msg.msg_iovlen = iovcnt;
+
+    ssize_t sent = sendmsg(sockfd, &msg, MQTT_SEND_FLAGS);
     if (sent < 0) {
-        perror("send");
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return MQTT_TRANSPORT_WOULD_BLOCK;
+        MQTT_LOG_ERROR("sendmsg: %s", strerror(errno));
         return -1;
     }
     return (int)sent;
@@ -60,14 +115,198 @@ int mqtt_transport_send(int sockfd, const void *buf, size_t len) {
 int mqtt_transport_recv(int sockfd, void *buf, size_t maxlen) {
     ssize_t recvd = recv(sockfd, buf, maxlen, 0);
     if (recvd < 0) {
-        perror("recv");
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return MQTT_TRANSPORT_WOULD_BLOCK;
+        MQTT_LOG_ERROR("recv: %s", strerror(errno));
         return -1;
     }
     return (int)recvd; // can be 0 if connection closed
 }
 
+int mqtt_transport_set_nonblocking(int sockfd, bool enable) {
+    int flags = fcntl(sockfd, F_GETFL, 0);
+    if (flags < 0) {
+        MQTT_LOG_ERROR("fcntl(F_GETFL): %s", strerror(errno));
+        return -1;
+    }
+
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    if (fcntl(sockfd, F_SETFL, flags) != 0) {
+        MQTT_LOG_ERROR("fcntl(F_SETFL): %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int mqtt_transport_wait(int sockfd, short events, int timeout_ms) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    for (;;) {
+        int r = poll(&pfd, 1, timeout_ms);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) {
+            MQTT_LOG_ERROR("poll: %s", strerror(errno));
+            return -1;
+        }
+        return r > 0 ? 1 : 0;
+    }
+}
+
+int mqtt_transport_wait_readable(int sockfd, int timeout_ms) {
+    return mqtt_transport_wait(sockfd, POLLIN, timeout_ms);
+}
+
+int mqtt_transport_wait_writable(int sockfd, int timeout_ms) {
+    return mqtt_transport_wait(sockfd, POLLOUT, timeout_ms);
+}
+
+void mqtt_transport_set_cork(int sockfd, bool enable) {
+    int on = enable ? 1 : 0;
+#if defined(TCP_CORK)
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) != 0 &&
+        errno != ENOTSOCK)
+        MQTT_LOG_ERROR("setsockopt(TCP_CORK): %s", strerror(errno));
+#elif defined(TCP_NOPUSH)
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NOPUSH, &on, sizeof(on)) != 0 &&
+        errno != ENOTSOCK)
+        MQTT_LOG_ERROR("setsockopt(TCP_NOPUSH): %s", strerror(errno));
+#else
+    (void)sockfd;
+    (void)on;
+#endif
+}
+
+void mqtt_transport_push(int sockfd) {
+#if defined(TCP_NODELAY)
+    // Setting TCP_NODELAY sends whatever is queued, corked or not.
+    int was = 0;
+    socklen_t len = sizeof(was);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &was, &len) != 0) {
+        if (errno != ENOTSOCK && errno != EOPNOTSUPP)
+            MQTT_LOG_ERROR("getsockopt(TCP_NODELAY): %s", strerror(errno));
+        return;
+    }
+    int on = 1;
+    if (setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) != 0) {
+        MQTT_LOG_ERROR("setsockopt(TCP_NODELAY): %s", strerror(errno));
+        return;
+    }
+    if (!was) setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &was, sizeof(was));
+#else
+    (void)sockfd;
+#endif
+}
+
 void mqtt_transport_close(int sockfd) {
     if (sockfd >= 0) {
         close(sockfd);
     }
 }
+
+typedef struct {
+    mqtt_transport_t  base;
+    int               fd;
+    mqtt_connector_t *connector;    // set while connect_start is in progress
+} mqtt_tcp_transport_t;
+
+static int mqtt_tcp_connect(mqtt_transport_t *t, const char *host, uint16_t port) {
+    mqtt_tcp_transport_t *tcp = (mqtt_tcp_transport_t *)t;
+    tcp->fd = mqtt_transport_connect(host, port);
+    return tcp->fd < 0 ? -1 : 0;
+}
+
+static int mqtt_tcp_connect_continue(mqtt_transport_t *t) {
+    mqtt_tcp_transport_t *tcp = (mqtt_tcp_transport_t *)t;
+    if (!tcp->connector) return tcp->fd >= 0 ? 0 : -1;
+
+    int fd = mqtt_connector_poll(tcp->connector);
+    if (fd == MQTT_TRANSPORT_WOULD_BLOCK) return fd;
+    mqtt_connector_free(tcp->connector);
+    tcp->connector = NULL;
+    tcp->fd = fd;
+    return fd < 0 ? -1 : 0;
+}
+
+static int mqtt_tcp_connect_start(mqtt_transport_t *t, const char *host, uint16_t port) {
+    mqtt_tcp_transport_t *tcp = (mqtt_tcp_transport_t *)t;
+    tcp->connector = mqtt_connector_start(host, port);
+    if (!tcp->connector) return -1;
+    return mqtt_tcp_connect_continue(t);
+}
+
+static int mqtt_tcp_send(mqtt_transport_t *t, const void *buf, size_t len) {
+    return mqtt_transport_send(((mqtt_tcp_transport_t *)t)->fd, buf, len);
+}
+
+static int mqtt_tcp_sendv(mqtt_transport_t *t, const mqtt_iovec_t *iov, size_t iovcnt) {
+    return mqtt_transport_sendv(((mqtt_tcp_transport_t *)t)->fd, iov, iovcnt);
+}
+
+static int mqtt_tcp_recv(mqtt_transport_t *t, void *buf, size_t maxlen) {
+    return mqtt_transport_recv(((mqtt_tcp_transport_t *)t)->fd, buf, maxlen);
+}
+
+static void mqtt_tcp_close(mqtt_transport_t *t) {
+    mqtt_tcp_transport_t *tcp = (mqtt_tcp_transport_t *)t;
+    mqtt_connector_free(tcp->connector);
+    tcp->connector = NULL;
+    mqtt_transport_close(tcp->fd);
+    tcp->fd = -1;
+}
+
+static int mqtt_tcp_fd(const mqtt_transport_t *t) {
+    const mqtt_tcp_transport_t *tcp = (const mqtt_tcp_transport_t *)t;
+    return tcp->connector ? mqtt_connector_fd(tcp->connector) : tcp->fd;
+}
+
+static size_t mqtt_tcp_pending(const mqtt_transport_t *t) {
+    (void)t;
+    return 0;
+}
+
+static void mqtt_tcp_destroy(mqtt_transport_t *t) {
+    mqtt_tcp_close(t);
+    free(t);
+}
+
+static const mqtt_transport_ops_t mqtt_tcp_ops = {
+    .name    = "tcp",
+    .connect = mqtt_tcp_connect,
+    .send    = mqtt_tcp_send,
+    .sendv   = mqtt_tcp_sendv,
+    .recv    = mqtt_tcp_recv,
+    .close   = mqtt_tcp_close,
+    .fd      = mqtt_tcp_fd,
+    .pending = mqtt_tcp_pending,
+    .destroy = mqtt_tcp_destroy,
+    .connect_start    = mqtt_tcp_connect_start,
+    .connect_continue = mqtt_tcp_connect_continue,
+};
+
+mqtt_transport_t *mqtt_transport_tcp_create(void) {
+    mqtt_tcp_transport_t *tcp = (mqtt_tcp_transport_t *)calloc(1, sizeof(*tcp));
+    if (!tcp) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    tcp->base.ops = &mqtt_tcp_ops;
+    tcp->fd = -1;
+    return &tcp->base;
+}
+
+mqtt_transport_t *mqtt_transport_tcp_adopt(int fd) {
+    mqtt_transport_t *t = mqtt_transport_tcp_create();
+    if (!t) {
+        mqtt_transport_close(fd);
+        return NULL;
+    }
+    ((mqtt_tcp_transport_t *)t)->fd = fd;
+    return t;
+}
+
+void mqtt_transport_destroy(mqtt_transport_t *t) {
+    if (t) t->ops->destroy(t);
+}
@@ -0,0 +1,453 @@
+#include "mqtt_transport_tls.h"
+#include "mqtt_connector.h"
+#include "mqtt_log.h"
+
+#include <stdio.h>
+
+#ifdef MQTT_HAVE_OPENSSL
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+/* Largest TLS record payload; sendv coalesces up to this much. */
+#define MQTT_TLS_RECORD_SIZE 16384
+
+typedef struct {
+    mqtt_transport_t base;
+    SSL_CTX    *ctx;
+    SSL        *ssl;
+    int         fd;
+    bool        failed;       // fatal error: no close_notify on close
+    bool        verify;
+    bool        resumption;
+    char       *server_name;
+    SSL_SESSION *session;     // offered on the next connect
+    mqtt_tls_stats_t stats;
+
+    // connect_start in progress: TCP first, then the handshake
+    mqtt_connector_t *connector;
+    bool        handshaking;
+    char       *connect_name; // server name for the pending handshake
+
+    // sendv staging: OpenSSL has no gather write
+    uint8_t     stage[MQTT_TLS_RECORD_SIZE];
+} mqtt_tls_transport_t;
+
+static const mqtt_transport_ops_t mqtt_tls_ops;
+
+/*
+ * Socket BIO on top of the POSIX helpers, so TLS traffic gets the same
+ * MSG_NOSIGNAL and non-blocking behaviour as plain TCP.
+ */
+static int mqtt_tls_bio_write(BIO *bio, const char *buf, int len) {
+    int fd = (int)(intptr_t)BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    int r = mqtt_transport_send(fd, buf, (size_t)len);
+    if (r == MQTT_TRANSPORT_WOULD_BLOCK) {
+        BIO_set_retry_write(bio);
+        return -1;
+    }
+    return r;
+}
+
+static int mqtt_tls_bio_read(BIO *bio, char *buf, int len) {
+    int fd = (int)(intptr_t)BIO_get_data(bio);
+    BIO_clear_retry_flags(bio);
+    int r = mqtt_transport_recv(fd, buf, (size_t)len);
+    if (r == MQTT_TRANSPORT_WOULD_BLOCK) {
+        BIO_set_retry_read(bio);
+        return -1;
+    }
+    return r;
+}
+
+static long mqtt_tls_bio_ctrl(BIO *bio, int cmd, long num, void *ptr) {
+    (void)bio;
+    (void)num;
+    (void)ptr;
+    return cmd == BIO_CTRL_FLUSH ? 1 : 0;
+}
+
+/* One method for the process: BIO type indices are a scarce resource. */
+static BIO_METHOD     *mqtt_tls_bio_method;
+static pthread_once_t  mqtt_tls_bio_once = PTHREAD_ONCE_INIT;
+
+static void mqtt_tls_bio_init(void) {
+    BIO_METHOD *m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK,
+                                 "mqtt socket");
+    if (!m) return;
+    if (BIO_meth_set_write(m, mqtt_tls_bio_write) != 1 ||
+        BIO_meth_set_read(m, mqtt_tls_bio_read) != 1 ||
+        BIO_meth_set_ctrl(m, mqtt_tls_bio_ctrl) != 1) {
+        BIO_meth_free(m);
+        return;
+    }
+    mqtt_tls_bio_method = m;
+}
+
+static void mqtt_tls_print_errors(const char *what) {
+    unsigned long err;
+    bool any = false;
+    while ((err = ERR_get_error()) != 0) {
+        char buf[256];
+        ERR_error_string_n(err, buf, sizeof(buf));
+        MQTT_LOG_ERROR("%s: %s", what, buf);
+        any = true;
+    }
+    if (!any) MQTT_LOG_ERROR("%s failed", what);
+}
+
+/* Keep the newest session the server hands out (TLS 1.3: after the handshake). */
+static int mqtt_tls_new_session(SSL *ssl, SSL_SESSION *session) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)SSL_get_app_data(ssl);
+    if (!t || !t->resumption) return 0;
+    if (t->session) SSL_SESSION_free(t->session);
+    t->session = session;
+    return 1; // we keep the reference
+}
+
+static bool mqtt_tls_is_ip(const char *name) {
+    unsigned char addr[16];
+    return inet_pton(AF_INET, name, addr) == 1 || inet_pton(AF_INET6, name, addr) == 1;
+}
+
+static void mqtt_tls_close(mqtt_transport_t *base) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+    mqtt_connector_free(t->connector);
+    t->connector = NULL;
+    if (t->handshaking) t->failed = true;   // nothing to shut down yet
+    t->handshaking = false;
+    if (t->ssl) {
+        // Best effort close_notify; a non-blocking socket may refuse it.
+        if (!t->failed) SSL_shutdown(t->ssl);
+        SSL_free(t->ssl);
+        t->ssl = NULL;
+    }
+    mqtt_transport_close(t->fd);
+    t->fd = -1;
+    t->failed = false;
+    ERR_clear_error();
+}
+
+/*
+ * Put a TLS client session on the connected socket fd, which the
+ * transport owns from here on.
+ *
+ * @return 0, or -1 (fd is closed)
+ */
+static int mqtt_tls_attach(mqtt_tls_transport_t *t, int fd, const char *name) {
+    SSL *ssl = SSL_new(t->ctx);
+    BIO *bio = ssl ? BIO_new(mqtt_tls_bio_method) : NULL;
+    if (!bio) {
+        mqtt_tls_print_errors("SSL_new");
+        SSL_free(ssl);
+        mqtt_transport_close(fd);
+        return -1;
+    }
+    BIO_set_data(bio, (void *)(intptr_t)fd);
+    BIO_set_init(bio, 1);
+    SSL_set_bio(ssl, bio, bio);
+    SSL_set_app_data(ssl, t);
+
+    bool ip = mqtt_tls_is_ip(name);
+    if (!ip) SSL_set_tlsext_host_name(ssl, name);
+    if (t->verify) {
+        int ok = ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name)
+                    : SSL_set1_host(ssl, name);
+        if (ok != 1) {
+            mqtt_tls_print_errors("TLS host check setup");
+            SSL_free(ssl);
+            mqtt_transport_close(fd);
+            return -1;
+        }
+    }
+    if (t->session) SSL_set_session(ssl, t->session);
+
+    t->ssl = ssl;
+    t->fd = fd;
+    return 0;
+}
+
+static void mqtt_tls_handshake_failed(mqtt_tls_transport_t *t) {
+    mqtt_tls_print_errors("TLS handshake");
+    if (t->verify && SSL_get_verify_result(t->ssl) != X509_V_OK) {
+        MQTT_LOG_ERROR("Certificate verification: %s",
+                       X509_verify_cert_error_string(SSL_get_verify_result(t->ssl)));
+    }
+    t->failed = true;
+    mqtt_tls_close(&t->base);
+    // A stale or rejected session must not be offered again.
+    if (t->session) {
+        SSL_SESSION_free(t->session);
+        t->session = NULL;
+    }
+}
+
+static void mqtt_tls_handshake_done(mqtt_tls_transport_t *t) {
+    t->stats.handshakes++;
+    if (SSL_session_reused(t->ssl)) t->stats.resumed++;
+}
+
+static int mqtt_tls_connect(mqtt_transport_t *base, const char *host, uint16_t port) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+    const char *name = t->server_name ? t->server_name : host;
+
+    int fd = mqtt_transport_connect(host, port);
+    if (fd < 0) return -1;
+    if (mqtt_tls_attach(t, fd, name) != 0) return -1;
+
+    ERR_clear_error();
+    if (SSL_connect(t->ssl) != 1) {
+        mqtt_tls_handshake_failed(t);
+        return -1;
+    }
+    mqtt_tls_handshake_done(t);
+    return 0;
+}
+
+static int mqtt_tls_connect_continue(mqtt_transport_t *base) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+
+    if (t->connector) {
+        int fd = mqtt_connector_poll(t->connector);
+        if (fd == MQTT_TRANSPORT_WOULD_BLOCK) return fd;
+        mqtt_connector_free(t->connector);
+        t->connector = NULL;
+        if (fd < 0 || mqtt_tls_attach(t, fd, t->connect_name) != 0) return -1;
+        t->handshaking = true;
+    }
+    if (!t->handshaking) return t->ssl ? 0 : -1;
+
+    ERR_clear_error();
+    int r = SSL_connect(t->ssl);
+    if (r != 1) {
+        int err = SSL_get_error(t->ssl, r);
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return MQTT_TRANSPORT_WOULD_BLOCK;
+        mqtt_tls_handshake_failed(t);
+        return -1;
+    }
+    t->handshaking = false;
+    mqtt_tls_handshake_done(t);
+    return 0;
+}
+
+static int mqtt_tls_connect_start(mqtt_transport_t *base, const char *host, uint16_t port) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+
+    free(t->connect_name);
+    t->connect_name = strdup(t->server_name ? t->server_name : host);
+    if (!t->connect_name) {
+        MQTT_LOG_ERROR("strdup: %s", strerror(errno));
+        return -1;
+    }
+    t->connector = mqtt_connector_start(host, port);
+    if (!t->connector) return -1;
+    return mqtt_tls_connect_continue(base);
+}
+
+/* Map an SSL_read/SSL_write result onto the transport return codes. */
+static int mqtt_tls_result(mqtt_tls_transport_t *t, int r, const char *what) {
+    switch (SSL_get_error(t->ssl, r)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        return MQTT_TRANSPORT_WOULD_BLOCK;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // The socket error itself was reported by the BIO.
+        t->failed = true;
+        if (ERR_peek_error() != 0) mqtt_tls_print_errors(what);
+        return -1;
+    default:
+        t->failed = true;
+        mqtt_tls_print_errors(what);
+        return -1;
+    }
+}
+
+static int mqtt_tls_send(mqtt_transport_t *base, const void *buf, size_t len) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+    if (!t->ssl) return -1;
+    if (len == 0) return 0;
+
+    ERR_clear_error();
+    int r = SSL_write(t->ssl, buf, len > INT_MAX ? INT_MAX : (int)len);
+    return r > 0 ? r : mqtt_tls_result(t, r, "SSL_write");
+}
+
+/*
+ * Small buffers are gathered into one record-sized write, so a PUBLISH
+ * made of header, topic and payload becomes one TLS record rather than
+ * three. A large leading buffer is written directly.
+ */
+static int mqtt_tls_sendv(mqtt_transport_t *base, const mqtt_iovec_t *iov, size_t iovcnt) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+
+    while (iovcnt > 0 && iov->len == 0) {
+        iov++;
+        iovcnt--;
+    }
+    if (iovcnt == 0) return 0;
+    if (iovcnt == 1 || iov->len >= sizeof(t->stage)) {
+        return mqtt_tls_send(base, iov->base, iov->len);
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < iovcnt && n < sizeof(t->stage); ++i) {
+        size_t take = iov[i].len;
+        if (take > sizeof(t->stage) - n) take = sizeof(t->stage) - n;
+        memcpy(t->stage + n, iov[i].base, take);
+        n += take;
+    }
+    return mqtt_tls_send(base, t->stage, n);
+}
+
+static int mqtt_tls_recv(mqtt_transport_t *base, void *buf, size_t maxlen) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+    if (!t->ssl) return -1;
+
+    ERR_clear_error();
+    int r = SSL_read(t->ssl, buf, maxlen > INT_MAX ? INT_MAX : (int)maxlen);
+    return r > 0 ? r : mqtt_tls_result(t, r, "SSL_read");
+}
+
+static int mqtt_tls_fd(const mqtt_transport_t *base) {
+    const mqtt_tls_transport_t *t = (const mqtt_tls_transport_t *)base;
+    return t->connector ? mqtt_connector_fd(t->connector) : t->fd;
+}
+
+static size_t mqtt_tls_pending(const mqtt_transport_t *base) {
+    const mqtt_tls_transport_t *t = (const mqtt_tls_transport_t *)base;
+    return t->ssl ? (size_t)SSL_pending(t->ssl) : 0;
+}
+
+static void mqtt_tls_destroy(mqtt_transport_t *base) {
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)base;
+    mqtt_tls_close(base);
+    if (t->session) SSL_SESSION_free(t->session);
+    SSL_CTX_free(t->ctx);
+    free(t->server_name);
+    free(t->connect_name);
+    free(t);
+}
+
+static const mqtt_transport_ops_t mqtt_tls_ops = {
+    .name    = "tls",
+    .connect = mqtt_tls_connect,
+    .send    = mqtt_tls_send,
+    .sendv   = mqtt_tls_sendv,
+    .recv    = mqtt_tls_recv,
+    .close   = mqtt_tls_close,
+    .fd      = mqtt_tls_fd,
+    .pending = mqtt_tls_pending,
+    .destroy = mqtt_tls_destroy,
+    .connect_start    = mqtt_tls_connect_start,
+    .connect_continue = mqtt_tls_connect_continue,
+};
+
+static int mqtt_tls_setup_ctx(mqtt_tls_transport_t *t, const mqtt_tls_config_t *cfg) {
+    t->ctx = SSL_CTX_new(TLS_client_method());
+    if (!t->ctx) return -1;
+
+    SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+    // Short writes behave like send(): the caller resumes with the rest.
+    SSL_CTX_set_mode(t->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                             SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // MQTT framing catches truncation; a bare TCP close is just "closed".
+    SSL_CTX_set_options(t->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
+    if (t->verify) {
+        SSL_CTX_set_verify(t->ctx, SSL_VERIFY_PEER, NULL);
+        int ok = cfg->ca_file ? SSL_CTX_load_verify_locations(t->ctx, cfg->ca_file, NULL)
+                              : SSL_CTX_set_default_verify_paths(t->ctx);
+        if (ok != 1) return -1;
+    } else {
+        SSL_CTX_set_verify(t->ctx, SSL_VERIFY_NONE, NULL);
+    }
+
+    if (cfg->cert_file &&
+        SSL_CTX_use_certificate_chain_file(t->ctx, cfg->cert_file) != 1) {
+        return -1;
+    }
+    if (cfg->key_file &&
+        SSL_CTX_use_PrivateKey_file(t->ctx, cfg->key_file, SSL_FILETYPE_PEM) != 1) {
+        return -1;
+    }
+
+    if (t->resumption) {
+        // Sessions are kept per transport, not in OpenSSL's cache.
+        SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_CLIENT |
+                                               SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(t->ctx, mqtt_tls_new_session);
+    } else {
+        SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_OFF);
+        SSL_CTX_set_options(t->ctx, SSL_OP_NO_TICKET);
+    }
+
+    pthread_once(&mqtt_tls_bio_once, mqtt_tls_bio_init);
+    return mqtt_tls_bio_method ? 0 : -1;
+}
+
+mqtt_transport_t *mqtt_transport_tls_create(const mqtt_tls_config_t *cfg) {
+    static const mqtt_tls_config_t defaults = { 0 };
+    if (!cfg) cfg = &defaults;
+
+    mqtt_tls_transport_t *t = (mqtt_tls_transport_t *)calloc(1, sizeof(*t));
+    if (!t) {
+        MQTT_LOG_ERROR("calloc: %s", strerror(errno));
+        return NULL;
+    }
+    t->base.ops   = &mqtt_tls_ops;
+    t->fd         = -1;
+    t->verify     = !cfg->insecure;
+    t->resumption = !cfg->no_resumption;
+
+    if (cfg->server_name) {
+        t->server_name = strdup(cfg->server_name);
+        if (!t->server_name) {
+            MQTT_LOG_ERROR("strdup: %s", strerror(errno));
+            free(t);
+            return NULL;
+        }
+    }
+
+    if (mqtt_tls_setup_ctx(t, cfg) != 0) {
+        mqtt_tls_print_errors("TLS setup");
+        mqtt_tls_destroy(&t->base);
+        return NULL;
+    }
+    return &t->base;
+}
+
+int mqtt_transport_tls_get_stats(const mqtt_transport_t *t, mqtt_tls_stats_t *stats) {
+    if (!t || t->ops != &mqtt_tls_ops) return -1;
+    *stats = ((const mqtt_tls_transport_t *)t)->stats;
+    return 0;
+}
+
+#else // !MQTT_HAVE_OPENSSL
+
+mqtt_transport_t *mqtt_transport_tls_create(const mqtt_tls_config_t *cfg) {
+    (void)cfg;
+    MQTT_LOG_ERROR("mqtt_transport_tls_create: built without OpenSSL");
+    return NULL;
+}
+
+int mqtt_transport_tls_get_stats(const mqtt_transport_t *t, mqtt_tls_stats_t *stats) {
+    (void)t;
+    (void)stats;
+    return -1;
+}
+
+#endif // MQTT_HAVE_OPENSSL
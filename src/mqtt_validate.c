@@ -0,0 +1,334 @@
+#include "mqtt_validate.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define MQTT_VALIDATE_X86 1
+#include <immintrin.h>
+#endif
+
+/* Returned by the scanners below for ill-formed input. */
+#define MQTT_UTF8_BAD SIZE_MAX
+
+/*
+ * Validate s[i..end), finishing a code point that straddles end, and
+ * note any wildcard byte.
+ *
+ * @return index past the last code point, or MQTT_UTF8_BAD
+ */
+static size_t mqtt_utf8_scan(const uint8_t *s, size_t len, size_t i, size_t end,
+                             bool *wildcards) {
+    while (i < end) {
+        uint8_t c = s[i];
+        if (c < 0x80) {
+            if (c == 0) return MQTT_UTF8_BAD;
+            if (c == '+' || c == '#') *wildcards = true;
+            i++;
+            continue;
+        }
+
+        // C0 and C1 only start overlong forms; F5 and up exceed U+10FFFF.
+        if (c < 0xC2 || c > 0xF4) return MQTT_UTF8_BAD;
+        size_t n = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+        if (len - i < n) return MQTT_UTF8_BAD;
+
+        // The second byte's range depends on the lead (Unicode table 3-7).
+        uint8_t lo = 0x80, hi = 0xBF;
+        if (c == 0xE0)      lo = 0xA0;  // overlong
+        else if (c == 0xED) hi = 0x9F;  // surrogates
+        else if (c == 0xF0) lo = 0x90;  // overlong
+        else if (c == 0xF4) hi = 0x8F;  // above U+10FFFF
+        if (s[i + 1] < lo || s[i + 1] > hi) return MQTT_UTF8_BAD;
+        for (size_t k = 2; k < n; ++k) {
+            if ((s[i + k] & 0xC0) != 0x80) return MQTT_UTF8_BAD;
+        }
+        i += n;
+    }
+    return i;
+}
+
+/*
+ * One implementation: validate s[0..len) as an MQTT string and report
+ * whether '+' or '#' occur.
+ *
+ * @return 0 if valid, -1 if not
+ */
+typedef int (*mqtt_validate_fn)(const uint8_t *s, size_t len, bool *wildcards);
+
+static int mqtt_validate_scalar(const uint8_t *s, size_t len, bool *wildcards) {
+    *wildcards = false;
+    return mqtt_utf8_scan(s, len, 0, len, wildcards) == MQTT_UTF8_BAD ? -1 : 0;
+}
+
+#ifdef MQTT_VALIDATE_X86
+
+/*
+ * Blocks of plain ASCII (no NUL) are checked 16 bytes at a time; a block
+ * with anything else goes through the scalar scanner.
+ */
+__attribute__((target("sse2")))
+static int mqtt_validate_sse2(const uint8_t *s, size_t len, bool *wildcards) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i plus = _mm_set1_epi8('+');
+    const __m128i hash = _mm_set1_epi8('#');
+    __m128i wild = zero;
+    bool scalar_wild = false;
+    size_t i = 0;
+
+    while (len - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        // High bit set: a non-ASCII byte or a NUL.
+        if (_mm_movemask_epi8(_mm_or_si128(v, _mm_cmpeq_epi8(v, zero))) == 0) {
+            wild = _mm_or_si128(wild, _mm_or_si128(_mm_cmpeq_epi8(v, plus),
+                                                   _mm_cmpeq_epi8(v, hash)));
+            i += 16;
+            continue;
+        }
+        i = mqtt_utf8_scan(s, len, i, i + 16, &scalar_wild);
+        if (i == MQTT_UTF8_BAD) return -1;
+    }
+    if (mqtt_utf8_scan(s, len, i, len, &scalar_wild) == MQTT_UTF8_BAD) return -1;
+
+    *wildcards = scalar_wild || _mm_movemask_epi8(wild) != 0;
+    return 0;
+}
+
+/*
+ * Byte-pair classification tables of the Keiser-Lemire validator
+ * ("Validating UTF-8 in less than one instruction per byte", 2021). Each
+ * bit is one kind of error; a pair of adjacent bytes is ill-formed where
+ * the entries for the first byte's high and low nibble and the second
+ * byte's high nibble share a bit.
+ */
+#define TOO_SHORT   (1 << 0)    // lead not followed by a continuation
+#define TOO_LONG    (1 << 1)    // ASCII followed by a continuation
+#define OVERLONG_3  (1 << 2)    // E0 80..9F
+#define TOO_LARGE   (1 << 3)    // F4 90..BF, F5 and up
+#define SURROGATE   (1 << 4)    // ED A0..BF
+#define OVERLONG_2  (1 << 5)    // C0, C1
+#define TOO_LARGE_1000 (1 << 6) // F5.. 80..8F
+#define OVERLONG_4  (1 << 6)    // F0 80..8F
+#define TWO_CONTS   (1 << 7)    // continuation followed by a continuation
+#define CARRY       (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+static const uint8_t mqtt_utf8_byte1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+static const uint8_t mqtt_utf8_byte1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+static const uint8_t mqtt_utf8_byte2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+/* Largest byte values that complete a sequence at the end of a block. */
+static const uint8_t mqtt_utf8_max_tail[32] = {
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1,
+};
+
+/* The 32 bytes ending n bytes before the end of cur, prev coming first. */
+#define MQTT_AVX2_PREV(cur, prev, n) \
+    _mm256_alignr_epi8((cur), _mm256_permute2x128_si256((prev), (cur), 0x21), 16 - (n))
+
+typedef struct {
+    __m256i byte1_high, byte1_low, byte2_high, max_tail;
+    __m256i prev, prev_incomplete, error, wild;
+} mqtt_avx2_state_t;
+
+__attribute__((target("avx2")))
+static inline __m256i mqtt_avx2_table(const uint8_t table[16]) {
+    return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table));
+}
+
+__attribute__((target("avx2")))
+static inline void mqtt_avx2_block(mqtt_avx2_state_t *st, __m256i in) {
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    st->error = _mm256_or_si256(st->error, _mm256_cmpeq_epi8(in, _mm256_setzero_si256()));
+    st->wild  = _mm256_or_si256(st->wild,
+                                _mm256_or_si256(_mm256_cmpeq_epi8(in, _mm256_set1_epi8('+')),
+                                                _mm256_cmpeq_epi8(in, _mm256_set1_epi8('#'))));
+
+    if (_mm256_movemask_epi8(in) == 0) {
+        // All ASCII: only a sequence cut off by the previous block can be wrong.
+        st->error = _mm256_or_si256(st->error, st->prev_incomplete);
+    } else {
+        __m256i prev1 = MQTT_AVX2_PREV(in, st->prev, 1);
+        __m256i b1h = _mm256_shuffle_epi8(st->byte1_high,
+                          _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+        __m256i b1l = _mm256_shuffle_epi8(st->byte1_low, _mm256_and_si256(prev1, nibble));
+        __m256i b2h = _mm256_shuffle_epi8(st->byte2_high,
+                          _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble));
+        __m256i special = _mm256_and_si256(_mm256_and_si256(b1h, b1l), b2h);
+
+        // Third and fourth bytes of a sequence must be continuations.
+        __m256i prev2 = MQTT_AVX2_PREV(in, st->prev, 2);
+        __m256i prev3 = MQTT_AVX2_PREV(in, st->prev, 3);
+        __m256i third  = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+        __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+        __m256i must_cont = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                             _mm256_set1_epi8((char)0x80));
+
+        st->error = _mm256_or_si256(st->error, _mm256_xor_si256(must_cont, special));
+        st->prev_incomplete = _mm256_subs_epu8(in, st->max_tail);
+    }
+    st->prev = in;
+}
+
+/*
+ * Whole-string validation in vector registers, 32 bytes per step. The
+ * tail is padded with spaces, which are valid and end any sequence.
+ */
+__attribute__((target("avx2")))
+static int mqtt_validate_avx2(const uint8_t *s, size_t len, bool *wildcards) {
+    mqtt_avx2_state_t st;
+    st.byte1_high      = mqtt_avx2_table(mqtt_utf8_byte1_high);
+    st.byte1_low       = mqtt_avx2_table(mqtt_utf8_byte1_low);
+    st.byte2_high      = mqtt_avx2_table(mqtt_utf8_byte2_high);
+    st.max_tail        = _mm256_loadu_si256((const __m256i *)mqtt_utf8_max_tail);
+    st.prev            = _mm256_setzero_si256();
+    st.prev_incomplete = _mm256_setzero_si256();
+    st.error           = _mm256_setzero_si256();
+    st.wild            = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; len - i >= 32; i += 32) {
+        mqtt_avx2_block(&st, _mm256_loadu_si256((const __m256i *)(s + i)));
+    }
+    if (i < len) {
+        uint8_t tail[32];
+        memset(tail, ' ', sizeof(tail));
+        memcpy(tail, s + i, len - i);
+        mqtt_avx2_block(&st, _mm256_loadu_si256((const __m256i *)tail));
+    }
+    st.error = _mm256_or_si256(st.error, st.prev_incomplete);
+
+    *wildcards = !_mm256_testz_si256(st.wild, st.wild);
+    return _mm256_testz_si256(st.error, st.error) ? 0 : -1;
+}
+
+#undef TOO_SHORT
+#undef TOO_LONG
+#undef OVERLONG_3
+#undef TOO_LARGE
+#undef SURROGATE
+#undef OVERLONG_2
+#undef TOO_LARGE_1000
+#undef OVERLONG_4
+#undef TWO_CONTS
+#undef CARRY
+
+#endif // MQTT_VALIDATE_X86
+
+static int mqtt_validate_resolve(const uint8_t *s, size_t len, bool *wildcards);
+
+/* Starts out picking the implementation on first use. */
+static _Atomic(mqtt_validate_fn) mqtt_validate_impl = mqtt_validate_resolve;
+
+static mqtt_validate_fn mqtt_validate_pick(mqtt_validate_impl_t impl) {
+#ifdef MQTT_VALIDATE_X86
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    bool sse2 = __builtin_cpu_supports("sse2");
+
+    switch (impl) {
+    case MQTT_VALIDATE_AUTO:
+        return avx2 ? mqtt_validate_avx2 : sse2 ? mqtt_validate_sse2 : mqtt_validate_scalar;
+    case MQTT_VALIDATE_SCALAR: return mqtt_validate_scalar;
+    case MQTT_VALIDATE_SSE2:   return sse2 ? mqtt_validate_sse2 : NULL;
+    case MQTT_VALIDATE_AVX2:   return avx2 ? mqtt_validate_avx2 : NULL;
+    }
+    return NULL;
+#else
+    return impl == MQTT_VALIDATE_AUTO || impl == MQTT_VALIDATE_SCALAR
+           ? mqtt_validate_scalar : NULL;
+#endif
+}
+
+static int mqtt_validate_resolve(const uint8_t *s, size_t len, bool *wildcards) {
+    mqtt_validate_fn fn = mqtt_validate_pick(MQTT_VALIDATE_AUTO);
+    atomic_store_explicit(&mqtt_validate_impl, fn, memory_order_relaxed);
+    return fn(s, len, wildcards);
+}
+
+static int mqtt_validate(const void *s, size_t len, bool *wildcards) {
+    mqtt_validate_fn fn = atomic_load_explicit(&mqtt_validate_impl, memory_order_relaxed);
+    return fn((const uint8_t *)s, len, wildcards);
+}
+
+bool mqtt_validate_utf8(const void *s, size_t len) {
+    bool wildcards;
+    return len == 0 || mqtt_validate(s, len, &wildcards) == 0;
+}
+
+bool mqtt_validate_topic_name(const char *topic, size_t len) {
+    bool wildcards;
+    if (!topic || len == 0 || len > 0xFFFF) return false;
+    return mqtt_validate(topic, len, &wildcards) == 0 && !wildcards;
+}
+
+bool mqtt_validate_topic_filter(const char *filter, size_t len) {
+    bool wildcards;
+    if (!filter || len == 0 || len > 0xFFFF) return false;
+    if (mqtt_validate(filter, len, &wildcards) != 0) return false;
+    if (!wildcards) return true;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (filter[i] != '+' && filter[i] != '#') continue;
+        if (i > 0 && filter[i - 1] != '/') return false;
+        if (filter[i] == '#' ? i + 1 != len
+                             : i + 1 < len && filter[i + 1] != '/') return false;
+    }
+    return true;
+}
+
+int mqtt_validate_set_impl(mqtt_validate_impl_t impl) {
+    mqtt_validate_fn fn = mqtt_validate_pick(impl);
+    if (!fn) return -1;
+    atomic_store_explicit(&mqtt_validate_impl, fn, memory_order_relaxed);
+    return 0;
+}
+
+const char *mqtt_validate_impl_name(void) {
+    mqtt_validate_fn fn = atomic_load_explicit(&mqtt_validate_impl, memory_order_relaxed);
+    if (fn == mqtt_validate_resolve) fn = mqtt_validate_pick(MQTT_VALIDATE_AUTO);
+#ifdef MQTT_VALIDATE_X86
+    if (fn == mqtt_validate_avx2) return "avx2";
+    if (fn == mqtt_validate_sse2) return "sse2";
+#endif
+    return "scalar";
+}